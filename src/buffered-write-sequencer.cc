@@ -15,21 +15,104 @@
 
 #include "buffered-write-sequencer.h"
 
+#include <limits.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cerrno>
+#include <chrono>
 #include <csignal>
 #include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <future>
 #include <mutex>
 #include <thread>
 #include <utility>
+#include <vector>
 
+#include "pipeline-stats.h"
 #include "timg-time.h"
 
 namespace timg {
 
+OutBuffer::~OutBuffer() {
+    if (data == nullptr) return;
+    if (pool) {
+        pool->Return(data, capacity);
+    }
+    else {
+        delete[] data;
+    }
+}
+
+void OutBuffer::Reserve(size_t additional) {
+    if (size + additional <= capacity) return;
+    const size_t new_capacity = std::max(2 * capacity, size + additional);
+    char *const new_data      = new char[new_capacity];
+    if (data) memcpy(new_data, data, size);
+    OutBuffer old(data, 0);  // Returns old data to wherever it belongs.
+    old.capacity = capacity;
+    old.pool     = pool;
+    data         = new_data;
+    capacity     = new_capacity;
+}
+
+OutBufferPool::~OutBufferPool() {
+    for (auto &buffer : free_) delete[] buffer.first;
+}
+
+OutBuffer OutBufferPool::Get(size_t size) {
+    OutBuffer result;
+    {
+        std::lock_guard<std::mutex> l(lock_);
+        // Best fit: smallest buffer that can hold the requested size.
+        auto best = free_.end();
+        for (auto it = free_.begin(); it != free_.end(); ++it) {
+            if (it->second >= size &&
+                (best == free_.end() || it->second < best->second)) {
+                best = it;
+            }
+        }
+        if (best != free_.end()) {
+            result.data     = best->first;
+            result.capacity = best->second;
+            *best           = free_.back();
+            free_.pop_back();
+        }
+    }
+    if (!result.data) {
+        result.data     = new char[size];
+        result.capacity = size;
+    }
+    result.size = 0;
+    result.pool = this;
+    return result;
+}
+
+void OutBufferPool::Return(char *data, size_t capacity) {
+    std::lock_guard<std::mutex> l(lock_);
+    if (free_.size() < max_free_) {
+        free_.emplace_back(data, capacity);
+        return;
+    }
+    // Pool is full. Keep the larger buffers as they can serve more requests.
+    auto smallest = free_.begin();
+    for (auto it = free_.begin(); it != free_.end(); ++it) {
+        if (it->second < smallest->second) smallest = it;
+    }
+    if (smallest != free_.end() && smallest->second < capacity) {
+        std::swap(smallest->first, data);
+        smallest->second = capacity;
+    }
+    delete[] data;
+}
+
 BufferedWriteSequencer::BufferedWriteSequencer(
     int fd, bool allow_frame_skip, int max_queu_len, bool debug_no_frame_delay,
     const volatile sig_atomic_t &interrupt_received)
@@ -38,44 +121,118 @@ BufferedWriteSequencer::BufferedWriteSequencer(
       max_queue_len_(max_queu_len),
       debug_no_frame_delay_(debug_no_frame_delay),
       interrupt_received_(interrupt_received),
+      // Buffers in flight: queued up, one being written, one being filled.
+      buffer_pool_(max_queu_len + 2),
+      work_(max_queu_len),
       work_executor_(
           new std::thread(&BufferedWriteSequencer::ProcessQueue, this)) {}
 
 BufferedWriteSequencer::~BufferedWriteSequencer() {
     Flush();
-    {
-        std::lock_guard<std::mutex> l(work_lock_);
-        OutBuffer exit_condition;  // nullptr considered exit condition.
-        std::promise<OutBuffer> p;
-        p.set_value(std::move(exit_condition));
-        work_.push({p.get_future(), SeqType::ControlWrite, {}});
-    }
-    work_sync_.notify_all();
+    OutBuffer exit_condition;  // nullptr considered exit condition.
+    std::promise<OutBuffer> p;
+    p.set_value(std::move(exit_condition));
+    work_.Push({p.get_future(), SeqType::ControlWrite, {}});
     work_executor_->join();
     delete work_executor_;
 }
 
-static ssize_t ReliableWrite(int fd, const char *buffer, const size_t size) {
-    if (size == 0) return 0;
-    ssize_t written  = 0;
-    size_t remaining = size;
-    while (remaining && (written = write(fd, buffer, remaining)) > 0) {
-        remaining -= written;
-        buffer += written;
+// Each write is limited in size, so that we see in between how the output
+// keeps up. Waiting longer than kStallThreshold for a write to be accepted
+// counts as stall.
+static constexpr size_t kMaxWriteChunk    = 64 << 10;
+static constexpr int kMaxWriteIov         = 64;
+static constexpr Duration kStallThreshold = Duration::Millis(100);
+
+// If more than that is still queued from previous writes, the output does
+// not keep up, even if write() returns quickly.
+static constexpr int64_t kOutputBehindBytes = 32 << 10;
+
+int64_t BufferedWriteSequencer::OutputBacklog() const {
+    int queued = 0;
+#ifdef TIOCOUTQ
+    if (ioctl(fd_, TIOCOUTQ, &queued) == 0) return queued;  // Terminal.
+#endif
+    if (ioctl(fd_, FIONREAD, &queued) == 0) return queued;  // Pipe.
+    return -1;
+}
+
+void BufferedWriteSequencer::WriteAll(std::vector<struct iovec> *iov) {
+    size_t first = 0;
+    while (first < iov->size()) {
+        struct iovec chunk[kMaxWriteIov];
+        int count    = 0;
+        size_t bytes = 0;
+        for (size_t i = first; i < iov->size() && count < kMaxWriteIov &&
+                               bytes < kMaxWriteChunk;
+             ++i) {
+            chunk[count] = (*iov)[i];
+            chunk[count].iov_len =
+                std::min(chunk[count].iov_len, kMaxWriteChunk - bytes);
+            bytes += chunk[count].iov_len;
+            ++count;
+        }
+
+        // Wait in poll() until the output accepts data. The write itself
+        // still blocks, but only for what did not fit.
+        const int64_t wait_start_ns = Time::Now().nanoseconds();
+        stalled_since_ns_.store(wait_start_ns);
+        struct pollfd pfd = {fd_, POLLOUT, 0};
+        int ready;
+        do {
+            ready = poll(&pfd, 1, -1);
+        } while (ready < 0 && errno == EINTR);
+        const int64_t write_start_ns = Time::Now().nanoseconds();
+        ssize_t written              = -1;
+        if (ready > 0 && !(pfd.revents & (POLLERR | POLLNVAL))) {
+            written = writev(fd_, chunk, count);
+        }
+        const int64_t end_ns = Time::Now().nanoseconds();
+        stalled_since_ns_.store(0);
+        {
+            std::lock_guard<std::mutex> l(stats_lock_);
+            WriteStats &stats  = write_stats_;
+            const int64_t took = end_ns - write_start_ns;
+            ++stats.writes;
+            stats.write_ns += took;
+            stats.max_write_ns = std::max(stats.max_write_ns, took);
+            if (end_ns - wait_start_ns > kStallThreshold.nanoseconds()) {
+                ++stats.stalls;
+                stats.stall_ns += end_ns - wait_start_ns;
+            }
+        }
+        if (written <= 0) break;
+        // Skip what has been fully written, adjust the partial one.
+        while (first < iov->size() &&
+               (size_t)written >= (*iov)[first].iov_len) {
+            written -= (*iov)[first].iov_len;
+            ++first;
+        }
+        if (written > 0) {
+            (*iov)[first].iov_base = (char *)(*iov)[first].iov_base + written;
+            (*iov)[first].iov_len -= written;
+        }
     }
-    if (written < 0) return -1;
-    return size;
+    iov->clear();
 }
 
+// Allow for occasional blip as long as it does not accumulate.
+static constexpr Duration kAllowedSkew = Duration::Millis(250);
+
+// Adaptive compression: measurements are taken over a window of frames
+// before the level is changed. If a change made the frame rate worse, it is
+// reverted and the level kept for a number of windows. Levels are from zero
+// (uncompressed) to max.
+static constexpr int kAdaptWindowFrames      = 8;
+static constexpr int kAdaptHoldWindows       = 16;
+static constexpr int kMaxAdaptiveCompression = 9;
+
 void BufferedWriteSequencer::WriteBuffer(std::future<OutBuffer> future_block,
                                          SeqType sequence_type,
                                          const Duration &end_of_frame) {
-    {
-        std::unique_lock<std::mutex> l(work_lock_);
-        work_sync_.wait(l, [this]() { return work_.size() < max_queue_len_; });
-        work_.push({std::move(future_block), sequence_type, end_of_frame});
-    }
-    work_sync_.notify_all();
+    if (sequence_type == SeqType::StartOfAnimation) ++animations_submitted_;
+    PipelineStats::Scope timing(Stage::kQueueWait);
+    work_.Push({std::move(future_block), sequence_type, end_of_frame});
 }
 
 void BufferedWriteSequencer::WriteBuffer(OutBuffer &&block,
@@ -88,39 +245,123 @@ void BufferedWriteSequencer::WriteBuffer(OutBuffer &&block,
     WriteBuffer(p.get_future(), sequence_type, end_of_frame);
 }
 
+// Can this item be written right away together with the previous ones ?
+// That is the case if it is finished already and nothing has to wait for it.
+static bool CanCoalesce(SeqType sequence_type,
+                        const std::future<OutBuffer> &block) {
+    switch (sequence_type) {
+    case SeqType::ControlWrite:
+    case SeqType::FrameImmediate: break;
+    case SeqType::StartOfAnimation:
+    case SeqType::AnimationFrame: return false;  // Timing relevant.
+    }
+    return block.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+}
+
 void BufferedWriteSequencer::ProcessQueue() {
     timg::Time animation_start;
     timg::Duration last_frame_end;
 
+    // Buffers ready to be written in one go; they are only returned to the
+    // buffer pool once written.
+    std::vector<OutBuffer> batch;
+    std::vector<struct iovec> iov;
+    std::vector<std::promise<void> *> flushed;  // Notify after batch written.
+    int frames_in_batch   = 0;
+    int64_t batch_wait_ns = 0;  // Time waiting for frames to be encoded.
+    auto write_batch = [&]() {
+        for (const OutBuffer &b : batch) {
+            if (b.size) iov.push_back({b.data, b.size});
+        }
+        int64_t write_ns = 0;
+        if (!iov.empty()) {
+            // What the output could not send since the previous batch.
+            const int64_t backlog = OutputBacklog();
+            adapt_max_backlog_    = std::max(adapt_max_backlog_, backlog);
+            {
+                std::lock_guard<std::mutex> l(stats_lock_);
+                write_stats_.max_backlog =
+                    std::max(write_stats_.max_backlog, backlog);
+            }
+            PipelineStats::Scope timing(Stage::kWrite);
+            const int64_t start_ns = Time::Now().nanoseconds();
+            WriteAll(&iov);
+            write_ns = Time::Now().nanoseconds() - start_ns;
+        }
+        PipelineStats::FramesWritten(frames_in_batch);
+        if (frames_in_batch) {
+            AdaptCompressionLevel(frames_in_batch, write_ns, batch_wait_ns);
+        }
+        frames_in_batch = 0;
+        batch_wait_ns   = 0;
+        batch.clear();
+        for (std::promise<void> *p : flushed) p->set_value();
+        flushed.clear();
+    };
+
+    // Is the next queued animation frame already encoded ?
+    auto next_frame_ready = [this]() {
+        const WorkItem *const next = work_.Front();
+        return next && next->sequence_type == SeqType::AnimationFrame &&
+               next->block.wait_for(std::chrono::seconds(0)) ==
+                   std::future_status::ready;
+    };
+
     for (;;) {
-        WorkItem work_item;
-        {
-            std::unique_lock<std::mutex> l(work_lock_);
-            work_sync_.wait(l, [this]() { return !work_.empty(); });
-            work_item = std::move(work_.front());
-            work_.pop();
+        WorkItem *next = nullptr;
+        if (batch.empty() && flushed.empty()) {
+            next = work_.WaitFront();
+        }
+        else {
+            next = work_.Front();
+            if (!next || !CanCoalesce(next->sequence_type, next->block)) {
+                write_batch();
+                continue;
+            }
         }
-        work_sync_.notify_all();
+        WorkItem work_item = std::move(*next);
+        work_.Pop();
 
-        const OutBuffer block = work_item.block.get();
-        if (block.data == nullptr) return;  // Exit condition.
+        const int64_t wait_start_ns = Time::Now().nanoseconds();
+        OutBuffer block             = [&work_item]() {
+            PipelineStats::Scope timing(Stage::kEncodeWait);
+            return work_item.block.get();
+        }();
+        if (work_item.sequence_type != SeqType::ControlWrite) {
+            batch_wait_ns += Time::Now().nanoseconds() - wait_start_ns;
+        }
+        if (block.data == nullptr) {  // Exit condition.
+            write_batch();
+            return;
+        }
+        if (work_item.flushed) flushed.push_back(work_item.flushed);
 
         if (interrupt_received_ &&
             work_item.sequence_type != SeqType::ControlWrite) {
+            PipelineStats::FrameDropped();
+            if (block.on_skip) block.on_skip();
             continue;  // Finish quickly, discard any queued-up frames.
         }
 
         bool do_skip = false;
         switch (work_item.sequence_type) {
-        case SeqType::StartOfAnimation: animation_start = Time::Now(); break;
+        case SeqType::StartOfAnimation:
+            animation_start = Time::Now();
+            animation_start_ns_.store(animation_start.nanoseconds());
+            animations_started_.fetch_add(1);
+            break;
         case SeqType::AnimationFrame:
             if (!last_frame_end.is_zero()) {
                 const Time finish_time = animation_start + last_frame_end;
+                // A frame is obsolete if its time to be shown is over and
+                // the next one is ready to take its place.
+                const Time obsolete_time =
+                    animation_start + work_item.end_of_frame;
+                const Time now = Time::Now();
                 // Only consider skipping if not Immediate or first in frame.
-                // Allow for occasional blip as long as it does not accumulate.
-                static constexpr Duration kAllowedSkew = Duration::Millis(250);
                 do_skip = (allow_frame_skipping_ &&
-                           finish_time + kAllowedSkew < Time::Now());
+                           (finish_time + kAllowedSkew < now ||
+                            (obsolete_time < now && next_frame_ready())));
                 if (!debug_no_frame_delay_) finish_time.WaitUntil();
             }
             break;
@@ -129,10 +370,6 @@ void BufferedWriteSequencer::ProcessQueue() {
         }
         last_frame_end = work_item.end_of_frame;
 
-        if (!do_skip) {
-            ReliableWrite(fd_, block.data, block.size);
-        }
-
         if (work_item.sequence_type != SeqType::ControlWrite) {
             std::lock_guard<std::mutex> l(stats_lock_);
             stats_bytes_total_ += block.size;
@@ -142,19 +379,108 @@ void BufferedWriteSequencer::ProcessQueue() {
                 ++stats_frames_skipped_;
             }
         }
+
+        if (do_skip) {
+            PipelineStats::FrameDropped();
+            if (block.on_skip) block.on_skip();
+        }
+        else {
+            if (work_item.sequence_type != SeqType::ControlWrite) {
+                ++frames_in_batch;
+            }
+            batch.push_back(std::move(block));
+        }
     }
 }
 
+void BufferedWriteSequencer::AdaptCompressionLevel(int frames,
+                                                   int64_t write_ns,
+                                                   int64_t wait_ns) {
+    const int64_t now_ns = Time::Now().nanoseconds();
+    if (adapt_frames_to_ignore_ > 0) {
+        // Still frames that had been encoded with the previous level.
+        adapt_frames_to_ignore_ -= frames;
+        adapt_start_ns_    = now_ns;
+        adapt_max_backlog_ = 0;
+        return;
+    }
+    adapt_frames_ += frames;
+    adapt_write_ns_ += write_ns;
+    adapt_wait_ns_ += wait_ns;
+    if (adapt_frames_ < kAdaptWindowFrames) return;
+
+    const int current_level  = adaptive_compression_level_.load();
+    int level                = current_level;
+    const int64_t elapsed_ns = now_ns - adapt_start_ns_;
+    const double fps         = adapt_frames_ * 1e9 / elapsed_ns;
+    const int64_t busy_ns    = adapt_write_ns_ + adapt_wait_ns_;
+    const bool output_behind = adapt_max_backlog_ > kOutputBehindBytes;
+    if (adapt_previous_level_ >= 0 && fps < 0.95 * adapt_previous_fps_) {
+        // The last change did not pay off. Go back and stay for a while.
+        level               = adapt_previous_level_;
+        adapt_hold_windows_ = kAdaptHoldWindows;
+    }
+    else if (adapt_hold_windows_ > 0) {
+        --adapt_hold_windows_;
+    }
+    else if (adapt_start_ns_ && (4 * busy_ns > elapsed_ns || output_behind)) {
+        // Otherwise, we mostly waited for the time to show the next frame;
+        // neither writing nor encoding limit the frame rate.
+        if (output_behind || adapt_write_ns_ > 2 * adapt_wait_ns_) {
+            level = std::min(level + 1, kMaxAdaptiveCompression);
+        }
+        else if (adapt_wait_ns_ > 2 * adapt_write_ns_) {
+            level = std::max(level - 1, 0);
+        }
+    }
+    adapt_previous_level_ = -1;
+    if (level != current_level) {
+        if (adapt_hold_windows_ == 0) {  // Trying something new.
+            adapt_previous_level_ = current_level;
+            adapt_previous_fps_   = fps;
+        }
+        adaptive_compression_level_.store(level);
+        adapt_frames_to_ignore_ = max_queue_len_;
+    }
+    adapt_frames_      = 0;
+    adapt_write_ns_    = 0;
+    adapt_wait_ns_     = 0;
+    adapt_start_ns_    = now_ns;
+    adapt_max_backlog_ = 0;
+}
+
+bool BufferedWriteSequencer::SkipLateFrame(const Duration &end_of_frame) {
+    if (!allow_frame_skipping_) return false;
+    // Only if the writer already started the animation we are asked about.
+    if (animations_started_.load() != animations_submitted_) return false;
+    const int64_t now_ns      = Time::Now().nanoseconds();
+    const int64_t deadline_ns = animation_start_ns_.load() +
+                                end_of_frame.nanoseconds() +
+                                kAllowedSkew.nanoseconds();
+    // While the output is stalled, everything queued up will be late.
+    const int64_t stalled_since_ns = stalled_since_ns_.load();
+    const bool stalled =
+        stalled_since_ns &&
+        now_ns - stalled_since_ns > kAllowedSkew.nanoseconds();
+    if (now_ns <= deadline_ns && !stalled) return false;
+
+    PipelineStats::TraceInstant("skip-late-frame");
+    std::lock_guard<std::mutex> l(stats_lock_);
+    ++stats_frames_total_;
+    ++stats_frames_skipped_;
+    return true;
+}
+
 void BufferedWriteSequencer::Flush() {
-    // Sending an empty dummy-write so that we know that this is the
-    // last write-in-progress when queue is empty (as the queue is already
-    // empty while the call to write() is still in progress)
+    // Sending an empty dummy-write; once this is reported as written, we
+    // know everything queued before is out.
+    std::promise<void> flushed;
+    std::future<void> flush_done = flushed.get_future();
     OutBuffer flush_sentinel(new char[1]);
-    WriteBuffer(std::move(flush_sentinel), SeqType::ControlWrite, {});
-    {
-        std::unique_lock<std::mutex> l(work_lock_);
-        work_sync_.wait(l, [this]() { return work_.empty(); });
-    }
+    std::promise<OutBuffer> p;
+    p.set_value(std::move(flush_sentinel));
+    work_.Push({p.get_future(), SeqType::ControlWrite, {}, &flushed});
+    flush_done.wait();
 }
 
 int64_t BufferedWriteSequencer::bytes_total() const {
@@ -177,4 +503,10 @@ int64_t BufferedWriteSequencer::frames_skipped() const {
     return stats_frames_skipped_;
 }
 
+BufferedWriteSequencer::WriteStats BufferedWriteSequencer::write_stats()
+    const {
+    std::lock_guard<std::mutex> l(stats_lock_);
+    return write_stats_;
+}
+
 }  // namespace timg
@@ -15,31 +15,79 @@
 #ifndef BUFFERED_WRITE_SEQUENCER_H_
 #define BUFFERED_WRITE_SEQUENCER_H_
 
-#include <condition_variable>
+#include <sys/uio.h>
+
+#include <atomic>
 #include <csignal>
 #include <cstddef>
 #include <cstdint>
+#include <functional>
 #include <future>
 #include <mutex>
-#include <queue>
 #include <thread>
+#include <utility>
+#include <vector>
 
+#include "spsc-queue.h"
 #include "timg-time.h"
 
 namespace timg {
+class OutBufferPool;
+
 // Allocated block of data. It can only be moved, last owner deletes.
 // Typically the frame canvas allocates such  buffer and fills with "size"
 // data, then hand it to the BufferedWriteSequencer.
+// Buffers handed out by an OutBufferPool are given back to it instead.
 struct OutBuffer {
     OutBuffer(char *data = nullptr, size_t size = 0) : data(data), size(size) {}
-    OutBuffer(OutBuffer &&other) : data(other.data), size(other.size) {
+    OutBuffer(OutBuffer &&other)
+        : data(other.data),
+          size(other.size),
+          capacity(other.capacity),
+          pool(other.pool),
+          on_skip(std::move(other.on_skip)) {
         other.data = nullptr;
     }
     OutBuffer(const OutBuffer &other) = delete;
-    ~OutBuffer() { delete[] data; }
+    ~OutBuffer();
+
+    // Make sure there is room for "additional" bytes after "size",
+    // reallocating if needed. Buffers not from a pool don't know their
+    // capacity, so are always reallocated.
+    void Reserve(size_t additional);
 
     char *data;
     size_t size;
+
+    // Only set if this buffer came from a pool it should be returned to.
+    size_t capacity     = 0;
+    OutBufferPool *pool = nullptr;
+
+    // If set, called when the sequencer discards this buffer instead of
+    // writing it, e.g. to remove resources the content refers to.
+    std::function<void()> on_skip;
+};
+
+// A bounded pool of re-usable buffers. Buffers are returned to the pool
+// when the OutBuffer holding them is destructed. Thread-safe.
+class OutBufferPool {
+public:
+    // Keep at most "max_free" unused buffers around.
+    explicit OutBufferPool(size_t max_free) : max_free_(max_free) {}
+    OutBufferPool(const OutBufferPool &) = delete;
+    ~OutBufferPool();
+
+    // Get a buffer with space for at least "size" bytes. Returned
+    // OutBuffer has a size() of zero.
+    OutBuffer Get(size_t size);
+
+private:
+    friend struct OutBuffer;
+    void Return(char *data, size_t capacity);
+
+    const size_t max_free_;
+    std::mutex lock_;
+    std::vector<std::pair<char *, size_t>> free_;  // data, capacity
 };
 
 // The last step towards writing content to the terminal.
@@ -53,7 +101,13 @@ struct OutBuffer {
 // already determined, the timing can be fixed best here.
 //
 // Write requests are queued and written asynchronously in a separate
-// thread to be de-coupled from the timing of the incoming calls.
+// thread to be de-coupled from the timing of the incoming calls. Buffers
+// that are ready and don't need to wait for their time to be shown are
+// coalesced into a single writev() call.
+//
+// Writes are done in limited chunks, each only once poll() reports that the
+// output accepts data, so that a stalled terminal or connection is noticed
+// and measured (see WriteStats) instead of just blocking in write().
 enum class SeqType {
     ControlWrite,      // Control information to be written. Do delay, no skip.
     FrameImmediate,    // Don't delay when frame is written.
@@ -77,7 +131,8 @@ public:
                            const volatile sig_atomic_t &interrupt_received);
     ~BufferedWriteSequencer();
 
-    // Put block into sequence to be written out to file descriptor. Accepts
+    // Put block into sequence to be written out to file descriptor. Must
+    // always be called from the same thread. Accepts
     // a std::future of the data to allow it to be enqueued while still being
     // generated.
     //
@@ -120,32 +175,111 @@ public:
     // Flush all pending writes.
     void Flush();
 
+    // Get a buffer from the sequencer-owned buffer pool with space for at
+    // least "size" bytes. Once written, they are handed back to the pool,
+    // so in steady state (e.g. animations) no new allocations are needed.
+    OutBuffer RequestBuffer(size_t size) { return buffer_pool_.Get(size); }
+
+    // Returns true if frame skipping is enabled and a frame of the current
+    // animation that is supposed to finish at "end_of_frame" would be
+    // skipped anyway as the output is already behind or stalled. Such a
+    // frame is counted as skipped; the caller should not even bother
+    // preparing and sending it. Can be called from any thread, but only once
+    // the first frame of that animation was passed to WriteBuffer().
+    bool SkipLateFrame(const Duration &end_of_frame);
+
     size_t max_queue_len() const { return max_queue_len_; }
 
+    // Compression level for frames that are encoded next, if the caller
+    // wants it to be adapted to maximize the frame rate. The writer thread
+    // observes if it mostly waits for write() to finish or for frames to be
+    // encoded: if write() is the bottleneck, such as on slow remote
+    // connections, or data is still queued in the kernel from the previous
+    // frames, the level goes up; if encoding is, the level goes down.
+    // Can be called from any thread.
+    int adaptive_compression_level() const {
+        return adaptive_compression_level_.load(std::memory_order_relaxed);
+    }
+
+    // Returns true if the "interrupt_received" flag was set and thus pending
+    // writes might have been discarded.
+    bool interrupted() const { return interrupt_received_; }
+
     // -- Stats
     int64_t bytes_total() const;
     int64_t bytes_skipped() const;
     int64_t frames_total() const;
     int64_t frames_skipped() const;
 
+    // How the output kept up with what we wrote.
+    struct WriteStats {
+        int64_t writes       = 0;  // Number of write calls.
+        int64_t write_ns     = 0;  // Total time spent in write calls.
+        int64_t max_write_ns = 0;  // Longest write call.
+        int64_t stalls       = 0;  // Long waits for the output to accept data
+        int64_t stall_ns     = 0;  // Total time of these waits.
+        int64_t max_backlog  = 0;  // Most bytes seen waiting in the kernel.
+    };
+    WriteStats write_stats() const;
+
 private:
     void ProcessQueue();  // Runs in thread.
 
+    // Called by writer thread after a batch was written with that many
+    // frames, "write_ns" time spent in write() and "wait_ns" waiting for
+    // the frames to be encoded.
+    void AdaptCompressionLevel(int frames, int64_t write_ns, int64_t wait_ns);
+
+    // Write all "iov", waiting for the output to accept data in between.
+    // Called by the writer thread.
+    void WriteAll(std::vector<struct iovec> *iov);
+
+    // Bytes written before that the kernel still holds for the terminal or
+    // connection; -1 if not known for this kind of output.
+    int64_t OutputBacklog() const;
+
     const int fd_;
     const bool allow_frame_skipping_;
     const size_t max_queue_len_;
     const bool debug_no_frame_delay_;
     const volatile sig_atomic_t &interrupt_received_;
 
-    // Work queue. Items are stored in a FIFO.
+    // Start time of the last animation that began to be written, and how
+    // many animations were started so far by the writer thread or submitted
+    // by WriteBuffer(). Only if these numbers match, the start time refers
+    // to the animation that is currently submitted.
+    std::atomic<int64_t> animation_start_ns_{0};
+    std::atomic<int> animations_started_{0};
+    std::atomic<int> animations_submitted_{0};
+
+    // Measurements in the current window of frames to adapt compression.
+    std::atomic<int> adaptive_compression_level_{1};
+    int adapt_frames_           = 0;
+    int adapt_frames_to_ignore_ = 0;
+    int64_t adapt_write_ns_     = 0;
+    int64_t adapt_wait_ns_      = 0;
+    int64_t adapt_start_ns_     = 0;
+    int adapt_previous_level_   = -1;  // Level before last change, if any.
+    double adapt_previous_fps_  = 0;
+    int adapt_hold_windows_     = 0;
+    int64_t adapt_max_backlog_  = 0;
+
+    // Start of the write the writer thread currently waits for the output
+    // to accept; zero if not stalled.
+    std::atomic<int64_t> stalled_since_ns_{0};
+
+    // Needs to outlive all the buffers in the work queue.
+    OutBufferPool buffer_pool_;
+
+    // Work queue. Items are stored in a FIFO. There is only one thread
+    // calling WriteBuffer() (the producer) and our worker thread consuming.
     struct WorkItem {
         std::future<OutBuffer> block;
         SeqType sequence_type;
         Duration end_of_frame;
+        std::promise<void> *flushed = nullptr;  // If set: notify once written
     };
-    std::mutex work_lock_;
-    std::queue<WorkItem> work_;
-    std::condition_variable work_sync_;
+    SpscQueue<WorkItem> work_;
     std::thread *work_executor_;
 
     // Statistics.
@@ -154,6 +288,7 @@ private:
     int64_t stats_bytes_skipped_  = 0;
     int64_t stats_frames_total_   = 0;
     int64_t stats_frames_skipped_ = 0;
+    WriteStats write_stats_;
 };
 }  // namespace timg
 #endif  // BUFFERED_WRITE_SEQUENCER_H_
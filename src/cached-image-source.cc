@@ -0,0 +1,355 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// (c) 2024 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#include "cached-image-source.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "buffered-write-sequencer.h"
+#include "display-options.h"
+#include "framebuffer.h"
+#include "renderer.h"
+#include "timg-time.h"
+#include "timg-version.h"
+
+// File format: all values in native byte order; the cache is not meant to
+// be shared between machines.
+//   magic, key, title, animation_before_frame_limit, frame count
+//   per frame: dx, dy, seq_type, width, height, end_of_frame, pixels
+// Strings are prefixed with their uint32_t length.
+
+namespace timg {
+static constexpr char kMagic[8] = {'T', 'I', 'M', 'G', 'C', 'A', 'C', '1'};
+
+// Huge animations would quickly fill the disk and are not much faster to
+// read than to decode. Don't cache them.
+static constexpr int64_t kMaxCachedPixelBytes = 64 << 20;
+
+// Returns a string uniquely describing the file and all the options that
+// influence the resulting frames or empty string if it can't be cached.
+static std::string CacheKey(const std::string &filename,
+                            const DisplayOptions &opts, int frame_offset,
+                            int frame_count) {
+    if (opts.cache_dir.empty() || opts.scroll_animation) return "";
+    char path[PATH_MAX];
+    if (!realpath(filename.c_str(), path)) return "";
+    struct stat s;
+    if (stat(path, &s) != 0 || !S_ISREG(s.st_mode)) return "";
+
+    // The configured background, not the resolved one: asking the terminal
+    // for it might take a while, which we don't want to wait for on every
+    // load.
+    const std::string bg =
+        opts.local_alpha_handling ? opts.bg_color_name : std::string();
+    char params[512];
+    snprintf(params, sizeof(params),
+             "%s|%" PRId64 "|%" PRId64 "|%" PRId64 "|%" PRId64
+             "|%dx%d|%dx%d|%.4f|%d%d%d%d%d%d%d%d%d|%d|%d,%d"
+             "|%02x%02x%02x%02x|%d",
+             TIMG_VERSION, (int64_t)s.st_dev, (int64_t)s.st_ino,
+             (int64_t)s.st_size, (int64_t)s.st_mtime, opts.width, opts.height,
+             opts.cell_x_px, opts.cell_y_px, opts.width_stretch, opts.upscale,
+             opts.upscale_integer, opts.fill_width, opts.fill_height,
+             opts.antialias, opts.center_horizontally, opts.auto_crop,
+             opts.exif_rotate, opts.local_alpha_handling, opts.crop_border,
+             frame_offset, frame_count, opts.bg_pattern_color.r,
+             opts.bg_pattern_color.g, opts.bg_pattern_color.b,
+             opts.bg_pattern_color.a, opts.pattern_size);
+    return std::string(path) + "|" + params + "|" + bg + "|" +
+           opts.title_format;
+}
+
+static std::string CacheFile(const std::string &dir, const std::string &key) {
+    char name[32];
+    snprintf(name, sizeof(name), "/%016" PRIx64 ".img",
+             (uint64_t)std::hash<std::string>()(key));
+    return dir + name;
+}
+
+static bool WriteString(FILE *out, const std::string &str) {
+    const uint32_t len = str.size();
+    return fwrite(&len, sizeof(len), 1, out) == 1 &&
+           fwrite(str.data(), 1, len, out) == len;
+}
+
+static bool ReadString(FILE *in, std::string *str) {
+    uint32_t len;
+    if (fread(&len, sizeof(len), 1, in) != 1 || len > (1 << 16)) return false;
+    str->resize(len);
+    return fread(&(*str)[0], 1, len, in) == len;
+}
+
+namespace {
+// Passes on the frames of the wrapped source, and writes them to a new
+// cache entry on the way. The entry is only kept once a complete sequence
+// went through, i.e. all frames of a still image or one loop of an
+// animation.
+class CacheRecorder final : public ImageSource {
+public:
+    CacheRecorder(ImageSource *source, const DisplayOptions &opts,
+                  const std::string &key)
+        : ImageSource(source->filename()),
+          source_(source),
+          key_(key),
+          title_format_(opts.title_format),
+          cache_file_(CacheFile(opts.cache_dir, key)),
+          tmp_file_(cache_file_ + ".tmp" + std::to_string(getpid())) {}
+    ~CacheRecorder() final { Abandon(); }
+
+    bool LoadAndScale(const DisplayOptions &, int, int) final {
+        return true;  // The wrapped source is already loaded.
+    }
+
+    void SendFrames(const Duration &duration, int loops,
+                    const volatile sig_atomic_t &interrupt_received,
+                    const Renderer::WriteFramebufferFun &sink) final;
+
+    std::string FormatTitle(const std::string &format_string) const final {
+        return source_->FormatTitle(format_string);
+    }
+    bool IsAnimationBeforeFrameLimit() const final {
+        return source_->IsAnimationBeforeFrameLimit();
+    }
+    int FramesPerLoop() const final { return source_->FramesPerLoop(); }
+
+private:
+    // Write to a temporary file first so that concurrently running timg
+    // instances never see partial content.
+    bool Start();
+    bool WriteFrame(int dx, int dy, const Framebuffer &fb, SeqType seq_type,
+                    Duration end_of_frame);
+    void Finish();
+    void Abandon();
+
+    const std::unique_ptr<ImageSource> source_;
+    const std::string key_;
+    const std::string title_format_;
+    const std::string cache_file_;
+    const std::string tmp_file_;
+    bool recorded_ = false;  // Only the first SendFrames() is recorded.
+    FILE *out_     = nullptr;
+    long frames_pos_;
+    uint32_t frames_     = 0;
+    int64_t pixel_bytes_ = 0;
+};
+}  // namespace
+
+bool CacheRecorder::Start() {
+    out_ = fopen(tmp_file_.c_str(), "wb");
+    if (!out_) return false;
+    const uint8_t animation = source_->IsAnimationBeforeFrameLimit();
+    bool success = fwrite(kMagic, sizeof(kMagic), 1, out_) == 1 &&
+                   WriteString(out_, key_) &&
+                   WriteString(out_, source_->FormatTitle(title_format_)) &&
+                   fwrite(&animation, sizeof(animation), 1, out_) == 1;
+    frames_pos_ = ftell(out_);  // Count filled in once all are written.
+    success = success && frames_pos_ >= 0 &&
+              fwrite(&frames_, sizeof(frames_), 1, out_) == 1;
+    if (!success) Abandon();
+    return success;
+}
+
+bool CacheRecorder::WriteFrame(int dx, int dy, const Framebuffer &fb,
+                               SeqType seq_type, Duration end_of_frame) {
+    // Stop writing as soon as it gets too large.
+    pixel_bytes_ += (int64_t)fb.width() * fb.height() * sizeof(rgba_t);
+    if (pixel_bytes_ > kMaxCachedPixelBytes) return false;
+    const int32_t header[5] = {dx, dy, (int32_t)seq_type, fb.width(),
+                               fb.height()};
+    const int64_t end_ns    = end_of_frame.nanoseconds();
+    const size_t width      = fb.width();
+    bool success = fwrite(header, sizeof(header), 1, out_) == 1 &&
+                   fwrite(&end_ns, sizeof(end_ns), 1, out_) == 1;
+    for (int y = 0; success && y < fb.height(); ++y) {
+        success = fwrite(fb.row(y), sizeof(rgba_t), width, out_) == width;
+    }
+    ++frames_;
+    return success;
+}
+
+void CacheRecorder::Finish() {
+    bool success = frames_ > 0 && fseek(out_, frames_pos_, SEEK_SET) == 0 &&
+                   fwrite(&frames_, sizeof(frames_), 1, out_) == 1;
+    success      = (fclose(out_) == 0) && success;
+    out_         = nullptr;
+    if (!success || rename(tmp_file_.c_str(), cache_file_.c_str()) != 0) {
+        unlink(tmp_file_.c_str());
+    }
+}
+
+void CacheRecorder::Abandon() {
+    if (!out_) return;
+    fclose(out_);
+    out_ = nullptr;
+    unlink(tmp_file_.c_str());
+}
+
+void CacheRecorder::SendFrames(const Duration &duration, int loops,
+                               const volatile sig_atomic_t &interrupt_received,
+                               const Renderer::WriteFramebufferFun &sink) {
+    bool recording = !recorded_ && Start();
+    recorded_      = true;
+    bool animation = false;
+    bool complete  = false;  // Set once a full loop went through.
+    source_->SendFrames(
+        duration, loops, interrupt_received,
+        [&](int dx, int dy, const Framebuffer &fb, SeqType seq_type,
+            Duration end_of_frame) {
+            if (recording) {
+                if (frames_ == 0) {
+                    animation = (seq_type == SeqType::StartOfAnimation);
+                }
+                if (animation && (int)frames_ >= source_->FramesPerLoop()) {
+                    complete  = source_->FramesPerLoop() > 0;
+                    recording = false;  // Next loop; have everything.
+                }
+                // Frames cut short by the duration are not what a full
+                // playback shows.
+                else if (animation && !(end_of_frame < duration)) {
+                    recording = false;
+                }
+                else {
+                    recording =
+                        WriteFrame(dx, dy, fb, seq_type, end_of_frame);
+                }
+                if (!recording && !complete) Abandon();
+            }
+            sink(dx, dy, fb, seq_type, end_of_frame);
+        });
+    if (recording) {
+        complete = animation ? (source_->FramesPerLoop() > 0 &&
+                                (int)frames_ >= source_->FramesPerLoop())
+                             : !interrupt_received;
+    }
+    if (complete) {
+        Finish();
+    }
+    else {
+        Abandon();
+    }
+}
+
+ImageSource *CachedImageSource::Record(ImageSource *source,
+                                       const DisplayOptions &opts,
+                                       int frame_offset, int frame_count) {
+    const std::string key =
+        CacheKey(source->filename(), opts, frame_offset, frame_count);
+    if (key.empty()) return source;
+    return new CacheRecorder(source, opts, key);
+}
+
+bool CachedImageSource::LoadAndScale(const DisplayOptions &opts,
+                                     int frame_offset, int frame_count) {
+    const std::string key =
+        CacheKey(filename(), opts, frame_offset, frame_count);
+    if (key.empty()) return false;
+
+    FILE *in = fopen(CacheFile(opts.cache_dir, key).c_str(), "rb");
+    if (!in) return false;
+    char magic[sizeof(kMagic)];
+    std::string stored_key;
+    uint8_t animation;
+    uint32_t frames;
+    bool success = fread(magic, sizeof(magic), 1, in) == 1 &&
+                   memcmp(magic, kMagic, sizeof(kMagic)) == 0 &&
+                   ReadString(in, &stored_key) && stored_key == key &&
+                   ReadString(in, &title_) &&
+                   fread(&animation, sizeof(animation), 1, in) == 1 &&
+                   fread(&frames, sizeof(frames), 1, in) == 1;
+    for (uint32_t i = 0; success && i < frames; ++i) {
+        int32_t header[5];
+        int64_t end_ns;
+        success = fread(header, sizeof(header), 1, in) == 1 &&
+                  fread(&end_ns, sizeof(end_ns), 1, in) == 1 &&
+                  header[3] > 0 && header[4] > 0 &&
+                  (int64_t)header[3] * header[4] * (int64_t)sizeof(rgba_t) <=
+                      kMaxCachedPixelBytes;
+        if (!success) break;
+        Frame frame{header[0], header[1], (SeqType)header[2],
+                    Duration::Nanos(end_ns),
+                    Framebuffer(header[3], header[4])};
+        const size_t pixels = (size_t)header[3] * header[4];
+        success = fread(frame.framebuffer.begin(), sizeof(rgba_t), pixels,
+                        in) == pixels;  // Packed; rows are contiguous.
+        frames_.push_back(std::move(frame));
+    }
+    fclose(in);
+    if (!success) {
+        frames_.clear();
+        return false;
+    }
+    title_format_                 = opts.title_format;
+    animation_before_frame_limit_ = animation;
+    return !frames_.empty();
+}
+
+std::string CachedImageSource::FormatTitle(
+    const std::string &format_string) const {
+    if (format_string == title_format_) return title_;
+    return FormatFromParameters(format_string, display_name(), 0, 0, "cache");
+}
+
+// Replay frames as recorded, with the usual looping of animations.
+void CachedImageSource::SendFrames(
+    const Duration &duration, int loops,
+    const volatile sig_atomic_t &interrupt_received,
+    const Renderer::WriteFramebufferFun &sink) {
+    const bool is_animation = frames_[0].seq_type == SeqType::StartOfAnimation;
+    if (!is_animation) {
+        for (const Frame &frame : frames_) {
+            sink(frame.dx, frame.dy, frame.framebuffer, frame.seq_type,
+                 std::min(frame.end_of_frame, duration));
+        }
+        return;
+    }
+
+    // Not initialized or negative value wants us to loop forever.
+    const bool loop_forever = (loops < 0) || (loops == timg::kNotInitialized);
+
+    int last_height = -1;  // First image emit will not have a height.
+    timg::Duration time_from_first_frame;
+    bool is_first = true;
+    for (int k = 0; (loop_forever || k < loops) && !interrupt_received &&
+                    time_from_first_frame < duration;
+         ++k) {
+        Duration prev_end;
+        for (const Frame &frame : frames_) {
+            if (interrupt_received) break;
+            time_from_first_frame.Add(Duration::Nanos(
+                frame.end_of_frame.nanoseconds() - prev_end.nanoseconds()));
+            prev_end     = frame.end_of_frame;
+            const int dy = last_height > 0 ? -last_height : 0;
+            sink(frame.dx, dy, frame.framebuffer,
+                 is_first ? SeqType::StartOfAnimation : SeqType::AnimationFrame,
+                 std::min(time_from_first_frame, duration));
+            last_height = frame.framebuffer.height();
+            if (time_from_first_frame > duration) break;
+            is_first = false;
+        }
+    }
+}
+}  // namespace timg
@@ -0,0 +1,81 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// (c) 2024 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#ifndef CACHED_IMAGE_SOURCE_H_
+#define CACHED_IMAGE_SOURCE_H_
+
+#include <csignal>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "buffered-write-sequencer.h"
+#include "display-options.h"
+#include "framebuffer.h"
+#include "image-source.h"
+#include "renderer.h"
+#include "timg-time.h"
+
+namespace timg {
+// Disk cache of the final, scaled, frames of images, so that showing the
+// same images again with the same display options does not have to decode
+// and scale them again.
+//
+// Enabled with TIMG_USE_CACHE=1; files are stored in $XDG_CACHE_HOME/timg
+// (or ~/.cache/timg), keyed by file identity, modification time and all
+// the display options that influence the resulting frames.
+class CachedImageSource final : public ImageSource {
+public:
+    explicit CachedImageSource(const std::string &filename)
+        : ImageSource(filename) {}
+
+    // Wrap the freshly loaded "source", so that the frames it emits for the
+    // given options are recorded in the cache while they are shown. Returns
+    // "source" itself if caching is disabled or the file is not cacheable.
+    static ImageSource *Record(ImageSource *source,
+                               const DisplayOptions &options, int frame_offset,
+                               int frame_count);
+
+    // Load from cache. Returns false if there is no valid entry.
+    bool LoadAndScale(const DisplayOptions &options, int frame_offset,
+                      int frame_count) final;
+
+    void SendFrames(const Duration &duration, int loops,
+                    const volatile sig_atomic_t &interrupt_received,
+                    const Renderer::WriteFramebufferFun &sink) final;
+
+    std::string FormatTitle(const std::string &format_string) const final;
+
+    bool IsAnimationBeforeFrameLimit() const final {
+        return animation_before_frame_limit_;
+    }
+
+private:
+    struct Frame {
+        int dx;
+        int dy;
+        SeqType seq_type;
+        Duration end_of_frame;
+        Framebuffer framebuffer;
+    };
+
+    std::string title_format_;  // Title was formatted with this.
+    std::string title_;
+    bool animation_before_frame_limit_ = false;
+    std::vector<Frame> frames_;
+};
+}  // namespace timg
+
+#endif  // CACHED_IMAGE_SOURCE_H_
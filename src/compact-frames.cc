@@ -0,0 +1,110 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// (c) 2024 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#include "compact-frames.h"
+
+#include <cstring>
+#include <memory>
+#include <utility>
+
+#include "framebuffer.h"
+
+namespace timg {
+static bool RowDiffers(const Framebuffer &a, const Framebuffer &b, int y) {
+    return memcmp(a.row(y), b.row(y), a.width() * sizeof(rgba_t)) != 0;
+}
+
+// Bounding box of the pixels that differ between "a" and "b" of same size.
+// Empty if they are the same.
+static Rect ChangedRegion(const Framebuffer &a, const Framebuffer &b) {
+    int top = 0;
+    while (top < a.height() && !RowDiffers(a, b, top)) ++top;
+    if (top == a.height()) return {0, 0, 0, 0};
+    int bottom = a.height() - 1;
+    while (bottom > top && !RowDiffers(a, b, bottom)) --bottom;
+
+    // Only the columns outside of what we found so far need a look.
+    int left  = a.width();
+    int right = -1;
+    for (int y = top; y <= bottom; ++y) {
+        const rgba_t *const row_a = a.row(y);
+        const rgba_t *const row_b = b.row(y);
+        for (int x = 0; x < left; ++x) {
+            if (row_a[x] != row_b[x]) {
+                left = x;
+                break;
+            }
+        }
+        for (int x = a.width() - 1; x > right; --x) {
+            if (row_a[x] != row_b[x]) {
+                right = x;
+                break;
+            }
+        }
+    }
+    return {left, top, right - left + 1, bottom - top + 1};
+}
+
+void CompactFrames::Append(Framebuffer frame, const Duration &delay) {
+    const Rect full = {0, 0, frame.width(), frame.height()};
+    if (frames_.empty()) {
+        first_.reset(new Framebuffer(std::move(frame)));
+        frames_.push_back({delay, full, true, {}});
+        return;
+    }
+    const Framebuffer &previous = Get(size() - 1);
+    const bool new_size = previous.width() != frame.width() ||
+                          previous.height() != frame.height();
+    Frame stored = {delay, full, new_size, {}};
+    if (!new_size) stored.changed = ChangedRegion(previous, frame);
+    const Rect &r = stored.changed;
+    stored.pixels.resize((size_t)r.width * r.height);
+    for (int y = 0; y < r.height; ++y) {
+        memcpy(&stored.pixels[(size_t)y * r.width], frame.row(r.y + y) + r.x,
+               r.width * sizeof(rgba_t));
+    }
+    frames_.push_back(std::move(stored));
+}
+
+const Framebuffer &CompactFrames::Get(int index) {
+    if (index == 0) return *first_;
+    if (current_ < 0 || current_ > index) {
+        // Start over from the first frame.
+        if (scratch_ && scratch_->width() == first_->width() &&
+            scratch_->height() == first_->height()) {
+            for (int y = 0; y < first_->height(); ++y) {
+                memcpy(scratch_->row(y), first_->row(y),
+                       first_->width() * sizeof(rgba_t));
+            }
+        }
+        else {
+            scratch_.reset(new Framebuffer(*first_));
+        }
+        current_ = 0;
+    }
+    while (current_ < index) ApplyNext();
+    return *scratch_;
+}
+
+void CompactFrames::ApplyNext() {
+    const Frame &next = frames_[++current_];
+    const Rect &r     = next.changed;
+    if (next.new_size) scratch_.reset(new Framebuffer(r.width, r.height));
+    for (int y = 0; y < r.height; ++y) {
+        memcpy(scratch_->row(r.y + y) + r.x, &next.pixels[(size_t)y * r.width],
+               r.width * sizeof(rgba_t));
+    }
+}
+}  // namespace timg
@@ -0,0 +1,68 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// (c) 2024 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#ifndef TIMG_COMPACT_FRAMES_H
+#define TIMG_COMPACT_FRAMES_H
+
+#include <memory>
+#include <vector>
+
+#include "framebuffer.h"
+#include "timg-time.h"
+
+namespace timg {
+// Storage of prepared animation frames that keeps only the first frame in
+// full. Each following frame is stored as the rectangle that changed
+// compared to the frame before, which in typical animations is a small part.
+//
+// Frames are expanded on request into a scratch framebuffer; that is cheap
+// when going through them in order. Not thread-safe.
+class CompactFrames {
+public:
+    CompactFrames() = default;
+    CompactFrames(const CompactFrames &) = delete;
+
+    // Append the next frame, shown for "delay". The first frame is kept
+    // as is, of the following only what changed.
+    void Append(Framebuffer frame, const Duration &delay);
+
+    int size() const { return (int)frames_.size(); }
+    bool empty() const { return frames_.empty(); }
+
+    const Duration &delay(int index) const { return frames_[index].delay; }
+
+    // Return frame "index". The reference is valid until the next call to
+    // Get() or Append().
+    const Framebuffer &Get(int index);
+
+private:
+    struct Frame {
+        Duration delay;
+        Rect changed;                // Region of pixels different to before.
+        bool new_size;               // Changed size; "changed" is all of it.
+        std::vector<rgba_t> pixels;  // Rows of the changed region.
+    };
+
+    // Bring the scratch framebuffer from frame "current_" to the next.
+    void ApplyNext();
+
+    std::unique_ptr<Framebuffer> first_;
+    std::vector<Frame> frames_;
+    std::unique_ptr<Framebuffer> scratch_;
+    int current_ = -1;  // Frame in scratch_.
+};
+}  // namespace timg
+
+#endif  // TIMG_COMPACT_FRAMES_H
@@ -0,0 +1,377 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// (c) 2024 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#include "decoder-process-pool.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "framebuffer.h"
+
+#ifdef MSG_NOSIGNAL
+static constexpr int kSendFlags = MSG_NOSIGNAL;  // Dead worker: no SIGPIPE
+#else
+static constexpr int kSendFlags = 0;  // We set SO_NOSIGPIPE instead.
+#endif
+
+namespace timg {
+namespace {
+// Pixel memory in a shared memory object. In the main process, it is
+// created on Allocate(); in the worker, the object received from the main
+// process is mapped.
+class SharedPixels final : public PixelAllocator {
+public:
+    explicit SharedPixels(int fd = -1) : fd_(fd) {}
+    ~SharedPixels() final { CloseFile(); }
+
+    rgba_t *Allocate(size_t count) final {
+        const size_t size = count * sizeof(rgba_t);
+        if (fd_ < 0) fd_ = CreateSharedMemory(size);
+        void *mem = MAP_FAILED;
+        if (fd_ >= 0) {
+            mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                       fd_, 0);
+        }
+        if (mem == MAP_FAILED) {
+            // Not shareable, but still a valid framebuffer to not leave
+            // the caller with nothing.
+            CloseFile();
+            mem = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        }
+        return (rgba_t *)mem;
+    }
+
+    void Release(rgba_t *pixels, size_t count) final {
+        munmap(pixels, count * sizeof(rgba_t));
+    }
+
+    // File descriptor of the shared memory; -1 if it could not be created.
+    int fd() const { return fd_; }
+
+    // The mapping stays valid after the file is closed; no need to keep
+    // a file descriptor around for every image in memory.
+    void CloseFile() {
+        if (fd_ >= 0) close(fd_);
+        fd_ = -1;
+    }
+
+private:
+    static int CreateSharedMemory(size_t size) {
+        static std::atomic<unsigned> counter{0};
+        char name[32];
+        snprintf(name, sizeof(name), "/timg-dec-%d-%u", getpid(), counter++);
+        const int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd < 0) return -1;
+        shm_unlink(name);  // Only needed by file descriptor from now on.
+        if (ftruncate(fd, size) != 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    int fd_;
+};
+
+// Files we only have open ourselves, such as downloads held in memory, are
+// referred to by this path. A worker does not have them, so they are
+// handed over as file descriptor with the request.
+static constexpr char kOwnFilePrefix[] = "/proc/self/fd/";
+
+// Either "render" or "query" is set. Only render requests come with the
+// shared memory for the pixels.
+struct Request {
+    DecoderProcessPool::RenderFunction render;
+    DecoderProcessPool::QueryFunction query;
+    int32_t width;
+    int32_t height;
+    Framebuffer::Layout layout;
+    double args[DecoderProcessPool::kMaxArgs];
+    char filename[PATH_MAX];
+};
+
+struct Reply {
+    int32_t success;
+    double results[DecoderProcessPool::kMaxArgs];
+};
+
+struct Worker {
+    pid_t pid;
+    int socket;
+};
+}  // namespace
+
+static std::mutex pool_lock;
+static std::condition_variable worker_returned;
+static std::vector<Worker> idle_workers;
+static int workers_alive = 0;
+
+static bool WriteFully(int fd, const void *data, size_t len) {
+    const char *pos = (const char *)data;
+    while (len > 0) {
+        const ssize_t w = send(fd, pos, len, kSendFlags);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return false;
+        pos += w;
+        len -= w;
+    }
+    return true;
+}
+
+static bool ReadFully(int fd, void *data, size_t len) {
+    char *pos = (char *)data;
+    while (len > 0) {
+        const ssize_t r = read(fd, pos, len);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return false;
+        pos += r;
+        len -= r;
+    }
+    return true;
+}
+
+// The request goes together with the file descriptors that are not -1:
+// the shared memory for the pixels and the file to render.
+static bool SendRequest(int socket, const Request &request, int pixels_fd,
+                        int file_fd) {
+    int fds[2];
+    int fd_count = 0;
+    if (pixels_fd >= 0) fds[fd_count++] = pixels_fd;
+    if (file_fd >= 0) fds[fd_count++] = file_fd;
+    struct iovec iov = {(void *)&request, sizeof(request)};
+    alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(fds))] = {};
+    struct msghdr msg = {};
+    msg.msg_iov       = &iov;
+    msg.msg_iovlen    = 1;
+    if (fd_count > 0) {
+        msg.msg_control    = control;
+        msg.msg_controllen = CMSG_SPACE(fd_count * sizeof(int));
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level     = SOL_SOCKET;
+        cmsg->cmsg_type      = SCM_RIGHTS;
+        cmsg->cmsg_len       = CMSG_LEN(fd_count * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, fd_count * sizeof(int));
+    }
+
+    ssize_t w;
+    do {
+        w = sendmsg(socket, &msg, kSendFlags);
+    } while (w < 0 && errno == EINTR);
+    if (w <= 0) return false;
+    return WriteFully(socket, (const char *)&request + w, sizeof(request) - w);
+}
+
+static bool ReceiveRequest(int socket, Request *request, int *pixels_fd,
+                           int *file_fd) {
+    int fds[2]       = {-1, -1};
+    int fd_count     = 0;
+    struct iovec iov = {(void *)request, sizeof(*request)};
+    alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(fds))] = {};
+    struct msghdr msg = {};
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t r;
+    do {
+        r = recvmsg(socket, &msg, 0);
+    } while (r < 0 && errno == EINTR);
+    if (r <= 0) return false;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            const size_t len = std::min(cmsg->cmsg_len - CMSG_LEN(0),
+                                        sizeof(fds));
+            memcpy(fds, CMSG_DATA(cmsg), len);
+            fd_count = len / sizeof(int);
+        }
+    }
+    if (!ReadFully(socket, (char *)request + r, sizeof(*request) - r)) {
+        return false;
+    }
+    // Same order as sent; queries don't come with pixels.
+    const int pixel_fds = request->render ? 1 : 0;
+    *pixels_fd          = pixel_fds ? fds[0] : -1;
+    *file_fd            = (fd_count > pixel_fds) ? fds[pixel_fds] : -1;
+    return !request->render || *pixels_fd >= 0;
+}
+
+// Main loop of a worker process. Exits once the main process closes the
+// socket, so workers never outlive it.
+[[noreturn]] static void RunWorker(int socket) {
+    signal(SIGINT, SIG_IGN);  // Ctrl-C is for the main process to handle.
+    Request request;
+    int pixels_fd, file_fd;
+    while (ReceiveRequest(socket, &request, &pixels_fd, &file_fd)) {
+        request.filename[sizeof(request.filename) - 1] = '\0';
+        if (file_fd >= 0) {  // Now our own file under our descriptor.
+            snprintf(request.filename, sizeof(request.filename), "%s%d",
+                     kOwnFilePrefix, file_fd);
+        }
+        Reply reply = {};
+        if (request.render) {
+            Framebuffer out(request.width, request.height, request.layout,
+                            std::make_shared<SharedPixels>(pixels_fd));
+            reply.success = request.render(request.filename, request.args,
+                                           &out);
+        }
+        else {
+            reply.success = request.query(request.filename, reply.results);
+        }
+        if (file_fd >= 0) close(file_fd);
+        if (!WriteFully(socket, &reply, sizeof(reply))) break;
+    }
+    _exit(0);  // Don't run any of the main process' atexit() cleanup.
+}
+
+void DecoderProcessPool::Start(int count) {
+    std::unique_lock<std::mutex> l(pool_lock);
+    for (int i = 0; i < count; ++i) {
+        int sockets[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0) break;
+#ifdef SO_NOSIGPIPE
+        const int on = 1;
+        setsockopt(sockets[0], SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+        const pid_t pid = fork();
+        if (pid == 0) {
+            close(sockets[0]);
+            for (const Worker &w : idle_workers) close(w.socket);
+            RunWorker(sockets[1]);
+        }
+        close(sockets[1]);
+        if (pid < 0) {
+            close(sockets[0]);
+            break;
+        }
+        idle_workers.push_back({pid, sockets[0]});
+        ++workers_alive;
+    }
+}
+
+bool DecoderProcessPool::Enabled() {
+    std::unique_lock<std::mutex> l(pool_lock);
+    return workers_alive > 0;
+}
+
+// Fill the filename of "request". Returns false if it is too long.
+static bool SetFilename(const std::string &filename, Request *request) {
+    if (filename.size() >= sizeof(request->filename)) return false;
+    memset(request->filename, 0, sizeof(request->filename));
+    memcpy(request->filename, filename.data(), filename.size());
+    return true;
+}
+
+// Hand "request" to the next idle worker, together with the shared memory
+// "pixels_fd" if not -1, and wait for its "reply".
+static DecoderProcessPool::Result RunInWorker(const Request &request,
+                                              int pixels_fd, Reply *reply) {
+    using Result = DecoderProcessPool::Result;
+    *reply       = {};
+    Worker worker;
+    {
+        std::unique_lock<std::mutex> l(pool_lock);
+        worker_returned.wait(
+            l, []() { return !idle_workers.empty() || workers_alive == 0; });
+        if (idle_workers.empty()) return Result::kNoWorker;
+        worker = idle_workers.back();
+        idle_workers.pop_back();
+    }
+
+    // Opened anew, so that the worker reads with its own file offset.
+    const bool own_file = strncmp(request.filename, kOwnFilePrefix,
+                                  strlen(kOwnFilePrefix)) == 0;
+    const int file_fd =
+        own_file ? open(request.filename, O_RDONLY | O_CLOEXEC) : -1;
+    bool worker_okay = true;
+    if ((request.query || pixels_fd >= 0) && (!own_file || file_fd >= 0)) {
+        worker_okay = SendRequest(worker.socket, request, pixels_fd, file_fd) &&
+                      ReadFully(worker.socket, reply, sizeof(*reply));
+    }
+    if (file_fd >= 0) close(file_fd);
+
+    {
+        std::unique_lock<std::mutex> l(pool_lock);
+        if (worker_okay) {
+            idle_workers.push_back(worker);
+        }
+        else {
+            // Crashed. Not replaced, as we can't safely fork() anymore now
+            // that there are threads.
+            close(worker.socket);
+            waitpid(worker.pid, nullptr, 0);
+            --workers_alive;
+        }
+    }
+    worker_returned.notify_all();
+    return reply->success ? Result::kSuccess : Result::kFailed;
+}
+
+std::unique_ptr<Framebuffer> DecoderProcessPool::Render(
+    RenderFunction render, const std::string &filename, int width, int height,
+    Framebuffer::Layout layout, const double (&args)[kMaxArgs],
+    Result *result) {
+    Result dummy;
+    if (!result) result = &dummy;
+    Request request = {};
+    *result         = Result::kFailed;
+    if (!SetFilename(filename, &request)) return nullptr;
+    request.render = render;
+    request.width  = width;
+    request.height = height;
+    request.layout = layout;
+    memcpy(request.args, args, sizeof(request.args));
+
+    auto pixels = std::make_shared<SharedPixels>();
+    auto image  = std::make_unique<Framebuffer>(width, height, layout, pixels);
+    Reply reply;
+    *result = RunInWorker(request, pixels->fd(), &reply);
+    pixels->CloseFile();
+    return (*result == Result::kSuccess) ? std::move(image) : nullptr;
+}
+
+DecoderProcessPool::Result DecoderProcessPool::Query(
+    QueryFunction query, const std::string &filename,
+    double (&results)[kMaxArgs]) {
+    Request request = {};
+    if (!SetFilename(filename, &request)) return Result::kFailed;
+    request.query = query;
+    Reply reply;
+    const Result result = RunInWorker(request, -1, &reply);
+    memcpy(results, reply.results, sizeof(results));
+    return result;
+}
+}  // namespace timg
@@ -0,0 +1,78 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// (c) 2024 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#ifndef TIMG_DECODER_PROCESS_POOL_H
+#define TIMG_DECODER_PROCESS_POOL_H
+
+#include <memory>
+#include <string>
+
+#include "framebuffer.h"
+
+namespace timg {
+// Pool of worker processes for decoders that are not thread-safe or that
+// are prone to crash on broken input. Each worker renders one image at a
+// time directly into shared memory that the resulting Framebuffer uses, so
+// no pixels are copied. If a worker crashes, only the image it worked on
+// fails to load.
+//
+// Workers are forked from the main process, so they have the same code
+// and functions can be handed to them by pointer.
+class DecoderProcessPool {
+public:
+    static constexpr int kMaxArgs = 4;
+
+    enum class Result {
+        kSuccess,
+        kFailed,    // Function failed or the worker crashed.
+        kNoWorker,  // No worker (left) to run it.
+    };
+
+    // Function run in a worker: render "filename" into "out", which already
+    // has the size requested in Render(). "args" are kMaxArgs values as
+    // passed to Render(), e.g. the original image size.
+    using RenderFunction = bool (*)(const char *filename, const double *args,
+                                    Framebuffer *out);
+
+    // Function run in a worker: find out about "filename" without rendering
+    // it, e.g. its size, and fill up to kMaxArgs "results".
+    using QueryFunction = bool (*)(const char *filename, double *results);
+
+    // Start "count" worker processes. Needs to be called before any threads
+    // are started, as workers are forked and only get the calling thread.
+    static void Start(int count);
+
+    // Returns true if workers have been started.
+    static bool Enabled();
+
+    // Let a worker run "render" for "filename" into a new framebuffer of
+    // the given size and layout. Blocks until a worker is available and
+    // has finished. A "filename" in /proc/self/fd/, only open in this
+    // process, is handed to the worker as file descriptor.
+    // Returns nullptr if "render" failed, the worker crashed or there is no
+    // worker (left); if "result" is given, it tells which.
+    static std::unique_ptr<Framebuffer> Render(
+        RenderFunction render, const std::string &filename, int width,
+        int height, Framebuffer::Layout layout, const double (&args)[kMaxArgs],
+        Result *result = nullptr);
+
+    // Let a worker run "query" for "filename", same as Render(), but without
+    // pixels. Parsing untrusted input thus happens in the worker as well.
+    static Result Query(QueryFunction query, const std::string &filename,
+                        double (&results)[kMaxArgs]);
+};
+}  // namespace timg
+
+#endif  // TIMG_DECODER_PROCESS_POOL_H
@@ -29,6 +29,9 @@ namespace timg {
 // line.
 static constexpr int kNotInitialized = std::numeric_limits<int>::min();
 
+// Value for DisplayOptions::compress_pixel_level.
+static constexpr int kAdaptiveCompression = -1;
+
 // Options influencing the rendering, chosen on the command-line or
 // programmatically.
 struct DisplayOptions {
@@ -49,6 +52,9 @@ struct DisplayOptions {
     // useful when SSH-ed in remotely), at the expense of more CPU time
     // used by timg to re-compress (usefulness might be negative when playing
     // a video locally). Compression is done in separate thread.
+    // Higher levels also try more PNG row filters to find the best one.
+    // With kAdaptiveCompression, the level is chosen while frames are sent
+    // depending on whether the connection or the CPU is the bottleneck.
     int compress_pixel_level = 1;
 
     float width_stretch = 1.0;  // To correct font squareness aspect ratio
@@ -80,6 +86,17 @@ struct DisplayOptions {
 
     bool allow_frame_skipping = false;  // skip frame if CPU or terminal slow
 
+    // Position in a video to start playing at. Currently only honored by
+    // videos, which can seek directly to the nearest keyframe.
+    Duration start_time;
+
+    // If set, animation sources can ask if a frame that is supposed to
+    // finish "end_of_frame" after the start of the animation is already too
+    // late to be shown. If so, it will not be shown and the source can skip
+    // the expensive steps of preparing and sending it. Can be asked from any
+    // thread, but only after the animation's first frame was sent to the sink.
+    std::function<bool(const Duration &end_of_frame)> frame_is_late;
+
     //-- Background options for transparent images --
     bool local_alpha_handling = true;  // If we alpha blend locally
     // "bgcolor_getter" is a function that can be called to retrieve the
@@ -96,12 +113,20 @@ struct DisplayOptions {
     // terminal emulator take a while to respond to the background color query).
     std::function<rgba_t()> bgcolor_getter;
 
+    // The background color as configured, e.g. "auto"; "bgcolor_getter"
+    // resolves it.
+    std::string bg_color_name;
+
     // In case of background color alpha merging, this is the optional
     // 'checkerboard' color if alpha=0xff, or no checkerboard if alpha=0x00.
     rgba_t bg_pattern_color = {0x00, 0x00, 0x00, 0x00};
 
     // Factor of pattern-size from the default
     int pattern_size = 1;
+
+    // If not empty, the final scaled frames of images are cached in this
+    // directory to be re-used the next time the same image is shown.
+    std::string cache_dir;
 };
 }  // namespace timg
 #endif  // DISPLAY_OPTIONS_H
@@ -0,0 +1,116 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// (c) 2024 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+//
+#ifndef TIMG_ENCODED_FRAME_CACHE
+#define TIMG_ENCODED_FRAME_CACHE
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+
+#include "framebuffer.h"
+
+namespace timg {
+// Thread-safe, byte-bounded, LRU cache of the terminal escape sequences a
+// canvas created for a framebuffer, keyed by a hash of the framebuffer
+// content and whatever else the encoding depends on. Frames that show up
+// again, such as in looping animations, don't have to be encoded again.
+class EncodedFrameCache {
+public:
+    using Payload = std::shared_ptr<const std::string>;
+
+    explicit EncodedFrameCache(size_t max_bytes) : max_bytes_(max_bytes) {}
+    EncodedFrameCache(const EncodedFrameCache &) = delete;
+
+    // Hash of the pixels and size of the framebuffer.
+    static uint64_t HashFramebuffer(const Framebuffer &fb) {
+        uint64_t h = ((uint64_t)fb.width() << 32 | fb.height());
+        if (fb.is_packed()) {
+            return Combine(h, HashPixels(fb.begin(), fb.width() * fb.height()));
+        }
+        for (int y = 0; y < fb.height(); ++y) {
+            h = Combine(h, HashPixels(fb.row(y), fb.width()));
+        }
+        return h;
+    }
+
+    // Mix "value" into hash "h" to create a key that also depends on
+    // whatever else influences the encoding, such as the position.
+    static uint64_t Combine(uint64_t h, uint64_t value) {
+        return h ^ (value + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2));
+    }
+
+    // Return payload stored for "key" or nullptr if not there.
+    Payload Lookup(uint64_t key) {
+        std::lock_guard<std::mutex> l(lock_);
+        auto found = index_.find(key);
+        if (found == index_.end()) return nullptr;
+        lru_.splice(lru_.begin(), lru_, found->second);  // Now most recent.
+        return found->second->second;
+    }
+
+    // Store payload for "key". If this exceeds the bytes budget, the least
+    // recently used entries are evicted; unless "evict" is false, then the
+    // new payload is not stored. The latter is what frames of looping
+    // animations need: evicting the least recently used frame would throw
+    // out exactly the one needed next.
+    void Insert(uint64_t key, std::string &&payload, bool evict = true) {
+        if (payload.size() > max_bytes_) return;
+        Payload value = std::make_shared<const std::string>(std::move(payload));
+        std::lock_guard<std::mutex> l(lock_);
+        if (index_.find(key) != index_.end()) return;  // Raced with other.
+        if (!evict && bytes_ + value->size() > max_bytes_) return;
+        lru_.emplace_front(key, std::move(value));
+        index_[key] = lru_.begin();
+        bytes_ += lru_.front().second->size();
+        while (bytes_ > max_bytes_) {
+            bytes_ -= lru_.back().second->size();
+            index_.erase(lru_.back().first);
+            lru_.pop_back();
+        }
+    }
+
+    // Forget all entries, e.g. when a new animation starts.
+    void Clear() {
+        std::lock_guard<std::mutex> l(lock_);
+        lru_.clear();
+        index_.clear();
+        bytes_ = 0;
+    }
+
+private:
+    static uint64_t HashPixels(const rgba_t *pixels, size_t count) {
+        return std::hash<std::string_view>()(
+            std::string_view((const char *)pixels, count * sizeof(rgba_t)));
+    }
+
+    using Entry = std::pair<uint64_t, Payload>;
+
+    const size_t max_bytes_;
+    std::mutex lock_;
+    std::list<Entry> lru_;  // Most recently used first.
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> index_;
+    size_t bytes_ = 0;
+};
+}  // namespace timg
+
+#endif  // TIMG_ENCODED_FRAME_CACHE
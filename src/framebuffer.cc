@@ -17,10 +17,17 @@
 
 #include <strings.h>
 
+#include <algorithm>
 #include <cassert>
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <utility>
+
+#include "pipeline-stats.h"
 
 namespace timg {
 
@@ -56,65 +63,185 @@ rgba_t rgba_t::ParseColor(const char *color) {
 // a full row.
 static constexpr int SWS_SCRATCH_ADDITIONAL_ROW = 1;
 
-Framebuffer::Framebuffer(int w, int h, const rgba_t *from_data)
+static rgba_t *AllocatePixels(size_t count) {
+    return (rgba_t *)::operator new[](
+        count * sizeof(rgba_t), std::align_val_t(Framebuffer::kRowAlignment));
+}
+
+static void FreePixels(rgba_t *pixels) {
+    ::operator delete[](pixels, std::align_val_t(Framebuffer::kRowAlignment));
+}
+
+static int RowPixels(int width, Framebuffer::Layout layout) {
+    static constexpr int kAlignPixels =
+        Framebuffer::kRowAlignment / sizeof(rgba_t);
+    if (layout == Framebuffer::Layout::kPacked) return width;
+    return (width + kAlignPixels - 1) / kAlignPixels * kAlignPixels;
+}
+
+Framebuffer::Framebuffer(int w, int h, Layout layout,
+                         const Framebuffer *copy_from,
+                         std::shared_ptr<PixelAllocator> allocator)
     : width_(w),
       height_(h),
-      pixels_(new rgba_t[width_ * (height_ + SWS_SCRATCH_ADDITIONAL_ROW)]),
-      end_(pixels_ + width_ * height_) {
-    strides_[0] = (int)sizeof(rgba_t) * width_;
+      row_pixels_(RowPixels(w, layout)),
+      allocator_(std::move(allocator)) {
+    pixels_ = allocator_ ? allocator_->Allocate(allocated_pixels())
+                         : AllocatePixels(allocated_pixels());
+    end_        = pixels_ + row_pixels_ * height_;
+    strides_[0] = (int)sizeof(rgba_t) * row_pixels_;
     strides_[1] = 0;  // empty sentinel value.
-    if (from_data) {
-        memcpy(pixels_, from_data, sizeof(rgba_t) * width_ * height_);
+    if (copy_from) {
+        // Same layout, so also the padding can be copied with the pixels.
+        memcpy(pixels_, copy_from->pixels_,
+               sizeof(rgba_t) * row_pixels_ * height_);
     }
     else {
         Clear();
     }
 }
 
-Framebuffer::Framebuffer(int w, int h) : Framebuffer(w, h, nullptr) {}
+Framebuffer::Framebuffer(int w, int h,
+                         std::shared_ptr<PixelAllocator> allocator)
+    : Framebuffer(w, h, Layout::kPacked, nullptr, std::move(allocator)) {}
 
-Framebuffer::Framebuffer(const Framebuffer &other)
-    : Framebuffer(other.width(), other.height(), other.pixels_) {}
+Framebuffer::Framebuffer(int w, int h, Layout layout,
+                         std::shared_ptr<PixelAllocator> allocator)
+    : Framebuffer(w, h, layout, nullptr, std::move(allocator)) {}
+
+Framebuffer::Framebuffer(const Framebuffer &other,
+                         std::shared_ptr<PixelAllocator> allocator)
+    : Framebuffer(other.width(), other.height(),
+                  other.is_packed() ? Layout::kPacked : Layout::kAlignedRows,
+                  &other, std::move(allocator)) {}
+
+Framebuffer::Framebuffer(Framebuffer &&other) noexcept
+    : width_(0),
+      height_(0),
+      row_pixels_(0),
+      pixels_(nullptr),
+      end_(nullptr),
+      strides_{0, 0} {
+    *this = std::move(other);
+}
+
+// Swap with the other, so that it takes care of releasing what we had.
+Framebuffer &Framebuffer::operator=(Framebuffer &&other) noexcept {
+    std::swap(width_, other.width_);
+    std::swap(height_, other.height_);
+    std::swap(row_pixels_, other.row_pixels_);
+    std::swap(allocator_, other.allocator_);
+    std::swap(pixels_, other.pixels_);
+    std::swap(end_, other.end_);
+    std::swap(strides_, other.strides_);
+    std::swap(row_data_, other.row_data_);
+    return *this;
+}
 
 Framebuffer::~Framebuffer() {
     delete[] row_data_;
-    delete[] pixels_;
+    if (!pixels_) return;  // Moved away.
+    if (allocator_) {
+        allocator_->Release(pixels_, allocated_pixels());
+    }
+    else {
+        FreePixels(pixels_);
+    }
+}
+
+size_t Framebuffer::allocated_pixels() const {
+    return (size_t)row_pixels_ * (height_ + SWS_SCRATCH_ADDITIONAL_ROW);
 }
 
 void Framebuffer::SetPixel(int x, int y, rgba_t value) {
     if (x < 0 || x >= width() || y < 0 || y >= height()) return;
-    pixels_[width_ * y + x] = value;
+    row(y)[x] = value;
 }
 
 rgba_t Framebuffer::at(int x, int y) const {
     assert(x >= 0 && x < width() && y >= 0 && y < height());
-    return pixels_[width_ * y + x];
+    return row(y)[x];
 }
 
 void Framebuffer::Clear() {
-    memset(pixels_, 0, sizeof(*pixels_) * width_ * height_);
+    memset(pixels_, 0, sizeof(*pixels_) * row_pixels_ * height_);
 }
 
 uint8_t **Framebuffer::row_data() {
     if (!row_data_) {
         row_data_ = new uint8_t *[height_ + 1];
-        for (int i = 0; i < height_; ++i)
-            row_data_[i] = (uint8_t *)pixels_ + i * width_ * sizeof(rgba_t);
+        for (int i = 0; i < height_; ++i) row_data_[i] = (uint8_t *)row(i);
         row_data_[height_] = nullptr;  // empty sentinel value.
     }
     return row_data_;
 }
 
+namespace {
+// Integer version of what LinearColor::AlphaBlend() does, with the squaring
+// and square root of the gamma approximation in lookup tables. Gives the
+// same results.
+class LinearBackground {
+public:
+    /* implicit */ LinearBackground(rgba_t bg)  // NOLINT
+        : r_(kToLinear[bg.r]), g_(kToLinear[bg.g]), b_(kToLinear[bg.b]) {}
+
+    rgba_t Blend(rgba_t c) const {
+        const uint32_t a   = c.a;
+        const uint32_t inv = 0xff - a;
+        return {ToGamma((kToLinear[c.r] * a + r_ * inv) / 0xff),
+                ToGamma((kToLinear[c.g] * a + g_ * inv) / 0xff),
+                ToGamma((kToLinear[c.b] * a + b_ * inv) / 0xff), 0xff};
+    }
+
+private:
+    struct LinearTable {
+        LinearTable() {
+            for (int i = 0; i < 256; ++i) value[i] = i * i;
+        }
+        uint32_t operator[](uint8_t i) const { return value[i]; }
+        uint32_t value[256];
+    };
+
+    // Linear values are up to 255*255; the table maps each to the
+    // truncated square root.
+    struct GammaTable {
+        GammaTable() {
+            int root = 0;
+            for (int i = 0; i <= 0xff * 0xff; ++i) {
+                if ((root + 1) * (root + 1) <= i) ++root;
+                value[i] = root;
+            }
+        }
+        uint8_t value[0xff * 0xff + 1];
+    };
+
+    static uint8_t ToGamma(uint32_t linear) { return kToGamma.value[linear]; }
+
+    static const LinearTable kToLinear;
+    static const GammaTable kToGamma;
+    const uint32_t r_, g_, b_;
+};
+const LinearBackground::LinearTable LinearBackground::kToLinear;
+const LinearBackground::GammaTable LinearBackground::kToGamma;
+}  // namespace
+
 void Framebuffer::AlphaComposeBackground(const bgcolor_query &get_bg,
                                          rgba_t pattern_col, int pwidth,
                                          int pheight, int start_row) {
     if (!get_bg) return;  // -b none
+    PipelineStats::Scope timing(Stage::kAlphaCompose);
 
-    iterator pos = begin() + (start_row * width());
-    for (/**/; pos < end(); ++pos) {
-        if (pos->a < 0xff) break;  // First pixel that is transparent.
+    // Find the first pixel that is transparent.
+    int start_x = 0;
+    int start_y = start_row;
+    for (/**/; start_y < height_; ++start_y) {
+        const rgba_t *const line = row(start_y);
+        for (start_x = 0; start_x < width_; ++start_x) {
+            if (line[start_x].a < 0xff) break;
+        }
+        if (start_x < width_) break;
     }
-    if (pos >= end()) return;  // Nothing transparent all the way to the end.
+    if (start_y >= height_) return;  // Nothing transparent all the way down.
 
     // Need to do alpha blending, so only now we have to retrieve the bgcolor.
     const rgba_t bgcolor = get_bg();
@@ -123,30 +250,163 @@ void Framebuffer::AlphaComposeBackground(const bgcolor_query &get_bg,
     // Fast path if we don't have a pattern color.
     if (pattern_col.a == 0x00 || pattern_col == bgcolor || pwidth <= 0 ||
         pheight <= 0) {
-        const LinearColor bg(bgcolor);
-        for (/**/; pos < end(); ++pos) {
-            if (pos->a == 0xff) continue;
-            *pos = LinearColor(*pos).AlphaBlend(bg).repack();
+        const LinearBackground bg(bgcolor);
+        for (int y = start_y; y < height_; ++y) {
+            rgba_t *const line = row(y);
+            for (int x = (y == start_y ? start_x : 0); x < width_; ++x) {
+                if (line[x].a == 0xff) continue;
+                line[x] = bg.Blend(line[x]);
+            }
         }
         return;
     }
 
     // If we have a pattern color, use that as alternating choice.
-    const LinearColor bg_choice[2] = {bgcolor, pattern_col};
-
-    // Pos moved to the first pixel that required alpha blending.
-    // From this pos, we need to recover the x/y position to be in the
-    // right place for the checkerboard pattern.
-    const int start_x = (pos - begin()) % width_;
-    const int start_y = (pos - begin()) / width_;
+    const LinearBackground bg_choice[2] = {bgcolor, pattern_col};
     for (int y = start_y; y < height_; ++y) {
         const int y_pattern_pos = y / pheight;
-        for (int x = (y == start_y ? start_x : 0); x < width_; ++x, pos++) {
-            if (pos->a == 0xff) continue;
-            const auto &bg = bg_choice[((x / pwidth) + y_pattern_pos) % 2];
-            *pos           = LinearColor(*pos).AlphaBlend(bg).repack();
+        rgba_t *const line      = row(y);
+        // Pattern changes every pwidth pixels; no need to compute per pixel.
+        for (int x = (y == start_y ? start_x : 0); x < width_; /**/) {
+            const int x_pattern_pos = x / pwidth;
+            const int pattern_end =
+                std::min(width_, (x_pattern_pos + 1) * pwidth);
+            const auto &bg = bg_choice[(x_pattern_pos + y_pattern_pos) % 2];
+            for (/**/; x < pattern_end; ++x) {
+                if (line[x].a == 0xff) continue;
+                line[x] = bg.Blend(line[x]);
+            }
         }
     }
 }
 
+// Content box search: pixels are compared in blocks, which the compiler
+// can vectorize, and the search stops at the first block with a difference.
+static constexpr int kCompareBlockPixels = 16;
+
+namespace {
+class PixelMatcher {
+public:
+    PixelMatcher(rgba_t background, int fuzz)
+        : fuzz_(std::clamp(fuzz, 0, 255)) {
+        for (int i = 0; i < kCompareBlockPixels; ++i) {
+            memcpy(background_ + 4 * i, &background, 4);
+        }
+    }
+
+    // Index of first pixel in "pixels" that is different or -1.
+    int FirstDifferent(const rgba_t *pixels, int count) const {
+        int i = 0;
+        for (/**/; i + kCompareBlockPixels <= count; i += kCompareBlockPixels) {
+            if (BlockDifferent(pixels + i)) break;
+        }
+        for (/**/; i < count; ++i) {
+            if (PixelDifferent(pixels[i])) return i;
+        }
+        return -1;
+    }
+
+    // Index of last pixel in "pixels" that is different or -1.
+    int LastDifferent(const rgba_t *pixels, int count) const {
+        int i = count;
+        for (/**/; i >= kCompareBlockPixels; i -= kCompareBlockPixels) {
+            if (BlockDifferent(pixels + i - kCompareBlockPixels)) break;
+        }
+        for (--i; i >= 0; --i) {
+            if (PixelDifferent(pixels[i])) return i;
+        }
+        return -1;
+    }
+
+private:
+    static uint8_t AbsDiff(uint8_t a, uint8_t b) {
+        return a > b ? a - b : b - a;
+    }
+
+    bool BlockDifferent(const rgba_t *pixels) const {
+        const uint8_t *bytes = (const uint8_t *)pixels;
+        bool different       = false;
+        for (int i = 0; i < 4 * kCompareBlockPixels; ++i) {
+            different |= AbsDiff(bytes[i], background_[i]) > fuzz_;
+        }
+        return different;
+    }
+
+    bool PixelDifferent(rgba_t pixel) const {
+        const uint8_t *bytes = (const uint8_t *)&pixel;
+        bool different       = false;
+        for (int i = 0; i < 4; ++i) {
+            different |= AbsDiff(bytes[i], background_[i]) > fuzz_;
+        }
+        return different;
+    }
+
+    const uint8_t fuzz_;
+    uint8_t background_[4 * kCompareBlockPixels];  // Background repeated.
+};
+}  // namespace
+
+Rect Framebuffer::FindContentBox(const Rect &r, int fuzz) const {
+    return FindContentBox(pixels_, row_pixels_, r, fuzz);
+}
+
+Rect Framebuffer::FindContentBox(const rgba_t *pixels, int row_pixels,
+                                 const Rect &r, int fuzz) {
+    auto row = [&](int y) { return pixels + (size_t)y * row_pixels; };
+    const PixelMatcher matcher(row(r.y)[r.x], fuzz);
+    auto row_different = [&](int y) {
+        return matcher.FirstDifferent(row(y) + r.x, r.width) >= 0;
+    };
+
+    // Rows from top and bottom until we find the first with content.
+    const int end_y = r.y + r.height;
+    int top         = r.y;
+    while (top < end_y && !row_different(top)) ++top;
+    if (top == end_y) return {r.x, r.y, 0, 0};  // All the same color.
+    int bottom = end_y - 1;
+    while (!row_different(bottom)) --bottom;
+
+    // In the remaining rows, we only need to look at the part left of the
+    // leftmost and right of the rightmost content found so far.
+    const int end_x = r.x + r.width;
+    int left        = end_x;
+    int right       = r.x - 1;
+    for (int y = top; y <= bottom; ++y) {
+        const rgba_t *const line = row(y);
+        const int first = matcher.FirstDifferent(line + r.x, left - r.x);
+        if (first >= 0) left = r.x + first;
+        const int last =
+            matcher.LastDifferent(line + right + 1, end_x - right - 1);
+        if (last >= 0) right += 1 + last;
+    }
+    return {left, top, right - left + 1, bottom - top + 1};
+}
+
+FramebufferPool::~FramebufferPool() {
+    for (const Block &block : free_) FreePixels(block.pixels);
+}
+
+rgba_t *FramebufferPool::Allocate(size_t count) {
+    {
+        std::lock_guard<std::mutex> l(lock_);
+        for (auto it = free_.begin(); it != free_.end(); ++it) {
+            if (it->count != count) continue;
+            rgba_t *const result = it->pixels;
+            free_.erase(it);
+            return result;
+        }
+    }
+    return AllocatePixels(count);
+}
+
+void FramebufferPool::Release(rgba_t *pixels, size_t count) {
+    {
+        std::lock_guard<std::mutex> l(lock_);
+        if ((int)free_.size() < max_free_) {
+            free_.push_back({pixels, count});
+            return;
+        }
+    }
+    FreePixels(pixels);
+}
 }  // namespace timg
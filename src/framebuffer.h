@@ -17,12 +17,37 @@
 #define TIMG_FRAMEBUFFER_H
 
 #include <cmath>
+#include <cstddef>
 #include <cstdint>
 #include <cstring>
 #include <functional>
 #include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <vector>
 
 namespace timg {
+namespace internal {
+// Lookup tables for rgba_t::As256TermColor(), per color component.
+struct TermColor256Table {
+    constexpr TermColor256Table() : cube(), gray() {
+        for (int v = 0; v < 256; ++v) {
+            // Middle of cut-off points for cube.
+            cube[v] = v < 0x5f / 2            ? 0
+                      : v < (0x5f + 0x87) / 2 ? 1
+                      : v < (0x87 + 0xaf) / 2 ? 2
+                      : v < (0xaf + 0xd7) / 2 ? 3
+                      : v < (0xd7 + 0xff) / 2 ? 4
+                                              : 5;
+            gray[v] = 232 + (v * 23 / 255);  // Using the 232-255 range.
+        }
+    }
+    uint8_t cube[256];  // Position in the 6 steps of the cube.
+    uint8_t gray[256];  // Palette entry for gray scale.
+};
+inline constexpr TermColor256Table kTermColor256;
+}  // namespace internal
+
 struct rgba_t {
     uint8_t r, g, b;  // Color components, gamma corrected (non-linear)
     uint8_t a;        // Alpha channel. Linear. [transparent..opaque]=0..255
@@ -35,20 +60,9 @@ struct rgba_t {
 
     // Rough mapping to the 256 color modes, a 6x6x6 cube.
     inline uint8_t As256TermColor() const {
-        if (r == g && g == b) {
-            // gray scale, using the 232-255 range.
-            return 232 + (r * 23 / 255);
-        }
-
-        auto v2cube = [](uint8_t v) {  // middle of cut-off points for cube.
-            return v < 0x5f / 2            ? 0
-                   : v < (0x5f + 0x87) / 2 ? 1
-                   : v < (0x87 + 0xaf) / 2 ? 2
-                   : v < (0xaf + 0xd7) / 2 ? 3
-                   : v < (0xd7 + 0xff) / 2 ? 4
-                                           : 5;
-        };
-        return 16 + 36 * v2cube(r) + 6 * v2cube(g) + v2cube(b);
+        const internal::TermColor256Table &table = internal::kTermColor256;
+        if (r == g && g == b) return table.gray[r];
+        return 16 + 36 * table.cube[r] + 6 * table.cube[g] + table.cube[b];
     }
 
     // Parse a color given as string. Supported are numeric formats are
@@ -60,16 +74,61 @@ struct rgba_t {
 };
 static_assert(sizeof(rgba_t) == 4, "Unexpected size for rgba_t struct");
 
+// Rectangular region of an image.
+struct Rect {
+    int x, y, width, height;
+};
+
+// Where the pixel memory of framebuffers comes from. Without one, it is
+// allocated from the heap.
+class PixelAllocator {
+public:
+    virtual ~PixelAllocator() = default;
+
+    // Return memory for "count" pixels, aligned to
+    // Framebuffer::kRowAlignment bytes.
+    virtual rgba_t *Allocate(size_t count) = 0;
+
+    // Give back "pixels" previously returned by Allocate(count).
+    virtual void Release(rgba_t *pixels, size_t count) = 0;
+};
+
 // Very simple framebuffer, storing widht*height pixels in RGBA format.
+// Rows might be padded (see Layout), so they should be accessed
+// with row() or stride().
 class Framebuffer {
 public:
     typedef rgba_t *iterator;
     typedef const rgba_t *const_iterator;
     class rgb_iterator;
 
+    // With kAlignedRows, each row starts at a multiple of kRowAlignment
+    // bytes, so that vectorized code working on rows can use aligned
+    // loads and stores. Rows are then padded and not contiguous anymore.
+    // kPacked rows are tightly packed, as needed by libraries that expect
+    // width * height contiguous pixels.
+    static constexpr int kRowAlignment = 64;
+    enum class Layout {
+        kPacked,
+        kAlignedRows,
+    };
+
     Framebuffer() = delete;
-    Framebuffer(int width, int height);
-    explicit Framebuffer(const Framebuffer &other);
+    // Create framebuffer with pixel memory from "allocator" if given. The
+    // framebuffer keeps a reference to the allocator, so it can be handed
+    // to other threads without worrying about the allocator's lifetime.
+    Framebuffer(int width, int height,
+                std::shared_ptr<PixelAllocator> allocator = nullptr);
+    Framebuffer(int width, int height, Layout layout,
+                std::shared_ptr<PixelAllocator> allocator = nullptr);
+
+    // Copy, with the same layout as the "other".
+    explicit Framebuffer(const Framebuffer &other,
+                         std::shared_ptr<PixelAllocator> allocator = nullptr);
+    Framebuffer(Framebuffer &&other) noexcept;
+
+    Framebuffer &operator=(const Framebuffer &other) = delete;
+    Framebuffer &operator=(Framebuffer &&other) noexcept;
 
     ~Framebuffer();
 
@@ -105,13 +164,33 @@ public:
                                 int pattern_width, int pattern_height,
                                 int start_row = 0);
 
-    // The raw internal buffer containing width()*height() pixels organized
-    // from top left to bottom right.
+    // Box around everything in "region" that differs from the color of its
+    // top left corner by more than "fuzz" in any component, similar to
+    // what GraphicsMagick's trim() does. Returns an empty rectangle if
+    // "region" is all the same color.
+    Rect FindContentBox(const Rect &region, int fuzz = 0) const;
+
+    // Same, for "pixels" not held in a Framebuffer, with rows that are
+    // "row_pixels" apart.
+    static Rect FindContentBox(const rgba_t *pixels, int row_pixels,
+                               const Rect &region, int fuzz = 0);
+
+    // The raw internal buffer containing height() rows of pixels organized
+    // from top left to bottom right. Only with Layout::kPacked, this is
+    // a contiguous block of width()*height() pixels; otherwise it includes
+    // the padding at the end of each row; use row() to access these.
     const_iterator begin() const { return pixels_; }
     iterator begin() { return pixels_; }
     const_iterator end() const { return end_; }
     iterator end() { return end_; }
 
+    // The first pixel of row "y".
+    const_iterator row(int y) const { return pixels_ + y * row_pixels_; }
+    iterator row(int y) { return pixels_ + y * row_pixels_; }
+
+    // If rows are contiguous, i.e. begin() to end() is just the image.
+    bool is_packed() const { return row_pixels_ == width_; }
+
     /* the following two methods are useful with line-oriented sws_scale()
      * to allow it to directly write into our frame-buffer
      */
@@ -124,16 +203,46 @@ public:
     uint8_t **row_data();
 
 private:
-    Framebuffer(int width, int height, const rgba_t *from_data);
+    Framebuffer(int width, int height, Layout layout,
+                const Framebuffer *copy_from,
+                std::shared_ptr<PixelAllocator> allocator);
+
+    // Number of pixels allocated, which is a bit more than the image.
+    size_t allocated_pixels() const;
 
-    const int width_;
-    const int height_;
-    rgba_t *const pixels_;
-    rgba_t *const end_;
+    int width_;
+    int height_;
+    int row_pixels_;  // Pixels from one row to the next, including padding.
+    std::shared_ptr<PixelAllocator> allocator_;
+    rgba_t *pixels_;
+    rgba_t *end_;
     int strides_[2];
     uint8_t **row_data_ = nullptr;  // Only allocated if requested.
 };
 
+// Allocator keeping the pixel memory of framebuffers that went away to hand
+// it out again for the next framebuffer of the same size, as it happens
+// with frames of animations and videos. Thread-safe.
+class FramebufferPool final : public PixelAllocator {
+public:
+    // Keep at most "max_free" unused blocks around.
+    explicit FramebufferPool(int max_free = 8) : max_free_(max_free) {}
+    FramebufferPool(const FramebufferPool &) = delete;
+    ~FramebufferPool() override;
+
+    rgba_t *Allocate(size_t count) final;
+    void Release(rgba_t *pixels, size_t count) final;
+
+private:
+    struct Block {
+        rgba_t *pixels;
+        size_t count;
+    };
+    const int max_free_;
+    std::mutex lock_;
+    std::vector<Block> free_;
+};
+
 // Unpacked rgba_t into linear color space, useful to do any blending ops on.
 class LinearColor {
 public:
@@ -28,73 +28,69 @@
 #include <cstring>
 #include <exception>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "buffered-write-sequencer.h"
 #include "display-options.h"
 #include "framebuffer.h"
+#include "pipeline-stats.h"
 #include "renderer.h"
 #include "timg-time.h"
 
 static constexpr bool kDebug = false;
 
+// Animation frames prepared ahead of the one shown.
+static constexpr int kPrepareAhead = 4;
+
 namespace timg {
 static void CopyToFramebuffer(const Magick::Image &img,
                               timg::Framebuffer *result) {
     assert(result->width() >= (int)img.columns() &&
            result->height() >= (int)img.rows());
+    // Images with a palette have the authoritative color in the colormap.
+    const MagickLib::Image *const image = img.constImage();
+    const bool use_colormap =
+        image->storage_class == MagickLib::PseudoClass && image->colormap;
+    const size_t columns = img.columns();
     for (size_t y = 0; y < img.rows(); ++y) {
-        for (size_t x = 0; x < img.columns(); ++x) {
-            const Magick::Color &c = img.pixelColor(x, y);
-            result->SetPixel(
-                x, y,
-                {ScaleQuantumToChar(c.redQuantum()),
-                 ScaleQuantumToChar(c.greenQuantum()),
-                 ScaleQuantumToChar(c.blueQuantum()),
-                 (uint8_t)(0xff - ScaleQuantumToChar(c.alphaQuantum()))});
+        // Row-wise bulk access to the pixel cache.
+        const Magick::PixelPacket *pixel = img.getConstPixels(0, y, columns, 1);
+        if (!pixel) return;
+        const Magick::IndexPacket *index =
+            use_colormap ? img.getConstIndexes() : nullptr;
+        rgba_t *out = result->row(y);
+        for (size_t x = 0; x < columns; ++x, ++pixel, ++out) {
+            const Magick::PixelPacket &c = (index && index[x] < image->colors)
+                                               ? image->colormap[index[x]]
+                                               : *pixel;
+            *out = {ScaleQuantumToChar(c.red), ScaleQuantumToChar(c.green),
+                    ScaleQuantumToChar(c.blue),
+                    (uint8_t)(0xff - ScaleQuantumToChar(c.opacity))};
         }
     }
 }
 
-// Frame already prepared as the buffer to be sent, so copy to terminal-buffer
-// does not have to be done online. Also knows about the animation delay.
-class GraphicsMagickSource::PreprocessedFrame {
-public:
-    PreprocessedFrame(const Magick::Image &img, const DisplayOptions &opt,
-                      bool is_part_of_animation)
-        : delay_(DurationFromImgDelay(img, is_part_of_animation)),
-          framebuffer_(img.columns(), img.rows()) {
-        CopyToFramebuffer(img, &framebuffer_);
-        framebuffer_.AlphaComposeBackground(
-            opt.bgcolor_getter, opt.bg_pattern_color,
-            opt.pattern_size * opt.cell_x_px,
-            opt.pattern_size * opt.cell_y_px / 2);
-    }
-    Duration delay() const { return delay_; }
-    const timg::Framebuffer &framebuffer() const { return framebuffer_; }
-
-private:
-    static Duration DurationFromImgDelay(const Magick::Image &img,
-                                         bool is_part_of_animation) {
-        if (!is_part_of_animation) return Duration::Millis(0);
-        int delay_time = img.animationDelay();  // in 1/100s of a second.
-        if (delay_time < 1) delay_time = 10;
-        return Duration::Millis(delay_time * 10);
-    }
-    const Duration delay_;
-    timg::Framebuffer framebuffer_;
-};
-
-GraphicsMagickSource::~GraphicsMagickSource() {
-    for (PreprocessedFrame *f : frames_) delete f;
+static Duration DurationFromImgDelay(const Magick::Image &img,
+                                     bool is_part_of_animation) {
+    if (!is_part_of_animation) return Duration::Millis(0);
+    int delay_time = img.animationDelay();  // in 1/100s of a second.
+    if (delay_time < 1) delay_time = 10;
+    return Duration::Millis(delay_time * 10);
 }
 
+GraphicsMagickSource::GraphicsMagickSource(const std::string &filename)
+    : ImageSource(filename) {}
+
+GraphicsMagickSource::~GraphicsMagickSource() = default;
+
 const char *GraphicsMagickSource::VersionInfo() {
     return "GraphicsMagick " MagickLibVersionText " (" MagickReleaseDate ")";
 }
 
 std::string GraphicsMagickSource::FormatTitle(
     const std::string &format_string) const {
-    return FormatFromParameters(format_string, filename_, orig_width_,
+    return FormatFromParameters(format_string, display_name(), orig_width_,
                                 orig_height_, "image");
 }
 
@@ -131,9 +127,20 @@ static ExifImageOp GetExifOp(Magick::Image &img) {  // NOLINT
 // An extended version of Magick::readImages that requests a
 // decoding/raster with a transparent background by priming
 // the opacity in the image info.
+// If "max_frames" is positive, decoders that support it stop reading after
+// that many frames. A non-empty "size_hint" lets decoders that support it
+// decode at a reduced resolution, at least that size.
 static void readImagesWithTransparentBackground(
-    std::vector<Magick::Image> *sequence, const std::string &filename) {
+    std::vector<Magick::Image> *sequence, const std::string &filename,
+    int max_frames, const std::string &size_hint) {
     MagickLib::ImageInfo *image_info = MagickLib::CloneImageInfo(nullptr);
+    if (max_frames > 0) {
+        image_info->subimage = 0;
+        image_info->subrange = max_frames;
+    }
+    if (!size_hint.empty()) {
+        MagickLib::CloneString(&image_info->size, size_hint.c_str());
+    }
 
     // ScaleCharToQuantum resolves to ((Quantum)(257U * (value)))
     // but Quantum is undefined...
@@ -152,6 +159,60 @@ static void readImagesWithTransparentBackground(
     Magick::throwException(exception_info);
 }
 
+static bool StartsWithJPEGMarker(const std::string &filename) {
+    FILE *f = fopen(filename.c_str(), "rb");
+    if (!f) return false;
+    uint8_t header[3];
+    const bool is_jpeg =
+        fread(header, 1, sizeof(header), f) == sizeof(header) &&
+        header[0] == 0xff && header[1] == 0xd8 && header[2] == 0xff;
+    fclose(f);
+    return is_jpeg;
+}
+
+// The JPEG decoder can decode at 1/2, 1/4 or 1/8 of the size, which is a lot
+// faster and needs a lot less memory for large images. Ping the image to get
+// its size cheaply and return the size it needs to have at least to be
+// scaled to the display; empty string if it should be decoded at full size.
+// For the size hint, GraphicsMagick picks the smallest reduction that is
+// still at least as large.
+std::string GraphicsMagickSource::JPEGSizeHint(const std::string &filename,
+                                               const DisplayOptions &opts,
+                                               int *orig_width,
+                                               int *orig_height) {
+    // Cropping is in pixels of the original size; auto-crop might leave
+    // a small part that is scaled up again.
+    if (opts.crop_border > 0 || opts.auto_crop) return "";
+    if (!StartsWithJPEGMarker(filename)) return "";
+
+    MagickLib::ImageInfo *image_info = MagickLib::CloneImageInfo(nullptr);
+    filename.copy(image_info->filename, MaxTextExtent - 1);
+    image_info->filename[filename.length()] = 0;
+    MagickLib::ExceptionInfo exception_info;
+    MagickLib::GetExceptionInfo(&exception_info);
+    MagickLib::Image *ping = MagickLib::PingImage(image_info, &exception_info);
+    MagickLib::DestroyImageInfo(image_info);
+    MagickLib::DestroyExceptionInfo(&exception_info);
+    if (!ping) return "";
+    const int width  = ping->columns;
+    const int height = ping->rows;
+    MagickLib::DestroyImageList(ping);
+
+    // We don't know the EXIF rotation yet, so the hint needs to work for both.
+    int w, h, rotated_w, rotated_h;
+    if (!CalcScaleToFitDisplay(width, height, opts, false, &w, &h) ||
+        !CalcScaleToFitDisplay(width, height, opts, true, &rotated_w,
+                               &rotated_h)) {
+        return "";
+    }
+    w = std::max(w, rotated_w);
+    h = std::max(h, rotated_h);
+    if (w * 2 > width || h * 2 > height) return "";  // No reduction possible.
+    *orig_width  = width;
+    *orig_height = height;
+    return std::to_string(w) + "x" + std::to_string(h);
+}
+
 bool GraphicsMagickSource::LoadAndScale(const DisplayOptions &opts,
                                         int frame_offset, int frame_count) {
     options_ = opts;
@@ -162,10 +223,15 @@ bool GraphicsMagickSource::LoadAndScale(const DisplayOptions &opts,
     }
 #endif
 
+    // Coalescing might need images prior to the offset, so read from start.
+    const int max_read = frame_count > 0 ? frame_offset + frame_count : -1;
+    int hinted_width, hinted_height;
+    const std::string size_hint =
+        JPEGSizeHint(filename(), opts, &hinted_width, &hinted_height);
     std::vector<Magick::Image> frames;
     try {
-        readImagesWithTransparentBackground(
-            &frames, filename());  // ideally, we could set max_frames
+        readImagesWithTransparentBackground(&frames, filename(), max_read,
+                                            size_hint);
     }
     catch (Magick::Warning &warning) {
         if (kDebug)
@@ -185,8 +251,9 @@ bool GraphicsMagickSource::LoadAndScale(const DisplayOptions &opts,
         return false;
     }
 
-    orig_width_  = frames.front().columns();
-    orig_height_ = frames.front().rows();
+    // With a size hint, the image might be decoded smaller than it is.
+    orig_width_  = size_hint.empty() ? frames.front().columns() : hinted_width;
+    orig_height_ = size_hint.empty() ? frames.front().rows() : hinted_height;
 
     // We don't really know if something is an animation from the frames we
     // got back (or is there ?), so we use a blacklist approach here: filenames
@@ -209,10 +276,11 @@ bool GraphicsMagickSource::LoadAndScale(const DisplayOptions &opts,
     // disposal modes, but they are handled nicely by coalesceImages()
     if (frames.size() > 1 && could_be_animation) {
         Magick::coalesceImages(&result, frames.begin(), frames.end());
+        frames.clear();  // Don't hold on to two full sets of images.
         is_animation_ = true;
     }
     else {
-        result.insert(result.end(), frames.begin(), frames.end());
+        result.swap(frames);
         is_animation_ = false;
     }
 
@@ -221,62 +289,97 @@ bool GraphicsMagickSource::LoadAndScale(const DisplayOptions &opts,
         result.erase(result.begin(), result.begin() + frame_offset);
     }
 
-    for (Magick::Image &img : result) {
-        ExifImageOp exif_op;
-        if (opts.exif_rotate) exif_op = GetExifOp(img);
-
-        // We do trimming only if this is not an animation, which will likely
-        // not create a pleasent result.
-        if (!is_animation_) {
-            if (opts.crop_border > 0) {
-                const int c = opts.crop_border;
-                const int w = std::max(1, (int)img.columns() - 2 * c);
-                const int h = std::max(1, (int)img.rows() - 2 * c);
-                img.crop(Magick::Geometry(w, h, c, c));
-            }
-            if (opts.auto_crop) {
-                img.trim();
-            }
-        }
-
-        // Figure out scaling for the image.
-        int target_width = 0, target_height = 0;
-        if (CalcScaleToFitDisplay(img.columns(), img.rows(), opts,
-                                  abs(exif_op.angle) == 90, &target_width,
-                                  &target_height)) {
-            try {
-                auto geometry = Magick::Geometry(target_width, target_height);
-                geometry.aspect(true);  // Force to scale to given size.
-                if (opts.antialias)
-                    img.scale(geometry);
-                else
-                    img.sample(geometry);
-            }
-            catch (const std::exception &e) {
-                if (kDebug)
-                    fprintf(stderr, "%s: %s\n", filename().c_str(), e.what());
-                return false;
-            }
-        }
+    // Frames are only prepared shortly before they are needed, so that
+    // long animations can start right away. The first few are done upfront,
+    // also to know if we can deal with it at all.
+    image_count_ = result.size();
+    max_frames_  = (frame_count < 0) ? image_count_
+                                     : std::min(frame_count, image_count_);
+    unprepared_.assign(result.begin(), result.end());
+    result.clear();
+    return GetFrame(0) != nullptr;
+}
 
-        // Now that the image is nice and small, the following ops are cheap
-        if (exif_op.flip) img.flip();
-        img.rotate(exif_op.angle);
+const Framebuffer *GraphicsMagickSource::GetFrame(int index) {
+    // Full-size images are much larger than prepared frames, so they are
+    // prepared a few frames ahead of what is shown and then released.
+    const int prepare_until = std::min(index + kPrepareAhead, max_frames_ - 1);
+    while (frames_.size() <= std::max(index, prepare_until)) {
+        if (!PrepareNextFrame()) break;
+    }
+    return index < frames_.size() ? &frames_.Get(index) : nullptr;
+}
 
-        frames_.push_back(new PreprocessedFrame(img, opts, result.size() > 1));
+bool GraphicsMagickSource::PrepareNextFrame() {
+    const int index = frames_.size();
+    if (unprepared_.empty()) return false;
+
+    // Reference counted; once taken from the queue, it is the only one.
+    Magick::Image img = unprepared_.front();
+    unprepared_.pop_front();
+    const DisplayOptions &opts = options_;
+    ExifImageOp exif_op;
+    if (opts.exif_rotate) exif_op = GetExifOp(img);
+
+    // We do trimming only if this is not an animation, which will likely
+    // not create a pleasent result.
+    if (!is_animation_) {
+        if (opts.crop_border > 0) {
+            const int c = opts.crop_border;
+            const int w = std::max(1, (int)img.columns() - 2 * c);
+            const int h = std::max(1, (int)img.rows() - 2 * c);
+            img.crop(Magick::Geometry(w, h, c, c));
+        }
+        if (opts.auto_crop) {
+            img.trim();
+        }
     }
 
-    max_frames_ = (frame_count < 0)
-                      ? (int)frames_.size()
-                      : std::min(frame_count, (int)frames_.size());
+    // Figure out scaling for the image.
+    int target_width = 0, target_height = 0;
+    if (CalcScaleToFitDisplay(img.columns(), img.rows(), opts,
+                              abs(exif_op.angle) == 90, &target_width,
+                              &target_height)) {
+        try {
+            PipelineStats::Scope timing(Stage::kScale);
+            auto geometry = Magick::Geometry(target_width, target_height);
+            geometry.aspect(true);  // Force to scale to given size.
+            if (opts.antialias)
+                img.scale(geometry);
+            else
+                img.sample(geometry);
+        }
+        catch (const std::exception &e) {
+            if (kDebug)
+                fprintf(stderr, "%s: %s\n", filename().c_str(), e.what());
+            // Can't show this or any following frame.
+            unprepared_.clear();
+            max_frames_ = std::min(max_frames_, index);
+            return false;
+        }
+    }
 
+    // Now that the image is nice and small, the following ops are cheap
+    if (exif_op.flip) img.flip();
+    img.rotate(exif_op.angle);
+
+    // Prepared as the buffer to be sent, so copy to terminal-buffer does
+    // not have to be done online.
+    Framebuffer framebuffer(img.columns(), img.rows());
+    CopyToFramebuffer(img, &framebuffer);
+    framebuffer.AlphaComposeBackground(
+        opts.bgcolor_getter, opts.bg_pattern_color,
+        opts.pattern_size * opts.cell_x_px,
+        opts.pattern_size * opts.cell_y_px / 2);
+    frames_.Append(std::move(framebuffer),
+                   DurationFromImgDelay(img, image_count_ > 1));
     return true;
 }
 
 int GraphicsMagickSource::IndentationIfCentered(
-    const PreprocessedFrame *frame) const {
+    const Framebuffer &frame) const {
     return options_.center_horizontally
-               ? (options_.width - frame->framebuffer().width()) / 2
+               ? (options_.width - frame.width()) / 2
                : 0;
 }
 
@@ -285,13 +388,25 @@ void GraphicsMagickSource::SendFrames(
     const volatile sig_atomic_t &interrupt_received,
     const Renderer::WriteFramebufferFun &sink) {
     if (options_.scroll_animation) {
-        Scroll(duration, loops, interrupt_received, options_.scroll_dx,
-               options_.scroll_dy, options_.scroll_delay, sink);
+        if (image_count_ > 1 && kDebug) {
+            fprintf(stderr,
+                    "This is an %simage format, "
+                    "scrolling on top of that is not supported. "
+                    "Just doing the scrolling of the first frame.\n",
+                    is_animation_ ? "animated " : "multi-");
+            // TODO: do both.
+        }
+        const Framebuffer *frame = GetFrame(0);
+        if (frame) {
+            ScrollImage(*frame, options_, duration, loops, interrupt_received,
+                        sink);
+        }
+        unprepared_.clear();  // Only the first frame is ever shown.
         return;
     }
 
     int last_height = -1;  // First image emit will not have a height.
-    if (frames_.size() == 1 || !is_animation_)
+    if (image_count_ == 1 || !is_animation_)
         loops = 1;  // If there is no animation, nothing to repeat.
 
     // Not initialized or negative value wants us to loop forever.
@@ -304,97 +419,28 @@ void GraphicsMagickSource::SendFrames(
                     time_from_first_frame < duration;
          ++k) {
         for (int f = 0; f < max_frames_ && !interrupt_received; ++f) {
-            const auto &frame = frames_[f];
-            time_from_first_frame.Add(frame->delay());
-            const int dx = IndentationIfCentered(frame);
+            const Framebuffer *frame = GetFrame(f);
+            if (!frame) break;
+            time_from_first_frame.Add(frames_.delay(f));
+            const int dx = IndentationIfCentered(*frame);
             const int dy = is_animation_ && last_height > 0 ? -last_height : 0;
             SeqType seq_type = SeqType::FrameImmediate;
             if (is_animation_) {
                 seq_type = is_first ? SeqType::StartOfAnimation
                                     : SeqType::AnimationFrame;
             }
-            sink(dx, dy, frame->framebuffer(), seq_type,
+            sink(dx, dy, *frame, seq_type,
                  std::min(time_from_first_frame, duration));
-            last_height = frame->framebuffer().height();
+            last_height = frame->height();
             if (time_from_first_frame > duration) break;
             is_first = false;
         }
     }
-}
 
-static int gcd(int a, int b) { return b == 0 ? a : gcd(b, a % b); }
-
-void GraphicsMagickSource::Scroll(
-    const Duration &duration, int loops,
-    const volatile sig_atomic_t &interrupt_received, int dx, int dy,
-    const Duration &scroll_delay,
-    const Renderer::WriteFramebufferFun &write_fb) {
-    if (frames_.size() > 1) {
-        if (kDebug)
-            fprintf(stderr,
-                    "This is an %simage format, "
-                    "scrolling on top of that is not supported. "
-                    "Just doing the scrolling of the first frame.\n",
-                    is_animation_ ? "animated " : "multi-");
-        // TODO: do both.
-    }
-
-    const Framebuffer &img = frames_[0]->framebuffer();
-    const int img_width    = img.width();
-    const int img_height   = img.height();
-
-    const int display_w = std::min(options_.width, img_width);
-    const int display_h = std::min(options_.height, img_height);
-
-    // Since the user can choose the number of cycles we go through it,
-    // we need to calculate what the minimum number of steps is we need
-    // to do the scroll. If this is just in one direction, that is simple: the
-    // number of pixel in that direction. If we go diagonal, then it is
-    // essentially the least common multiple of steps.
-    const int x_steps =
-        (dx == 0)
-            ? 1
-            : ((img_width % abs(dx) == 0) ? img_width / abs(dx) : img_width);
-    const int y_steps =
-        (dy == 0)
-            ? 1
-            : ((img_height % abs(dy) == 0) ? img_height / abs(dy) : img_height);
-    const int64_t cycle_steps = x_steps * y_steps / gcd(x_steps, y_steps);
-
-    // Depending if we go forward or backward, we want to start out aligned
-    // right or left.
-    // For negative direction, guarantee that we never run into negative
-    // numbers.
-    const int64_t x_init =
-        (dx < 0) ? (img_width - display_w - dx * cycle_steps) : 0;
-    const int64_t y_init =
-        (dy < 0) ? (img_height - display_h - dy * cycle_steps) : 0;
-    bool is_first = true;
-
-    timg::Framebuffer display_fb(display_w, display_h);
-    timg::Duration time_from_first_frame;
-    for (int k = 0; (loops < 0 || k < loops) && !interrupt_received &&
-                    time_from_first_frame < duration;
-         ++k) {
-        for (int64_t cycle_pos = 0; cycle_pos <= cycle_steps; ++cycle_pos) {
-            if (interrupt_received || time_from_first_frame > duration) break;
-            const int64_t x_cycle_pos = dx * cycle_pos;
-            const int64_t y_cycle_pos = dy * cycle_pos;
-            for (int y = 0; y < display_h; ++y) {
-                for (int x = 0; x < display_w; ++x) {
-                    const int x_src = (x_init + x_cycle_pos + x) % img_width;
-                    const int y_src = (y_init + y_cycle_pos + y) % img_height;
-                    display_fb.SetPixel(x, y, img.at(x_src, y_src));
-                }
-            }
-            time_from_first_frame.Add(scroll_delay);
-            write_fb(
-                0, is_first ? 0 : -display_fb.height(), display_fb,
-                is_first ? SeqType::StartOfAnimation : SeqType::AnimationFrame,
-                time_from_first_frame);
-            is_first = false;
-        }
-    }
+    // Playback stopped, e.g. cut short by the duration. Images not prepared
+    // by now are not needed anymore.
+    unprepared_.clear();
+    max_frames_ = std::min(max_frames_, frames_.size());
 }
 
 }  // namespace timg
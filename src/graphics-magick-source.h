@@ -17,20 +17,24 @@
 #define GRAPHICS_MAGICK_SOURCE_H_
 
 #include <csignal>
+#include <deque>
 #include <string>
-#include <vector>
 
+#include "compact-frames.h"
 #include "display-options.h"
 #include "image-source.h"
 #include "renderer.h"
 #include "timg-time.h"
 
+namespace Magick {
+class Image;
+}
+
 namespace timg {
 
 class GraphicsMagickSource final : public ImageSource {
 public:
-    explicit GraphicsMagickSource(const std::string &filename)
-        : ImageSource(filename) {}
+    explicit GraphicsMagickSource(const std::string &filename);
     ~GraphicsMagickSource() final;
 
     static const char *VersionInfo();
@@ -62,20 +66,31 @@ public:
         return is_animation_before_frame_limit_;
     }
 
+    int FramesPerLoop() const final { return max_frames_; }
+
 private:
-    class PreprocessedFrame;
+    // Size hint to decode JPEG images at a reduced size that is still large
+    // enough for the display; empty if not possible. If not empty, sets
+    // "orig_width" and "orig_height" to the full image size.
+    static std::string JPEGSizeHint(const std::string &filename,
+                                    const DisplayOptions &opts,
+                                    int *orig_width, int *orig_height);
+
+    // Return frame at "index", preparing it and a few frames after from the
+    // decoded images first if needed. Returns nullptr if it can't be
+    // prepared. Valid until the next call.
+    const Framebuffer *GetFrame(int index);
 
-    // Provide image scrolling in dx/dy direction for up to the given time.
-    void Scroll(const Duration &duration, int loops,
-                const volatile sig_atomic_t &interrupt_received, int dx, int dy,
-                const Duration &scroll_delay,
-                const Renderer::WriteFramebufferFun &write_fb);
+    // Prepare the next decoded image, append it to frames_ and release it.
+    bool PrepareNextFrame();
 
     // Return how much we should indent a frame if centering is requested.
-    int IndentationIfCentered(const PreprocessedFrame *frame) const;
+    int IndentationIfCentered(const Framebuffer &frame) const;
 
     DisplayOptions options_;
-    std::vector<PreprocessedFrame *> frames_;
+    CompactFrames frames_;                  // Frames prepared so far.
+    std::deque<Magick::Image> unprepared_;  // Decoded images to prepare.
+    int image_count_ = 0;                   // Prepared and unprepared.
     int orig_width_, orig_height_;
     int max_frames_;
     bool is_animation_before_frame_limit_ = false;
@@ -21,8 +21,10 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <cerrno>
 #include <cmath>
+#include <cstdlib>
 #include <cstdint>
 #include <cstring>
 #include <memory>
@@ -31,11 +33,13 @@
 #include <utility>
 
 // Various implementations for the factory.
+#include "cached-image-source.h"
 #include "display-options.h"
 #include "graphics-magick-source.h"
 #include "jpeg-source.h"
 #include "openslide-source.h"
 #include "pdf-image-source.h"
+#include "pipeline-stats.h"
 #include "qoi-image-source.h"
 #include "stb-image-source.h"
 #include "svg-image-source.h"
@@ -152,72 +156,324 @@ bool ImageSource::CalcScaleToFitDisplay(int img_width, int img_height,
     return *target_width != img_width || *target_height != img_height;
 }
 
+// The first bytes of a file, read once to determine the file format.
+namespace {
+struct FileHeader {
+    static constexpr size_t kMaxLen = 1024;
+
+    // Read up to kMaxLen bytes, return the number of bytes read.
+    size_t Read(const std::string &filename) {
+        const int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) return 0;
+        const ssize_t r = pread(fd, data, kMaxLen, 0);  // Fails on pipes.
+        close(fd);
+        len = (r < 0) ? 0 : r;
+        return len;
+    }
+
+    bool StartsWith(const char *magic, size_t magic_len, size_t pos = 0) const {
+        return pos + magic_len <= len &&
+               memcmp(data + pos, magic, magic_len) == 0;
+    }
+    template <size_t N>
+    bool StartsWith(const char (&magic)[N], size_t pos = 0) const {
+        return StartsWith(magic, N - 1, pos);  // Without the \0 byte.
+    }
+
+    uint8_t data[kMaxLen];
+    size_t len = 0;
+};
+}  // namespace
+
+// File formats we can recognize by their first bytes. Most of them are
+// routing decisions to a specialized decoder or skipping those that
+// can not deal with the format.
+enum class FileFormat {
+    kUnknown,     // Could be anything; just try all decoders.
+    kJPEG,
+    kQOI,
+    kPNG,
+    kAPNG,        // Animated PNG, which we play with the video decoder.
+    kTIFF,        // Also the container of many OpenSlide formats.
+    kSVG,
+    kPDF,
+    kOtherImage,  // Known image format only handled by generic decoders.
+    kVideo,
+};
+
+static int gcd(int a, int b) { return b == 0 ? a : gcd(b, a % b); }
+
+Rect ImageSource::CropRegion(const Framebuffer &image,
+                             const DisplayOptions &options) {
+    return CropRegion(image.begin(), image.width(), image.height(),
+                      image.stride()[0] / sizeof(rgba_t), options);
+}
+
+Rect ImageSource::CropRegion(const rgba_t *pixels, int width, int height,
+                             int row_pixels, const DisplayOptions &options) {
+    const int border =
+        std::clamp(options.crop_border, 0, std::min(width, height) / 2);
+    const Rect region = {border, border, std::max(1, width - 2 * border),
+                         std::max(1, height - 2 * border)};
+    if (!options.auto_crop) return region;
+    const Rect content =
+        Framebuffer::FindContentBox(pixels, row_pixels, region);
+    return content.width > 0 ? content : region;
+}
+
+void ImageSource::ScrollImage(const Framebuffer &img,
+                              const DisplayOptions &options,
+                              const Duration &duration, int loops,
+                              const volatile sig_atomic_t &interrupt_received,
+                              const Renderer::WriteFramebufferFun &sink) {
+    const int dx         = options.scroll_dx;
+    const int dy         = options.scroll_dy;
+    const int img_width  = img.width();
+    const int img_height = img.height();
+
+    const int display_w = std::min(options.width, img_width);
+    const int display_h = std::min(options.height, img_height);
+
+    // Since the user can choose the number of cycles we go through it,
+    // we need to calculate what the minimum number of steps is we need
+    // to do the scroll. If this is just in one direction, that is simple: the
+    // number of pixel in that direction. If we go diagonal, then it is
+    // essentially the least common multiple of steps.
+    const int x_steps =
+        (dx == 0)
+            ? 1
+            : ((img_width % abs(dx) == 0) ? img_width / abs(dx) : img_width);
+    const int y_steps =
+        (dy == 0)
+            ? 1
+            : ((img_height % abs(dy) == 0) ? img_height / abs(dy) : img_height);
+    const int64_t cycle_steps = x_steps * y_steps / gcd(x_steps, y_steps);
+
+    // Depending if we go forward or backward, we want to start out aligned
+    // right or left.
+    // For negative direction, guarantee that we never run into negative
+    // numbers.
+    const int64_t x_init =
+        (dx < 0) ? (img_width - display_w - dx * cycle_steps) : 0;
+    const int64_t y_init =
+        (dy < 0) ? (img_height - display_h - dy * cycle_steps) : 0;
+    bool is_first = true;
+
+    timg::Framebuffer display_fb(display_w, display_h);
+    timg::Duration time_from_first_frame;
+    for (int k = 0; (loops < 0 || k < loops) && !interrupt_received &&
+                    time_from_first_frame < duration;
+         ++k) {
+        for (int64_t cycle_pos = 0; cycle_pos <= cycle_steps; ++cycle_pos) {
+            if (interrupt_received || time_from_first_frame > duration) break;
+            // Each display row is a window into a source row, starting at
+            // x_start. If that window wraps around the right edge, it is
+            // copied as two spans.
+            const int x_start      = (x_init + dx * cycle_pos) % img_width;
+            const int first_span   = std::min(display_w, img_width - x_start);
+            const int second_span  = display_w - first_span;
+            const int64_t y_offset = y_init + dy * cycle_pos;
+            for (int y = 0; y < display_h; ++y) {
+                const rgba_t *src = img.row((y_offset + y) % img_height);
+                rgba_t *dst       = display_fb.row(y);
+                memcpy(dst, src + x_start, first_span * sizeof(rgba_t));
+                if (second_span) {
+                    memcpy(dst + first_span, src,
+                           second_span * sizeof(rgba_t));
+                }
+            }
+            time_from_first_frame.Add(options.scroll_delay);
+            sink(0, is_first ? 0 : -display_fb.height(), display_fb,
+                 is_first ? SeqType::StartOfAnimation : SeqType::AnimationFrame,
+                 time_from_first_frame);
+            is_first = false;
+        }
+    }
+}
+
+static bool HasPNGEnding(const std::string &filename) {
+    const char *const file = filename.c_str();
+    const size_t len       = filename.length();
+    for (const char *ending : {".png", ".apng"}) {
+        if (len >= strlen(ending) &&
+            strcasecmp(file + len - strlen(ending), ending) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Iterate through the PNG chunks in the header until we find an acTL one.
+static bool HasAPNGHeader(const FileHeader &header) {
+    static constexpr size_t kPngHeaderLen = 8;
+    size_t pos = kPngHeaderLen;
+    while (pos + 8 <= header.len) {
+        if (header.StartsWith("acTL", pos + 4)) return true;
+        uint32_t chunk_len;
+        memcpy(&chunk_len, header.data + pos, sizeof(chunk_len));
+        // Data length; add sizeof() for len, CRC, and ChunkType
+        pos += ntohl(chunk_len) + 12;
+    }
+    return false;
+}
+
+// Brands of the ISO base media file format (mp4, mov, ...) that are still
+// images.
+static bool IsImageBrand(const FileHeader &header) {
+    for (const char *brand : {"heic", "heix", "heim", "heis", "hevc", "hevx",
+                              "mif1", "msf1", "avif", "avis"}) {
+        if (header.StartsWith(brand, 4, 8)) return true;
+    }
+    return false;
+}
+
+static FileFormat SniffFileFormat(const std::string &filename,
+                                  const FileHeader &header) {
+    if (header.StartsWith("\xff\xd8\xff")) return FileFormat::kJPEG;
+    if (header.StartsWith("qoif")) return FileFormat::kQOI;
+    if (header.StartsWith("\x89PNG\r\n\x1a\n")) {
+        return (HasPNGEnding(filename) && HasAPNGHeader(header))
+                   ? FileFormat::kAPNG
+                   : FileFormat::kPNG;
+    }
+    if (header.StartsWith("II*\0") || header.StartsWith("MM\0*") ||
+        header.StartsWith("II+\0") || header.StartsWith("MM\0+")) {
+        return FileFormat::kTIFF;
+    }
+    if (header.StartsWith("%PDF-")) return FileFormat::kPDF;
+    if (header.StartsWith("GIF87a") || header.StartsWith("GIF89a") ||
+        header.StartsWith("BM") ||
+        (header.StartsWith("RIFF") && header.StartsWith("WEBP", 8))) {
+        return FileFormat::kOtherImage;
+    }
+    if (header.StartsWith("ftyp", 4)) {
+        return IsImageBrand(header) ? FileFormat::kOtherImage
+                                    : FileFormat::kVideo;
+    }
+    if (header.StartsWith("\x1a\x45\xdf\xa3") ||  // Matroska, WebM
+        (header.StartsWith("RIFF") && header.StartsWith("AVI ", 8)) ||
+        header.StartsWith("OggS") || header.StartsWith("FLV\x01") ||
+        header.StartsWith("\x30\x26\xb2\x75") ||  // ASF, WMV
+        header.StartsWith("\0\0\x01\xba") ||      // MPEG program stream
+        (header.StartsWith("\x47") && header.StartsWith("\x47", 188))) {
+        return FileFormat::kVideo;  // ^ MPEG transport stream
+    }
+
+    // SVG is text, might start with a BOM, xml declaration, comments...
+    // so just look for the tag.
+    const char *const text = (const char *)header.data;
+    const char *const end  = text + header.len;
+    static constexpr char kSVGTag[] = "<svg";
+    if (std::search(text, end, kSVGTag, kSVGTag + 4) != end) {
+        return FileFormat::kSVG;
+    }
+    return FileFormat::kUnknown;
+}
+
 ImageSource *ImageSource::Create(const std::string &filename,
                                  const DisplayOptions &options,
                                  int frame_offset, int frame_count,
                                  bool attempt_image_loading,
                                  bool attempt_video_loading,
                                  std::string *error) {
+    PipelineStats::Scope timing(Stage::kLoad);
+
+    // Look at the first bytes to go straight to the decoder that can deal
+    // with the file. In doubt, decoders are attempted one after another.
+    FileHeader header;
+    header.Read(filename);
+    const FileFormat format = SniffFileFormat(filename, header);
+
+    // Specialized decoders are only attempted if the format is theirs or
+    // unknown. Generic decoders are always attempted.
+    [[maybe_unused]] auto attempt = [format](FileFormat decoder_format) {
+        return format == decoder_format || format == FileFormat::kUnknown;
+    };
+
     std::unique_ptr<ImageSource> result;
+    auto load = [&](ImageSource *source) {
+        result.reset(source);
+        return result->LoadAndScale(options, frame_offset, frame_count);
+    };
+
+#ifdef WITH_TIMG_VIDEO
+    // Videos don't need to go through all the image decoders first.
+    const bool video_first =
+        (format == FileFormat::kVideo || format == FileFormat::kAPNG);
+    if (video_first && attempt_video_loading &&
+        load(new VideoSource(filename))) {
+        return result.release();
+    }
+    // If the video decoder didn't like it, it is not worth trying again.
+    if (video_first) attempt_video_loading = false;
+#endif
+
     if (attempt_image_loading) {
-#ifdef WITH_TIMG_OPENSLIDE_SUPPORT
-        result.reset(new OpenSlideSource(filename));
-        if (result->LoadAndScale(options, frame_offset, frame_count)) {
+        // Freshly decoded images are remembered for next time while they are
+        // shown, if caching.
+        auto cached = [&](ImageSource *source) {
+            return CachedImageSource::Record(source, options, frame_offset,
+                                             frame_count);
+        };
+
+        if (load(new CachedImageSource(filename))) {
             return result.release();
         }
+
+#ifdef WITH_TIMG_OPENSLIDE_SUPPORT
+        // MIRAX slides come as a jpeg preview next to a directory with data.
+        const bool mirax = format == FileFormat::kJPEG &&
+                           filename.size() > 5 &&
+                           strcasecmp(filename.c_str() + filename.size() - 5,
+                                      ".mrxs") == 0;
+        if ((attempt(FileFormat::kTIFF) || mirax) &&
+            load(new OpenSlideSource(filename))) {
+            return cached(result.release());
+        }
 #endif
 
 #ifdef WITH_TIMG_QOI
-        result.reset(new QOIImageSource(filename));
-        if (result->LoadAndScale(options, frame_offset, frame_count)) {
-            return result.release();
+        if (attempt(FileFormat::kQOI) && load(new QOIImageSource(filename))) {
+            return cached(result.release());
         }
 #endif
 
 #ifdef WITH_TIMG_JPEG
-        result.reset(new JPEGSource(filename));
-        if (result->LoadAndScale(options, frame_offset, frame_count)) {
-            return result.release();
+        if (attempt(FileFormat::kJPEG) && load(new JPEGSource(filename))) {
+            return cached(result.release());
         }
 #endif
 
 #ifdef WITH_TIMG_RSVG
-        result.reset(new SVGImageSource(filename));
-        if (result->LoadAndScale(options, frame_offset, frame_count)) {
-            return result.release();
+        if (attempt(FileFormat::kSVG) && load(new SVGImageSource(filename))) {
+            return cached(result.release());
         }
 #endif
 
 #ifdef WITH_TIMG_POPPLER
-        result.reset(new PDFImageSource(filename));
-        if (result->LoadAndScale(options, frame_offset, frame_count)) {
-            return result.release();
+        if (attempt(FileFormat::kPDF) && load(new PDFImageSource(filename))) {
+            return cached(result.release());
         }
 #endif
 
 #ifdef WITH_TIMG_GRPAPHICSMAGICK
-        result.reset(new GraphicsMagickSource(filename));
-        if (result->LoadAndScale(options, frame_offset, frame_count)) {
-            return result.release();
+        if (load(new GraphicsMagickSource(filename))) {
+            return cached(result.release());
         }
 #endif
 
 #ifdef WITH_TIMG_STB
         // STB image loading always last as last fallback resort.
-        result.reset(new STBImageSource(filename));
-        if (result->LoadAndScale(options, frame_offset, frame_count)) {
-            return result.release();
+        if (load(new STBImageSource(filename))) {
+            return cached(result.release());
         }
 #endif
     }  // end attempt image loading
 
 #ifdef WITH_TIMG_VIDEO
-    if (attempt_video_loading) {
-        result.reset(new VideoSource(filename));
-        if (result->LoadAndScale(options, frame_offset, frame_count)) {
-            return result.release();
-        }
-    }  // end attempt video loading
+    if (attempt_video_loading && load(new VideoSource(filename))) {
+        return result.release();
+    }
 #endif
 
     // Ran into trouble opening. Let's see if this is even an accessible file.
@@ -294,35 +550,11 @@ std::string ImageSource::FormatFromParameters(const std::string &fmt_string,
     return result.str();
 }
 
-static bool HasAPNGHeader(const std::string &filename) {
-    static constexpr size_t kPngHeaderLen = 8;
-
-    // Iterate through headers in the first kibibyte until we find an acTL one.
-    const int fd = open(filename.c_str(), O_RDONLY);
-    if (fd < 0) return false;
-    size_t pos = kPngHeaderLen;
-    uint8_t buf[8];
-    bool found_actl_header = false;
-    while (!found_actl_header && pos < 1024) {
-        const ssize_t len = pread(fd, buf, 8, pos);
-        if (len < 0 || len != 8) break;  // Best effort.
-        found_actl_header = (memcmp(buf + 4, "acTL", 4) == 0);
-        // Header contains data length; add sizeof() for len, CRC, and ChunkType
-        pos += ntohl(*(uint32_t *)buf) + 12;
-    }
-    close(fd);
-    return found_actl_header;
-}
-
 bool ImageSource::LooksLikeAPNG(const std::string &filename) {
-    const char *const file = filename.c_str();
-    for (const char *ending : {".png", ".apng"}) {
-        if (strcasecmp(file + strlen(file) - strlen(ending), ending) == 0 &&
-            HasAPNGHeader(filename)) {
-            return true;
-        }
-    }
-    return false;
+    FileHeader header;
+    return HasPNGEnding(filename) &&
+           header.Read(filename) > 0 &&
+           HasAPNGHeader(header);
 }
 
 }  // namespace timg
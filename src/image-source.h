@@ -18,7 +18,9 @@
 
 #include <signal.h>
 
+#include <memory>
 #include <string>
+#include <utility>
 
 #include "display-options.h"
 #include "renderer.h"
@@ -44,6 +46,9 @@ public:
     // Send preprocessed frames for a maximum of given, max frames and loops,
     // whatever comes first. Stop loop when "interrupt_received" is true.
     // Send all frames to "sink", a callback that accepts Framebuffers.
+    // Sources might still produce later frames in the background after
+    // LoadAndScale() returned (see PublishedFrames); each frame is sent as
+    // soon as it is ready.
     virtual void SendFrames(const Duration &duration, int loops,
                             const volatile sig_atomic_t &interrupt_received,
                             const Renderer::WriteFramebufferFun &sink) = 0;
@@ -54,11 +59,30 @@ public:
     // Return filename, this ImageSource has loaded.
     const std::string &filename() const { return filename_; }
 
+    // Name shown for this source, e.g. in the title. Typically the filename,
+    // unless loaded from a local copy of something else.
+    const std::string &display_name() const {
+        return origin_.empty() ? filename_ : origin_;
+    }
+
+    // This source was loaded from "local_copy" of "origin", e.g. a downloaded
+    // URL. Show "origin" as name and keep the local copy around for as long
+    // as the source might still read from it.
+    void SetOrigin(const std::string &origin,
+                   std::shared_ptr<const void> local_copy) {
+        origin_     = origin;
+        local_copy_ = std::move(local_copy);
+    }
+
     // FYI if this image source is a multi-frame animation, e.g. if it
     // would require to skip up to the beginning, independent if this was
     // limited by frames_count (Context: Issue #86)
     virtual bool IsAnimationBeforeFrameLimit() const { return false; }
 
+    // Number of frames an animation sends per loop in SendFrames(), or -1
+    // if not known. Might only be final once SendFrames() got to the end.
+    virtual int FramesPerLoop() const { return -1; }
+
 protected:
     explicit ImageSource(const std::string &filename) : filename_(filename) {}
 
@@ -86,6 +110,28 @@ protected:
                                       bool fit_in_rotated_frame,
                                       int *target_width, int *target_height);
 
+    // Utility function to determine the region of "image" to show: without
+    // "options.crop_border" pixels on each side and, if "options.auto_crop"
+    // is set, without the uniform border around the content.
+    static Rect CropRegion(const Framebuffer &image,
+                           const DisplayOptions &options);
+
+    // Same, for "width" x "height" pixels with "row_pixels" from one row
+    // to the next, e.g. as they come from a decoder.
+    static Rect CropRegion(const rgba_t *pixels, int width, int height,
+                           int row_pixels, const DisplayOptions &options);
+
+    // Utility function to send a scroll animation of "img" for still images,
+    // moving by "options.scroll_dx" and "options.scroll_dy" pixels every
+    // "options.scroll_delay". The image is treated as a circular buffer that
+    // wraps around at the edges; it needs to be at least as large as the
+    // shown part. Loops and interrupt work like in SendFrames().
+    static void ScrollImage(const Framebuffer &img,
+                            const DisplayOptions &options,
+                            const Duration &duration, int loops,
+                            const volatile sig_atomic_t &interrupt_received,
+                            const Renderer::WriteFramebufferFun &sink);
+
     // Utility function to format
     static std::string FormatFromParameters(const std::string &fmt_string,
                                             const std::string &filename,
@@ -98,6 +144,10 @@ protected:
 
 protected:
     const std::string filename_;
+
+private:
+    std::string origin_;
+    std::shared_ptr<const void> local_copy_;
 };
 }  // namespace timg
 
@@ -17,13 +17,18 @@
 
 #include <cassert>
 #include <cstddef>
+#include <cstdint>
 #include <cstdio>
 #include <cstring>
 #include <functional>
 #include <memory>
+#include <string>
+#include <utility>
 
 #include "buffered-write-sequencer.h"
 #include "display-options.h"
+#include "encoded-frame-cache.h"
+#include "pipeline-stats.h"
 #include "terminal-canvas.h"
 #include "thread-pool.h"
 #include "timg-base64.h"
@@ -47,21 +52,44 @@ void ITerm2GraphicsCanvas::Send(int x, int dy, const Framebuffer &fb_orig,
     MoveCursorDX(x / options_.cell_x_px);
 
     // Create copy to be used in threads.
-    const Framebuffer *const fb = new Framebuffer(fb_orig);
-    char *const buffer          = RequestBuffer(fb->width(), fb->height());
-    char *const offset          = AppendPrefixToBuffer(buffer);
+    const Framebuffer *const fb = new Framebuffer(fb_orig, framebuffer_pool_);
+    OutBuffer *const buffer =
+        new OutBuffer(RequestBuffer(fb->width(), fb->height()));
+    char *const offset = AppendPrefixToBuffer(buffer->data);
 
-    const auto &options                   = options_;
-    std::function<OutBuffer()> encode_fun = [options, fb, buffer, offset]() {
+    DisplayOptions options = options_;
+    if (options.compress_pixel_level == kAdaptiveCompression) {
+        options.compress_pixel_level =
+            write_sequencer_->adaptive_compression_level();
+    }
+    std::shared_ptr<EncodedFrameCache> cache = encoded_cache_;
+    std::function<OutBuffer()> encode_fun = [options, cache, fb, buffer,
+                                             offset]() {
         std::unique_ptr<const Framebuffer> auto_delete(fb);
+        std::unique_ptr<OutBuffer> auto_delete_buffer(buffer);
+        PipelineStats::Scope timing(Stage::kEncode);
+
+        // Frames repeat e.g. when animations loop; no need to encode again.
+        // The adaptive compression level might have changed since.
+        const uint64_t cache_key = EncodedFrameCache::Combine(
+            EncodedFrameCache::HashFramebuffer(*fb),
+            options.compress_pixel_level);
+        if (EncodedFrameCache::Payload payload = cache->Lookup(cache_key)) {
+            memcpy(offset, payload->data(), payload->size());
+            buffer->size = (offset - buffer->data) + payload->size();
+            return std::move(*buffer);
+        }
+
         const size_t png_buf_size = png::UpperBound(fb->width(), fb->height());
         std::unique_ptr<char[]> png_buf(new char[png_buf_size]);
 
-        const int png_size = png::Encode(*fb, options.compress_pixel_level,
-                                         options.local_alpha_handling
-                                             ? png::ColorEncoding::kRGB_24
-                                             : png::ColorEncoding::kRGBA_32,
-                                         png_buf.get(), png_buf_size);
+        // Compressor state is expensive to set up; keep one per thread.
+        static thread_local png::Encoder png_encoder;
+        const int png_size = png_encoder.Encode(
+            *fb, options.compress_pixel_level,
+            options.local_alpha_handling ? png::ColorEncoding::kRGB_24
+                                         : png::ColorEncoding::kRGBA_32,
+            png_buf.get(), png_buf_size);
 
         char *pos = offset;
         pos += sprintf(pos,
@@ -71,13 +99,16 @@ void ITerm2GraphicsCanvas::Send(int x, int dy, const Framebuffer &fb_orig,
 
         *pos++ = '\007';
         *pos++ = '\n';  // Need one final cursor movement.
-        return OutBuffer(buffer, pos - buffer);
+        buffer->size = pos - buffer->data;
+        cache->Insert(cache_key, std::string(offset, pos));
+        return std::move(*buffer);
     };
-    write_sequencer_->WriteBuffer(executor_->ExecAsync(encode_fun), seq_type,
-                                  end_of_frame);
+    write_sequencer_->WriteBuffer(
+        executor_->ExecAsync(encode_fun, ThreadPool::Priority::kHigh),
+        seq_type, end_of_frame);
 }
 
-char *ITerm2GraphicsCanvas::RequestBuffer(int width, int height) {
+OutBuffer ITerm2GraphicsCanvas::RequestBuffer(int width, int height) {
     const size_t png_compressed_size = png::UpperBound(width, height);
     const int encoded_base64_size    = png_compressed_size * 4 / 3;
     const size_t content_size =
@@ -86,7 +117,7 @@ char *ITerm2GraphicsCanvas::RequestBuffer(int width, int height) {
         + strlen("\e\1337;File=width=9999px;height=9999px;inline=1:\007") + 4 +
         1; /* digit space for cursor up/right; \n */
 
-    return new char[content_size];
+    return write_sequencer_->RequestBuffer(content_size);
 }
 
 int ITerm2GraphicsCanvas::cell_height_for_pixels(int pixels) const {
@@ -39,7 +39,7 @@ private:
     const DisplayOptions &options_;
     ThreadPool *const executor_;
 
-    char *RequestBuffer(int width, int height);
+    OutBuffer RequestBuffer(int width, int height);
 };
 }  // namespace timg
 #endif  // ITERM2_CANVAS_H
@@ -15,7 +15,6 @@
 
 #include "jpeg-source.h"
 
-#include <fcntl.h>
 #include <libexif/exif-content.h>
 #include <libexif/exif-data.h>
 #include <libexif/exif-entry.h>
@@ -23,11 +22,9 @@
 #include <libexif/exif-ifd.h>
 #include <libexif/exif-tag.h>
 #include <libexif/exif-utils.h>
-#include <sys/mman.h>
-#include <sys/stat.h>
 #include <turbojpeg.h>
-#include <unistd.h>
 
+#include <algorithm>
 #include <csignal>
 #include <cstdarg>
 #include <cstdint>
@@ -41,7 +38,9 @@
 #include "buffered-write-sequencer.h"
 #include "display-options.h"
 #include "framebuffer.h"
+#include "mapped-file.h"
 #include "renderer.h"
+#include "timg-swscale.h"
 #include "timg-time.h"
 
 extern "C" {  // avutil is missing extern "C"
@@ -89,43 +88,134 @@ static ExifImageOp ReadExifOrientation(const uint8_t *buffer, size_t len) {
     return {};
 }
 
+// Apply the exif operation to the scaled image in a single pass. Mirror and
+// 180 degree rotation are done in place, only 90 degree rotations need
+// a new buffer.
 static timg::Framebuffer *ApplyExifOp(timg::Framebuffer *orig,
                                       const ExifImageOp &op) {
     const int h = orig->height();
     const int w = orig->width();
-    if (op.mirror) {
-        for (int y = 0; y < h; ++y) {
-            Framebuffer::iterator left  = &orig->begin()[y * w];
-            Framebuffer::iterator right = &orig->begin()[(y + 1) * w - 1];
-            while (left < right) {
-                std::swap(*left++, *right--);
-            }
-        }
-    }
-    if (op.angle == 180) {
-        Framebuffer::iterator top_left     = orig->begin();
-        Framebuffer::iterator bottom_right = orig->end() - 1;
-        while (top_left < bottom_right) {
-            std::swap(*top_left++, *bottom_right--);
-        }
-    }
-    else if (op.angle == 90 || op.angle == -90) {
-        // TODO: rotate in place without new alloc.
-        // OTOH, the affected images are small.
+    // Rotation by 180 degrees is mirroring horizontally and vertically.
+    const bool flip_x = op.mirror != (op.angle == 180);
+    const bool flip_y = (op.angle == 180 || op.angle == -90);
+    if (op.angle == 90 || op.angle == -90) {
+        // Flip, then transpose. -90 also flips vertically as that is the
+        // same as rotating clockwise after the transpose.
         std::unique_ptr<timg::Framebuffer> discard(orig);
-        timg::Framebuffer *result = new timg::Framebuffer(h, w);
+        timg::Framebuffer *result = new timg::Framebuffer(
+            h, w,
+            orig->is_packed() ? Framebuffer::Layout::kPacked
+                              : Framebuffer::Layout::kAlignedRows);
         for (int y = 0; y < h; y++) {
+            const int src_y = flip_y ? h - y - 1 : y;
             for (int x = 0; x < w; ++x) {
-                int new_x = (op.angle == -90) ? result->width() - y - 1 : y;
-                result->SetPixel(new_x, x, orig->at(x, y));
+                const int src_x = flip_x ? w - x - 1 : x;
+                result->SetPixel(y, x, orig->at(src_x, src_y));
             }
         }
         return result;
     }
 
+    if (flip_y) {
+        // Swap top and bottom rows, reversing them on the way if needed.
+        for (int y = 0; y < h / 2; ++y) {
+            Framebuffer::iterator top    = orig->row(y);
+            Framebuffer::iterator bottom = orig->row(h - y - 1);
+            if (flip_x) {
+                std::reverse(top, top + w);
+                std::reverse(bottom, bottom + w);
+            }
+            std::swap_ranges(top, top + w, bottom);
+        }
+        if (flip_x && h % 2 == 1) {
+            Framebuffer::iterator middle = orig->row(h / 2);
+            std::reverse(middle, middle + w);
+        }
+    }
+    else if (flip_x) {
+        for (int y = 0; y < h; ++y) {
+            std::reverse(orig->row(y), orig->row(y) + w);
+        }
+    }
     return orig;
 }
 
+// Location of "r" in an image decoded with the scaling factor "f".
+static Rect ScaleRect(const Rect &r, const tjscalingfactor &f) {
+    const int x0 = r.x * f.num / f.denom;
+    const int y0 = r.y * f.num / f.denom;
+    const int x1 = TJSCALED(r.x + r.width, f);
+    const int y1 = TJSCALED(r.y + r.height, f);
+    return {x0, y0, std::max(1, x1 - x0), std::max(1, y1 - y0)};
+}
+
+// The smallest scaling factor that decodes "width" x "height" to at least
+// the target size.
+static tjscalingfactor ChooseScalingFactor(int width, int height,
+                                           int target_width,
+                                           int target_height) {
+    int factors_size;
+    tjscalingfactor *factors = tjGetScalingFactors(&factors_size);
+    // Looking backwards: later scale factors generate smaller images.
+    for (tjscalingfactor *f = factors + factors_size - 1; f > factors; --f) {
+        if (TJSCALED(width, (*f)) >= target_width &&
+            TJSCALED(height, (*f)) >= target_height) {
+            return *f;
+        }
+    }
+    return factors[0];
+}
+
+// Decode the part "region" of the image, scaled by "factor". Returns the
+// image and in "decoded" the location of the region in it. Only decodes
+// the region if libjpeg-turbo supports it (>= 3.0), the whole image
+// otherwise.
+static std::unique_ptr<Framebuffer> DecodeRegion(
+    tjhandle handle, const MappedFile &file, int width, int height,
+    int subsamp, const tjscalingfactor &factor, const Rect &region,
+    Rect *decoded) {
+    const Rect want = ScaleRect(region, factor);
+    std::unique_ptr<Framebuffer> result;
+#ifdef TJ_NUMINIT  // libjpeg-turbo 3 API
+    // Left edge of the cropping region needs to be on a MCU boundary.
+    const int mcu_width =
+        subsamp >= 0 ? TJSCALED(tjMCUWidth[subsamp], factor) : 0;
+    tjregion crop = TJUNCROPPED;
+    if (mcu_width > 0 && (want.width < TJSCALED(width, factor) ||
+                          want.height < TJSCALED(height, factor))) {
+        crop.x = want.x - want.x % mcu_width;
+        crop.y = want.y;
+        crop.w = want.x + want.width - crop.x;
+        crop.h = want.height;
+    }
+    if (tj3SetScalingFactor(handle, factor) != 0 ||
+        tj3SetCroppingRegion(handle, crop) != 0) {
+        return nullptr;
+    }
+    result.reset(new Framebuffer(crop.w ? crop.w : TJSCALED(width, factor),
+                                 crop.h ? crop.h : TJSCALED(height, factor),
+                                 Framebuffer::Layout::kAlignedRows));
+    if (tj3Decompress8(handle, file.data(), file.size(),
+                       (uint8_t *)result->begin(), result->stride()[0],
+                       TJPF_RGBA) != 0) {
+        return nullptr;
+    }
+    *decoded = {want.x - crop.x, want.y - crop.y, want.width, want.height};
+#else
+    const int decode_width  = TJSCALED(width, factor);
+    const int decode_height = TJSCALED(height, factor);
+    result.reset(new Framebuffer(decode_width, decode_height,
+                                 Framebuffer::Layout::kAlignedRows));
+    if (tjDecompress2(handle, file.data(), file.size(),
+                      (uint8_t *)result->begin(), decode_width,
+                      result->stride()[0], decode_height, TJPF_RGBA, 0) != 0) {
+        return nullptr;
+    }
+    *decoded = want;
+#endif
+    return result;
+}
+
 }  // namespace
 
 const char *JPEGSource::VersionInfo() {
@@ -133,32 +223,23 @@ const char *JPEGSource::VersionInfo() {
 }
 
 std::string JPEGSource::FormatTitle(const std::string &format_string) const {
-    return FormatFromParameters(format_string, filename_, orig_width_,
+    return FormatFromParameters(format_string, display_name(), orig_width_,
                                 orig_height_, "jpeg");
 }
 
 bool JPEGSource::LoadAndScale(const DisplayOptions &opts, int, int) {
     options_ = opts;
-    if (opts.scroll_animation || filename() == "/dev/stdin" ||
-        filename() == "-") {
+    if (filename() == "/dev/stdin" || filename() == "-") {
         return false;  // Not dealing with these now.
     }
-    const int fd = open(filename().c_str(), O_RDONLY);
-    if (fd < 0) return false;
-    struct stat statresult;
-    if (fstat(fd, &statresult) < 0) return false;
-    const size_t filesize = statresult.st_size;
-    if (filesize == 0) return false;
-    void *file_buf = mmap(nullptr, filesize, PROT_READ, MAP_PRIVATE, fd, 0);
-    close(fd);
-    if (file_buf == MAP_FAILED) return false;
-    const uint8_t *jpeg_content = (uint8_t *)file_buf;
+    static constexpr char kJPEGMagic[] = {'\xff', '\xd8', '\xff'};
+    const MappedFile file(filename(), kJPEGMagic, sizeof(kJPEGMagic));
+    if (!file.is_valid()) return false;
+    const uint8_t *jpeg_content = file.data();
+    const size_t filesize       = file.size();
 
     tjhandle handle = tjInitDecompress();
-    ScopeGuard s([handle, file_buf, filesize]() {  // cleanup C-objects
-        tjDestroy(handle);
-        munmap(file_buf, filesize);
-    });
+    ScopeGuard s([handle]() { tjDestroy(handle); });  // cleanup C-objects
 
     // Figure out the original size of the image
     int width, height, jpegSubsamp, jpegColorspace;
@@ -174,57 +255,80 @@ bool JPEGSource::LoadAndScale(const DisplayOptions &opts, int, int) {
 
     ExifImageOp exif_op;
     if (opts.exif_rotate) exif_op = ReadExifOrientation(jpeg_content, filesize);
+    const bool rotated = abs(exif_op.angle) == 90;
+
+    // Cropping is done before the exif operation, on the original image.
+    Rect region = {0, 0, width, height};
+    if (opts.crop_border > 0) {
+        const int c = std::min(opts.crop_border, std::min(width, height) / 2);
+        region      = {c, c, std::max(1, width - 2 * c),
+                       std::max(1, height - 2 * c)};
+    }
 
     int target_width;
     int target_height;
-    CalcScaleToFitDisplay(width, height, opts, abs(exif_op.angle) == 90,
+    CalcScaleToFitDisplay(region.width, region.height, opts, rotated,
                           &target_width, &target_height);
 
     // Output is larger and we request integer upscaling. That looks fuzzy
     // with our bilinear upscaling, so bail here and let generic graphicsmagick
     // image loader take care of it: that does crisp integer upscaling.
     if (opts.upscale_integer &&
-        (target_width / width || target_height / height)) {
+        (target_width / region.width || target_height / region.height)) {
         return false;
     }
 
-    // Find the scaling factor that creates the smallest image that is
-    // larger than our target size.
-    int factors_size;
-    tjscalingfactor *factors = tjGetScalingFactors(&factors_size);
-    int decode_width         = width;
-    int decode_height        = height;
-    // Looking backwards: later scale factors generate smaller images.
-    for (tjscalingfactor *f = factors + factors_size; f >= factors; --f) {
-        decode_width  = TJSCALED(width, (*f));
-        decode_height = TJSCALED(height, (*f));
-        if (decode_width >= target_width && decode_height >= target_height)
-            break;
-    }
+    // Decode to the smallest image that is larger than our target size.
+    tjscalingfactor factor = ChooseScalingFactor(region.width, region.height,
+                                                 target_width, target_height);
+    Rect decoded;
+    std::unique_ptr<Framebuffer> decode_image = DecodeRegion(
+        handle, file, width, height, jpegSubsamp, factor, region, &decoded);
+    if (!decode_image) return false;
 
-    // Decode into an RGB buffer
-    const TJPF decode_pixel_format = TJPF_RGBA;
-    const int decode_pixel_width   = tjPixelSize[decode_pixel_format];
-    const int decode_row_bytes     = decode_width * decode_pixel_width;
-    timg::Framebuffer decode_image(decode_width, decode_height);
-    if (tjDecompress2(handle, jpeg_content, filesize,
-                      (uint8_t *)decode_image.begin(), decode_width,
-                      decode_row_bytes, decode_height, decode_pixel_format,
-                      0) != 0) {
-        return false;
+    if (opts.auto_crop) {
+        // Determine the content on the image we have, then map back to
+        // the original image to see what resolution it requires.
+        Rect box = decode_image->FindContentBox(decoded);
+        if (box.width == 0) box = decoded;  // Nothing to trim.
+        const Rect content = {
+            region.x + (box.x - decoded.x) * region.width / decoded.width,
+            region.y + (box.y - decoded.y) * region.height / decoded.height,
+            std::max(1, box.width * region.width / decoded.width),
+            std::max(1, box.height * region.height / decoded.height)};
+        CalcScaleToFitDisplay(content.width, content.height, opts, rotated,
+                              &target_width, &target_height);
+        if (opts.upscale_integer && (target_width / content.width ||
+                                     target_height / content.height)) {
+            return false;
+        }
+        const tjscalingfactor content_factor = ChooseScalingFactor(
+            content.width, content.height, target_width, target_height);
+        if (content_factor.num * factor.denom == factor.num *
+                                                     content_factor.denom) {
+            decoded = box;  // Good enough; no need to decode again.
+        }
+        else {
+            // Need more resolution, decode just the content.
+            decode_image = DecodeRegion(handle, file, width, height,
+                                        jpegSubsamp, content_factor, content,
+                                        &decoded);
+            if (!decode_image) return false;
+        }
     }
 
     // Further scaling to desired target width/height
     av_log_set_callback(dummy_log);
-    SwsContext *swsCtx =
-        sws_getContext(decode_width, decode_height, AV_PIX_FMT_RGBA,
-                       target_width, target_height, AV_PIX_FMT_RGBA,
-                       SWS_BILINEAR, nullptr, nullptr, nullptr);
+    SwsContext *swsCtx = CreateScaleContext(
+        decoded.width, decoded.height, AV_PIX_FMT_RGBA, target_width,
+        target_height, AV_PIX_FMT_RGBA, SWS_BILINEAR, 1);
     if (!swsCtx) return false;
-    image_.reset(new timg::Framebuffer(target_width, target_height));
+    image_.reset(new timg::Framebuffer(target_width, target_height,
+                                       Framebuffer::Layout::kAlignedRows));
 
-    sws_scale(swsCtx, decode_image.row_data(), decode_image.stride(), 0,
-              decode_height, image_->row_data(), image_->stride());
+    ScaleFramebufferRect(swsCtx, *decode_image, AV_PIX_FMT_RGBA, decoded.x,
+                         decoded.y, decoded.width, decoded.height,
+                         image_.get());
     sws_freeContext(swsCtx);
 
     image_.reset(ApplyExifOp(image_.release(), exif_op));
@@ -239,6 +343,11 @@ int JPEGSource::IndentationIfCentered(const timg::Framebuffer &image) const {
 void JPEGSource::SendFrames(const Duration &duration, int loops,
                             const volatile sig_atomic_t &interrupt_received,
                             const Renderer::WriteFramebufferFun &sink) {
+    if (options_.scroll_animation) {
+        ScrollImage(*image_, options_, duration, loops, interrupt_received,
+                    sink);
+        return;
+    }
     sink(IndentationIfCentered(*image_), 0, *image_, SeqType::FrameImmediate,
          {});
 }
@@ -15,6 +15,10 @@
 
 #include "kitty-canvas.h"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
 #include <algorithm>
 #include <cassert>
 #include <cstddef>
@@ -25,9 +29,13 @@
 #include <ctime>
 #include <functional>
 #include <memory>
+#include <string>
+#include <utility>
 
 #include "buffered-write-sequencer.h"
 #include "display-options.h"
+#include "encoded-frame-cache.h"
+#include "pipeline-stats.h"
 #include "terminal-canvas.h"
 #include "thread-pool.h"
 #include "timg-base64.h"
@@ -36,6 +44,7 @@
 
 #define SCREEN_CURSOR_UP_FORMAT    "\033[%dA"  // Move cursor up given lines.
 #define SCREEN_CURSOR_RIGHT_FORMAT "\033[%dC"  // Move cursor right given cols
+#define SCREEN_CURSOR_DOWN_FORMAT  "\033[%dB"  // Move cursor down given lines.
 
 #define TMUX_START_PASSTHROUGH "\ePtmux;"
 #define TMUX_END_PASSTHROUGH   "\e\\"
@@ -43,6 +52,11 @@
 static constexpr int kBase64EncodedChunkSize = 4096;  // Max allowed: 4096.
 static constexpr int kByteChunk              = kBase64EncodedChunkSize / 4 * 3;
 
+// Pixel bytes of transmitted images we expect the terminal to still hold to
+// be placed again. Kitty keeps up to 320MiB by default, but other programs
+// use that storage as well.
+static constexpr size_t kTransmittedImageBudget = 128 << 20;
+
 namespace timg {
 // Create ID unique enough for our purposes.
 static uint32_t CreateId() {
@@ -110,19 +124,194 @@ static void EnableTmuxPassthrough() {
     }
 }
 
+// Region of a frame that changed compared to the previous one.
+struct DirtyRect {
+    int x, y, width, height;
+};
+
+// Number of unchanged rows we tolerate within one rectangle before starting a
+// new one; each rectangle has some fixed overhead.
+static constexpr int kMergeRowGap   = 8;
+static constexpr int kMaxDirtyRects = 8;
+
+// Compare "prev" and "current" frame (same size) and fill the "rects" array
+// with up to kMaxDirtyRects regions that cover all changes. Returns the
+// number of rectangles found; zero if both frames are the same.
+static int FindDirtyRects(const Framebuffer &prev, const Framebuffer &current,
+                          DirtyRect *rects) {
+    const int width  = current.width();
+    const int height = current.height();
+    int count        = 0;
+    int last_dirty_y = -1;
+    int x_begin = 0, x_end = 0;  // Horizontal span of current rectangle.
+    for (int y = 0; y < height; ++y) {
+        const rgba_t *const prev_row = prev.row(y);
+        const rgba_t *const cur_row  = current.row(y);
+        if (memcmp(prev_row, cur_row, width * sizeof(rgba_t)) == 0) continue;
+        int first = 0;
+        while (prev_row[first] == cur_row[first]) ++first;
+        int last = width - 1;
+        while (prev_row[last] == cur_row[last]) --last;
+
+        const bool extend_current =
+            count > 0 &&
+            (y - last_dirty_y <= kMergeRowGap || count == kMaxDirtyRects);
+        if (extend_current) {
+            x_begin = std::min(x_begin, first);
+            x_end   = std::max(x_end, last + 1);
+        }
+        else {
+            ++count;
+            rects[count - 1].y = y;
+            x_begin            = first;
+            x_end              = last + 1;
+        }
+        DirtyRect *const r = &rects[count - 1];
+        r->x               = x_begin;
+        r->width           = x_end - x_begin;
+        r->height          = y - r->y + 1;
+        last_dirty_y       = y;
+    }
+    return count;
+}
+
+// Write out binary data base64-encoded in chunks of limited size. The
+// first chunk is appended to an already started kitty command; if there is
+// more data, continuation chunks are started. Finishes the last command.
+static char *AppendBase64Chunks(char *pos, const char *data, int size,
+                                bool wrap_tmux) {
+    pos = timg::EncodeBase64Chunks(
+        data, size, kByteChunk, pos, [wrap_tmux](char *out, int remaining) {
+            out = AppendEscaped(out, '\\', wrap_tmux);  // finish
+            if (wrap_tmux) {
+                out +=
+                    sprintf(out, TMUX_END_PASSTHROUGH TMUX_START_PASSTHROUGH);
+            }
+            out = AppendEscaped(out, '_', wrap_tmux);
+            return out + sprintf(out, "Gq=2,m=%d;", remaining > kByteChunk);
+        });
+    return AppendEscaped(pos, '\\', wrap_tmux);
+}
+
+// Name of the shared memory object or temporary file that transmits "part"
+// of "frame". Deterministic, so that we can clean up leftovers.
+static void MediumName(KittyMedium medium, uint32_t frame, int part,
+                       char *name, size_t len) {
+    if (medium == KittyMedium::kSharedMemory) {
+        // Short: some systems only allow 31 characters.
+        snprintf(name, len, "/timg-%d-%u-%d", getpid(), frame, part);
+    }
+    else {
+        // Kitty only reads (and deletes) files with that name in a temp dir.
+        snprintf(name, len, "/tmp/tty-graphics-protocol-timg-%d-%u-%d",
+                 getpid(), frame, part);
+    }
+}
+
+// Remove the shared memory objects or temporary files of the first "parts"
+// parts of "frame", if still there.
+static void RemoveMedium(KittyMedium medium, uint32_t frame, int parts) {
+    char name[64];
+    for (int part = 0; part < parts; ++part) {
+        MediumName(medium, frame, part, name, sizeof(name));
+        (medium == KittyMedium::kSharedMemory) ? shm_unlink(name)
+                                               : unlink(name);
+    }
+}
+
+// Write raw RGBA pixels of "fb" into a new shared memory object or temporary
+// file with the given name. The terminal will delete it once read.
+static bool WritePixelsToMedium(KittyMedium medium, const char *name,
+                                const Framebuffer &fb) {
+    const size_t size = fb.width() * fb.height() * sizeof(rgba_t);
+    const int fd      = (medium == KittyMedium::kSharedMemory)
+                            ? shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600)
+                            : open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) return false;
+    bool success = (ftruncate(fd, size) == 0);
+    if (success) {
+        void *mem = mmap(nullptr, size, PROT_WRITE, MAP_SHARED, fd, 0);
+        success   = (mem != MAP_FAILED);
+        if (success) {
+            const size_t row_bytes = fb.width() * sizeof(rgba_t);
+            for (int y = 0; y < fb.height(); ++y) {
+                memcpy((char *)mem + y * row_bytes, fb.row(y), row_bytes);
+            }
+            munmap(mem, size);
+        }
+    }
+    close(fd);
+    if (!success) {
+        (medium == KittyMedium::kSharedMemory) ? shm_unlink(name)
+                                               : unlink(name);
+    }
+    return success;
+}
+
+// Append the format, transmission medium and image data of "fb" to an already
+// started kitty command and finish it. If the image can't be placed into
+// the requested medium, it is sent directly as PNG.
+static char *AppendImageData(char *pos, const Framebuffer &fb,
+                             KittyMedium medium, uint32_t frame, int part,
+                             const DisplayOptions &opts, bool wrap_tmux) {
+    if (medium != KittyMedium::kDirect) {
+        char name[64];
+        MediumName(medium, frame, part, name, sizeof(name));
+        if (WritePixelsToMedium(medium, name, fb)) {
+            pos += sprintf(pos, ",f=32,s=%d,v=%d,t=%c;", fb.width(),
+                           fb.height(),
+                           medium == KittyMedium::kSharedMemory ? 's' : 't');
+            pos = timg::EncodeBase64(name, strlen(name), pos);
+            return AppendEscaped(pos, '\\', wrap_tmux);
+        }
+    }
+
+    const size_t png_buf_size = png::UpperBound(fb.width(), fb.height());
+    std::unique_ptr<char[]> png_buf(new char[png_buf_size]);
+
+    // Compressor state is expensive to set up; keep one per thread.
+    static thread_local png::Encoder png_encoder;
+    const int png_size = png_encoder.Encode(
+        fb, opts.compress_pixel_level,
+        opts.local_alpha_handling ? png::ColorEncoding::kRGB_24
+                                  : png::ColorEncoding::kRGBA_32,
+        png_buf.get(), png_buf_size);
+    pos += sprintf(pos, ",f=100,m=%d;", png_size > kByteChunk);
+    return AppendBase64Chunks(pos, png_buf.get(), png_size, wrap_tmux);
+}
+
 KittyGraphicsCanvas::KittyGraphicsCanvas(BufferedWriteSequencer *ws,
                                          ThreadPool *thread_pool,
                                          bool tmux_passthrough_needed,
+                                         bool use_animation_frames,
+                                         bool use_placements,
+                                         KittyMedium medium,
                                          const DisplayOptions &opts)
     : TerminalCanvas(ws),
       options_(opts),
       tmux_passthrough_needed_(tmux_passthrough_needed),
-      executor_(thread_pool) {
+      executor_(thread_pool),
+      use_animation_frames_(use_animation_frames),
+      use_placements_(use_placements),
+      medium_(medium) {
     if (tmux_passthrough_needed) {
         EnableTmuxPassthrough();
     }
 }
 
+KittyGraphicsCanvas::~KittyGraphicsCanvas() {
+    if (medium_ == KittyMedium::kDirect) return;
+    // The terminal deletes the transmitted shared memory objects or files
+    // once it read them. However, if we were interrupted, the sequencer
+    // discarded the last frames, so nobody will. Clean up these.
+    write_sequencer_->Flush();
+    if (!write_sequencer_->interrupted()) return;
+    const uint32_t max_in_flight = write_sequencer_->max_queue_len() + 2;
+    for (uint32_t f = 0; f < max_in_flight && f < frame_counter_; ++f) {
+        RemoveMedium(medium_, frame_counter_ - f, kMaxDirtyRects);
+    }
+}
+
 void KittyGraphicsCanvas::Send(int x, int dy, const Framebuffer &fb_orig,
                                SeqType seq_type, Duration end_of_frame) {
     if (dy < 0) {
@@ -130,12 +319,38 @@ void KittyGraphicsCanvas::Send(int x, int dy, const Framebuffer &fb_orig,
     }
     MoveCursorDX(x / options_.cell_x_px);
 
+    // Same image shown before: no need to transmit it again.
+    uint64_t image_hash = 0;
+    if (use_placements_ && seq_type == SeqType::FrameImmediate) {
+        image_hash = EncodedFrameCache::HashFramebuffer(fb_orig);
+        auto found = transmitted_.find(image_hash);
+        if (found != transmitted_.end()) {
+            PlaceTransmitted(found->second.id, x / options_.cell_x_px,
+                             fb_orig.width() / options_.cell_x_px,
+                             -cell_height_for_pixels(-fb_orig.height()),
+                             end_of_frame);
+            return;
+        }
+    }
+
     // Create independent copy of frame buffer for use in thread.
-    Framebuffer *const fb = new Framebuffer(fb_orig);
-    char *const buffer    = RequestBuffer(fb->width(), fb->height());
-    char *const offset    = AppendPrefixToBuffer(buffer);
+    std::shared_ptr<const Framebuffer> fb(
+        new Framebuffer(fb_orig, framebuffer_pool_));
 
-    const auto &opts = options_;
+    // With animation frames, we edit the image shown in the previous frame
+    // in-place and only need to transmit what changed.
+    std::shared_ptr<const Framebuffer> prev_frame;
+    if (use_animation_frames_ && seq_type == SeqType::AnimationFrame &&
+        last_frame_ && last_frame_->width() == fb->width() &&
+        last_frame_->height() == fb->height()) {
+        prev_frame = last_frame_;
+    }
+
+    DisplayOptions opts = options_;
+    if (opts.compress_pixel_level == kAdaptiveCompression) {
+        opts.compress_pixel_level =
+            write_sequencer_->adaptive_compression_level();
+    }
 
     // Creating a new ID. Some terminals store the images in a GPU texture
     // buffer (looking at you, wezterm) and index by the ID, so we need to be
@@ -143,83 +358,144 @@ void KittyGraphicsCanvas::Send(int x, int dy, const Framebuffer &fb_orig,
     uint32_t id                  = 0;
     static uint32_t animation_id = 0;
     static uint8_t flip_buffer   = 0;
-    switch (seq_type) {
-    case SeqType::FrameImmediate:
-        // Ideally we use the content hash here. However, that means that
-        // if we have the same image in the same timg session, this would
-        // replace images. This could be addressed by remembering the ID
-        // and do a placement with the ID, however this is only really
-        // supported by Kitty directly while other compatible terminals can't
-        // deal with it yet reliably.
-        // So compromise: create unique ID for regular images.
-        id = CreateId();
-        break;
-    case SeqType::StartOfAnimation:
-        // Sending a bunch of images with different IDs overwhelms some
-        // terminals. So, for animations, just use two IDs back/forth.
-        id = CreateId();
-        CreateId();  // Also, reserve the next ID that we use in the flip-buffer
-        animation_id = id;
-        flip_buffer  = 0;
-        break;
-    case SeqType::AnimationFrame:
-        ++flip_buffer;
-        id = animation_id + (flip_buffer % 2);
-        break;
-    case SeqType::ControlWrite: {
-        // should not happen.
+    if (prev_frame) {
+        id = last_frame_id_;  // Image we're modifying.
     }
+    else {
+        switch (seq_type) {
+        case SeqType::FrameImmediate:
+            // Using the content hash as ID would replace an earlier image
+            // with the same content. Instead, each image gets a unique ID;
+            // if the terminal supports it, the same content is placed again
+            // by that ID (see above). Other compatible terminals can't deal
+            // with placements reliably yet.
+            id = CreateId();
+            if (use_placements_) RememberTransmitted(image_hash, id, *fb);
+            break;
+        case SeqType::StartOfAnimation:
+            // Sending a bunch of images with different IDs overwhelms some
+            // terminals. So, for animations, just use two IDs back/forth.
+            id = CreateId();
+            CreateId();  // Also, reserve the next ID used in the flip-buffer
+            animation_id = id;
+            flip_buffer  = 0;
+            break;
+        case SeqType::AnimationFrame:
+            ++flip_buffer;
+            id = animation_id + (flip_buffer % 2);
+            break;
+        case SeqType::ControlWrite: {
+            // should not happen.
+        }
+        }
+    }
+    // Looping animations send the same frames again. With the image data
+    // in the escape sequence, the encoding depends on the content, the ID,
+    // the indentation, the compression level and, if we only send the
+    // changes, the previous frame.
+    const int indent   = x / opts.cell_x_px;
+    uint64_t cache_key = 0;
+    uint64_t fb_hash   = 0;
+    if (seq_type == SeqType::StartOfAnimation ||
+        seq_type == SeqType::AnimationFrame) {
+        if (seq_type == SeqType::StartOfAnimation) encoded_cache_->Clear();
+        if (medium_ == KittyMedium::kDirect) {
+            fb_hash   = EncodedFrameCache::HashFramebuffer(*fb);
+            cache_key = EncodedFrameCache::Combine(
+                fb_hash, prev_frame ? last_frame_hash_ : 0);
+            cache_key = EncodedFrameCache::Combine(cache_key, id);
+            cache_key = EncodedFrameCache::Combine(cache_key, indent);
+            cache_key = EncodedFrameCache::Combine(cache_key,
+                                                   opts.compress_pixel_level);
+        }
     }
 
-    const int cols       = fb->width() / opts.cell_x_px;
-    const int rows       = -cell_height_for_pixels(-fb->height());
-    const int indent     = x / opts.cell_x_px;
-    const bool wrap_tmux = tmux_passthrough_needed_;
-    std::function<OutBuffer()> encode_fun = [opts, fb, id, buffer, offset, rows,
-                                             cols, indent, wrap_tmux]() {
-        std::unique_ptr<const Framebuffer> auto_delete(fb);
-        const size_t png_buf_size = png::UpperBound(fb->width(), fb->height());
-        std::unique_ptr<char[]> png_buf(new char[png_buf_size]);
-
-        int png_size = png::Encode(*fb, opts.compress_pixel_level,
-                                   opts.local_alpha_handling
-                                       ? png::ColorEncoding::kRGB_24
-                                       : png::ColorEncoding::kRGBA_32,
-                                   png_buf.get(), png_buf_size);
+    if (use_animation_frames_ && seq_type != SeqType::FrameImmediate) {
+        last_frame_      = fb;
+        last_frame_id_   = id;
+        last_frame_hash_ = fb_hash;
+    }
+    else {
+        last_frame_.reset();
+    }
 
+    if (cache_key) {
+        if (EncodedFrameCache::Payload payload =
+                encoded_cache_->Lookup(cache_key)) {
+            write_sequencer_->WriteBuffer(PrefixedBuffer(*payload), seq_type,
+                                          end_of_frame);
+            return;
+        }
+    }
+
+    OutBuffer *const buffer = new OutBuffer(
+        RequestBuffer(fb->width(), fb->height(), prev_frame != nullptr));
+    char *const offset = AppendPrefixToBuffer(buffer->data);
+
+    const int cols           = fb->width() / opts.cell_x_px;
+    const int rows           = -cell_height_for_pixels(-fb->height());
+    const bool wrap_tmux     = tmux_passthrough_needed_;
+    const uint32_t frame     = ++frame_counter_;
+    const KittyMedium medium = medium_;
+    std::shared_ptr<EncodedFrameCache> cache = encoded_cache_;
+    std::function<OutBuffer()> encode_fun = [opts, fb, prev_frame, id, buffer,
+                                             offset, rows, cols, indent,
+                                             wrap_tmux, frame, medium, cache,
+                                             cache_key]() {
+        std::unique_ptr<OutBuffer> auto_delete_buffer(buffer);
+        PipelineStats::Scope timing(Stage::kEncode);
         char *pos = offset;  // Appending to the partially populated buffer.
 
+        // The terminal removes what it read; if this frame is skipped
+        // instead, nobody would.
+        if (medium != KittyMedium::kDirect) {
+            buffer->on_skip = [medium, frame]() {
+                RemoveMedium(medium, frame, kMaxDirtyRects);
+            };
+        }
+
+        if (prev_frame) {
+            // Animation frame: edit the changed regions of the root frame of
+            // the already placed image (r=1), replacing pixels (X=1).
+            DirtyRect rects[kMaxDirtyRects];
+            const int rect_count = FindDirtyRects(*prev_frame, *fb, rects);
+            for (int i = 0; i < rect_count; ++i) {
+                const DirtyRect &r = rects[i];
+                Framebuffer region(r.width, r.height);
+                for (int y = 0; y < r.height; ++y) {
+                    memcpy(region.row(y), fb->row(r.y + y) + r.x,
+                           r.width * sizeof(rgba_t));
+                }
+                if (wrap_tmux) pos += sprintf(pos, TMUX_START_PASSTHROUGH);
+                pos = AppendEscaped(pos, '_', wrap_tmux);
+                pos += sprintf(pos, "Ga=f,i=%u,r=1,x=%d,y=%d,X=1,q=2", id,
+                               r.x, r.y);
+                pos = AppendImageData(pos, region, medium, frame, i, opts,
+                                      wrap_tmux);
+                if (wrap_tmux) pos += sprintf(pos, TMUX_END_PASSTHROUGH);
+            }
+            // Nothing is placed, so cursor does not move. Do the movement a
+            // full image would have done: to the beginning of the next line.
+            pos += sprintf(pos, SCREEN_CURSOR_DOWN_FORMAT "\r", rows);
+            buffer->size = pos - buffer->data;
+            if (cache_key) {
+                cache->Insert(cache_key, std::string(offset, pos - offset),
+                              false);
+            }
+            return std::move(*buffer);
+        }
+
         // Need to send an image with an id (i=...) as some terminals interpet
         // no id with id=0 and just keep replacing one picture.
         // Also need q=2 to prevent getting terminal feedback back we don't
         // read.
         if (wrap_tmux) pos += sprintf(pos, TMUX_START_PASSTHROUGH);
         pos = AppendEscaped(pos, '_', wrap_tmux);
-        pos +=
-            sprintf(pos, "Ga=T,i=%u,q=2,f=100,m=%d", id, png_size > kByteChunk);
+        pos += sprintf(pos, "Ga=T,i=%u,q=2", id);
         if (wrap_tmux) {
             pos += sprintf(pos, ",U=1,c=%d,r=%d", cols, rows);
         }
-        *pos++ = ';';  // End of Kitty command
-
-        // Write out binary data base64-encoded in chunks of limited size.
-        const char *png_data = png_buf.get();
-        while (png_size) {
-            const int chunk_bytes = std::min(png_size, kByteChunk);
-            pos = timg::EncodeBase64(png_data, chunk_bytes, pos);
-            png_data += chunk_bytes;
-            png_size -= chunk_bytes;
-            if (png_size) {  // More to come. Finish chunk and start next.
-                pos = AppendEscaped(pos, '\\', wrap_tmux);  // finish
-                if (wrap_tmux) {
-                    pos += sprintf(pos,
-                                   TMUX_END_PASSTHROUGH TMUX_START_PASSTHROUGH);
-                }
-                pos = AppendEscaped(pos, '_', wrap_tmux);
-                pos += sprintf(pos, "Gq=2,m=%d;", png_size > kByteChunk);
-            }
-        }
-        pos = AppendEscaped(pos, '\\', wrap_tmux);
+        pos = AppendImageData(pos, *fb, medium, frame, 0, opts, wrap_tmux);
 
         if (wrap_tmux) {
             pos += sprintf(pos, TMUX_END_PASSTHROUGH);
@@ -228,14 +504,51 @@ void KittyGraphicsCanvas::Send(int x, int dy, const Framebuffer &fb_orig,
         else {
             *pos++ = '\n';  // Need one final cursor movement.
         }
-        return OutBuffer(buffer, pos - buffer);
+        buffer->size = pos - buffer->data;
+        if (cache_key) {
+            cache->Insert(cache_key, std::string(offset, pos - offset), false);
+        }
+        return std::move(*buffer);
     };
 
-    write_sequencer_->WriteBuffer(executor_->ExecAsync(encode_fun), seq_type,
-                                  end_of_frame);
+    // This is the next frame to be shown: encode before any background work.
+    write_sequencer_->WriteBuffer(
+        executor_->ExecAsync(encode_fun, ThreadPool::Priority::kHigh),
+        seq_type, end_of_frame);
+}
+
+void KittyGraphicsCanvas::RememberTransmitted(uint64_t hash, uint32_t id,
+                                              const Framebuffer &fb) {
+    const size_t bytes = (size_t)fb.width() * fb.height() * sizeof(rgba_t);
+    transmitted_[hash] = {id, bytes};
+    transmitted_order_.push_back(hash);
+    transmitted_bytes_ += bytes;
+    while (transmitted_bytes_ > kTransmittedImageBudget) {
+        auto oldest = transmitted_.find(transmitted_order_.front());
+        transmitted_bytes_ -= oldest->second.bytes;
+        transmitted_.erase(oldest);
+        transmitted_order_.pop_front();
+    }
+}
+
+void KittyGraphicsCanvas::PlaceTransmitted(uint32_t id, int indent, int cols,
+                                           int rows, Duration end_of_frame) {
+    std::unique_ptr<char[]> buffer(new char[rows * (cols * 16 + 64) + 64]);
+    char *pos = buffer.get();
+    if (tmux_passthrough_needed_) {
+        // The virtual placement is still there, just emit its tiles.
+        pos = AppendUnicodePicureTiles(pos, id, indent, rows, cols);
+    }
+    else {
+        pos += sprintf(pos, "\e_Ga=p,i=%u,q=2\e\\\n", id);
+    }
+    write_sequencer_->WriteBuffer(
+        PrefixedBuffer(std::string(buffer.get(), pos - buffer.get())),
+        SeqType::FrameImmediate, end_of_frame);
 }
 
-char *KittyGraphicsCanvas::RequestBuffer(int width, int height) {
+OutBuffer KittyGraphicsCanvas::RequestBuffer(int width, int height,
+                                             bool with_dirty_rects) {
     const size_t png_compressed_size = png::UpperBound(width, height);
     const int encoded_base64_size    = png_compressed_size * 4 / 3;
     const int cols                   = width / options_.cell_x_px;
@@ -247,9 +560,10 @@ char *KittyGraphicsCanvas::RequestBuffer(int width, int height) {
         + strlen("\e_Ga=T,f=XX,s=9999,v=9999,m=1;\e\\") +
         (encoded_base64_size / kBase64EncodedChunkSize) *
             strlen("\e_Gm=0;\e\\") +
-        4 + 1 +            // digit space for cursor up/right; \n
-        rows * cols * 16;  // Some space for unicode tiles with diacritics.
-    return new char[content_size];
+        4 + 1 +             // digit space for cursor up/right; \n
+        rows * cols * 16 +  // Some space for unicode tiles with diacritics.
+        (with_dirty_rects ? kMaxDirtyRects * 512 : 0);  // per-rect overhead
+    return write_sequencer_->RequestBuffer(content_size);
 }
 
 int KittyGraphicsCanvas::cell_height_for_pixels(int pixels) const {
@@ -16,6 +16,12 @@
 #ifndef KITTY_CANVAS_H
 #define KITTY_CANVAS_H
 
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <unordered_map>
+
 #include "buffered-write-sequencer.h"
 #include "display-options.h"
 #include "framebuffer.h"
@@ -24,12 +30,21 @@
 #include "timg-time.h"
 
 namespace timg {
+// How image data is transmitted to the terminal.
+enum class KittyMedium {
+    kDirect,        // Base64 encoded PNG in the escape sequence.
+    kSharedMemory,  // Raw pixels in a POSIX shared memory object (t=s)
+    kTempFile,      // Raw pixels in a temporary file (t=t)
+};
+
 // Implements https://sw.kovidgoyal.net/kitty/graphics-protocol.html
 class KittyGraphicsCanvas final : public TerminalCanvas {
 public:
     KittyGraphicsCanvas(BufferedWriteSequencer *ws, ThreadPool *thread_pool,
                         bool tmux_passthrough_needed,
-                        const DisplayOptions &opts);
+                        bool use_animation_frames, bool use_placements,
+                        KittyMedium medium, const DisplayOptions &opts);
+    ~KittyGraphicsCanvas() override;
 
     int cell_height_for_pixels(int pixels) const final;
 
@@ -41,7 +56,39 @@ private:
     const bool tmux_passthrough_needed_;
     ThreadPool *const executor_;
 
-    char *RequestBuffer(int width, int height);
+    // If the terminal supports editing image data with the animation frame
+    // command (a=f), animations only send the regions changed since the
+    // previous frame, which we keep here.
+    const bool use_animation_frames_;
+    std::shared_ptr<const Framebuffer> last_frame_;
+    uint32_t last_frame_id_   = 0;
+    uint64_t last_frame_hash_ = 0;
+
+    // If the terminal can place an already transmitted image again (a=p),
+    // images shown more than once in a session are only transmitted once.
+    // They are found by content hash. We only remember as many as the
+    // terminal likely still keeps in its image storage.
+    struct TransmittedImage {
+        uint32_t id;
+        size_t bytes;
+    };
+    const bool use_placements_;
+    std::unordered_map<uint64_t, TransmittedImage> transmitted_;
+    std::deque<uint64_t> transmitted_order_;  // Oldest first.
+    size_t transmitted_bytes_ = 0;
+
+    // Shared memory or temp files only work if the terminal runs locally.
+    const KittyMedium medium_;
+    uint32_t frame_counter_ = 0;
+
+    OutBuffer RequestBuffer(int width, int height, bool with_dirty_rects);
+
+    // Remember that image with content "hash" was transmitted with "id".
+    void RememberTransmitted(uint64_t hash, uint32_t id, const Framebuffer &fb);
+
+    // Show the already transmitted image "id" again at the cursor position.
+    void PlaceTransmitted(uint32_t id, int indent, int cols, int rows,
+                          Duration end_of_frame);
 };
 }  // namespace timg
 #endif  // KITTY_CANVAS_H
@@ -0,0 +1,85 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// (c) 2024 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+namespace timg {
+// Read-only memory mapping of a file for decoders that work on a memory
+// buffer, so that they don't have to read a full copy onto the heap first.
+//
+// If a "magic" header is given, only that many bytes are read first and the
+// file is not mapped if they don't match; that way, a decoder can bail
+// quickly on files that are not in its format.
+class MappedFile {
+public:
+    explicit MappedFile(const std::string &filename,
+                        const char *magic = nullptr, size_t magic_len = 0) {
+        const int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        if (StartsWith(fd, magic, magic_len)) Map(fd);
+        close(fd);
+    }
+
+    ~MappedFile() {
+        if (data_) munmap((void *)data_, size_);
+    }
+
+    MappedFile(const MappedFile &)            = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    // If false, the file could not be opened, mapped or the magic
+    // did not match.
+    bool is_valid() const { return data_ != nullptr; }
+
+    const uint8_t *data() const { return data_; }
+    size_t size() const { return size_; }
+
+private:
+    static bool StartsWith(int fd, const char *magic, size_t len) {
+        if (len == 0) return true;
+        char header[16];
+        if (len > sizeof(header)) return false;
+        return pread(fd, header, len, 0) == (ssize_t)len &&
+               memcmp(header, magic, len) == 0;
+    }
+
+    void Map(int fd) {
+        struct stat s;
+        if (fstat(fd, &s) < 0 || !S_ISREG(s.st_mode) || s.st_size == 0) return;
+        void *buf = mmap(nullptr, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (buf == MAP_FAILED) return;
+        // Decoders go through the file front to back; read ahead aggressively.
+        madvise(buf, s.st_size, MADV_SEQUENTIAL);
+        data_ = (const uint8_t *)buf;
+        size_ = s.st_size;
+    }
+
+    const uint8_t *data_ = nullptr;
+    size_t size_         = 0;
+};
+}  // namespace timg
+
+#endif  // MAPPED_FILE_H
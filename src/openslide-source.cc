@@ -18,6 +18,8 @@
 
 #include <openslide.h>
 
+#include <algorithm>
+#include <atomic>
 #include <csignal>
 #include <cstdarg>
 #include <cstdint>
@@ -26,11 +28,14 @@
 #include <functional>
 #include <limits>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "buffered-write-sequencer.h"
 #include "display-options.h"
 #include "framebuffer.h"
 #include "renderer.h"
+#include "timg-swscale.h"
 #include "timg-time.h"
 
 extern "C" {
@@ -44,7 +49,7 @@ const char *OpenSlideSource::VersionInfo() { return openslide_get_version(); }
 
 std::string OpenSlideSource::FormatTitle(
     const std::string &format_string) const {
-    return FormatFromParameters(format_string, filename_, orig_width_,
+    return FormatFromParameters(format_string, display_name(), orig_width_,
                                 orig_height_, "openslide");
 }
 
@@ -63,6 +68,72 @@ static inline bool invalid_dimensions(int64_t width, int64_t height) {
             height > std::numeric_limits<int>::max());
 }
 
+// Threads reading tiles in addition to the ones loading slides, shared by
+// all slides loaded at the same time. Loading already happens in parallel,
+// so this keeps a grid of slides from starting cores-many threads each.
+static std::atomic<int> spare_tile_readers{
+    std::max(0, (int)std::thread::hardware_concurrency() - 1)};
+
+// Take up to "wanted" from the spare tile readers.
+static int ClaimTileReaders(int wanted) {
+    int available = spare_tile_readers.load();
+    int claimed;
+    do {
+        claimed = std::min(available, wanted);
+    } while (claimed > 0 && !spare_tile_readers.compare_exchange_weak(
+                                available, available - claimed));
+    return claimed;
+}
+
+// Read the whole "level" of the slide into "out" in tiles, in parallel.
+// Slides are stored in tiles, so reading in tiles keeps the working set per
+// thread small. OpenSlide handles can be used from multiple threads.
+static bool ReadLevel(openslide_t *osr, int32_t level, timg::Framebuffer *out) {
+    static constexpr int kTileSize = 1024;
+    const double downsample = openslide_get_level_downsample(osr, level);
+    const int width         = out->width();
+    const int height        = out->height();
+    const int tiles_x       = (width + kTileSize - 1) / kTileSize;
+    const int tile_count    = tiles_x * ((height + kTileSize - 1) / kTileSize);
+    if (tile_count <= 1) {
+        openslide_read_region(osr, (uint32_t *)out->begin(), 0, 0, level,
+                              width, height);
+        return openslide_get_error(osr) == nullptr;
+    }
+
+    std::atomic<int> next_tile{0};
+    std::atomic<bool> success{true};
+    const std::function<void()> read_tiles = [&]() {
+        std::vector<uint32_t> tile((size_t)kTileSize * kTileSize);
+        for (int t; (t = next_tile.fetch_add(1)) < tile_count;) {
+            const int x = (t % tiles_x) * kTileSize;
+            const int y = (t / tiles_x) * kTileSize;
+            const int w = std::min(kTileSize, width - x);
+            const int h = std::min(kTileSize, height - y);
+            // Region position is always given in level-0 coordinates.
+            const int64_t x0 = x * downsample;
+            const int64_t y0 = y * downsample;
+            openslide_read_region(osr, tile.data(), x0, y0, level, w, h);
+            if (openslide_get_error(osr)) {
+                success = false;
+                return;
+            }
+            for (int row = 0; row < h; ++row) {
+                memcpy(out->row(y + row) + x, &tile[(size_t)row * w],
+                       w * sizeof(uint32_t));
+            }
+        }
+    };
+
+    const int helpers = ClaimTileReaders(tile_count - 1);
+    std::vector<std::thread> readers;
+    for (int i = 0; i < helpers; ++i) readers.emplace_back(read_tiles);
+    read_tiles();  // This thread reads tiles as well.
+    for (std::thread &t : readers) t.join();
+    spare_tile_readers.fetch_add(helpers);
+    return success;
+}
+
 bool OpenSlideSource::LoadAndScale(const DisplayOptions &opts, int, int) {
     options_ = opts;
     if (opts.scroll_animation || filename() == "/dev/stdin" ||
@@ -126,20 +197,17 @@ bool OpenSlideSource::LoadAndScale(const DisplayOptions &opts, int, int) {
         if (invalid_dimensions(width, height)) return false;
 
         source_image.reset(new timg::Framebuffer(width, height));
-        openslide_read_region(osr, (uint32_t *)source_image->begin(), 0, 0,
-                              level, width, height);
-        if (openslide_get_error(osr)) return false;
+        if (!ReadLevel(osr, level, source_image.get())) return false;
     }
 
     // Further scaling to desired target width/height
     av_log_set_callback(dummy_log);
-    SwsContext *swsCtx = sws_getContext(
-        width, height, AV_PIX_FMT_RGB32, target_width, target_height,
-        AV_PIX_FMT_RGBA, SWS_BILINEAR, NULL, NULL, NULL);
+    SwsContext *swsCtx =
+        CreateScaleContext(width, height, AV_PIX_FMT_RGB32, target_width,
+                           target_height, AV_PIX_FMT_RGBA, SWS_BILINEAR, 1);
     if (!swsCtx) return false;
     image_.reset(new timg::Framebuffer(target_width, target_height));
-    sws_scale(swsCtx, source_image->row_data(), source_image->stride(), 0,
-              height, image_->row_data(), image_->stride());
+    ScaleFramebuffer(swsCtx, *source_image, AV_PIX_FMT_RGB32, image_.get());
     sws_freeContext(swsCtx);
     image_->AlphaComposeBackground(opts.bgcolor_getter, opts.bg_pattern_color,
                                    opts.pattern_size * options_.cell_x_px,
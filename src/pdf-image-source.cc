@@ -19,9 +19,14 @@
 #include <poppler.h>
 
 #include <algorithm>
+#include <atomic>
 #include <csignal>
 #include <filesystem>
+#include <functional>
+#include <memory>
 #include <string>
+#include <thread>
+#include <utility>
 
 #include "display-options.h"
 #include "framebuffer.h"
@@ -34,10 +39,91 @@ namespace timg {
 
 std::string PDFImageSource::FormatTitle(
     const std::string &format_string) const {
-    return FormatFromParameters(format_string, filename_, (int)orig_width_,
+    return FormatFromParameters(format_string, display_name(), (int)orig_width_,
                                 (int)orig_height_, "pdf");
 }
 
+// Page renderers in addition to the one every document gets, shared by all
+// documents loaded at the same time. Each renderer opens its own copy of the
+// document, so this keeps a grid of PDFs from opening cores-many each.
+static std::atomic<int> spare_page_renderers{
+    std::max(0, (int)std::thread::hardware_concurrency() - 1)};
+
+// Take up to "wanted" from the spare page renderers.
+static int ClaimPageRenderers(int wanted) {
+    int available = spare_page_renderers.load();
+    int claimed;
+    do {
+        claimed = std::min(available, wanted);
+    } while (claimed > 0 && !spare_page_renderers.compare_exchange_weak(
+                                available, available - claimed));
+    return claimed;
+}
+
+PDFImageSource::PageResult PDFImageSource::RenderPage(
+    PopplerDocument *document, int page_num, const DisplayOptions &opts,
+    double *width, double *height) {
+    PopplerPage *const page = poppler_document_get_page(document, page_num);
+    if (page == nullptr) return nullptr;
+
+    PopplerRectangle bounding_box;
+#if POPPLER_CHECK_VERSION(0, 88, 0)
+    if (opts.auto_crop) {
+        poppler_page_get_bounding_box(page, &bounding_box);
+        *width  = bounding_box.x2 - bounding_box.x1;
+        *height = bounding_box.y2 - bounding_box.y1;
+    }
+    else
+#endif
+    {
+        poppler_page_get_size(page, width, height);
+        bounding_box =
+            PopplerRectangle{.x1 = 0, .y1 = 0, .x2 = *width, .y2 = *height};
+    }
+
+    int render_width;
+    int render_height;
+    CalcScaleToFitDisplay(*width, *height, opts, false, &render_width,
+                          &render_height);
+
+    const auto kCairoFormat = CAIRO_FORMAT_ARGB32;
+    int stride = cairo_format_stride_for_width(kCairoFormat, render_width);
+    std::unique_ptr<timg::Framebuffer> image(
+        new timg::Framebuffer(stride / 4, render_height));
+
+    cairo_surface_t *surface = cairo_image_surface_create_for_data(
+        (uint8_t *)image->begin(), kCairoFormat, render_width, render_height,
+        stride);
+
+    cairo_t *cr = cairo_create(surface);
+    cairo_scale(cr, 1.0 * render_width / *width, 1.0 * render_height / *height);
+    cairo_translate(cr, -bounding_box.x1, -bounding_box.y1);
+    cairo_save(cr);
+
+    // Fill background with page color.
+    cairo_set_source_rgb(cr, 1, 1, 1);
+    cairo_paint(cr);
+
+    poppler_page_render(page, cr);
+
+    cairo_restore(cr);
+    g_object_unref(page);
+
+    cairo_destroy(cr);
+    cairo_surface_destroy(surface);
+
+    // Cairo stores A (high-byte), R, G, B (low-byte). We need ABGR.
+    for (rgba_t &pixel : *image) {
+        std::swap(pixel.r, pixel.b);
+    }
+    return image;
+}
+
+PDFImageSource::~PDFImageSource() {
+    if (pages_) pages_->Cancel();
+    render_pool_.reset();  // Wait for pages currently rendered.
+}
+
 bool PDFImageSource::LoadAndScale(const DisplayOptions &opts, int frame_offset,
                                   int frame_count) {
     options_ = opts;
@@ -51,76 +137,56 @@ bool PDFImageSource::LoadAndScale(const DisplayOptions &opts, int frame_offset,
         return false;
     }
 
-    bool success         = true;
     const int page_count = poppler_document_get_n_pages(document);
     const int start_page = std::max(0, frame_offset);
     const int max_display_page =
         (frame_count < 0) ? page_count
                           : std::min(page_count, start_page + frame_count);
-    PopplerRectangle bounding_box;
-    for (int page_num = start_page; page_num < max_display_page; ++page_num) {
-        PopplerPage *const page = poppler_document_get_page(document, page_num);
-        if (page == nullptr) {
-            success = false;
-            break;
-        }
 
-#if POPPLER_CHECK_VERSION(0, 88, 0)
-        if (opts.auto_crop) {
-            poppler_page_get_bounding_box(page, &bounding_box);
-            orig_width_  = bounding_box.x2 - bounding_box.x1;
-            orig_height_ = bounding_box.y2 - bounding_box.y1;
-        }
-        else
-#endif
-        {
-            poppler_page_get_size(page, &orig_width_, &orig_height_);
-            bounding_box = PopplerRectangle{
-                .x1 = 0, .y1 = 0, .x2 = orig_width_, .y2 = orig_height_};
-        }
-
-        int render_width;
-        int render_height;
-        CalcScaleToFitDisplay(orig_width_, orig_height_, opts, false,
-                              &render_width, &render_height);
-
-        const auto kCairoFormat = CAIRO_FORMAT_ARGB32;
-        int stride = cairo_format_stride_for_width(kCairoFormat, render_width);
-        std::unique_ptr<timg::Framebuffer> image(
-            new timg::Framebuffer(stride / 4, render_height));
-
-        cairo_surface_t *surface = cairo_image_surface_create_for_data(
-            (uint8_t *)image->begin(), kCairoFormat, render_width,
-            render_height, stride);
-
-        cairo_t *cr = cairo_create(surface);
-        cairo_scale(cr, 1.0 * render_width / orig_width_,
-                    1.0 * render_height / orig_height_);
-        cairo_translate(cr, -bounding_box.x1, -bounding_box.y1);
-        cairo_save(cr);
-
-        // Fill background with page color.
-        cairo_set_source_rgb(cr, 1, 1, 1);
-        cairo_paint(cr);
-
-        poppler_page_render(page, cr);
-
-        cairo_restore(cr);
-        g_object_unref(page);
-
-        cairo_destroy(cr);
-        cairo_surface_destroy(surface);
-
-        // Cairo stores A (high-byte), R, G, B (low-byte). We need ABGR.
-        for (rgba_t &pixel : *image) {
-            std::swap(pixel.r, pixel.b);
-        }
-
-        pages_.emplace_back(std::move(image));
+    if (start_page >= max_display_page) {
+        g_object_unref(document);
+        return false;
     }
+
+    // The first page is needed right away, and tells if this works at all.
+    PageResult first_page =
+        RenderPage(document, start_page, opts, &orig_width_, &orig_height_);
     g_object_unref(document);
+    if (!first_page) return false;
 
-    return success && !pages_.empty();
+    pages_.reset(new PublishedFrames<timg::Framebuffer>(max_display_page -
+                                                        start_page));
+    pages_->Publish(0, std::move(first_page));
+    StartRendering(uri, start_page + 1);
+    return true;
+}
+
+void PDFImageSource::StartRendering(const std::string &uri, int first_page) {
+    const int count = pages_->size() - 1;
+    if (count <= 0) return;
+
+    // Poppler documents can not be used from multiple threads at once, so
+    // each worker opens its own and renders every n-th page. Workers beyond
+    // the first are only started if spare, and handed back once done.
+    const int workers = 1 + ClaimPageRenderers(count - 1);
+    render_pool_.reset(new ThreadPool(workers));
+    for (int w = 0; w < workers; ++w) {
+        std::function<bool()> render_pages = [=]() {
+            PopplerDocument *const document =
+                poppler_document_new_from_file(uri.c_str(), nullptr, nullptr);
+            for (int i = w; i < count && !pages_->cancelled(); i += workers) {
+                double width, height;
+                pages_->Publish(
+                    i + 1, document ? RenderPage(document, first_page + i,
+                                                 options_, &width, &height)
+                                    : nullptr);
+            }
+            if (document) g_object_unref(document);
+            if (w > 0) spare_page_renderers.fetch_add(1);
+            return true;
+        };
+        render_pool_->ExecAsync(render_pages);
+    }
 }
 
 int PDFImageSource::IndentationIfCentered(
@@ -132,9 +198,12 @@ int PDFImageSource::IndentationIfCentered(
 void PDFImageSource::SendFrames(const Duration &duration, int loops,
                                 const volatile sig_atomic_t &interrupt_received,
                                 const Renderer::WriteFramebufferFun &sink) {
-    for (const auto &page : pages_) {
-        const int dx = IndentationIfCentered(*page);
-        sink(dx, 0, *page, SeqType::FrameImmediate, {});
+    // Pages are sent as soon as they are ready.
+    for (int i = 0; i < pages_->size() && !interrupt_received; ++i) {
+        const timg::Framebuffer *page = pages_->Get(i);
+        if (!page) break;
+        sink(IndentationIfCentered(*page), 0, *page, SeqType::FrameImmediate,
+             {});
     }
 }
 
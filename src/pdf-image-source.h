@@ -19,20 +19,26 @@
 #include <csignal>
 #include <memory>
 #include <string>
-#include <vector>
 
 #include "display-options.h"
 #include "framebuffer.h"
 #include "image-source.h"
+#include "published-frames.h"
 #include "renderer.h"
+#include "thread-pool.h"
 #include "timg-time.h"
 
+typedef struct _PopplerDocument PopplerDocument;
+
 namespace timg {
 class PDFImageSource final : public ImageSource {
 public:
     explicit PDFImageSource(const std::string &filename)
         : ImageSource(filename) {}
+    ~PDFImageSource() final;
 
+    // Renders the first page, all the following are rendered in parallel
+    // in the background.
     bool LoadAndScale(const DisplayOptions &options, int frame_offset,
                       int frame_count) final;
 
@@ -43,11 +49,24 @@ public:
     std::string FormatTitle(const std::string &format_string) const final;
 
 private:
+    using PageResult = std::unique_ptr<timg::Framebuffer>;
+
     int IndentationIfCentered(const timg::Framebuffer &image) const;
 
+    // Render page "page_num" of the document. Returns nullptr on failure.
+    // Also returns the original size of the page in "width" and "height".
+    static PageResult RenderPage(PopplerDocument *document, int page_num,
+                                 const DisplayOptions &opts, double *width,
+                                 double *height);
+
+    // Start rendering the remaining pages in the background, with
+    // "first_page" the document page of pages_ index 1.
+    void StartRendering(const std::string &uri, int first_page);
+
     DisplayOptions options_;
     double orig_width_, orig_height_;
-    std::vector<std::unique_ptr<timg::Framebuffer>> pages_;
+    std::unique_ptr<PublishedFrames<timg::Framebuffer>> pages_;
+    std::unique_ptr<ThreadPool> render_pool_;
 };
 
 }  // namespace timg
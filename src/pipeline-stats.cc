@@ -0,0 +1,190 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// (c) 2024 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#include "pipeline-stats.h"
+
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+namespace timg {
+static constexpr int kStageCount = (int)Stage::kWrite + 1;
+static constexpr const char *kStageNames[kStageCount] = {
+    "load", "scale", "alpha-compose", "encode",
+    "queue-wait", "encode-wait", "write",
+};
+
+struct StageTotals {
+    std::atomic<int64_t> count{0};
+    std::atomic<int64_t> wall_ns{0};
+    std::atomic<int64_t> cpu_ns{0};
+};
+static StageTotals stage_totals[kStageCount];
+
+static std::mutex frames_lock;
+static std::deque<int64_t> frame_starts_ns;  // Frames not written yet.
+static std::vector<int64_t> frame_latencies_ns;
+static int64_t frames_dropped = 0;
+static int64_t first_frame_ns = -1;
+static int64_t last_frame_ns  = -1;
+
+struct TraceEvent {
+    const char *name;
+    int thread;
+    int64_t start_ns;
+    int64_t duration_ns;  // Negative for instant events.
+};
+static std::mutex trace_lock;
+static std::vector<TraceEvent> trace_events;
+
+static int64_t NowNs(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Small numbers are easier to read in a trace viewer than system thread ids.
+static int ThreadNumber() {
+    static std::atomic<int> thread_count{0};
+    static thread_local int thread_number = ++thread_count;
+    return thread_number;
+}
+
+static void AddTraceEvent(const char *name, int64_t start_ns,
+                          int64_t duration_ns) {
+    const TraceEvent event{name, ThreadNumber(), start_ns, duration_ns};
+    std::lock_guard<std::mutex> l(trace_lock);
+    trace_events.push_back(event);
+}
+
+PipelineStats::Scope::Scope(Stage stage)
+    : stage_((int)stage), trace_name_(kStageNames[(int)stage]) {
+    if (!enabled() && !tracing()) return;
+    start_wall_ns_ = NowNs(CLOCK_MONOTONIC);
+    if (enabled()) start_cpu_ns_ = NowNs(CLOCK_THREAD_CPUTIME_ID);
+}
+
+PipelineStats::Scope::Scope(const char *trace_name)
+    : stage_(-1), trace_name_(trace_name) {
+    if (tracing()) start_wall_ns_ = NowNs(CLOCK_MONOTONIC);
+}
+
+PipelineStats::Scope::~Scope() {
+    if (start_wall_ns_ < 0) return;
+    const int64_t wall_ns = NowNs(CLOCK_MONOTONIC) - start_wall_ns_;
+    if (tracing()) AddTraceEvent(trace_name_, start_wall_ns_, wall_ns);
+    if (stage_ < 0 || !enabled()) return;
+    StageTotals &totals = stage_totals[stage_];
+    totals.count.fetch_add(1, std::memory_order_relaxed);
+    totals.wall_ns.fetch_add(wall_ns, std::memory_order_relaxed);
+    totals.cpu_ns.fetch_add(NowNs(CLOCK_THREAD_CPUTIME_ID) - start_cpu_ns_,
+                            std::memory_order_relaxed);
+}
+
+void PipelineStats::TraceInstant(const char *name) {
+    if (tracing()) AddTraceEvent(name, NowNs(CLOCK_MONOTONIC), -1);
+}
+
+void PipelineStats::FrameStarted() {
+    if (!enabled()) return;
+    const int64_t now = NowNs(CLOCK_MONOTONIC);
+    std::lock_guard<std::mutex> l(frames_lock);
+    if (first_frame_ns < 0) first_frame_ns = now;
+    frame_starts_ns.push_back(now);
+}
+
+void PipelineStats::FramesWritten(int count) {
+    if (!enabled() || count == 0) return;
+    const int64_t now = NowNs(CLOCK_MONOTONIC);
+    std::lock_guard<std::mutex> l(frames_lock);
+    for (int i = 0; i < count && !frame_starts_ns.empty(); ++i) {
+        frame_latencies_ns.push_back(now - frame_starts_ns.front());
+        frame_starts_ns.pop_front();
+    }
+    last_frame_ns = now;
+}
+
+void PipelineStats::FrameDropped() {
+    TraceInstant("frame-dropped");
+    if (!enabled()) return;
+    std::lock_guard<std::mutex> l(frames_lock);
+    if (!frame_starts_ns.empty()) frame_starts_ns.pop_front();
+    ++frames_dropped;
+}
+
+void PipelineStats::PrintReport(FILE *out) {
+    fprintf(out, "%-14s %8s %12s %12s %12s\n", "Stage", "count", "wall-ms",
+            "cpu-ms", "avg-wall-ms");
+    for (int i = 0; i < kStageCount; ++i) {
+        const int64_t count = stage_totals[i].count.load();
+        if (count == 0) continue;
+        const double wall_ms = stage_totals[i].wall_ns.load() / 1e6;
+        fprintf(out, "%-14s %8" PRId64 " %12.1f %12.1f %12.3f\n",
+                kStageNames[i], count, wall_ms,
+                stage_totals[i].cpu_ns.load() / 1e6, wall_ms / count);
+    }
+
+    std::lock_guard<std::mutex> l(frames_lock);
+    std::vector<int64_t> &latencies = frame_latencies_ns;
+    if (latencies.empty()) return;
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile_ms = [&latencies](int p) {
+        return latencies[(latencies.size() - 1) * p / 100] / 1e6;
+    };
+    const double seconds = (last_frame_ns - first_frame_ns) / 1e9;
+    fprintf(out, "%d frames written", (int)latencies.size());
+    if (frames_dropped) fprintf(out, " (%" PRId64 " dropped)", frames_dropped);
+    if (seconds > 0) {
+        fprintf(out, " in %.3fs; %.1ffps", seconds, latencies.size() / seconds);
+    }
+    fprintf(out,
+            "\nFrame latency ms: p50 %.2f; p95 %.2f; p99 %.2f; max %.2f\n",
+            percentile_ms(50), percentile_ms(95), percentile_ms(99),
+            percentile_ms(100));
+}
+
+bool PipelineStats::WriteTrace(const char *filename) {
+    FILE *out = fopen(filename, "w");
+    if (!out) return false;
+    std::lock_guard<std::mutex> l(trace_lock);
+    int64_t start_ns = INT64_MAX;
+    for (const TraceEvent &e : trace_events) {
+        start_ns = std::min(start_ns, e.start_ns);
+    }
+    fprintf(out, "{\"traceEvents\":[\n");
+    const char *separator = "";
+    for (const TraceEvent &e : trace_events) {
+        // Timestamps are in microseconds, with fractions allowed.
+        fprintf(out, "%s{\"name\":\"%s\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,",
+                separator, e.name, e.thread, (e.start_ns - start_ns) / 1e3);
+        if (e.duration_ns < 0) {
+            fprintf(out, "\"ph\":\"i\",\"s\":\"t\"}");
+        }
+        else {
+            fprintf(out, "\"ph\":\"X\",\"dur\":%.3f}", e.duration_ns / 1e3);
+        }
+        separator = ",\n";
+    }
+    fprintf(out, "\n]}\n");
+    return fclose(out) == 0;
+}
+}  // namespace timg
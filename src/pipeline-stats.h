@@ -0,0 +1,90 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// (c) 2024 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#ifndef TIMG_PIPELINE_STATS_H
+#define TIMG_PIPELINE_STATS_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+
+namespace timg {
+// Processing stages that are timed for --benchmark.
+enum class Stage {
+    kLoad,          // ImageSource::Create(): probe, decode, scale, compose.
+    kScale,         // Scaling images or video frames.
+    kAlphaCompose,  // Blending with the background color.
+    kEncode,        // Canvas encoding into terminal sequences.
+    kQueueWait,     // Waiting for room in the write queue.
+    kEncodeWait,    // Writer waiting for a frame to finish encoding.
+    kWrite,         // Writing to the output.
+};
+
+// Collects wall and CPU time spent in the processing stages and the
+// latencies of frames from being handed to the canvas until written.
+// Optionally, records all stages and other spans as trace events to see
+// how they overlap in the threads.
+// Disabled by default; then all calls return right away. Thread-safe.
+class PipelineStats {
+public:
+    static void Enable() { enabled_ = true; }
+    static bool enabled() { return enabled_; }
+
+    // Record trace events, to be written with WriteTrace().
+    static void EnableTrace() { tracing_ = true; }
+    static bool tracing() { return tracing_; }
+
+    // Time from construction to destruction is accounted to "stage".
+    // CPU time is that of the current thread.
+    // Scopes with just a name are only recorded as trace events. The name
+    // needs to be a string literal.
+    class Scope {
+    public:
+        explicit Scope(Stage stage);
+        explicit Scope(const char *trace_name);
+        Scope(const Scope &) = delete;
+        ~Scope();
+
+    private:
+        const int stage_;  // Negative if only traced.
+        const char *const trace_name_;
+        int64_t start_wall_ns_ = -1;  // Negative if not enabled.
+        int64_t start_cpu_ns_  = 0;
+    };
+
+    // Trace event of something that happened right now.
+    static void TraceInstant(const char *name);
+
+    // A frame is handed to the canvas to be sent.
+    static void FrameStarted();
+
+    // The oldest "count" started frames are written or were dropped.
+    static void FramesWritten(int count);
+    static void FrameDropped();
+
+    // Print stages and frame latency percentiles.
+    static void PrintReport(FILE *out);
+
+    // Write recorded trace events as Chrome trace event JSON, which can be
+    // loaded into ui.perfetto.dev or chrome://tracing.
+    static bool WriteTrace(const char *filename);
+
+private:
+    static inline std::atomic<bool> enabled_{false};
+    static inline std::atomic<bool> tracing_{false};
+};
+}  // namespace timg
+
+#endif  // TIMG_PIPELINE_STATS_H
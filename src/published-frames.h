@@ -0,0 +1,86 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// (c) 2024 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+//
+#ifndef TIMG_PUBLISHED_FRAMES
+#define TIMG_PUBLISHED_FRAMES
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace timg {
+// A fixed number of frames, produced by any number of threads in any order
+// and consumed in order. Lets an ImageSource start sending the first frames
+// in SendFrames() while the following are still being decoded.
+//
+// Frames stay available once published, so they can be consumed multiple
+// times, e.g. for looping.
+template <class T>
+class PublishedFrames {
+public:
+    explicit PublishedFrames(int count) : frames_(count), done_(count) {}
+    PublishedFrames(const PublishedFrames &) = delete;
+
+    int size() const { return frames_.size(); }
+
+    // -- Producer side
+
+    // Publish frame "index". A nullptr frame signifies that it could not be
+    // produced.
+    void Publish(int index, std::unique_ptr<T> frame) {
+        {
+            std::lock_guard<std::mutex> l(lock_);
+            frames_[index] = std::move(frame);
+            done_[index]   = true;
+        }
+        cv_.notify_all();
+    }
+
+    // Producers should check this and stop early if set.
+    bool cancelled() const { return cancelled_.load(); }
+
+    // -- Consumer side
+
+    // Return frame "index", waiting until it is published. Returns nullptr
+    // if it could not be produced or production was cancelled.
+    const T *Get(int index) {
+        if (index < 0 || index >= size()) return nullptr;
+        std::unique_lock<std::mutex> l(lock_);
+        cv_.wait(l, [&]() { return done_[index] || cancelled_.load(); });
+        return frames_[index].get();
+    }
+
+    // Don't wait for frames that are not published yet.
+    void Cancel() {
+        {
+            std::lock_guard<std::mutex> l(lock_);
+            cancelled_.store(true);
+        }
+        cv_.notify_all();
+    }
+
+private:
+    std::mutex lock_;
+    std::condition_variable cv_;
+    std::vector<std::unique_ptr<T>> frames_;
+    std::vector<bool> done_;
+    std::atomic<bool> cancelled_{false};
+};
+}  // namespace timg
+
+#endif  // TIMG_PUBLISHED_FRAMES
@@ -15,6 +15,7 @@
 
 #include "qoi-image-source.h"
 
+#define QOI_NO_STDIO  // We decode from a memory mapped file.
 #define QOI_IMPLEMENTATION
 #include "qoi.h"
 //
@@ -28,7 +29,9 @@
 #include "buffered-write-sequencer.h"
 #include "display-options.h"
 #include "framebuffer.h"
+#include "mapped-file.h"
 #include "renderer.h"
+#include "timg-swscale.h"
 #include "timg-time.h"
 
 extern "C" {
@@ -43,14 +46,16 @@ static void dummy_log(void *, int, const char *, va_list) {}
 
 std::string QOIImageSource::FormatTitle(
     const std::string &format_string) const {
-    return FormatFromParameters(format_string, filename_, orig_width_,
+    return FormatFromParameters(format_string, display_name(), orig_width_,
                                 orig_height_, "qoi");
 }
 
 bool QOIImageSource::LoadAndScale(const DisplayOptions &opts, int, int) {
     options_ = opts;
+    const MappedFile file(filename(), "qoif", 4);
+    if (!file.is_valid()) return false;
     qoi_desc desc;
-    void *const qoi_pic = qoi_read(filename().c_str(), &desc, 4);
+    void *const qoi_pic = qoi_decode(file.data(), file.size(), &desc, 4);
     if (!qoi_pic) return false;
 
     // TODO: would be good if Framebuffer supported adopting foreign buffer.
@@ -62,22 +67,24 @@ bool QOIImageSource::LoadAndScale(const DisplayOptions &opts, int, int) {
     orig_width_  = image_in.width();
     orig_height_ = image_in.height();
 
+    const Rect crop = CropRegion(image_in, opts);
+
     int target_width;
     int target_height;
-    CalcScaleToFitDisplay(desc.width, desc.height, opts, false, &target_width,
+    CalcScaleToFitDisplay(crop.width, crop.height, opts, false, &target_width,
                           &target_height);
 
     // Further scaling to desired target width/height
     av_log_set_callback(dummy_log);
     SwsContext *swsCtx =
-        sws_getContext(desc.width, desc.height, AV_PIX_FMT_RGBA,      //  in
-                       target_width, target_height, AV_PIX_FMT_RGBA,  // out
-                       SWS_BILINEAR, NULL, NULL, NULL);
+        CreateScaleContext(crop.width, crop.height, AV_PIX_FMT_RGBA,      //  in
+                           target_width, target_height, AV_PIX_FMT_RGBA,  // out
+                           SWS_BILINEAR, 1);
     if (!swsCtx) return false;
     image_.reset(new timg::Framebuffer(target_width, target_height));
 
-    sws_scale(swsCtx, image_in.row_data(), image_in.stride(), 0,
-              image_in.height(), image_->row_data(), image_->stride());
+    ScaleFramebufferRect(swsCtx, image_in, AV_PIX_FMT_RGBA, crop.x, crop.y,
+                         crop.width, crop.height, image_.get());
     sws_freeContext(swsCtx);
 
     if (desc.channels == 4) {
@@ -98,6 +105,11 @@ int QOIImageSource::IndentationIfCentered(
 void QOIImageSource::SendFrames(const Duration &duration, int loops,
                                 const volatile sig_atomic_t &interrupt_received,
                                 const Renderer::WriteFramebufferFun &sink) {
+    if (options_.scroll_animation) {
+        ScrollImage(*image_, options_, duration, loops, interrupt_received,
+                    sink);
+        return;
+    }
     sink(IndentationIfCentered(*image_), 0, *image_, SeqType::FrameImmediate,
          {});
 }
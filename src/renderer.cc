@@ -18,10 +18,12 @@
 #include <algorithm>
 #include <memory>
 #include <string>
+#include <vector>
 
 #include "buffered-write-sequencer.h"
 #include "display-options.h"
 #include "framebuffer.h"
+#include "pipeline-stats.h"
 #include "terminal-canvas.h"
 #include "timg-time.h"
 
@@ -54,6 +56,7 @@ public:
         RenderTitle(title);
         return [this](int x, int dy, const Framebuffer &fb, SeqType seq_type,
                       const Duration &end_of_frame) {
+            PipelineStats::Scope trace("canvas-send");
             canvas_->Send(x, dy, fb, seq_type, end_of_frame);
         };
     }
@@ -78,20 +81,28 @@ private:
 // The multi column renderer positions every update in a new column.
 // It keeps track which column it is in and if a new row needs to be started
 // and uses cursor movements to get to the right place.
+//
+// If rows are coalesced, still images are not sent right away but copied
+// into a pending row, which is sent as one wide framebuffer once complete.
+// That saves the cursor movements and the per-image overhead of the
+// canvas. Once an animation shows up in a row, the pending row is sent and
+// the rest of the row is positioned with cursor movements again.
 class MultiColumnRenderer final : public Renderer {
 public:
     MultiColumnRenderer(timg::TerminalCanvas *canvas,
                         const DisplayOptions &display_opts, int cols, int rows,
                         Duration wait_between_images,
-                        Duration wait_between_rows)
+                        Duration wait_between_rows, bool coalesce_rows)
 
         : Renderer(canvas, display_opts),
           columns_(cols),
           column_width_(display_opts.width),
           wait_between_images_(wait_between_images),
-          wait_between_rows_(wait_between_rows) {}
+          wait_between_rows_(wait_between_rows),
+          coalesce_rows_(coalesce_rows) {}
 
     ~MultiColumnRenderer() final {
+        Flush();
         if (current_column_ != 0) {
             const int down = highest_fb_column_height_ - last_fb_height_;
             if (down > 0) {
@@ -106,6 +117,22 @@ public:
         first_render_call_ = true;
         return [this](int x, int dy, const Framebuffer &fb, SeqType seq_type,
                       const Duration &end_of_frame) {
+            if (coalesce_rows_ && seq_type == SeqType::FrameImmediate &&
+                dy == 0) {
+                if (!first_render_call_) AdvanceColumn();  // Next image.
+                // Only rows started from the first column are coalesced.
+                if (current_column_ == 0 || !pending_.empty()) {
+                    AddToPendingRow(x, fb);
+                    first_render_call_ = false;
+                    return;
+                }
+            }
+            else if (!pending_.empty()) {
+                // Animations are sent as they come. Send what we have so
+                // far, then continue as if the row was sent image by image.
+                SendPendingRow();
+            }
+
             int y_offset;
             if (first_render_call_) {
                 // Unless we're in the first column, we've to move up from last
@@ -139,7 +166,11 @@ public:
                 y_offset = 0;  // No move by Send() needed anymore.
             }
 
-            canvas_->Send(x + x_offset, y_offset, fb, seq_type, end_of_frame);
+            {
+                PipelineStats::Scope trace("canvas-send");
+                canvas_->Send(x + x_offset, y_offset, fb, seq_type,
+                              end_of_frame);
+            }
             last_fb_height_ = fb.height();
             if (last_fb_height_ > highest_fb_column_height_)
                 highest_fb_column_height_ = last_fb_height_;
@@ -156,7 +187,67 @@ public:
         }
     }
 
+    bool Flush() final {
+        if (pending_.empty()) return false;
+        SendPendingRow();
+        return true;
+    }
+
 private:
+    struct PendingImage {
+        int column_x;       // Start of column in pixels.
+        int x;              // Position of image in row in pixels.
+        std::string title;  // Empty, if no title is shown.
+        Framebuffer framebuffer;
+    };
+
+    void AddToPendingRow(int x, const Framebuffer &fb) {
+        const int x_offset = current_column_ * column_width_;
+        std::string title;
+        if (options_.show_title && first_render_call_) {
+            title.assign(title_, 0, title_.length() - 1);  // Without newline.
+        }
+        pending_.push_back({x_offset, x + x_offset, title, Framebuffer(fb)});
+        if (current_column_ == columns_ - 1) SendPendingRow();
+    }
+
+    void SendPendingRow() {
+        int width  = 0;
+        int height = 0;
+        for (const PendingImage &image : pending_) {
+            width  = std::max(width, image.x + image.framebuffer.width());
+            height = std::max(height, image.framebuffer.height());
+        }
+        Framebuffer row(width, height);
+        bool any_title = false;
+        for (const PendingImage &image : pending_) {
+            const Framebuffer &fb = image.framebuffer;
+            for (int y = 0; y < fb.height(); ++y) {
+                std::copy(fb.row(y), fb.row(y) + fb.width(),
+                          row.row(y) + image.x);
+            }
+            any_title |= !image.title.empty();
+        }
+        if (any_title) {
+            // All titles in one line above the row.
+            for (const PendingImage &image : pending_) {
+                if (image.title.empty()) continue;
+                canvas_->AddPrefixNextSend("\r", 1);
+                canvas_->MoveCursorDX(image.column_x / options_.cell_x_px);
+                canvas_->AddPrefixNextSend(image.title.data(),
+                                           image.title.size());
+            }
+            canvas_->AddPrefixNextSend("\n", 1);
+        }
+        pending_.clear();
+        {
+            PipelineStats::Scope trace("canvas-send");
+            canvas_->Send(0, 0, row, SeqType::FrameImmediate, {});
+        }
+        last_fb_height_           = height;
+        highest_fb_column_height_ = std::max(highest_fb_column_height_, height);
+    }
+
     void PrepareTitle(const std::string &title) {
         if (!options_.show_title) return;
         title_ = TrimTitle(title, column_width_ / options_.cell_x_px);
@@ -165,6 +256,7 @@ private:
     bool AdvanceColumn() {
         ++current_column_;
         if (current_column_ >= columns_) {
+            Flush();  // Only if some source did not emit any images.
             // If our current image is shorter than the previous one,
             // we need to make up the difference to be ready for the next
             const int down = highest_fb_column_height_ - last_fb_height_;
@@ -180,7 +272,9 @@ private:
     const int column_width_;
     const Duration wait_between_images_;
     const Duration wait_between_rows_;
+    const bool coalesce_rows_;
 
+    std::vector<PendingImage> pending_;  // Row of images not sent yet.
     std::string title_;
     bool first_render_call_       = true;
     int current_column_           = -1;
@@ -198,11 +292,12 @@ std::unique_ptr<Renderer> Renderer::Create(timg::TerminalCanvas *output,
                                            const DisplayOptions &display_opts,
                                            int cols, int rows,
                                            Duration wait_between_images,
-                                           Duration wait_between_rows) {
+                                           Duration wait_between_rows,
+                                           bool coalesce_rows) {
     if (cols > 1) {
-        return std::make_unique<MultiColumnRenderer>(output, display_opts, cols,
-                                                     rows, wait_between_images,
-                                                     wait_between_rows);
+        return std::make_unique<MultiColumnRenderer>(
+            output, display_opts, cols, rows, wait_between_images,
+            wait_between_rows, coalesce_rows);
     }
     return std::make_unique<SingleColumnRenderer>(
         output, display_opts, std::max(wait_between_images, wait_between_rows));
@@ -41,11 +41,14 @@ public:
 
     // Create a renderer that writes to the terminal canvas.
     // The single column vs. multi column are different implementations.
+    // With "coalesce_rows", still images in a grid row are collected and
+    // sent as one image once the row is complete.
     static std::unique_ptr<Renderer> Create(timg::TerminalCanvas *output,
                                             const DisplayOptions &display_opts,
                                             int cols, int rows,
                                             Duration wait_between_images,
-                                            Duration wait_between_rows);
+                                            Duration wait_between_rows,
+                                            bool coalesce_rows = false);
 
     virtual ~Renderer() {}
 
@@ -59,6 +62,10 @@ public:
     // Wait if needed between image sources.
     virtual void MaybeWaitBetweenImageSources() const = 0;
 
+    // Send what is still pending, such as an incomplete grid row. Returns
+    // true if anything was sent.
+    virtual bool Flush() { return false; }
+
 protected:
     Renderer(timg::TerminalCanvas *canvas, const DisplayOptions &display_opts);
 
@@ -15,20 +15,31 @@
 
 #include "sixel-canvas.h"
 
+#ifdef WITH_TIMG_LIBSIXEL
 #include <sixel.h>
+#endif
 
 #include <algorithm>
 #include <cassert>
+#include <cstdint>
+#include <cstdlib>
 #include <cstring>
 #include <functional>
+#include <future>
 #include <memory>
+#include <string>
+#include <utility>
 
 #include "buffered-write-sequencer.h"
 #include "display-options.h"
+#include "encoded-frame-cache.h"
 #include "framebuffer.h"
+#include "pipeline-stats.h"
+#include "sixel-encoder.h"
 #include "terminal-canvas.h"
 #include "thread-pool.h"
 #include "timg-time.h"
+#include "utils.h"
 
 #define CSI "\033["
 
@@ -37,7 +48,10 @@ namespace timg {
 SixelCanvas::SixelCanvas(BufferedWriteSequencer *ws, ThreadPool *thread_pool,
                          bool required_cursor_placement_workaround,
                          const DisplayOptions &opts)
-    : TerminalCanvas(ws), options_(opts), executor_(thread_pool) {
+    : TerminalCanvas(ws),
+      options_(opts),
+      executor_(thread_pool),
+      use_builtin_encoder_(GetBoolenEnv("TIMG_SIXEL_BUILTIN")) {
     // Terminals might have different understanding where the curosr is placed
     // after an image is sent.
     // Apparently the original dec terminal placed it afterwards, but some
@@ -78,7 +92,7 @@ SixelCanvas::SixelCanvas(BufferedWriteSequencer *ws, ThreadPool *thread_pool,
 // Char needs to be non-const to be compatible sixel-callback.
 static int WriteToOutBuffer(char *data, int size, void *outbuf_param) {
     OutBuffer *outbuffer = (OutBuffer *)outbuf_param;
-    // TODO realloc
+    outbuffer->Reserve(size);
     memcpy(outbuffer->data + outbuffer->size, data, size);
     outbuffer->size += size;
     return size;
@@ -93,6 +107,34 @@ static void WriteStringToOutBuffer(const char *str, OutBuffer *outbuffer) {
     WriteToOutBuffer(const_cast<char *>(str), strlen(str), outbuffer);
 }
 
+#ifdef WITH_TIMG_LIBSIXEL
+// Histogram with 2 bits per color channel, sampling only every 4th pixel;
+// good enough to see if the colors of a scene changed.
+template <class Histogram>
+static Histogram ColorHistogram(const Framebuffer &fb) {
+    Histogram result = {};
+    const rgba_t *const end = fb.end();
+    for (const rgba_t *pixel = fb.begin(); pixel < end; pixel += 4) {
+        ++result[(pixel->r >> 6) << 4 | (pixel->g >> 6) << 2 | pixel->b >> 6];
+    }
+    return result;
+}
+
+// Returns true if the color distribution differs more than what the palette
+// of the other can represent.
+template <class Histogram>
+static bool IsSceneChange(const Histogram &a, const Histogram &b) {
+    // Fraction of samples that moved to a different bucket.
+    static constexpr float kSceneChangeThreshold = 0.15f;
+    int64_t total = 0, difference = 0;
+    for (size_t i = 0; i < a.size(); ++i) {
+        total += a[i] + b[i];
+        difference += abs(a[i] - b[i]);
+    }
+    return difference > kSceneChangeThreshold * total;
+}
+#endif
+
 void SixelCanvas::Send(int x, int dy, const Framebuffer &fb_orig,
                        SeqType seq_type, Duration end_of_frame) {
     if (dy < 0) {
@@ -100,12 +142,27 @@ void SixelCanvas::Send(int x, int dy, const Framebuffer &fb_orig,
     }
     MoveCursorDX(x / options_.cell_x_px);
 
+    // Looping animations send the same frames again; as the palette is
+    // always sent along, the encoding only depends on the content.
+    uint64_t cache_key = 0;
+    if (seq_type == SeqType::StartOfAnimation ||
+        seq_type == SeqType::AnimationFrame) {
+        if (seq_type == SeqType::StartOfAnimation) encoded_cache_->Clear();
+        cache_key = EncodedFrameCache::HashFramebuffer(fb_orig);
+        if (EncodedFrameCache::Payload payload =
+                encoded_cache_->Lookup(cache_key)) {
+            write_sequencer_->WriteBuffer(PrefixedBuffer(*payload), seq_type,
+                                          end_of_frame);
+            return;
+        }
+    }
+
     // Create copy to be used in threads.
 
     // Round height to next possible sixel cut-off treat the remaining strip
     // at the bottom as transparent.
-    Framebuffer *const fb =
-        new Framebuffer(fb_orig.width(), round_to_sixel(fb_orig.height()));
+    Framebuffer *const fb = new Framebuffer(
+        fb_orig.width(), round_to_sixel(fb_orig.height()), framebuffer_pool_);
     // First, make it transparent with whatever choosen (ideally, we only
     // do the last couple of rows)
     fb->AlphaComposeBackground(
@@ -113,44 +170,120 @@ void SixelCanvas::Send(int x, int dy, const Framebuffer &fb_orig,
         options_.pattern_size * options_.cell_x_px,
         options_.pattern_size * options_.cell_y_px / 2, fb_orig.height());
     // .. overwrite with whatever is in the orig.
-    std::copy(fb_orig.begin(), fb_orig.end(), fb->begin());
+    for (int y = 0; y < fb_orig.height(); ++y) {
+        std::copy(fb_orig.row(y), fb_orig.row(y) + fb_orig.width(), fb->row(y));
+    }
 
-    // TODO: this should be realloced as needed.
-    char *const buffer = new char[1024 + fb->width() * fb->height() * 5];
-    char *const offset = AppendPrefixToBuffer(buffer);
+    EncodeFunction encode_sixel = EncodeSixel;
+#ifdef WITH_TIMG_LIBSIXEL
+    if (!use_builtin_encoder_) {
+        encode_sixel = CreateLibsixelEncoder(*fb, seq_type);
+    }
+#endif
+
+    OutBuffer *const buffer = new OutBuffer(write_sequencer_->RequestBuffer(
+        1024 + fb->width() * fb->height() * 5));
+    const size_t prefix_len = AppendPrefixToBuffer(buffer->data) - buffer->data;
     // avoid capture whole 'this', so copy values locally
     const char *const cursor_handling_start = cursor_move_before_;
     const char *const cursor_handling_end   = cursor_move_after_;
+    std::shared_ptr<EncodedFrameCache> cache = encoded_cache_;
     const std::function<OutBuffer()> encode_fun =
-        [fb, buffer, offset, cursor_handling_start, cursor_handling_end]() {
+        [fb, buffer, prefix_len, cursor_handling_start, cursor_handling_end,
+         encode_sixel, cache, cache_key]() {
             std::unique_ptr<const Framebuffer> auto_delete(fb);
+            PipelineStats::Scope timing(Stage::kEncode);
 
-            OutBuffer out(buffer, offset - buffer);
+            OutBuffer out(std::move(*buffer));
+            delete buffer;
+            out.size = prefix_len;
             WriteStringToOutBuffer(cursor_handling_start, &out);
-            WriteStringToOutBuffer("\033Pq", &out);  // Start sixel data
-            sixel_output_t *sixel_out = nullptr;
-            sixel_output_new(&sixel_out, WriteToOutBuffer, &out, nullptr);
+            encode_sixel(*fb, &out);
+            WriteStringToOutBuffer(cursor_handling_end, &out);
+            if (cache_key) {
+                cache->Insert(cache_key,
+                              std::string(out.data + prefix_len,
+                                          out.size - prefix_len),
+                              false);
+            }
+            return out;
+        };
+    write_sequencer_->WriteBuffer(
+        executor_->ExecAsync(encode_fun, ThreadPool::Priority::kHigh),
+        seq_type, end_of_frame);
+}
+
+#ifdef WITH_TIMG_LIBSIXEL
+SixelCanvas::EncodeFunction SixelCanvas::CreateLibsixelEncoder(
+    const Framebuffer &fb, SeqType seq_type) {
+    // Animation frames reuse the palette of the previous frames unless the
+    // scene changed. The frame that determines the palette hands it to the
+    // following ones.
+    std::shared_ptr<std::promise<Palette>> determine_palette;
+    std::shared_future<Palette> reuse_palette;
+    if (seq_type == SeqType::StartOfAnimation ||
+        seq_type == SeqType::AnimationFrame) {
+        const Histogram histogram = ColorHistogram<Histogram>(fb);
+        if (seq_type == SeqType::AnimationFrame &&
+            animation_palette_.valid() &&
+            !IsSceneChange(histogram, palette_histogram_)) {
+            reuse_palette = animation_palette_;
+        }
+        else {
+            determine_palette  = std::make_shared<std::promise<Palette>>();
+            animation_palette_ = determine_palette->get_future().share();
+            palette_histogram_ = histogram;
+        }
+    }
+    else {
+        animation_palette_ = {};
+    }
+
+    return [determine_palette, reuse_palette](const Framebuffer &fb,
+                                              OutBuffer *out) {
+        WriteStringToOutBuffer("\033Pq", out);  // Start sixel data
+        sixel_output_t *sixel_out = nullptr;
+        sixel_output_new(&sixel_out, WriteToOutBuffer, out, nullptr);
+
+        // Encoding of the frame determining the palette was queued
+        // before us, so it is already in progress.
+        Palette palette;
+        if (reuse_palette.valid()) palette = reuse_palette.get();
 
-            sixel_dither_t *sixel_dither = nullptr;
+        sixel_dither_t *sixel_dither = nullptr;
+        if (!palette.empty()) {
+            sixel_dither_new(&sixel_dither, palette.size() / 3, nullptr);
+            sixel_dither_set_palette(sixel_dither, palette.data());
+            sixel_dither_set_pixelformat(sixel_dither,
+                                         SIXEL_PIXELFORMAT_RGBA8888);
+        }
+        else {
             sixel_dither_new(&sixel_dither, 256, nullptr);
             sixel_dither_initialize(
-                sixel_dither, (unsigned char *)fb->begin(), fb->width(),
-                fb->height(), SIXEL_PIXELFORMAT_RGBA8888, SIXEL_LARGE_LUM,
+                sixel_dither, (unsigned char *)fb.begin(), fb.width(),
+                fb.height(), SIXEL_PIXELFORMAT_RGBA8888, SIXEL_LARGE_LUM,
                 SIXEL_REP_AVERAGE_COLORS, SIXEL_QUALITY_AUTO);
+        }
+        if (determine_palette) {
+            // Always provide a value; empty makes users compute their own.
+            const unsigned char *colors =
+                sixel_dither_get_palette(sixel_dither);
+            const int count =
+                sixel_dither_get_num_of_palette_colors(sixel_dither);
+            determine_palette->set_value(
+                colors ? Palette(colors, colors + 3 * count) : Palette());
+        }
 
-            sixel_encode((unsigned char *)fb->begin(), fb->width(),
-                         fb->height(), 0, sixel_dither, sixel_out);
+        sixel_encode((unsigned char *)fb.begin(), fb.width(), fb.height(), 0,
+                     sixel_dither, sixel_out);
 
-            sixel_dither_destroy(sixel_dither);
-            sixel_output_destroy(sixel_out);
+        sixel_dither_destroy(sixel_dither);
+        sixel_output_destroy(sixel_out);
 
-            WriteStringToOutBuffer("\033\\", &out);  // end sixel data
-            WriteStringToOutBuffer(cursor_handling_end, &out);
-            return out;
-        };
-    write_sequencer_->WriteBuffer(executor_->ExecAsync(encode_fun), seq_type,
-                                  end_of_frame);
+        WriteStringToOutBuffer("\033\\", out);  // end sixel data
+    };
 }
+#endif
 
 int SixelCanvas::cell_height_for_pixels(int pixels) const {
     assert(pixels <= 0);  // Currently only use-case
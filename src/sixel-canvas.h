@@ -16,6 +16,11 @@
 #ifndef SIXEL_CANVAS_H
 #define SIXEL_CANVAS_H
 
+#include <array>
+#include <functional>
+#include <future>
+#include <vector>
+
 #include "buffered-write-sequencer.h"
 #include "display-options.h"
 #include "framebuffer.h"
@@ -37,10 +42,32 @@ public:
               SeqType sequence_type, Duration end_of_frame) override;
 
 private:
+    // Appends the sixel sequence of a framebuffer to the OutBuffer.
+    using EncodeFunction =
+        std::function<void(const Framebuffer &fb, OutBuffer *out)>;
+
     const DisplayOptions &options_;
     ThreadPool *const executor_;
+    const bool use_builtin_encoder_;  // Even if we have libsixel.
     const char *cursor_move_before_;
     const char *cursor_move_after_;
+
+#ifdef WITH_TIMG_LIBSIXEL
+    // Coarse color distribution of a frame to detect scene changes.
+    using Histogram = std::array<int, 64>;
+    using Palette   = std::vector<unsigned char>;  // RGB triplets.
+
+    // Returns function encoding "fb" with libsixel.
+    EncodeFunction CreateLibsixelEncoder(const Framebuffer &fb,
+                                         SeqType seq_type);
+
+    // Computing the palette is the expensive part of sixel encoding. In
+    // animations, it is only done on the first frame or if the scene
+    // changes; following frames use it once that frame's encoding
+    // determined it.
+    std::shared_future<Palette> animation_palette_;
+    Histogram palette_histogram_;
+#endif
 };
 }  // namespace timg
 #endif  // SIXEL_CANVAS_H
@@ -0,0 +1,195 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// (c) 2024 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#include "sixel-encoder.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "buffered-write-sequencer.h"
+#include "framebuffer.h"
+
+namespace timg {
+namespace {
+// Levels per channel of the color cube. Green gets one more, as the eye is
+// most sensitive to it.
+constexpr int kRedLevels   = 6;
+constexpr int kGreenLevels = 7;
+constexpr int kBlueLevels  = 6;
+constexpr int kColors      = kRedLevels * kGreenLevels * kBlueLevels;
+constexpr uint8_t kTransparent = 0xff;  // Index higher than any color.
+static_assert(kColors < kTransparent, "Palette index needs to fit in byte");
+
+// 4x4 Bayer matrix for ordered dithering.
+constexpr uint8_t kBayer[4][4] = {
+    {0, 8, 2, 10},
+    {12, 4, 14, 6},
+    {3, 11, 1, 9},
+    {15, 7, 13, 5},
+};
+
+// Quantize channel "value" to one of "levels", offset by the dither
+// threshold "bayer", that is in the range [0..15].
+inline int Quantize(int value, int levels, int bayer) {
+    const int q = (value * (levels - 1) * 32 + (2 * bayer + 1) * 255) /
+                  (255 * 32);
+    return q < levels ? q : levels - 1;
+}
+
+// Output writer with no bounds checks; callers Reserve() what they need.
+class Writer {
+public:
+    explicit Writer(OutBuffer *out) : out_(out) {}
+
+    void Reserve(size_t bytes) { out_->Reserve(bytes); }
+
+    void Append(const char *str, size_t len) {
+        memcpy(out_->data + out_->size, str, len);
+        out_->size += len;
+    }
+    void Append(char c) { out_->data[out_->size++] = c; }
+
+    void AppendNumber(int n) {
+        char digits[16];
+        int len = 0;
+        do {
+            digits[len++] = '0' + n % 10;
+            n /= 10;
+        } while (n);
+        while (len) Append(digits[--len]);
+    }
+
+    // Sixel character "c", repeated "count" times.
+    void AppendRun(char c, int count) {
+        if (count > 3) {
+            Append('!');
+            AppendNumber(count);
+            Append(c);
+        }
+        else {
+            while (count--) Append(c);
+        }
+    }
+
+private:
+    OutBuffer *const out_;
+};
+}  // namespace
+
+void EncodeSixel(const Framebuffer &fb, OutBuffer *out) {
+    const int width  = fb.width();
+    const int height = fb.height();
+
+    // Map to palette indices.
+    std::vector<uint8_t> indices((size_t)width * height);
+    bool used[kColors] = {};
+    uint8_t *index     = indices.data();
+    for (int y = 0; y < height; ++y) {
+        const rgba_t *pixel = fb.row(y);
+        for (int x = 0; x < width; ++x, ++pixel, ++index) {
+            if (pixel->a < 0x80) {
+                *index = kTransparent;
+                continue;
+            }
+            const int bayer = kBayer[y & 3][x & 3];
+            const int r     = Quantize(pixel->r, kRedLevels, bayer);
+            const int g     = Quantize(pixel->g, kGreenLevels, bayer);
+            const int b     = Quantize(pixel->b, kBlueLevels, bayer);
+            *index          = (r * kGreenLevels + g) * kBlueLevels + b;
+            used[*index]    = true;
+        }
+    }
+
+    Writer w(out);
+
+    // Unset pixels stay transparent; 1:1 pixel aspect ratio.
+    char header[64];
+    const int header_len = snprintf(header, sizeof(header),
+                                    "\033P0;1;0q\"1;1;%d;%d", width, height);
+    w.Reserve(header_len + kColors * 20);
+    w.Append(header, header_len);
+    for (int c = 0; c < kColors; ++c) {
+        if (!used[c]) continue;
+        const int r = c / (kGreenLevels * kBlueLevels);
+        const int g = c / kBlueLevels % kGreenLevels;
+        const int b = c % kBlueLevels;
+        w.Append('#');
+        w.AppendNumber(c);
+        w.Append(";2;", 3);  // RGB, in percent.
+        w.AppendNumber(r * 100 / (kRedLevels - 1));
+        w.Append(';');
+        w.AppendNumber(g * 100 / (kGreenLevels - 1));
+        w.Append(';');
+        w.AppendNumber(b * 100 / (kBlueLevels - 1));
+    }
+
+    // Each band of six rows is emitted color by color. For each color, we
+    // collect the six bits per column and the range of columns it occurs in,
+    // so that we only need to look at these.
+    std::vector<uint8_t> bits((size_t)kColors * width);
+    int first[kColors], last[kColors];
+    for (int band = 0; band < height; band += 6) {
+        if (band > 0) {
+            w.Reserve(1);
+            w.Append('-');  // Next band.
+        }
+        for (int c = 0; c < kColors; ++c) first[c] = -1;
+        const int rows = std::min(6, height - band);
+        for (int row = 0; row < rows; ++row) {
+            const uint8_t *index_row = &indices[(size_t)(band + row) * width];
+            for (int x = 0; x < width; ++x) {
+                const uint8_t c = index_row[x];
+                if (c == kTransparent) continue;
+                bits[(size_t)c * width + x] |= 1 << row;
+                if (first[c] < 0) {
+                    first[c] = last[c] = x;
+                }
+                else {
+                    first[c] = std::min(first[c], x);
+                    last[c]  = std::max(last[c], x);
+                }
+            }
+        }
+
+        bool first_color = true;
+        for (int c = 0; c < kColors; ++c) {
+            if (first[c] < 0) continue;
+            uint8_t *const color_bits = &bits[(size_t)c * width];
+            // Worst case: every column a different character.
+            w.Reserve(16 + last[c] + 1);
+            if (!first_color) w.Append('$');  // Back to start of band.
+            first_color = false;
+            w.Append('#');
+            w.AppendNumber(c);
+            w.AppendRun('?', first[c]);  // Skip to first column used.
+            for (int x = first[c]; x <= last[c];) {
+                const uint8_t value = color_bits[x];
+                int run             = 1;
+                while (x + run <= last[c] && color_bits[x + run] == value) {
+                    ++run;
+                }
+                w.AppendRun('?' + value, run);
+                x += run;
+            }
+            memset(color_bits + first[c], 0, last[c] - first[c] + 1);
+        }
+    }
+    w.Reserve(2);
+    w.Append("\033\\", 2);
+}
+}  // namespace timg
@@ -0,0 +1,34 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// (c) 2024 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#ifndef SIXEL_ENCODER_H
+#define SIXEL_ENCODER_H
+
+#include "buffered-write-sequencer.h"
+#include "framebuffer.h"
+
+namespace timg {
+// Built-in sixel encoder that does not need libsixel.
+//
+// Quantizes against a fixed 6x7x6 color cube with ordered dithering: the
+// nearest color is a direct computation instead of a search and no
+// palette needs to be determined, so this is fast enough for video.
+// Pixels with an alpha value below 50% are left transparent.
+//
+// Appends the complete sixel sequence (DCS ... ST) for "fb" to "out".
+void EncodeSixel(const Framebuffer &fb, OutBuffer *out);
+}  // namespace timg
+
+#endif  // SIXEL_ENCODER_H
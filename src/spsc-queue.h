@@ -0,0 +1,108 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// (c) 2024 Henner Zeller <h.zeller@acm.org>
+//
+// timg - a terminal image viewer.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+//
+#ifndef TIMG_SPSC_QUEUE
+#define TIMG_SPSC_QUEUE
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <utility>
+
+namespace timg {
+// Bounded FIFO for exactly one producer thread and one consumer thread,
+// implemented as ring-buffer.
+//
+// Pushing and popping is lock-free. Only if the queue is full (or empty)
+// and one side needs to go to sleep, a mutex is involved to wake it up
+// once the other side made progress.
+template <class T>
+class SpscQueue {
+public:
+    explicit SpscQueue(size_t capacity)
+        : capacity_(capacity), slots_(new T[capacity]) {}
+    SpscQueue(const SpscQueue &) = delete;
+    ~SpscQueue() { delete[] slots_; }
+
+    // -- Producer side
+
+    // Add element to the end of queue, blocking while the queue is full.
+    void Push(T &&value) {
+        const size_t head = head_.load(std::memory_order_relaxed);
+        WaitUntil([this, head]() { return head - tail_.load() < capacity_; });
+        slots_[head % capacity_] = std::move(value);
+        head_.store(head + 1);
+        WakeWaiting();
+    }
+
+    // -- Consumer side
+
+    // Return the oldest element or nullptr if the queue is empty. The
+    // element stays in the queue until Pop() is called.
+    T *Front() {
+        const size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail == head_.load()) return nullptr;
+        return &slots_[tail % capacity_];
+    }
+
+    // Like Front(), but block until an element is available.
+    T *WaitFront() {
+        const size_t tail = tail_.load(std::memory_order_relaxed);
+        WaitUntil([this, tail]() { return tail != head_.load(); });
+        return &slots_[tail % capacity_];
+    }
+
+    // Remove the element previously returned by Front()/WaitFront().
+    void Pop() {
+        const size_t tail        = tail_.load(std::memory_order_relaxed);
+        slots_[tail % capacity_] = T();
+        tail_.store(tail + 1);
+        WakeWaiting();
+    }
+
+private:
+    // The sequentially consistent access of head_, tail_ and waiting_
+    // guarantees that either the waiting side sees the update or
+    // the updating side sees that someone is waiting.
+    template <class Predicate>
+    void WaitUntil(const Predicate &ready) {
+        if (ready()) return;
+        std::unique_lock<std::mutex> l(lock_);
+        waiting_.fetch_add(1);
+        cv_.wait(l, ready);
+        waiting_.fetch_sub(1);
+    }
+
+    void WakeWaiting() {
+        if (waiting_.load() == 0) return;
+        { std::lock_guard<std::mutex> l(lock_); }  // Waiter is in wait()
+        cv_.notify_all();
+    }
+
+    const size_t capacity_;
+    T *const slots_;
+    std::atomic<size_t> head_{0};  // Next to write. Modified by producer.
+    std::atomic<size_t> tail_{0};  // Next to read. Modified by consumer.
+
+    std::atomic<int> waiting_{0};
+    std::mutex lock_;
+    std::condition_variable cv_;
+};
+}  // namespace timg
+
+#endif  // TIMG_SPSC_QUEUE
@@ -25,6 +25,7 @@
 #include "display-options.h"
 #include "framebuffer.h"
 #include "image-source.h"
+#include "pipeline-stats.h"
 #include "renderer.h"
 #include "stb/stb_image.h"
 #include "timg-time.h"
@@ -38,10 +39,11 @@
 #if STB_RESIZE_VERSION2
 #include "stb/stb_image_resize2.h"
 inline void stb_resize_image(const unsigned char *input_pixels, int input_w,
-                             int input_h, unsigned char *output_pixels,
-                             int output_w, int output_h) {
+                             int input_h, int input_stride,
+                             unsigned char *output_pixels, int output_w,
+                             int output_h) {
     static constexpr stbir_pixel_layout kFramebufferFormat = STBIR_RGBA;
-    stbir_resize_uint8_linear(input_pixels, input_w, input_h, 0,  //
+    stbir_resize_uint8_linear(input_pixels, input_w, input_h, input_stride,
                               output_pixels, output_w, output_h, 0,
                               kFramebufferFormat);
 }
@@ -49,10 +51,11 @@ inline void stb_resize_image(const unsigned char *input_pixels, int input_w,
 #else
 #include "stb/stb_image_resize.h"
 inline void stb_resize_image(const unsigned char *input_pixels, int input_w,
-                             int input_h, unsigned char *output_pixels,
-                             int output_w, int output_h) {
-    static constexpr int kFramebufferFormat = 4;              // RGBA.
-    stbir_resize_uint8(input_pixels, input_w, input_h, 0,     //
+                             int input_h, int input_stride,
+                             unsigned char *output_pixels, int output_w,
+                             int output_h) {
+    static constexpr int kFramebufferFormat = 4;  // RGBA.
+    stbir_resize_uint8(input_pixels, input_w, input_h, input_stride,
                        output_pixels, output_w, output_h, 0,  //
                        kFramebufferFormat);
 }
@@ -63,37 +66,31 @@ inline void stb_resize_image(const unsigned char *input_pixels, int input_w,
 
 static constexpr int kDesiredChannels = 4;  // RGBA, our framebuffer format
 namespace timg {
-class STBImageSource::PreprocessedFrame {
-public:
-    PreprocessedFrame(const uint8_t *image_data, int source_w, int source_h,
-                      int target_w, int target_h, const Duration &delay,
-                      const DisplayOptions &opt)
-        : delay_(delay), framebuffer_(target_w, target_h) {
-        stb_resize_image(image_data, source_w, source_h,
-                         (uint8_t *)framebuffer_.begin(), target_w, target_h);
-        framebuffer_.AlphaComposeBackground(
-            opt.bgcolor_getter, opt.bg_pattern_color,
-            opt.pattern_size * opt.cell_x_px,
-            opt.pattern_size * opt.cell_y_px / 2);
+// Scale and prepare a frame to be sent.
+// Rows of "image_data" are "source_stride" bytes apart; 0 if packed.
+static Framebuffer PrepareFrame(const uint8_t *image_data, int source_w,
+                                int source_h, int source_stride, int target_w,
+                                int target_h, const DisplayOptions &opt) {
+    Framebuffer result(target_w, target_h);
+    {
+        PipelineStats::Scope timing(Stage::kScale);
+        stb_resize_image(image_data, source_w, source_h, source_stride,
+                         (uint8_t *)result.begin(), target_w, target_h);
     }
-    Duration delay() const { return delay_; }
-    const timg::Framebuffer &framebuffer() const { return framebuffer_; }
-
-private:
-    const Duration delay_;
-    timg::Framebuffer framebuffer_;
-};
+    result.AlphaComposeBackground(opt.bgcolor_getter, opt.bg_pattern_color,
+                                  opt.pattern_size * opt.cell_x_px,
+                                  opt.pattern_size * opt.cell_y_px / 2);
+    return result;
+}
 
 STBImageSource::STBImageSource(const std::string &filename)
     : ImageSource(filename) {}
 
-STBImageSource::~STBImageSource() {
-    for (PreprocessedFrame *f : frames_) delete f;
-}
+STBImageSource::~STBImageSource() = default;
 
 std::string STBImageSource::FormatTitle(
     const std::string &format_string) const {
-    return FormatFromParameters(format_string, filename_, orig_width_,
+    return FormatFromParameters(format_string, display_name(), orig_width_,
                                 orig_height_, "stb");
 }
 
@@ -102,6 +99,7 @@ std::string STBImageSource::FormatTitle(
 // this is not an issue.
 bool STBImageSource::LoadAndScale(const DisplayOptions &options,
                                   int frame_offset, int frame_count) {
+    options_ = options;
 #ifdef WITH_TIMG_VIDEO
     if (LooksLikeAPNG(filename())) {
         return false;  // STB can't apng animate. Let Video do it.
@@ -131,9 +129,9 @@ bool STBImageSource::LoadAndScale(const DisplayOptions &options,
 
             CalcScaleToFitDisplay(gdata.w, gdata.h, options, false,
                                   &target_width, &target_height);
-            frames_.push_back(new PreprocessedFrame(
-                data, gdata.w, gdata.h, target_width, target_height,
-                Duration::Millis(gdata.delay), options));
+            frames_.Append(PrepareFrame(data, gdata.w, gdata.h, 0,
+                                        target_width, target_height, options),
+                           Duration::Millis(gdata.delay));
         }
         STBI_FREE(gdata.out);
         STBI_FREE(gdata.history);
@@ -151,10 +149,21 @@ bool STBImageSource::LoadAndScale(const DisplayOptions &options,
         orig_width_  = w;
         orig_height_ = h;
 
-        CalcScaleToFitDisplay(w, h, options, false, &target_width,
-                              &target_height);
-        frames_.push_back(new PreprocessedFrame(
-            data, w, h, target_width, target_height, Duration(), options));
+        // Cropping only needs to look at the pixels, scaling then starts
+        // at the top left of the region with the original row stride.
+        Rect crop = {0, 0, w, h};
+        if (options.crop_border > 0 || options.auto_crop) {
+            crop = CropRegion((const rgba_t *)data, w, h, w, options);
+        }
+
+        CalcScaleToFitDisplay(crop.width, crop.height, options, false,
+                              &target_width, &target_height);
+        frames_.Append(
+            PrepareFrame(
+                data + ((size_t)crop.y * w + crop.x) * kDesiredChannels,
+                crop.width, crop.height, w * kDesiredChannels, target_width,
+                target_height, options),
+            Duration());
         stbi_image_free(data);
     }
 
@@ -173,6 +182,12 @@ bool STBImageSource::LoadAndScale(const DisplayOptions &options,
 void STBImageSource::SendFrames(const Duration &duration, int loops,
                                 const volatile sig_atomic_t &interrupt_received,
                                 const Renderer::WriteFramebufferFun &sink) {
+    if (options_.scroll_animation) {
+        // Like other formats, only the first frame of animations scrolls.
+        ScrollImage(frames_.Get(0), options_, duration, loops,
+                    interrupt_received, sink);
+        return;
+    }
     int last_height         = -1;  // First image emit will not have a height.
     const bool is_animation = frames_.size() > 1;
     if (frames_.size() == 1 || !is_animation)
@@ -188,8 +203,8 @@ void STBImageSource::SendFrames(const Duration &duration, int loops,
                     time_from_first_frame < duration;
          ++k) {
         for (int f = 0; f < max_frames_ && !interrupt_received; ++f) {
-            const auto &frame = frames_[f];
-            time_from_first_frame.Add(frame->delay());
+            const Framebuffer &frame = frames_.Get(f);
+            time_from_first_frame.Add(frames_.delay(f));
             const int dx = indentation_;
             const int dy = is_animation && last_height > 0 ? -last_height : 0;
             SeqType seq_type = SeqType::FrameImmediate;
@@ -197,9 +212,9 @@ void STBImageSource::SendFrames(const Duration &duration, int loops,
                 seq_type = is_first ? SeqType::StartOfAnimation
                                     : SeqType::AnimationFrame;
             }
-            sink(dx, dy, frame->framebuffer(), seq_type,
+            sink(dx, dy, frame, seq_type,
                  std::min(time_from_first_frame, duration));
-            last_height = frame->framebuffer().height();
+            last_height = frame.height();
             if (time_from_first_frame > duration) break;
             is_first = false;
         }
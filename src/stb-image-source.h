@@ -18,8 +18,8 @@
 
 #include <csignal>
 #include <string>
-#include <vector>
 
+#include "compact-frames.h"
 #include "display-options.h"
 #include "image-source.h"
 #include "renderer.h"
@@ -47,9 +47,11 @@ public:
 
     std::string FormatTitle(const std::string &format_string) const final;
 
+    int FramesPerLoop() const final { return max_frames_; }
+
 private:
-    class PreprocessedFrame;
-    std::vector<PreprocessedFrame *> frames_;
+    DisplayOptions options_;
+    CompactFrames frames_;
     int orig_width_, orig_height_;
     int max_frames_  = 1;
     int indentation_ = 0;
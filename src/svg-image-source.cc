@@ -23,6 +23,7 @@
 #include <string>
 
 #include "buffered-write-sequencer.h"
+#include "decoder-process-pool.h"
 #include "display-options.h"
 #include "framebuffer.h"
 #include "renderer.h"
@@ -34,7 +35,8 @@
 // call stack of rsvg_handle_render_document().
 //
 // Workaound: add a global mutex around rsvg_handle_render_document(), which
-// fixes it.
+// fixes it. To still render in parallel, use --decode-processes, which
+// renders in separate single-threaded processes instead.
 //
 // TODO: figure out what the issue is, file bug upstream and make this
 // macro dependent on Cairo and RSVG Version macros if it is known which
@@ -49,60 +51,29 @@ namespace timg {
 
 std::string SVGImageSource::FormatTitle(
     const std::string &format_string) const {
-    return FormatFromParameters(format_string, filename_, (int)orig_width_,
+    return FormatFromParameters(format_string, display_name(), (int)orig_width_,
                                 (int)orig_height_, "svg");
 }
 
-bool SVGImageSource::LoadAndScale(const DisplayOptions &opts, int, int) {
-    options_        = opts;
-    RsvgHandle *svg = rsvg_handle_new_from_file(filename_.c_str(), nullptr);
-    if (!svg) return false;
-
-    RsvgRectangle viewbox;
-    gboolean out_has_width, out_has_height, out_has_viewbox;
-    RsvgLength svg_width, svg_height;
-    rsvg_handle_get_intrinsic_dimensions(svg, &out_has_width, &svg_width,
-                                         &out_has_height, &svg_height,
-                                         &out_has_viewbox, &viewbox);
-    if (out_has_viewbox) {
-        orig_width_  = viewbox.width;
-        orig_height_ = viewbox.height;
-    }
-    else if (out_has_width && out_has_height) {
-        // We ignore the unit, but this will still result in proper aspect ratio
-        orig_width_  = svg_width.length;
-        orig_height_ = svg_height.length;
-    }
-
-    // Filter out suspicious dimensions
-    if (orig_width_ <= 0 || orig_width_ > 1e6 || orig_height_ <= 0 ||
-        orig_height_ > 1e6) {
-        g_object_unref(svg);
-        return false;
-    }
-
-    int target_width;
-    int target_height;
-    CalcScaleToFitDisplay(orig_width_, orig_height_, opts, false, &target_width,
-                          &target_height);
-
+// Render document of size "orig_width" x "orig_height" to fill "out".
+static bool RenderDocument(RsvgHandle *svg, double orig_width,
+                           double orig_height, Framebuffer *out) {
     const auto kCairoFormat = CAIRO_FORMAT_ARGB32;
-    int stride = cairo_format_stride_for_width(kCairoFormat, target_width);
-    image_.reset(new timg::Framebuffer(stride / 4, target_height));
+    const int width         = out->width();
+    const int height        = out->height();
+    const int stride = cairo_format_stride_for_width(kCairoFormat, width);
 
     cairo_surface_t *surface = cairo_image_surface_create_for_data(
-        (uint8_t *)image_->begin(), kCairoFormat, target_width, target_height,
-        stride);
+        (uint8_t *)out->begin(), kCairoFormat, width, height, stride);
     cairo_t *cr = cairo_create(surface);
-    cairo_scale(cr, 1.0 * target_width / orig_width_,
-                1.0 * target_height / orig_height_);
+    cairo_scale(cr, 1.0 * width / orig_width, 1.0 * height / orig_height);
     cairo_save(cr);
 
     RsvgRectangle viewport = {
         .x      = 0.0,  // TODO: could we have an offset ?
         .y      = 0.0,
-        .width  = orig_width_,
-        .height = orig_height_,
+        .width  = orig_width,
+        .height = orig_height,
     };
 
 #if RSVG_THREADSAFE_ISSUE
@@ -118,15 +89,114 @@ bool SVGImageSource::LoadAndScale(const DisplayOptions &opts, int, int) {
 
     cairo_destroy(cr);
     cairo_surface_destroy(surface);
-    g_object_unref(svg);
 
     // Cairo stores A (high-byte), R, G, B (low-byte). We need ABGR.
-    for (rgba_t &pixel : *image_) {
+    for (rgba_t &pixel : *out) {
         std::swap(pixel.r, pixel.b);
     }
 
     // TODO: if there ever could be the condition of
     // int(stride / sizeof(rgba_t)) != render_width (for alignment?) : copy over
+    return success;
+}
+
+// Get the size of the document, if it is sensible.
+static bool DocumentSize(RsvgHandle *svg, double *width, double *height) {
+    RsvgRectangle viewbox;
+    gboolean out_has_width, out_has_height, out_has_viewbox;
+    RsvgLength svg_width, svg_height;
+    rsvg_handle_get_intrinsic_dimensions(svg, &out_has_width, &svg_width,
+                                         &out_has_height, &svg_height,
+                                         &out_has_viewbox, &viewbox);
+    *width = *height = 0;
+    if (out_has_viewbox) {
+        *width  = viewbox.width;
+        *height = viewbox.height;
+    }
+    else if (out_has_width && out_has_height) {
+        // We ignore the unit, but this will still result in proper aspect ratio
+        *width  = svg_width.length;
+        *height = svg_height.length;
+    }
+
+    // Filter out suspicious dimensions
+    return *width > 0 && *width <= 1e6 && *height > 0 && *height <= 1e6;
+}
+
+// These run in a DecoderProcessPool worker, which is single-threaded, so
+// the mutex above is never contended there.
+static bool MeasureInWorker(const char *filename, double *results) {
+    RsvgHandle *svg = rsvg_handle_new_from_file(filename, nullptr);
+    if (!svg) return false;
+    const bool success = DocumentSize(svg, &results[0], &results[1]);
+    g_object_unref(svg);
+    return success;
+}
+
+static bool RenderInWorker(const char *filename, const double *args,
+                           Framebuffer *out) {
+    RsvgHandle *svg = rsvg_handle_new_from_file(filename, nullptr);
+    if (!svg) return false;
+    const bool success = RenderDocument(svg, args[0], args[1], out);
+    g_object_unref(svg);
+    return success;
+}
+
+// Parse and render in a worker, so that this scales across processes, and
+// a crash in cairo or rsvg only takes down the worker. Returns kNoWorker
+// if there is none (left); it is up to us to do it then.
+DecoderProcessPool::Result SVGImageSource::LoadInWorker(
+    const DisplayOptions &opts) {
+    using Result = DecoderProcessPool::Result;
+    double size[DecoderProcessPool::kMaxArgs] = {};
+    Result result = DecoderProcessPool::Query(MeasureInWorker, filename_, size);
+    if (result != Result::kSuccess) return result;
+    orig_width_  = size[0];
+    orig_height_ = size[1];
+
+    int target_width;
+    int target_height;
+    CalcScaleToFitDisplay(orig_width_, orig_height_, opts, false, &target_width,
+                          &target_height);
+    const int stride =
+        cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, target_width);
+    const double args[DecoderProcessPool::kMaxArgs] = {orig_width_,
+                                                       orig_height_};
+    image_ = DecoderProcessPool::Render(RenderInWorker, filename_, stride / 4,
+                                        target_height,
+                                        Framebuffer::Layout::kPacked, args,
+                                        &result);
+    return result;
+}
+
+bool SVGImageSource::LoadAndScale(const DisplayOptions &opts, int, int) {
+    options_ = opts;
+
+    using Result = DecoderProcessPool::Result;
+    Result result = Result::kNoWorker;
+    if (DecoderProcessPool::Enabled()) result = LoadInWorker(opts);
+    if (result == Result::kFailed) return false;
+
+    if (result == Result::kNoWorker) {
+        RsvgHandle *svg = rsvg_handle_new_from_file(filename_.c_str(), nullptr);
+        if (!svg) return false;
+        if (!DocumentSize(svg, &orig_width_, &orig_height_)) {
+            g_object_unref(svg);
+            return false;
+        }
+
+        int target_width;
+        int target_height;
+        CalcScaleToFitDisplay(orig_width_, orig_height_, opts, false,
+                              &target_width, &target_height);
+        const int stride =
+            cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, target_width);
+        image_.reset(new timg::Framebuffer(stride / 4, target_height));
+        const bool success =
+            RenderDocument(svg, orig_width_, orig_height_, image_.get());
+        g_object_unref(svg);
+        if (!success) return false;
+    }
 
     // If requested, merge background with pattern.
     image_->AlphaComposeBackground(
@@ -134,7 +204,7 @@ bool SVGImageSource::LoadAndScale(const DisplayOptions &opts, int, int) {
         options_.pattern_size * options_.cell_x_px,
         options_.pattern_size * options_.cell_y_px / 2);
 
-    return success;
+    return true;
 }
 
 int SVGImageSource::IndentationIfCentered(
@@ -20,6 +20,7 @@
 #include <memory>
 #include <string>
 
+#include "decoder-process-pool.h"
 #include "display-options.h"
 #include "framebuffer.h"
 #include "image-source.h"
@@ -44,6 +45,9 @@ public:
 private:
     int IndentationIfCentered(const timg::Framebuffer &image) const;
 
+    // Load the image using the DecoderProcessPool.
+    DecoderProcessPool::Result LoadInWorker(const DisplayOptions &opts);
+
     DisplayOptions options_;
     double orig_width_, orig_height_;
     std::unique_ptr<timg::Framebuffer> image_;
@@ -18,6 +18,7 @@
 #include <fcntl.h>
 #include <string.h>  // NOLINT for memmem()
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/select.h>
 #include <termios.h>
 #include <unistd.h>
@@ -27,7 +28,10 @@
 #include <cstdlib>
 #include <ctime>
 #include <functional>
+#include <mutex>
+#include <string>
 
+#include "timg-base64.h"
 #include "timg-time.h"
 
 #define TERM_CSI "\033["
@@ -42,6 +46,140 @@ static void clean_up_terminal() {
     s_tty_fd = -1;
 }
 
+// There might be pipes and redirects.
+// Let's see if we have at least one file descriptor that is connected
+// to our terminal, so that we can open that terminal directly RD/WR.
+static const char *FindTtyPath() {
+    for (const int fd : {STDOUT_FILENO, STDERR_FILENO, STDIN_FILENO}) {
+        if (!isatty(fd)) continue;
+        const char *ttypath = ttyname(fd);
+        if (ttypath != nullptr) return ttypath;
+    }
+    return nullptr;
+}
+
+// Results of terminal queries remembered on disk. Each tty has its own file,
+// which is only used if the key matches, i.e. if it is still the same
+// session in the same kind of terminal.
+namespace {
+struct TermQueryCache {
+    std::string filename;  // Empty if not enabled.
+    std::string key;
+
+    bool has_background = false;
+    std::string background;  // Empty if the terminal did not answer.
+
+    bool has_cell_size = false;
+    int cell_width     = -1;
+    int cell_height    = -1;
+
+    bool has_graphics = false;
+    TermGraphicsInfo graphics;
+};
+}  // namespace
+static std::mutex s_cache_lock;
+static TermQueryCache s_cache;
+
+static std::string TermQueryCacheKey(const char *ttypath) {
+    std::string key = ttypath;
+    for (const char *env : {"TERM", "TERM_PROGRAM", "TMUX"}) {
+        const char *const value = getenv(env);
+        key.append(" ").append(value ? value : "-");
+    }
+    const bool ssh = getenv("SSH_CONNECTION") || getenv("SSH_CLIENT") ||
+                     getenv("SSH_TTY");
+    key.append(ssh ? " ssh" : " local");
+    // A tty is reused by a new terminal after the old one was closed.
+    key.append(" ").append(std::to_string(getsid(0)));
+    return key;
+}
+
+static void LoadTermQueryCache() {
+    FILE *f = fopen(s_cache.filename.c_str(), "r");
+    if (!f) return;
+    char line[1024];
+    bool key_matches = false;
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = '\0';
+        if (strncmp(line, "key ", 4) == 0) {
+            key_matches = (s_cache.key == line + 4);
+            continue;
+        }
+        if (!key_matches) break;
+        TermGraphicsInfo &g = s_cache.graphics;
+        int protocol, broken_sixel, tmux, kitty_frames, kitty_shm;
+        int kitty_placements;
+        char color[8];
+        if (strcmp(line, "background none") == 0) {
+            s_cache.has_background = true;
+        }
+        else if (sscanf(line, "background %7s", color) == 1) {
+            s_cache.has_background = true;
+            s_cache.background     = color;
+        }
+        else if (sscanf(line, "cell %d %d", &s_cache.cell_width,
+                        &s_cache.cell_height) == 2) {
+            s_cache.has_cell_size = true;
+        }
+        else if (sscanf(line, "graphics %d %d %d %d %d %d", &protocol,
+                        &broken_sixel, &tmux, &kitty_frames, &kitty_shm,
+                        &kitty_placements) == 6) {
+            s_cache.has_graphics                  = true;
+            g.preferred_graphics                  = (GraphicsProtocol)protocol;
+            g.known_broken_sixel_cursor_placement = broken_sixel;
+            g.in_tmux                             = tmux;
+            g.kitty_animation_frames              = kitty_frames;
+            g.kitty_shared_memory                 = kitty_shm;
+            g.kitty_placements                    = kitty_placements;
+        }
+    }
+    fclose(f);
+}
+
+// Write all we know. Needs to be called with s_cache_lock held.
+static void StoreTermQueryCache() {
+    if (s_cache.filename.empty()) return;
+    // Write to a temporary file first, so that timg running in parallel
+    // never reads a partial file.
+    const std::string tmp =
+        s_cache.filename + "." + std::to_string(getpid());
+    FILE *f = fopen(tmp.c_str(), "w");
+    if (!f) return;
+    fprintf(f, "key %s\n", s_cache.key.c_str());
+    if (s_cache.has_background) {
+        fprintf(f, "background %s\n", s_cache.background.empty()
+                                          ? "none"
+                                          : s_cache.background.c_str());
+    }
+    if (s_cache.has_cell_size) {
+        fprintf(f, "cell %d %d\n", s_cache.cell_width, s_cache.cell_height);
+    }
+    if (s_cache.has_graphics) {
+        const TermGraphicsInfo &g = s_cache.graphics;
+        fprintf(f, "graphics %d %d %d %d %d %d\n", (int)g.preferred_graphics,
+                g.known_broken_sixel_cursor_placement, g.in_tmux,
+                g.kitty_animation_frames, g.kitty_shared_memory,
+                g.kitty_placements);
+    }
+    const bool success = (fclose(f) == 0);
+    if (!success || rename(tmp.c_str(), s_cache.filename.c_str()) != 0) {
+        unlink(tmp.c_str());
+    }
+}
+
+void EnableTermQueryCache(const std::string &cache_dir, bool refresh) {
+    const char *const ttypath = FindTtyPath();
+    if (cache_dir.empty() || !ttypath) return;
+    std::unique_lock<std::mutex> l(s_cache_lock);
+    char name[32];
+    snprintf(name, sizeof(name), "/term-%016zx",
+             std::hash<std::string>()(ttypath));
+    s_cache          = {};
+    s_cache.filename = cache_dir + name;
+    s_cache.key      = TermQueryCacheKey(ttypath);
+    if (!refresh) LoadTermQueryCache();
+}
+
 // Send "query" to terminal and wait for response to arrive within
 // "time_budget". Use "buffer" with "len" to store results.
 // Whenever new data arrives, the caller's "response_found_p" response finder
@@ -55,15 +193,7 @@ static const char *QueryTerminal(const char *query, char *const buffer,
                                  const size_t buflen,
                                  const Duration &time_budget,
                                  const ResponseFinder &response_found_p) {
-    // There might be pipes and redirects.
-    // Let's see if we have at least one file descriptor that is connected
-    // to our terminal. We can then open that terminal directly RD/WR.
-    const char *ttypath = nullptr;
-    for (const int fd : {STDOUT_FILENO, STDERR_FILENO, STDIN_FILENO}) {
-        if (!isatty(fd)) continue;
-        ttypath = ttyname(fd);
-        if (ttypath != nullptr) break;
-    }
+    const char *const ttypath = FindTtyPath();
     if (!ttypath) return nullptr;
     s_tty_fd = open(ttypath, O_RDWR);
     if (s_tty_fd < 0) return nullptr;
@@ -133,7 +263,7 @@ static const char *find_str(const char *haystack, int64_t len, const char *s) {
 
 // Read background color queried from terminal emulator.
 // Might leak a file-descriptor when bailing out early. Accepted for brevity.
-const char *QueryBackgroundColor() {
+static const char *QueryBackgroundColorFromTerminal() {
     // The response might take a while. Typically, this should be only a
     // few milliseconds, but there can be situations over slow ssh
     // connections or very slow machines where it takes a little.
@@ -194,11 +324,63 @@ const char *QueryBackgroundColor() {
     return result;
 }
 
-TermGraphicsInfo QuerySupportedGraphicsProtocol() {
+const char *QueryBackgroundColor() {
+    std::unique_lock<std::mutex> l(s_cache_lock);
+    if (!s_cache.has_background) {
+        l.unlock();  // Don't block others while waiting for the terminal.
+        const char *const color = QueryBackgroundColorFromTerminal();
+        l.lock();
+        s_cache.has_background = true;
+        s_cache.background     = color ? color : "";
+        StoreTermQueryCache();
+    }
+    static char result[8];
+    snprintf(result, sizeof(result), "%s", s_cache.background.c_str());
+    return s_cache.background.empty() ? nullptr : result;
+}
+
+// Ask a kitty protocol terminal to load a one-pixel image from a shared
+// memory object. It only replies OK if it could read it, which is not the
+// case if it runs on another machine or in a sandbox.
+static bool KittyReadsSharedMemory(char *buffer, size_t buflen,
+                                   const Duration &time_budget) {
+    char name[32];
+    snprintf(name, sizeof(name), "/timg-probe-%d", getpid());
+    const int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) return false;
+    const char pixel[3] = {0, 0, 0};  // f=24: RGB
+    const bool written  = (write(fd, pixel, sizeof(pixel)) == sizeof(pixel));
+    close(fd);
+
+    bool success = false;
+    if (written) {
+        char query[128];
+        char *pos = query;
+        pos += sprintf(pos, "\033_Gi=31,s=1,v=1,a=q,t=s,f=24;");
+        pos = timg::EncodeBase64(name, strlen(name), pos);
+        // Followed by DSR 5, so that we don't have to wait for the timeout
+        // if the terminal does not reply.
+        strcpy(pos, "\033\\" TERM_CSI "5n");
+        QueryTerminal(query, buffer, buflen, time_budget,
+                      [&success](const char *data, size_t len) {
+                          if (find_str(data, len, "\033_Gi=31;OK")) {
+                              success = true;
+                          }
+                          return find_str(data, len, TERM_CSI "0");
+                      });
+    }
+    shm_unlink(name);  // The terminal only removes it if it read it.
+    return success;
+}
+
+static TermGraphicsInfo QueryGraphicsFromTerminal() {
     TermGraphicsInfo result;
     result.preferred_graphics                  = GraphicsProtocol::kNone;
     result.known_broken_sixel_cursor_placement = false;
     result.in_tmux                             = false;
+    result.kitty_animation_frames              = false;
+    result.kitty_shared_memory                 = false;
+    result.kitty_placements                    = false;
 
     // Environment variables can be changed, so guesses from environment
     // variables are just that: guesses.
@@ -251,6 +433,12 @@ TermGraphicsInfo QuerySupportedGraphicsProtocol() {
                       }
                       if (find_str(data, len, "kitty")) {
                           result.preferred_graphics = GraphicsProtocol::kKitty;
+                          // Other terminals implementing the kitty protocol
+                          // don't necessarily implement animations or
+                          // placing an image again.
+                          result.kitty_animation_frames = true;
+                          result.kitty_shared_memory    = true;  // Probed below
+                          result.kitty_placements       = true;
                       }
                       if (find_str(data, len, "ghostty")) {
                           result.preferred_graphics = GraphicsProtocol::kKitty;
@@ -272,6 +460,15 @@ TermGraphicsInfo QuerySupportedGraphicsProtocol() {
                       // We finish once we found the response to DSR5
                       return find_str(data, len, TERM_CSI "0");
                   });
+
+    // Shared memory only works if the terminal can see the same objects.
+    // Don't even try if there might be something in-between, otherwise ask.
+    if (result.kitty_shared_memory) {
+        result.kitty_shared_memory =
+            !result.in_tmux && !getenv("SSH_CONNECTION") &&
+            !getenv("SSH_CLIENT") && !getenv("SSH_TTY") &&
+            KittyReadsSharedMemory(buffer, sizeof(buffer), kTimeBudget);
+    }
     if (result.preferred_graphics != GraphicsProtocol::kNone) {
         return result;
     }
@@ -300,7 +497,27 @@ TermGraphicsInfo QuerySupportedGraphicsProtocol() {
     return result;
 }
 
+TermGraphicsInfo QuerySupportedGraphicsProtocol() {
+    std::unique_lock<std::mutex> l(s_cache_lock);
+    if (!s_cache.has_graphics) {
+        l.unlock();
+        const TermGraphicsInfo result = QueryGraphicsFromTerminal();
+        l.lock();
+        s_cache.has_graphics = true;
+        s_cache.graphics     = result;
+        StoreTermQueryCache();
+    }
+    return s_cache.graphics;
+}
+
 static bool QueryCellWidthHeight(int *width, int *height) {
+    std::unique_lock<std::mutex> l(s_cache_lock);
+    if (s_cache.has_cell_size) {
+        *width  = s_cache.cell_width;
+        *height = s_cache.cell_height;
+        return *width > 0 && *height > 0;
+    }
+    l.unlock();
     const Duration kTimeBudget      = Duration::Millis(50);
     constexpr char kQuery[]         = TERM_CSI "16t";
     constexpr char kResponseStart[] = TERM_CSI "6;";
@@ -310,12 +527,17 @@ static bool QueryCellWidthHeight(int *width, int *height) {
         [kResponseStart](const char *data, size_t len) -> const char * {
             return find_str(data, len, kResponseStart);
         });
-    int w;
-    int h;
-    if (!result ||
-        sscanf(result + strlen(kResponseStart), "%d;%dt", &h, &w) != 2) {
-        return false;
-    }
+    int w = -1;
+    int h = -1;
+    const bool success =
+        result &&
+        sscanf(result + strlen(kResponseStart), "%d;%dt", &h, &w) == 2;
+    l.lock();
+    s_cache.has_cell_size = true;
+    s_cache.cell_width    = success ? w : -1;
+    s_cache.cell_height   = success ? h : -1;
+    StoreTermQueryCache();
+    if (!success) return false;
     *width  = w;
     *height = h;
     return true;
@@ -16,8 +16,17 @@
 #ifndef TIMG_TERM_QUERY_H
 #define TIMG_TERM_QUERY_H
 
+#include <string>
+
 namespace timg {
 
+// Remember the results of the terminal queries below in a file in
+// "cache_dir", so that only the first timg invocation in a terminal
+// has to wait for the answers. With "refresh", stored results are ignored
+// and replaced by freshly queried ones.
+// Needs to be called before any of the queries.
+void EnableTermQueryCache(const std::string &cache_dir, bool refresh);
+
 // Determine size of terminal in pixels we can display.
 struct TermSizeResult {
     // Not available values will be negative.
@@ -42,6 +51,9 @@ struct TermGraphicsInfo {
     GraphicsProtocol preferred_graphics;
     bool known_broken_sixel_cursor_placement;  // see SixelCanvas impl. doc
     bool in_tmux;
+    bool kitty_animation_frames;  // Supports editing images with a=f
+    bool kitty_placements;        // Can place transmitted images again: a=p
+    bool kitty_shared_memory;     // Local kitty; can read images from shm
 };
 
 // Query the terminal if and what graphics protocol it supports.
@@ -19,6 +19,8 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <memory>
+#include <string>
 #include <utility>
 
 #include "buffered-write-sequencer.h"
@@ -40,7 +42,9 @@
 namespace timg {
 
 TerminalCanvas::TerminalCanvas(BufferedWriteSequencer *write_sequencer)
-    : write_sequencer_(write_sequencer) {}
+    : write_sequencer_(write_sequencer),
+      encoded_cache_(std::make_shared<EncodedFrameCache>(kEncodedCacheBytes)),
+      framebuffer_pool_(std::make_shared<FramebufferPool>()) {}
 
 TerminalCanvas::~TerminalCanvas() {
     if (!prefix_send_.empty()) {
@@ -63,6 +67,15 @@ char *TerminalCanvas::AppendPrefixToBuffer(char *buffer) {
     return buffer + len;
 }
 
+OutBuffer TerminalCanvas::PrefixedBuffer(const std::string &payload) {
+    OutBuffer buffer =
+        write_sequencer_->RequestBuffer(prefix_send_.size() + payload.size());
+    char *const pos = AppendPrefixToBuffer(buffer.data);
+    memcpy(pos, payload.data(), payload.size());
+    buffer.size = (pos - buffer.data) + payload.size();
+    return buffer;
+}
+
 void TerminalCanvas::MoveCursorDY(int rows) {
     if (rows == 0) return;
     char buf[32];
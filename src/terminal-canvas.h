@@ -16,9 +16,12 @@
 #ifndef TERMINAL_CANVAS_H_
 #define TERMINAL_CANVAS_H_
 
+#include <cstddef>
+#include <memory>
 #include <string>
 
 #include "buffered-write-sequencer.h"
+#include "encoded-frame-cache.h"
 #include "framebuffer.h"
 #include "timg-time.h"
 
@@ -53,8 +56,20 @@ public:
 protected:
     char *AppendPrefixToBuffer(char *buffer);
 
+    // Return a buffer with the prefix followed by "payload".
+    OutBuffer PrefixedBuffer(const std::string &payload);
+
     BufferedWriteSequencer *const write_sequencer_;  // not owned
 
+    // Fully encoded frames, not including the prefix, so that e.g. looping
+    // animations cost not much more than writing the frames after the first
+    // round. Shared with encoding threads, which might outlive us.
+    static constexpr size_t kEncodedCacheBytes = 64 << 20;
+    const std::shared_ptr<EncodedFrameCache> encoded_cache_;
+
+    // For the copies of frames handed to encoding threads.
+    const std::shared_ptr<FramebufferPool> framebuffer_pool_;
+
 private:
     std::string prefix_send_;
 };
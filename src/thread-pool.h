@@ -18,22 +18,41 @@
 #ifndef TIMG_THREAD_POOL
 #define TIMG_THREAD_POOL
 
+#include <algorithm>
+#include <atomic>
 #include <condition_variable>
 #include <deque>
 #include <functional>
 #include <future>
 #include <mutex>
 #include <thread>
+#include <utility>
 #include <vector>
 
 namespace timg {
-// Simplistic thread-pool. Unfortunately, std::async() was a good idea but
-// not with a relevant implementation
+// Thread-pool with work-stealing. Unfortunately, std::async() was a good idea
+// but not with a relevant implementation.
+//
+// Each worker has its own queue that is processed in FIFO order; work is
+// distributed round-robin on these. Idle workers steal from the others.
+// Work with high priority, e.g. encoding the frame to be shown next, goes
+// into a separate lane that is always looked at first. As a task is never
+// interrupted, some workers can be reserved for high priority work, so that
+// it does not have to wait for long-running background work to finish.
 class ThreadPool {
 public:
-    explicit ThreadPool(int count) {
-        while (count--) {
-            threads_.push_back(new std::thread(&ThreadPool::Runner, this));
+    enum class Priority {
+        kHigh,    // Needed soon, e.g. next frame to be shown.
+        kNormal,  // Background work, e.g. loading images ahead of time.
+    };
+
+    // Create pool with "count" threads, of which "high_priority_only" only
+    // run high priority work (at least one thread runs anything).
+    explicit ThreadPool(int count, int high_priority_only = 0)
+        : max_running_normal_(std::max(1, count - high_priority_only)) {
+        for (int i = 0; i < count; ++i) queues_.push_back(new WorkerQueue());
+        for (int i = 0; i < count; ++i) {
+            threads_.push_back(new std::thread(&ThreadPool::Runner, this, i));
         }
     }
 
@@ -43,47 +62,132 @@ public:
             t->join();
             delete t;
         }
+        for (Task *t : high_priority_.tasks) delete t;
+        for (WorkerQueue *q : queues_) {
+            for (Task *t : q->tasks) delete t;
+            delete q;
+        }
     }
 
     template <class T>
-    std::future<T> ExecAsync(std::function<T()> f) {
-        std::promise<T> *p           = new std::promise<T>();
-        std::future<T> future_result = p->get_future();
-        auto promise_fulfiller       = [p, f]() {
-            p->set_value(f());
-            delete p;
-        };
-        lock_.lock();
-        work_queue_.push_back(promise_fulfiller);
-        lock_.unlock();
+    std::future<T> ExecAsync(std::function<T()> f,
+                             Priority priority = Priority::kNormal) {
+        TaskWithResult<T> *task      = new TaskWithResult<T>(std::move(f));
+        std::future<T> future_result = task->result.get_future();
+        WorkerQueue *queue =
+            (priority == Priority::kHigh || queues_.empty())
+                ? &high_priority_
+                : queues_[next_queue_.fetch_add(1) % queues_.size()];
+        queue->lock.lock();
+        queue->tasks.push_back(task);
+        queue->lock.unlock();
+        (queue == &high_priority_ ? pending_high_ : pending_normal_)
+            .fetch_add(1);
+        { std::lock_guard<std::mutex> l(sleep_lock_); }  // See Runner()
         cv_.notify_one();
         return future_result;
     }
 
     void CancelAllWork() {
-        lock_.lock();
+        sleep_lock_.lock();
         exiting_ = true;
-        lock_.unlock();
+        sleep_lock_.unlock();
         cv_.notify_all();
     }
 
 private:
-    void Runner() {
+    // Type-erased work item; only one allocation per ExecAsync() call.
+    struct Task {
+        virtual ~Task() {}
+        virtual void Run() = 0;
+    };
+    template <class T>
+    struct TaskWithResult final : public Task {
+        explicit TaskWithResult(std::function<T()> &&f) : fun(std::move(f)) {}
+        void Run() final { result.set_value(fun()); }
+        std::function<T()> fun;
+        std::promise<T> result;
+    };
+
+    struct WorkerQueue {
+        std::mutex lock;
+        std::deque<Task *> tasks;
+    };
+
+    static Task *TakeFrom(WorkerQueue *queue) {
+        std::lock_guard<std::mutex> l(queue->lock);
+        if (queue->tasks.empty()) return nullptr;
+        Task *const result = queue->tasks.front();
+        queue->tasks.pop_front();
+        return result;
+    }
+
+    bool HasRunnableWork() const {
+        return pending_high_ > 0 ||
+               (pending_normal_ > 0 && running_normal_ < max_running_normal_);
+    }
+
+    // High priority first, then our own queue, then steal from others.
+    // Sets "is_normal" if the task counts towards the running normal ones.
+    Task *NextTask(size_t worker, bool *is_normal) {
+        *is_normal = false;
+        Task *task = TakeFrom(&high_priority_);
+        if (task) {
+            pending_high_.fetch_sub(1);
+            return task;
+        }
+        if (running_normal_.fetch_add(1) >= max_running_normal_) {
+            running_normal_.fetch_sub(1);  // All allowed ones busy.
+            return nullptr;
+        }
+        for (size_t i = 0; !task && i < queues_.size(); ++i) {
+            task = TakeFrom(queues_[(worker + i) % queues_.size()]);
+        }
+        if (!task) {
+            running_normal_.fetch_sub(1);
+            return nullptr;
+        }
+        pending_normal_.fetch_sub(1);
+        *is_normal = true;
+        return task;
+    }
+
+    void Runner(size_t worker) {
         for (;;) {
-            std::unique_lock<std::mutex> l(lock_);
-            cv_.wait(l, [this]() { return !work_queue_.empty() || exiting_; });
-            if (exiting_) return;
-            auto process_work_item = work_queue_.front();
-            work_queue_.pop_front();
-            l.unlock();
-            process_work_item();
+            {
+                // Counters are changed before taking the lock to notify, so
+                // we can't miss a wakeup while checking here.
+                std::unique_lock<std::mutex> l(sleep_lock_);
+                cv_.wait(l, [this]() { return HasRunnableWork() || exiting_; });
+                if (exiting_) return;
+            }
+            bool is_normal;
+            Task *const task = NextTask(worker, &is_normal);
+            if (!task) continue;  // Someone else was faster.
+            task->Run();
+            delete task;
+            if (is_normal) {
+                running_normal_.fetch_sub(1);
+                // Normal work might have waited for this slot.
+                if (pending_normal_ > 0) {
+                    { std::lock_guard<std::mutex> l(sleep_lock_); }
+                    cv_.notify_one();
+                }
+            }
         }
     }
 
     std::vector<std::thread *> threads_;
-    std::mutex lock_;
+    std::vector<WorkerQueue *> queues_;
+    WorkerQueue high_priority_;
+    std::atomic<size_t> next_queue_{0};
+    std::atomic<int> pending_high_{0};
+    std::atomic<int> pending_normal_{0};
+    const int max_running_normal_;  // At most that many normal tasks at once.
+    std::atomic<int> running_normal_{0};
+
+    std::mutex sleep_lock_;
     std::condition_variable cv_;
-    std::deque<std::function<void()>> work_queue_;
     bool exiting_ = false;
 };
 
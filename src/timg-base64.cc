@@ -0,0 +1,167 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// (c) 2024 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#include "timg-base64.h"
+
+#include <stdint.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define TIMG_BASE64_X86 1
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define TIMG_BASE64_NEON 1
+#endif
+
+// Vectorized base64 encoding as described by Wojciech Muła and Daniel
+// Lemire in "Faster Base64 Encoding and Decoding using AVX2 Instructions".
+// Each 32 bit lane is filled with three input bytes, the four 6-bit
+// indices are moved into their own byte with two multiplications, then
+// translated to characters by adding an offset looked up per range of
+// indices.
+
+namespace timg {
+namespace internal {
+#ifdef TIMG_BASE64_X86
+// Three input bytes b0, b1, b2 in each 32 bit lane as b1, b0, b2, b1, so
+// that each 6-bit index can be extracted with a 16 bit multiplication.
+#define BASE64_SHUFFLE_INPUT \
+    1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10
+
+// Offsets to add to index to get the character; looked up with a value
+// that is 0 for 'a'..'z', 1..10 for '0'..'9', 11, 12 for '+' '/' and 13 for
+// upper case letters.
+#define BASE64_CHARACTER_OFFSETS                                          \
+    'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, \
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0
+
+__attribute__((target("ssse3"))) static int EncodeSSSE3(const uint8_t *input,
+                                                        int input_len,
+                                                        char *out) {
+    const __m128i shuffle = _mm_setr_epi8(BASE64_SHUFFLE_INPUT);
+    const __m128i offsets = _mm_setr_epi8(BASE64_CHARACTER_OFFSETS);
+    int done              = 0;
+    // Loads 16 bytes, of which 12 are used.
+    for (/**/; done + 16 <= input_len; done += 12, out += 16) {
+        __m128i in = _mm_loadu_si128((const __m128i *)(input + done));
+        in         = _mm_shuffle_epi8(in, shuffle);
+        const __m128i hi = _mm_mulhi_epu16(
+            _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)),
+            _mm_set1_epi32(0x04000040));
+        const __m128i lo = _mm_mullo_epi16(
+            _mm_and_si128(in, _mm_set1_epi32(0x003f03f0)),
+            _mm_set1_epi32(0x01000010));
+        const __m128i indices = _mm_or_si128(hi, lo);
+
+        __m128i range         = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+        const __m128i letters = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+        range = _mm_or_si128(range, _mm_and_si128(letters, _mm_set1_epi8(13)));
+        const __m128i chars =
+            _mm_add_epi8(_mm_shuffle_epi8(offsets, range), indices);
+        _mm_storeu_si128((__m128i *)out, chars);
+    }
+    return done;
+}
+
+__attribute__((target("avx2"))) static int EncodeAVX2(const uint8_t *input,
+                                                      int input_len,
+                                                      char *out) {
+    const __m256i shuffle = _mm256_setr_epi8(BASE64_SHUFFLE_INPUT,  //
+                                             BASE64_SHUFFLE_INPUT);
+    const __m256i offsets = _mm256_setr_epi8(BASE64_CHARACTER_OFFSETS,
+                                             BASE64_CHARACTER_OFFSETS);
+    int done              = 0;
+    // Loads two times 16 bytes of which 12 are used in each 128 bit lane.
+    for (/**/; done + 28 <= input_len; done += 24, out += 32) {
+        const __m128i first =
+            _mm_loadu_si128((const __m128i *)(input + done));
+        const __m128i second =
+            _mm_loadu_si128((const __m128i *)(input + done + 12));
+        __m256i in =
+            _mm256_inserti128_si256(_mm256_castsi128_si256(first), second, 1);
+        in               = _mm256_shuffle_epi8(in, shuffle);
+        const __m256i hi = _mm256_mulhi_epu16(
+            _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00)),
+            _mm256_set1_epi32(0x04000040));
+        const __m256i lo = _mm256_mullo_epi16(
+            _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0)),
+            _mm256_set1_epi32(0x01000010));
+        const __m256i indices = _mm256_or_si256(hi, lo);
+
+        __m256i range = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+        const __m256i letters =
+            _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+        range                 = _mm256_or_si256(
+            range, _mm256_and_si256(letters, _mm256_set1_epi8(13)));
+        const __m256i chars =
+            _mm256_add_epi8(_mm256_shuffle_epi8(offsets, range), indices);
+        _mm256_storeu_si256((__m256i *)out, chars);
+    }
+    // The remaining bytes typically still allow for one 128 bit block.
+    return done + EncodeSSSE3(input + done, input_len - done, out);
+}
+
+#undef BASE64_SHUFFLE_INPUT
+#undef BASE64_CHARACTER_OFFSETS
+
+static int EncodeNothing(const uint8_t *, int, char *) { return 0; }
+
+using EncodeFun = int (*)(const uint8_t *, int, char *);
+static EncodeFun ChooseEncoder() {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return EncodeAVX2;
+    if (__builtin_cpu_supports("ssse3")) return EncodeSSSE3;
+    return EncodeNothing;
+}
+
+int EncodeBase64Vectorized(const uint8_t *input, int input_len, char *out) {
+    static const EncodeFun encode = ChooseEncoder();
+    return encode(input, input_len, out);
+}
+
+#elif defined(TIMG_BASE64_NEON)
+// NEON has table lookups of up to 64 bytes, so the characters can be looked
+// up directly; de-interleaving loads take care of the shuffling.
+int EncodeBase64Vectorized(const uint8_t *input, int input_len, char *out) {
+    static constexpr uint8_t kChars[64 + 1] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    const uint8x16x4_t table = {vld1q_u8(kChars), vld1q_u8(kChars + 16),
+                                vld1q_u8(kChars + 32), vld1q_u8(kChars + 48)};
+    int done                 = 0;
+    for (/**/; done + 48 <= input_len; done += 48, out += 64) {
+        const uint8x16x3_t in = vld3q_u8(input + done);
+        uint8x16x4_t indices;
+        indices.val[0] = vshrq_n_u8(in.val[0], 2);
+        indices.val[1] = vorrq_u8(
+            vshrq_n_u8(in.val[1], 4),
+            vandq_u8(vshlq_n_u8(in.val[0], 4), vdupq_n_u8(0x30)));
+        indices.val[2] = vorrq_u8(
+            vshrq_n_u8(in.val[2], 6),
+            vandq_u8(vshlq_n_u8(in.val[1], 2), vdupq_n_u8(0x3c)));
+        indices.val[3] = vandq_u8(in.val[2], vdupq_n_u8(0x3f));
+        uint8x16x4_t chars;
+        for (int i = 0; i < 4; ++i) {
+            chars.val[i] = vqtbl4q_u8(table, indices.val[i]);
+        }
+        vst4q_u8((uint8_t *)out, chars);
+    }
+    return done;
+}
+
+#else
+int EncodeBase64Vectorized(const uint8_t *, int, char *) { return 0; }
+#endif
+}  // namespace internal
+}  // namespace timg
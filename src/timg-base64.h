@@ -20,13 +20,31 @@
 
 #include <stdint.h>
 
+#include <type_traits>
+
 namespace timg {
+namespace internal {
+// Encode the longest prefix of "input" the vector instructions of this CPU
+// can handle. Returns the number of bytes consumed, a multiple of three.
+int EncodeBase64Vectorized(const uint8_t *input, int input_len, char *out);
+}  // namespace internal
+
 // Encode data as base64.
 // input_iterator "begin" yields chars, output_iterator "out" receives chars.
 // State of output iterator after end of encoding is returned.
+// Encoding from and to plain memory uses vector instructions if available.
 template <typename input_iterator, typename output_iterator>
 inline output_iterator EncodeBase64(input_iterator begin, int input_len,
                                     output_iterator out) {
+    if constexpr (std::is_pointer_v<input_iterator> &&
+                  sizeof(*begin) == 1 &&
+                  std::is_same_v<output_iterator, char *>) {
+        const int done = internal::EncodeBase64Vectorized(
+            (const uint8_t *)begin, input_len, out);
+        begin += done;
+        out += done / 3 * 4;
+        input_len -= done;
+    }
     static constexpr char b64[] =
         "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
     for (/**/; input_len >= 3; input_len -= 3) {
@@ -52,6 +70,24 @@ inline output_iterator EncodeBase64(input_iterator begin, int input_len,
     }
     return out;
 }
+
+// Encode data as base64 in chunks of "chunk_size" bytes of input, which
+// has to be a multiple of three. Between chunks, "separator(out, remaining)"
+// is called to append whatever the protocol needs between chunks and
+// returns the new output position; "remaining" is the number of input
+// bytes still to come.
+template <typename output_iterator, typename separator_fun>
+inline output_iterator EncodeBase64Chunks(const char *data, int size,
+                                          int chunk_size, output_iterator out,
+                                          const separator_fun &separator) {
+    while (size > chunk_size) {
+        out = EncodeBase64(data, chunk_size, out);
+        data += chunk_size;
+        size -= chunk_size;
+        out = separator(out, size);
+    }
+    return EncodeBase64(data, size, out);
+}
 }  // namespace timg
 
 #endif  // TIMG_BASE64_H_
@@ -0,0 +1,338 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// (c) 2024 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// Micro-benchmarks of the hot paths. Build with cmake -DWITH_BENCHMARKS=ON
+// and run ./src/timg-bench
+//
+// Images are synthetic unless environment variable TIMG_BENCH_IMAGE points
+// to a binary PPM (P6) file, e.g. a real photo, that is then used instead
+// (by repeating or cutting it to the size needed).
+
+#include <benchmark/benchmark.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "buffered-write-sequencer.h"
+#include "display-options.h"
+#include "framebuffer.h"
+#include "kitty-canvas.h"
+#include "sixel-canvas.h"
+#include "thread-pool.h"
+#include "timg-base64.h"
+#include "timg-png.h"
+#include "unicode-block-canvas.h"
+
+namespace timg {
+namespace {
+static volatile sig_atomic_t interrupt_received = 0;
+
+// Pixels of the image in TIMG_BENCH_IMAGE; empty if not set or readable.
+struct PhotoImage {
+    int width  = 0;
+    int height = 0;
+    std::vector<uint8_t> rgb;
+};
+static const PhotoImage &GetPhotoImage() {
+    static const PhotoImage *const image = []() {
+        PhotoImage *result   = new PhotoImage();
+        const char *filename = getenv("TIMG_BENCH_IMAGE");
+        FILE *f              = filename ? fopen(filename, "rb") : nullptr;
+        if (!f) return result;
+        int maxval;
+        if (fscanf(f, "P6 %d %d %d", &result->width, &result->height,
+                   &maxval) == 3 &&
+            maxval == 255 && fgetc(f) != EOF && result->width > 0 &&
+            result->height > 0) {
+            result->rgb.resize((size_t)result->width * result->height * 3);
+            if (fread(result->rgb.data(), 1, result->rgb.size(), f) !=
+                result->rgb.size()) {
+                result->rgb.clear();
+            }
+        }
+        if (result->rgb.empty()) {
+            fprintf(stderr, "Could not read P6 PPM from %s\n", filename);
+        }
+        fclose(f);
+        return result;
+    }();
+    return *image;
+}
+
+// Somewhat realistic image: smooth gradients interspersed with noisy areas so
+// that all the glyph choices are exercised. Or the TIMG_BENCH_IMAGE photo.
+static void FillTestImage(Framebuffer *fb) {
+    const PhotoImage &photo = GetPhotoImage();
+    uint32_t rnd            = 0x1234567;
+    for (int y = 0; y < fb->height(); ++y) {
+        for (int x = 0; x < fb->width(); ++x) {
+            rnd = rnd * 1103515245 + 12345;
+            if (!photo.rgb.empty()) {
+                const uint8_t *p =
+                    &photo.rgb[3 * ((y % photo.height) * photo.width +
+                                    (x % photo.width))];
+                fb->SetPixel(x, y, {p[0], p[1], p[2], 0xff});
+            }
+            else if ((x / 40 + y / 40) % 3 == 0) {
+                fb->SetPixel(x, y,
+                             {(uint8_t)(rnd >> 8), (uint8_t)(rnd >> 16),
+                              (uint8_t)(rnd >> 24), 0xff});
+            }
+            else {
+                fb->SetPixel(x, y,
+                             {(uint8_t)(x * 7), (uint8_t)(y * 3),
+                              (uint8_t)((x + y) / 3), 0xff});
+            }
+        }
+    }
+}
+
+// Second frame of a simple animation: first image with a box moved over it.
+static void FillTestAnimationFrame(Framebuffer *fb) {
+    FillTestImage(fb);
+    const int box = fb->width() / 4;
+    for (int y = fb->height() / 4; y < fb->height() / 4 + box; ++y) {
+        for (int x = fb->width() / 3; x < fb->width() / 3 + box; ++x) {
+            if (y < fb->height()) fb->SetPixel(x, y, {0xff, 0x80, 0x00, 0xff});
+        }
+    }
+}
+
+// Report throughput in pixel bytes and frames per second.
+static void SetFrameCounters(benchmark::State &state, const Framebuffer &fb) {
+    state.SetBytesProcessed(state.iterations() * fb.width() * fb.height() *
+                            sizeof(rgba_t));
+    state.counters["frames"] =
+        benchmark::Counter(state.iterations(), benchmark::Counter::kIsRate);
+}
+
+// Canvases write through a sequencer to /dev/null without frame delay.
+class NullOutput {
+public:
+    NullOutput()
+        : devnull_(open("/dev/null", O_WRONLY)),
+          sequencer_(devnull_, false, 4, true, interrupt_received) {}
+    ~NullOutput() {
+        sequencer_.Flush();
+        close(devnull_);
+    }
+
+    BufferedWriteSequencer *sequencer() { return &sequencer_; }
+
+private:
+    const int devnull_;
+    BufferedWriteSequencer sequencer_;
+};
+
+// Parameters: width, height, encoding threads, 256 colors, and if only the
+// difference to the previous frame is emitted.
+static void BM_UnicodeBlockSend(benchmark::State &state, bool quarter) {
+    const int width            = state.range(0);
+    const int height           = state.range(1);
+    const int threads          = state.range(2);
+    const bool use_256_color   = state.range(3);
+    const bool emit_difference = state.range(4);
+    Framebuffer fb(width, height);
+    FillTestImage(&fb);
+    Framebuffer other_fb(width, height);
+    FillTestAnimationFrame(&other_fb);
+
+    NullOutput out;
+    std::unique_ptr<ThreadPool> pool;
+    if (threads > 1) pool.reset(new ThreadPool(threads - 1));
+    UnicodeBlockCanvas canvas(out.sequencer(), pool.get(), threads, quarter,
+                              false, use_256_color, true);
+    // Going back up to the previous image emits difference only. As
+    // non-animation frames, they are always encoded, never cached.
+    const int dy = emit_difference ? -height : 0;
+    canvas.Send(0, 0, fb, SeqType::FrameImmediate, {});
+    bool odd = false;
+    for (auto _ : state) {
+        odd = !odd;
+        canvas.Send(0, dy, odd ? other_fb : fb, SeqType::FrameImmediate, {});
+    }
+    SetFrameCounters(state, fb);
+}
+
+static void BM_QuarterBlockSend(benchmark::State &state) {
+    BM_UnicodeBlockSend(state, true);
+}
+static void BM_HalfBlockSend(benchmark::State &state) {
+    BM_UnicodeBlockSend(state, false);
+}
+
+// Sizes of typical terminals: pixels are two per character cell per axis in
+// quarter mode.
+BENCHMARK(BM_QuarterBlockSend)
+    ->ArgNames({"w", "h", "threads", "256col", "diff"})
+    ->Args({160, 96, 1, 0, 0})
+    ->Args({480, 216, 1, 0, 0})
+    ->Args({480, 216, 4, 0, 0})
+    ->Args({480, 216, 1, 1, 0})
+    ->Args({480, 216, 1, 0, 1});
+BENCHMARK(BM_HalfBlockSend)
+    ->ArgNames({"w", "h", "threads", "256col", "diff"})
+    ->Args({80, 96, 1, 0, 0})
+    ->Args({240, 216, 1, 0, 0})
+    ->Args({240, 216, 4, 0, 0})
+    ->Args({240, 216, 1, 1, 0})
+    ->Args({240, 216, 1, 0, 1});
+
+// Pixel sizes of 80x24 and 200x50 terminals with 10x20 pixel cells.
+static void GraphicsTerminalSizes(benchmark::internal::Benchmark *b) {
+    b->ArgNames({"w", "h", "compress", "threads"});
+    for (int compress : {0, 1}) {
+        b->Args({800, 480, compress, 1});
+        b->Args({2000, 1000, compress, 1});
+    }
+    b->Args({2000, 1000, 1, 4});
+}
+
+static DisplayOptions GraphicsOptions(const benchmark::State &state) {
+    DisplayOptions opts;
+    opts.width                = state.range(0);
+    opts.height               = state.range(1);
+    opts.compress_pixel_level = state.range(2);
+    opts.cell_x_px            = 10;
+    opts.cell_y_px            = 20;
+    return opts;
+}
+
+static void BM_KittySend(benchmark::State &state) {
+    const DisplayOptions opts = GraphicsOptions(state);
+    const int threads         = state.range(3);
+    Framebuffer fb(opts.width, opts.height);
+    FillTestImage(&fb);
+
+    ThreadPool pool(threads);  // Outlives output that waits for its work.
+    NullOutput out;
+    KittyGraphicsCanvas canvas(out.sequencer(), &pool, false, false, false,
+                               KittyMedium::kDirect, opts);
+    for (auto _ : state) {
+        canvas.Send(0, 0, fb, SeqType::FrameImmediate, {});
+    }
+    SetFrameCounters(state, fb);
+}
+BENCHMARK(BM_KittySend)->Apply(GraphicsTerminalSizes)->UseRealTime();
+
+static void BM_SixelSend(benchmark::State &state) {
+    const DisplayOptions opts = GraphicsOptions(state);
+    const int threads         = state.range(3);
+    Framebuffer fb(opts.width, opts.height);
+    FillTestImage(&fb);
+
+    ThreadPool pool(threads);
+    NullOutput out;
+    SixelCanvas canvas(out.sequencer(), &pool, false, opts);
+    for (auto _ : state) {
+        canvas.Send(0, 0, fb, SeqType::FrameImmediate, {});
+    }
+    SetFrameCounters(state, fb);
+}
+BENCHMARK(BM_SixelSend)
+    ->ArgNames({"w", "h", "compress", "threads"})
+    ->Args({800, 480, 1, 1})
+    ->Args({2000, 1000, 1, 4})
+    ->UseRealTime();
+
+// Parameters: width, height, compression level.
+static void BM_PNGEncode(benchmark::State &state) {
+    const int width  = state.range(0);
+    const int height = state.range(1);
+    const int level  = state.range(2);
+    Framebuffer fb(width, height);
+    FillTestImage(&fb);
+    std::vector<char> buffer(png::UpperBound(width, height));
+    png::Encoder encoder;
+    size_t encoded_size = 0;
+    for (auto _ : state) {
+        encoded_size = encoder.Encode(fb, level, png::ColorEncoding::kRGB_24,
+                                      buffer.data(), buffer.size());
+        benchmark::DoNotOptimize(encoded_size);
+    }
+    SetFrameCounters(state, fb);
+    state.counters["ratio"] =
+        (double)encoded_size / (width * height * sizeof(rgba_t));
+}
+BENCHMARK(BM_PNGEncode)
+    ->ArgNames({"w", "h", "level"})
+    ->Args({800, 480, 0})
+    ->Args({800, 480, 1})
+    ->Args({800, 480, 2})
+    ->Args({800, 480, 4})
+    ->Args({800, 480, 9})
+    ->Args({2000, 1000, 1});
+
+static void BM_EncodeBase64(benchmark::State &state) {
+    const int size = state.range(0);
+    std::string input(size, '\0');
+    uint32_t rnd = 0x1234567;
+    for (char &c : input) {
+        rnd = rnd * 1103515245 + 12345;
+        c   = rnd >> 24;
+    }
+    std::string output(4 * ((size + 2) / 3), '\0');
+    for (auto _ : state) {
+        EncodeBase64(input.data(), size, &output[0]);
+        benchmark::DoNotOptimize(output.data());
+    }
+    state.SetBytesProcessed(state.iterations() * size);
+}
+BENCHMARK(BM_EncodeBase64)->Arg(4096)->Arg(1 << 20);
+
+// Half-transparent image, as with transparent GIFs, blended with a solid
+// color or, with the second parameter set, a checkerboard pattern.
+static void BM_AlphaComposeBackground(benchmark::State &state) {
+    const int width          = state.range(0);
+    const bool with_pattern  = state.range(1);
+    const int height         = width * 3 / 4;
+    const rgba_t kBackground = {0x20, 0x40, 0x60, 0xff};
+    const rgba_t kPattern    = {0x80, 0x80, 0x80, 0xff};
+
+    const Framebuffer::bgcolor_query get_bg = [&]() { return kBackground; };
+    Framebuffer image(width, height);
+    FillTestImage(&image);
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            rgba_t pixel = image.at(x, y);
+            pixel.a      = (x + y) & 0xff;
+            image.SetPixel(x, y, pixel);
+        }
+    }
+    for (auto _ : state) {
+        state.PauseTiming();
+        Framebuffer fb(image);
+        state.ResumeTiming();
+        fb.AlphaComposeBackground(get_bg, with_pattern ? kPattern : rgba_t{},
+                                  8, 8);
+        benchmark::DoNotOptimize(fb.begin());
+    }
+    SetFrameCounters(state, image);
+}
+BENCHMARK(BM_AlphaComposeBackground)
+    ->Args({640, 0})
+    ->Args({640, 1})
+    ->Args({1920, 0});
+}  // namespace
+}  // namespace timg
+
+BENCHMARK_MAIN();
@@ -18,9 +18,12 @@
 #include <libdeflate.h>
 #include <netinet/in.h>
 
+#include <algorithm>
 #include <cassert>
 #include <cstdint>
+#include <cstdlib>
 #include <cstring>
+#include <utility>
 
 #include "framebuffer.h"
 
@@ -87,10 +90,150 @@ private:
     uint8_t *pos_;          // Current write position
 };
 
+// Size of the filtered image data that is to be compressed.
+static size_t FilteredSize(int width, int height) {
+    return width * height * sizeof(rgba_t) + height * 1 /*filter-per-row*/;
+}
+
+// https://w3.org/TR/png/#9Filter-types
+enum FilterType : uint8_t {
+    kFilterNone  = 0,
+    kFilterSub   = 1,
+    kFilterUp    = 2,
+    kFilterAvg   = 3,
+    kFilterPaeth = 4,
+};
+
+// Rows needed in the scratch space after filtered data: packed current and
+// previous row, one result row for each filter we try.
+static constexpr int kScratchRows = 2 + 5;
+
+// Filter kernels, each working on "len" bytes of a row and (if needed) the
+// previous row. Filter is applied to the original bytes, so there are no
+// dependencies between iterations; written as plain loops over bytes that
+// the compiler vectorizes.
+template <int bpp>
+static void FilterSub(const uint8_t *row, const uint8_t *, int len,
+                      uint8_t *out) {
+    for (int i = 0; i < bpp; ++i) out[i] = row[i];
+    for (int i = bpp; i < len; ++i) out[i] = row[i] - row[i - bpp];
+}
+
+template <int bpp>
+static void FilterUp(const uint8_t *row, const uint8_t *prev, int len,
+                     uint8_t *out) {
+    for (int i = 0; i < len; ++i) out[i] = row[i] - prev[i];
+}
+
+template <int bpp>
+static void FilterAvg(const uint8_t *row, const uint8_t *prev, int len,
+                      uint8_t *out) {
+    for (int i = 0; i < bpp; ++i) out[i] = row[i] - (prev[i] >> 1);
+    for (int i = bpp; i < len; ++i) {
+        out[i] = row[i] - ((row[i - bpp] + prev[i]) >> 1);
+    }
+}
+
+static inline uint8_t PaethPredictor(int a, int b, int c) {
+    // Branch-free formulation (pa = |p - a| with p = a + b - c etc.) that can
+    // be vectorized.
+    const int pa = abs(b - c);
+    const int pb = abs(a - c);
+    const int pc = abs(a + b - 2 * c);
+    const int ab = (pa <= pb) ? a : b;
+    const int p  = (pa <= pb) ? pa : pb;
+    return (p <= pc) ? ab : c;
+}
+
+template <int bpp>
+static void FilterPaeth(const uint8_t *row, const uint8_t *prev, int len,
+                        uint8_t *out) {
+    for (int i = 0; i < bpp; ++i) out[i] = row[i] - prev[i];  // a = c = 0
+    for (int i = bpp; i < len; ++i) {
+        out[i] = row[i] - PaethPredictor(row[i - bpp], prev[i], prev[i - bpp]);
+    }
+}
+
+// Heuristic recommended by the PNG spec to choose a filter: the one with
+// the minimum sum of absolute values (as signed bytes) of the result.
+static uint32_t SumAbsDifferences(const uint8_t *data, int len) {
+    uint32_t sum = 0;
+    for (int i = 0; i < len; ++i) sum += abs((int8_t)data[i]);
+    return sum;
+}
+
+// Depending on the compression level, we spend more time to find the best
+// filter for better compression.
+static int FiltersForCompressionLevel(int compression_level,
+                                      FilterType filters[5]) {
+    int count = 0;
+    if (compression_level == 0) {
+        filters[count++] = kFilterNone;  // Filtering is pointless if stored.
+        return count;
+    }
+    filters[count++] = kFilterSub;  // The fast default.
+    if (compression_level >= 2) {
+        filters[count++] = kFilterUp;
+    }
+    if (compression_level >= 4) {
+        filters[count++] = kFilterNone;
+        filters[count++] = kFilterAvg;
+        filters[count++] = kFilterPaeth;
+    }
+    return count;
+}
+
+// Filter one row of "len" bytes with the given filter.
+template <int bpp>
+static void ApplyFilter(FilterType filter, const uint8_t *row,
+                        const uint8_t *prev, int len, uint8_t *out) {
+    switch (filter) {
+    case kFilterNone: memcpy(out, row, len); break;
+    case kFilterSub: FilterSub<bpp>(row, prev, len, out); break;
+    case kFilterUp: FilterUp<bpp>(row, prev, len, out); break;
+    case kFilterAvg: FilterAvg<bpp>(row, prev, len, out); break;
+    case kFilterPaeth: FilterPaeth<bpp>(row, prev, len, out); break;
+    }
+}
+
+// Write "data" as zlib stream of stored, uncompressed, deflate blocks into
+// "out" and return the number of bytes written. Much faster than to let
+// the compressor figure out that it should not compress.
+// https://www.rfc-editor.org/rfc/rfc1950 https://www.rfc-editor.org/rfc/rfc1951
+static size_t StoreUncompressed(const uint8_t *data, size_t len, uint8_t *out) {
+    static constexpr size_t kMaxStoredBlock = 0xffff;
+    uint8_t *pos        = out;
+    const uint8_t *from = data;
+    size_t remaining    = len;
+    *pos++              = 0x78;  // CMF: deflate, 32k window
+    *pos++              = 0x01;  // FLG: fastest, check bits for CMF, FLG
+    do {
+        const uint16_t block_len = std::min(remaining, kMaxStoredBlock);
+        const uint16_t nlen      = ~block_len;
+        remaining -= block_len;
+        *pos++ = (remaining == 0) ? 0x01 : 0x00;  // BFINAL; BTYPE=00 stored
+        *pos++ = block_len & 0xff;
+        *pos++ = block_len >> 8;
+        *pos++ = nlen & 0xff;
+        *pos++ = nlen >> 8;
+        memcpy(pos, from, block_len);
+        pos += block_len;
+        from += block_len;
+    } while (remaining > 0);
+    const uint32_t adler_bigint = htonl(libdeflate_adler32(1, data, len));
+    memcpy(pos, &adler_bigint, 4);
+    return pos + 4 - out;
+}
+
+// Encode "fb" into "buffer" using the given compressor and scratch memory.
+// The "compress_buffer" needs to be at least FilteredSize() large, followed
+// by kScratchRows rows of width * sizeof(rgba_t) bytes. With
+// compression_level 0, the "compressor" is not used and can be nullptr.
 template <bool with_alpha>
 static size_t EncodePNGInternal(const Framebuffer &fb, int compression_level,
+                                libdeflate_compressor *compressor,
+                                uint8_t *const compress_buffer,
                                 char *const buffer, size_t size) {
-    static constexpr uint8_t kFilterType = 0x01;  // simplest substract filter
 
     const int width  = fb.width();
     const int height = fb.height();
@@ -112,41 +255,79 @@ static size_t EncodePNGInternal(const Framebuffer &fb, int compression_level,
     block.writeByte(0);                   // interlace. None.
 
     // Prepare data to be compressed.
-    // TODO: to reduce allocation overhead in repeated calls, maybe ask the
-    // caller to provide a sufficiently large scratch buffer ?
-    const size_t cbuffer_size =
-        width * height * sizeof(rgba_t) + height * sizeof(kFilterType);
-    uint8_t *const compress_buffer = new uint8_t[cbuffer_size];
-
     constexpr int bytes_per_pixel = with_alpha ? 4 : 3;
-    const rgba_t *current_line    = fb.begin();
-    uint8_t *out                  = compress_buffer;
-    for (int y = 0; y < height; ++y, current_line += width) {
-        *out++ = kFilterType;
-        memcpy(out, current_line, sizeof(rgba_t));  // First pixel
-        out += bytes_per_pixel;
-        for (int i = 1; i < width; ++i) {
-            *out++ = current_line[i].r - current_line[i - 1].r;
-            *out++ = current_line[i].g - current_line[i - 1].g;
-            *out++ = current_line[i].b - current_line[i - 1].b;
-            if (with_alpha) *out++ = current_line[i].a - current_line[i - 1].a;
+    const int row_bytes           = width * bytes_per_pixel;
+    FilterType filters[5];
+    const int filter_count =
+        FiltersForCompressionLevel(compression_level, filters);
+
+    const size_t scratch_row = width * sizeof(rgba_t);
+    uint8_t *const scratch   = compress_buffer + FilteredSize(width, height);
+    uint8_t *packed_row      = scratch;  // Only used for RGB
+    uint8_t *packed_prev     = scratch + scratch_row;
+    uint8_t *const candidate = scratch + 2 * scratch_row;
+    memset(packed_prev, 0, scratch_row);  // "previous" of first row.
+
+    const uint8_t *prev = packed_prev;
+    uint8_t *out        = compress_buffer;
+    for (int y = 0; y < height; ++y) {
+        const rgba_t *const current_line = fb.row(y);
+        const uint8_t *row;
+        if (with_alpha) {
+            row = (const uint8_t *)current_line;  // Already in PNG byte order.
+        }
+        else {
+            for (int x = 0; x < width; ++x) {
+                packed_row[3 * x + 0] = current_line[x].r;
+                packed_row[3 * x + 1] = current_line[x].g;
+                packed_row[3 * x + 2] = current_line[x].b;
+            }
+            row = packed_row;
+        }
+
+        int best_filter = 0;
+        if (filter_count > 1) {
+            uint32_t best_sum = UINT32_MAX;
+            for (int f = 0; f < filter_count; ++f) {
+                uint8_t *const result = candidate + f * scratch_row;
+                ApplyFilter<bytes_per_pixel>(filters[f], row, prev, row_bytes,
+                                             result);
+                const uint32_t sum = SumAbsDifferences(result, row_bytes);
+                if (sum < best_sum) {
+                    best_sum    = sum;
+                    best_filter = f;
+                }
+            }
+            *out++ = filters[best_filter];
+            memcpy(out, candidate + best_filter * scratch_row, row_bytes);
+        }
+        else {
+            *out++ = filters[0];
+            ApplyFilter<bytes_per_pixel>(filters[0], row, prev, row_bytes, out);
+        }
+        out += row_bytes;
+
+        if (with_alpha) {
+            prev = row;
+        }
+        else {
+            std::swap(packed_row, packed_prev);
+            prev = packed_prev;
         }
     }
 
     // Write image IDAT data.
     uint8_t *const start_data = block.StartNextChunk("IDAT");
     const int compress_avail  = size - (start_data - (uint8_t *)buffer);
-    libdeflate_compressor *const compressor =
-        libdeflate_alloc_compressor(compression_level);
-
-    const size_t written_size = libdeflate_zlib_compress(
-        compressor, compress_buffer, out - compress_buffer,  //
-        start_data, compress_avail);
+    const size_t written_size =
+        (compression_level == 0)
+            ? StoreUncompressed(compress_buffer, out - compress_buffer,
+                                start_data)
+            : libdeflate_zlib_compress(compressor, compress_buffer,
+                                       out - compress_buffer,  //
+                                       start_data, compress_avail);
     block.updateWritten(written_size);
 
-    libdeflate_free_compressor(compressor);
-    delete[] compress_buffer;
-
     block.StartNextChunk("IEND");
     return block.Finalize() - (uint8_t *)buffer;
 }
@@ -155,17 +336,42 @@ static size_t EncodePNGInternal(const Framebuffer &fb, int compression_level,
 namespace png {
 size_t Encode(const Framebuffer &fb, int compression_level,
               ColorEncoding encoding, char *buffer, size_t size) {
+    Encoder encoder;
+    return encoder.Encode(fb, compression_level, encoding, buffer, size);
+}
+
+Encoder::~Encoder() {
+    if (compressor_) libdeflate_free_compressor(compressor_);
+    delete[] scratch_;
+}
+
+size_t Encoder::Encode(const Framebuffer &fb, int compression_level,
+                       ColorEncoding encoding, char *buffer, size_t size) {
+    if (compression_level > 0 &&
+        (!compressor_ || compression_level != compressor_level_)) {
+        if (compressor_) libdeflate_free_compressor(compressor_);
+        compressor_       = libdeflate_alloc_compressor(compression_level);
+        compressor_level_ = compression_level;
+    }
+    const size_t scratch_needed = FilteredSize(fb.width(), fb.height()) +
+                                  kScratchRows * fb.width() * sizeof(rgba_t);
+    if (scratch_needed > scratch_size_) {
+        delete[] scratch_;
+        scratch_      = new uint8_t[scratch_needed];
+        scratch_size_ = scratch_needed;
+    }
     if (encoding == ColorEncoding::kRGB_24) {
-        return EncodePNGInternal<false>(fb, compression_level, buffer, size);
+        return EncodePNGInternal<false>(fb, compression_level, compressor_,
+                                        scratch_, buffer, size);
     }
-    return EncodePNGInternal<true>(fb, compression_level, buffer, size);
+    return EncodePNGInternal<true>(fb, compression_level, compressor_,
+                                   scratch_, buffer, size);
 }
 
 size_t UpperBound(int width, int height) {
     static constexpr size_t kPNGHeaderOverhead = 128;  // reality about ~57
-    const size_t image_data_size =
-        width * height * sizeof(rgba_t) + height * 1 /*filter-per-row*/;
-    return libdeflate_zlib_compress_bound(nullptr, image_data_size) +
+    return libdeflate_zlib_compress_bound(nullptr,
+                                          FilteredSize(width, height)) +
            kPNGHeaderOverhead;
 }
 }  // namespace png
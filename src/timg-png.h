@@ -19,6 +19,9 @@
 // This implements a simple and fast PNG encoder https://w3.org/TR/png/
 
 #include <cstddef>
+#include <cstdint>
+
+struct libdeflate_compressor;
 
 namespace timg {
 class Framebuffer;
@@ -28,9 +31,11 @@ namespace png {
 //
 // Provided buffer needs to be large enough; use UpperSizeEstimate() to prepare.
 //
-// "compression_level" is the compression level; 0 means essentially plain
-// bytes without compression, 1 and more compresses. For our use-case probably
-// only 1 is ever needed (we want to be fast).
+// "compression_level" is the compression level; 0 means plain bytes in
+// stored deflate blocks without running the compressor, 1 and more
+// compresses. For our use-case probably only 1 is ever needed (we want to
+// be fast). Level 1 always uses the 'Sub' filter, from level 2 on, the best
+// filter is chosen for each row (two candidates, all five from level 4 on).
 //
 // The ColorEncoding enum requests if 24Bit RGB or full 32Bit RGBA is encoded.
 enum class ColorEncoding {
@@ -40,6 +45,25 @@ enum class ColorEncoding {
 size_t Encode(const Framebuffer &fb, int compression_level,
               ColorEncoding encoding, char *buffer, size_t size);
 
+// Same as png::Encode(), but keeps the compressor state and the scratch
+// memory needed for filtering around between calls. Useful for repeated
+// encoding such as animations. Not thread-safe, use one per thread.
+class Encoder {
+public:
+    Encoder() = default;
+    Encoder(const Encoder &) = delete;
+    ~Encoder();
+
+    size_t Encode(const Framebuffer &fb, int compression_level,
+                  ColorEncoding encoding, char *buffer, size_t size);
+
+private:
+    libdeflate_compressor *compressor_ = nullptr;
+    int compressor_level_              = -1;
+    uint8_t *scratch_                  = nullptr;
+    size_t scratch_size_               = 0;
+};
+
 // Return estimate of maximum size needed to encode image of given size.
 size_t UpperBound(int width, int height);
 
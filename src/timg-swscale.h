@@ -0,0 +1,145 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// (c) 2024 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#ifndef TIMG_SWSCALE_H
+#define TIMG_SWSCALE_H
+
+// Scaling with libswscale, using multiple threads if the library supports
+// slice threads (libswscale >= 6.1, ffmpeg 5.0). With older versions, this
+// falls back to the single-threaded sws_scale().
+
+#include "framebuffer.h"
+#include "pipeline-stats.h"
+
+extern "C" {  // avutil is missing extern "C"
+#include <libavutil/buffer.h>
+#include <libavutil/frame.h>
+#include <libavutil/opt.h>
+#include <libavutil/pixfmt.h>
+#include <libswscale/swscale.h>
+}
+
+#if LIBSWSCALE_VERSION_INT >= AV_VERSION_INT(6, 1, 100)
+#define TIMG_SWS_THREADED 1
+#endif
+
+namespace timg {
+// Create a context to scale from the given source to the destination size
+// and format, with the given number of "threads". Images are loaded in
+// parallel already, so only a scaler running on its own, such as in video
+// playback, should use more than one. Returns nullptr on failure.
+inline SwsContext *CreateScaleContext(int src_width, int src_height,
+                                      AVPixelFormat src_format, int dst_width,
+                                      int dst_height, AVPixelFormat dst_format,
+                                      int flags, int threads) {
+#ifdef TIMG_SWS_THREADED
+    SwsContext *ctx = sws_alloc_context();
+    if (!ctx) return nullptr;
+    av_opt_set_int(ctx, "srcw", src_width, 0);
+    av_opt_set_int(ctx, "srch", src_height, 0);
+    av_opt_set_int(ctx, "src_format", src_format, 0);
+    av_opt_set_int(ctx, "dstw", dst_width, 0);
+    av_opt_set_int(ctx, "dsth", dst_height, 0);
+    av_opt_set_int(ctx, "dst_format", dst_format, 0);
+    av_opt_set_int(ctx, "sws_flags", flags, 0);
+    av_opt_set_int(ctx, "threads", threads, 0);
+    if (sws_init_context(ctx, nullptr, nullptr) < 0) {
+        sws_freeContext(ctx);
+        return nullptr;
+    }
+    return ctx;
+#else
+    (void)threads;
+    return sws_getContext(src_width, src_height, src_format, dst_width,
+                          dst_height, dst_format, flags, nullptr, nullptr,
+                          nullptr);
+#endif
+}
+
+namespace internal {
+#ifdef TIMG_SWS_THREADED
+// The frame API wants reference counted buffers, otherwise it would make
+// a copy. So give it references that don't own the memory.
+inline void FramebufferNotOwned(void *, uint8_t *) {}
+
+inline bool WrapFramebuffer(const Framebuffer &fb, AVPixelFormat format,
+                            AVFrame *frame, int x = 0, int y = 0,
+                            int width = -1, int height = -1) {
+    uint8_t *const pixels = (uint8_t *)fb.begin();
+    frame->data[0]     = pixels + y * fb.stride()[0] + x * sizeof(rgba_t);
+    frame->linesize[0] = fb.stride()[0];
+    frame->width       = width < 0 ? fb.width() : width;
+    frame->height      = height < 0 ? fb.height() : height;
+    frame->format      = format;
+    frame->buf[0]      = av_buffer_create(pixels, fb.stride()[0] * fb.height(),
+                                          FramebufferNotOwned, nullptr, 0);
+    return frame->buf[0] != nullptr;
+}
+#endif
+}  // namespace internal
+
+// Scale the "src" frame into the RGBA framebuffer "dst". Sizes and formats
+// need to match what "ctx" was created with.
+inline bool ScaleFrame(SwsContext *ctx, const AVFrame *src, Framebuffer *dst) {
+    PipelineStats::Scope timing(Stage::kScale);
+#ifdef TIMG_SWS_THREADED
+    // Slice threading only works with the frame API, and only if the
+    // source frame is reference counted, as it is when it comes from
+    // a decoder.
+    if (src->buf[0]) {
+        AVFrame *out = av_frame_alloc();
+        bool success = internal::WrapFramebuffer(*dst, AV_PIX_FMT_RGBA, out) &&
+                       sws_scale_frame(ctx, out, src) >= 0;
+        av_frame_free(&out);
+        return success;
+    }
+#endif
+    return sws_scale(ctx, src->data, src->linesize, 0, src->height,
+                     dst->row_data(), dst->stride()) > 0;
+}
+
+// Scale the rectangle at "x", "y" with "width" and "height" of framebuffer
+// "src", whose pixels are in "src_format", into the RGBA framebuffer "dst".
+// Sizes need to match what "ctx" was created with.
+inline bool ScaleFramebufferRect(SwsContext *ctx, Framebuffer &src,
+                                 AVPixelFormat src_format, int x, int y,
+                                 int width, int height, Framebuffer *dst) {
+#ifdef TIMG_SWS_THREADED
+    AVFrame *in  = av_frame_alloc();
+    bool success = internal::WrapFramebuffer(src, src_format, in, x, y, width,
+                                             height) &&
+                   ScaleFrame(ctx, in, dst);
+    av_frame_free(&in);
+    return success;
+#else
+    PipelineStats::Scope timing(Stage::kScale);
+    uint8_t *const src_data[4] = {
+        src.row_data()[0] + y * src.stride()[0] + x * sizeof(rgba_t), nullptr,
+        nullptr, nullptr};
+    return sws_scale(ctx, src_data, src.stride(), 0, height, dst->row_data(),
+                     dst->stride()) > 0;
+#endif
+}
+
+// Scale framebuffer "src" whose pixels are in "src_format" into the
+// RGBA framebuffer "dst". Sizes need to match what "ctx" was created with.
+inline bool ScaleFramebuffer(SwsContext *ctx, Framebuffer &src,
+                             AVPixelFormat src_format, Framebuffer *dst) {
+    return ScaleFramebufferRect(ctx, src, src_format, 0, 0, src.width(),
+                                src.height(), dst);
+}
+}  // namespace timg
+
+#endif  // TIMG_SWSCALE_H
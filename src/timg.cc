@@ -19,10 +19,12 @@
 // $ sudo apt-get install libgraphicsmagick++-dev
 
 #include "buffered-write-sequencer.h"
+#include "decoder-process-pool.h"
 #include "display-options.h"
 #include "image-source.h"
 #include "iterm2-canvas.h"
 #include "kitty-canvas.h"
+#include "pipeline-stats.h"
 #include "renderer.h"
 #include "term-query.h"
 #include "terminal-canvas.h"
@@ -42,6 +44,7 @@
 #include "openslide-source.h"
 #endif
 #ifdef WITH_TIMG_VIDEO
+#include "url-fetcher.h"
 #include "video-source.h"
 #endif
 #ifdef WITH_TIMG_GRPAPHICSMAGICK
@@ -49,7 +52,7 @@
 
 #include "graphics-magick-source.h"
 #endif
-#ifdef WITH_TIMG_SIXEL
+#ifdef WITH_TIMG_LIBSIXEL
 #include <sixel.h>
 #endif
 #ifdef WITH_TIMG_RSVG
@@ -86,15 +89,19 @@ int getopt(int, char *const *, const char *);  // NOLINT
 
 #include <cctype>
 #include <cerrno>
+#include <chrono>
 #include <cinttypes>
 #include <cmath>
+#include <condition_variable>
 #include <csignal>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <deque>
 #include <fstream>
 #include <functional>
 #include <future>
+#include <limits>
 #include <memory>
 #include <mutex>
 #include <optional>
@@ -112,6 +119,8 @@ using timg::Duration;
 using timg::ImageSource;
 using timg::ITerm2GraphicsCanvas;
 using timg::KittyGraphicsCanvas;
+using timg::KittyMedium;
+using timg::PipelineStats;
 using timg::rgba_t;
 using timg::TerminalCanvas;
 using timg::Time;
@@ -151,8 +160,12 @@ struct PresentationOptions {
     Pixelation pixelation         = Pixelation::kNotChosen;
     bool sixel_cursor_workaround  = false;
     bool tmux_workaround          = false;
+    bool kitty_animation_frames   = false;  // Send only changes in animations
+    bool kitty_placements         = false;  // Re-place images already sent
+    KittyMedium kitty_medium      = KittyMedium::kDirect;
     bool terminal_use_upper_block = false;
     bool use_256_color = false;  // For terminals that don't do 24 bit color
+    int block_encode_threads = 1;  // Parallel encoding of unicode blocks.
 
     // Arrangement
     int grid_cols = 1;  // Grid arrangement
@@ -168,15 +181,189 @@ struct PresentationOptions {
 };
 }  // namespace timg
 
-// Image sources; as future as they are being filled while we start presenting
-typedef std::vector<std::future<timg::ImageSource *>> LoadedImageSources;
+volatile sig_atomic_t interrupt_received = 0;
+static void InterruptHandler(int signo) { interrupt_received = 1; }
+
+#ifdef WITH_TIMG_VIDEO
+// Fetches URLs ahead of loading them; nullptr if not used. Never deleted,
+// as its detached download threads might still use it.
+static timg::UrlFetcher *url_fetcher = nullptr;
+static constexpr int kUrlFetchConnections = 6;
+#endif
+
+namespace timg {
+// Filenames from the command line and from file lists. File lists are read
+// in a separate thread while images are already shown, so that a list
+// that is still being written, e.g. by `find` into a pipe, doesn't have to
+// be complete first.
+class FilenameStream {
+public:
+    // Add a newline separated list of filenames in "filelist_file" ("-"
+    // for stdin). Non-absolute files are resolved relative to the
+    // filelist_file if "relative_to_filelist", otherwise relative to the
+    // current working directory.
+    // Returns false if the file can't be opened.
+    bool AddFileList(const std::string &filelist_file,
+                     bool relative_to_filelist) {
+        auto stream = std::make_unique<std::ifstream>(
+            filelist_file == "-" ? "/dev/stdin" : filelist_file,
+            std::ifstream::in);
+        if (!*stream) {
+            fprintf(stderr, "%s: %s\n", filelist_file.c_str(),
+                    strerror(errno));
+            return false;
+        }
+        const size_t last_slash = filelist_file.find_last_of('/');
+        // Following works as expected if last_slash == npos (lsat_slash+1 == 0)
+        has_file_lists_ = true;
+        inputs_.push_back({std::move(stream),
+                           relative_to_filelist
+                               ? filelist_file.substr(0, last_slash + 1)
+                               : ""});
+        return true;
+    }
+
+    void AddFile(const std::string &filename) {
+        inputs_.push_back({nullptr, filename});
+    }
+
+    // Number of files and file lists added.
+    size_t inputs() const { return inputs_.size(); }
+    bool has_file_lists() const { return has_file_lists_; }
+
+    // Start reading the inputs in the background. After that, no more can
+    // be added. The thread is never joined, as reading a pipe might block
+    // until the program exits.
+    void Start() { std::thread(&FilenameStream::Reader, this).detach(); }
+
+    // Get the next filename. If there is none yet, wait for it if "wait".
+    // Returns false if there is none (yet).
+    bool Next(std::string *filename, bool wait) {
+        std::unique_lock<std::mutex> l(lock_);
+        while (wait && filenames_.empty() && !done_ && !interrupt_received) {
+            // Timeout, so that we can react to Ctrl-C.
+            arrived_.wait_for(l, std::chrono::milliseconds(100));
+        }
+        if (filenames_.empty()) return false;
+        *filename = std::move(filenames_.front());
+        filenames_.pop_front();
+        return true;
+    }
+
+private:
+    struct Input {
+        std::unique_ptr<std::ifstream> filelist;  // nullptr: just a file.
+        std::string prefix_or_filename;
+    };
+
+    void Reader() {
+        for (Input &input : inputs_) {
+            if (!input.filelist) {
+                Push(input.prefix_or_filename);
+                continue;
+            }
+            const std::string &prefix = input.prefix_or_filename;
+            for (std::string filename; std::getline(*input.filelist, filename);
+                 /**/) {
+                if (filename.empty()) continue;
+                if (filename[0] != '/' && !prefix.empty()) {
+                    filename.insert(0, prefix);
+                }
+                Push(std::move(filename));
+            }
+            input.filelist.reset();
+        }
+        std::unique_lock<std::mutex> l(lock_);
+        done_ = true;
+        arrived_.notify_all();
+    }
+
+    void Push(std::string filename) {
+        std::unique_lock<std::mutex> l(lock_);
+        filenames_.push_back(std::move(filename));
+        arrived_.notify_all();
+    }
+
+    std::vector<Input> inputs_;
+    bool has_file_lists_ = false;
+
+    std::mutex lock_;
+    std::condition_variable arrived_;
+    std::deque<std::string> filenames_;
+    bool done_ = false;
+};
+
+// Image sources are loaded asynchronously in the thread pool while we start
+// presenting. Only a limited number of them is loaded ahead of what has been
+// consumed, so that even huge file lists are shown in constant memory.
+class LoadedImageSources {
+public:
+    using LoadFunction = std::function<ImageSource *(const std::string &)>;
+
+    LoadedImageSources(ThreadPool *pool, FilenameStream *files,
+                       size_t lookahead, const LoadFunction &load)
+        : pool_(pool), files_(files), lookahead_(lookahead), load_(load) {
+        FillLookahead(false);
+    }
+
+    // Get the next image source in the order of the file list; nullptr if
+    // it could not be loaded. Returns false once all files are consumed.
+    bool Next(std::unique_ptr<ImageSource> *source) {
+        if (loading_.empty()) FillLookahead(true);
+        if (loading_.empty()) return false;
+        source->reset(loading_.front().get());
+        loading_.pop_front();
+        FillLookahead(false);
+        return true;
+    }
+
+    // Number of files that were handed out for loading.
+    size_t files_seen() const { return files_seen_; }
+
+private:
+    // Start loading what is known of the next files. If "wait" and there
+    // is nothing loading, wait for the next filename.
+    void FillLookahead(bool wait) {
+        std::string filename;
+        while (loading_.size() < lookahead_ && !interrupt_received &&
+               files_->Next(&filename, wait && loading_.empty())) {
+            ++files_seen_;
+#ifdef WITH_TIMG_VIDEO
+            // Downloads don't have to wait for a free thread in the pool,
+            // and only take one once they are done.
+            if (url_fetcher && UrlFetcher::IsUrl(filename)) {
+                auto loaded = std::make_shared<std::promise<ImageSource *>>();
+                loading_.push_back(loaded->get_future());
+                url_fetcher->Prefetch(filename, [pool = pool_, load = load_,
+                                                 filename, loaded]() {
+                    pool->ExecAsync<bool>([load, filename, loaded]() {
+                        loaded->set_value(load(filename));
+                        return true;
+                    });
+                });
+                continue;
+            }
+#endif
+            loading_.push_back(pool_->ExecAsync<ImageSource *>(
+                [load = load_, filename]() { return load(filename); }));
+        }
+    }
+
+    ThreadPool *const pool_;
+    FilenameStream *const files_;
+    const size_t lookahead_;
+    const LoadFunction load_;
+    size_t files_seen_ = 0;
+    std::deque<std::future<ImageSource *>> loading_;
+};
+}  // namespace timg
+using timg::FilenameStream;
+using timg::LoadedImageSources;
 
 // Use most cores that are available.
 static const int kDefaultThreadCount =
     std::max(1, 3 * (int)std::thread::hardware_concurrency() / 4);
 
-volatile sig_atomic_t interrupt_received = 0;
-static void InterruptHandler(int signo) { interrupt_received = 1; }
 
 static int usage(const char *progname, ExitCode exit_code, int width,
                  int height) {
@@ -271,12 +458,23 @@ static int usage(const char *progname, ExitCode exit_code, int width,
         "\t-E             : Don't hide the cursor while showing images.\n"
         "\t--compress[=level]: Only for -pk or -pi: Compress image data. More\n"
         "\t                 CPU use, but less used bandwidth. (default: 1)\n"
+        "\t                 'auto' adapts level to connection speed.\n"
         "\t--threads=<n>  : Run image decoding in parallel with n threads\n"
         "\t                 (Default %d, 3/4 #cores on this machine)\n"
+#ifdef WITH_TIMG_RSVG
+        "\t--decode-processes=<n>: Render SVGs in n separate processes\n"
+        "\t                 instead of one at a time.\n"
+#endif
         "\t--color8       : Choose 8 bit color mode for -ph or -pq\n"
+        "\t--refresh-term-cache: Query terminal again even with "
+        "TIMG_TERM_CACHE=1\n"
         "\t--version      : Print detailed version including used libraries.\n"
         "\t                 (%s)\n"
         "\t--verbose      : Print some stats after images shown.\n"
+        "\t--benchmark    : Show as fast as possible; print time spent in\n"
+        "\t                 processing stages and frame latencies.\n"
+        "\t--trace=<file> : Write timeline of processing steps in all threads\n"
+        "\t                 as Chrome trace JSON (view in ui.perfetto.dev).\n"
         "\t-h             : Print this help and exit.\n"
         "\t--help         : Page through detailed manpage-like help and exit.\n"
 
@@ -296,6 +494,7 @@ static int usage(const char *progname, ExitCode exit_code, int width,
         "\t--frames=<num>: Only show first num frames (if looping, loop only "
         "these)\n"
         "\t--frame-offset=<num>: Start animation/video at this frame\n"
+        "\t--start-time=<[[hh:]mm:]ss>: Start video at this time position\n"
         "\t-t<seconds>   : Stop after this time, independent of --loops or "
         "--frames\n",
         default_title ? "='" : "", default_title ? default_title : "",
@@ -304,56 +503,27 @@ static int usage(const char *progname, ExitCode exit_code, int width,
     return (int)exit_code;
 }
 
-// Read list of filenames from newline separated file.
-// Non-absolute files are resolved relative to the filelist_file or
-// relative to currnet working directory.
-bool AppendToFileList(const std::string &filelist_file,
-                      bool consider_relative_to_filelist,
-                      std::vector<std::string> *filelist) {
-    std::ifstream filelist_stream(
-        filelist_file == "-" ? "/dev/stdin" : filelist_file, std::ifstream::in);
-    if (!filelist_stream) {
-        fprintf(stderr, "%s: %s\n", filelist_file.c_str(), strerror(errno));
-        return false;
-    }
-    const size_t last_slash = filelist_file.find_last_of('/');
-    // Following works as expected if last_slash == npos (lsat_slash+1 == 0)
-    const std::string prefix = filelist_file.substr(0, last_slash + 1);
-    for (std::string filename; std::getline(filelist_stream, filename); /**/) {
-        if (filename.empty()) continue;
-        if (consider_relative_to_filelist &&  //
-            filename[0] != '/' && !prefix.empty()) {
-            filename.insert(0, prefix);
-        }
-        filelist->push_back(filename);
-    }
-    return true;
-}
-
 static int PresentImages(LoadedImageSources *loaded_sources,
                          const timg::DisplayOptions &display_opts,
                          const timg::PresentationOptions &present,
                          timg::BufferedWriteSequencer *sequencer,
-                         bool *any_animations_seen) {
-    using timg::ThreadPool;
-    std::unique_ptr<ThreadPool> compression_pool;
+                         timg::ThreadPool *pool, bool *any_animations_seen) {
     std::unique_ptr<TerminalCanvas> canvas;
     switch (present.pixelation) {
     case Pixelation::kKittyGraphics:
-        compression_pool.reset(new ThreadPool(sequencer->max_queue_len() + 1));
-        canvas.reset(new KittyGraphicsCanvas(sequencer, compression_pool.get(),
+        canvas.reset(new KittyGraphicsCanvas(sequencer, pool,
                                              present.tmux_workaround,
+                                             present.kitty_animation_frames,
+                                             present.kitty_placements,
+                                             present.kitty_medium,
                                              display_opts));
         break;
     case Pixelation::kiTerm2Graphics:
-        compression_pool.reset(new ThreadPool(sequencer->max_queue_len() + 1));
-        canvas.reset(new ITerm2GraphicsCanvas(sequencer, compression_pool.get(),
-                                              display_opts));
+        canvas.reset(new ITerm2GraphicsCanvas(sequencer, pool, display_opts));
         break;
 #ifdef WITH_TIMG_SIXEL
     case Pixelation::kSixelGraphics:
-        compression_pool.reset(new ThreadPool(sequencer->max_queue_len() + 1));
-        canvas.reset(new timg::SixelCanvas(sequencer, compression_pool.get(),
+        canvas.reset(new timg::SixelCanvas(sequencer, pool,
                                            present.sixel_cursor_workaround,
                                            display_opts));
         break;
@@ -361,14 +531,24 @@ static int PresentImages(LoadedImageSources *loaded_sources,
     case Pixelation::kHalfBlock:
     case Pixelation::kQuarterBlock:
     case Pixelation::kNotChosen:  // Should not happen.
+        // Send() encodes one band itself, the others go to the pool.
         canvas.reset(new UnicodeBlockCanvas(
-            sequencer, present.pixelation == Pixelation::kQuarterBlock,
-            present.terminal_use_upper_block, present.use_256_color));
+            sequencer, pool, present.block_encode_threads,
+            present.pixelation == Pixelation::kQuarterBlock,
+            present.terminal_use_upper_block, present.use_256_color,
+            present.grid_cols == 1));
     }
 
+    // Grid rows of still images are sent as one image, unless we want to
+    // see them appear one by one. Sixel can't leave the gaps between
+    // images of different size transparent.
+    const bool coalesce_rows =
+        present.duration_between_images.is_zero() &&
+        present.pixelation != Pixelation::kSixelGraphics;
     auto renderer = timg::Renderer::Create(
         canvas.get(), display_opts, present.grid_cols, present.grid_rows,
-        present.duration_between_images, present.duration_for_row);
+        present.duration_between_images, present.duration_for_row,
+        coalesce_rows);
 
     // Things to do before and after we show an image. Our goal is to keep
     // the terminal always in a good state (cursor on!) while also reacting
@@ -398,21 +578,34 @@ static int PresentImages(LoadedImageSources *loaded_sources,
     // Showing them in order of files on the command line.
     bool is_first    = true;
     int valid_images = 0;
-    for (auto &source_future : *loaded_sources) {
-        if (interrupt_received) break;
-        std::unique_ptr<timg::ImageSource> source(source_future.get());
+    std::unique_ptr<timg::ImageSource> source;
+    while (!interrupt_received && loaded_sources->Next(&source)) {
         if (!source) continue;
         valid_images++;
         *any_animations_seen |= source->IsAnimationBeforeFrameLimit();
         before_image_show(is_first);
-        source->SendFrames(present.duration_per_image, present.loops,
-                           interrupt_received,
-                           renderer->render_cb(
-                               source->FormatTitle(display_opts.title_format)));
+        timg::Renderer::WriteFramebufferFun sink = renderer->render_cb(
+            source->FormatTitle(display_opts.title_format));
+        if (PipelineStats::enabled() || PipelineStats::tracing()) {
+            sink = [sink](int x, int dy, const timg::Framebuffer &fb,
+                          timg::SeqType seq_type, const Duration &end) {
+                PipelineStats::FrameStarted();
+                PipelineStats::Scope trace("frame");
+                sink(x, dy, fb, seq_type, end);
+            };
+        }
+        {
+            PipelineStats::Scope trace("send-frames");
+            source->SendFrames(present.duration_per_image, present.loops,
+                               interrupt_received, sink);
+        }
         after_image_show();
         renderer->MaybeWaitBetweenImageSources();
         is_first = false;
     }
+    if (renderer->Flush() && present.hide_cursor) {
+        canvas->CursorOn();  // Cursor was switched off again with row.
+    }
     sequencer->Flush();
     return valid_images;
 }
@@ -445,6 +638,26 @@ static const char *PixelationToString(Pixelation p) {
     return "";  // Make compiler happy.
 }
 
+// Parse a time position given as plain seconds or as [[hh:]mm:]ss[.fraction]
+static std::optional<Duration> ParseTimePosition(const char *as_text) {
+    double seconds = 0;
+    for (;;) {
+        char *end;
+        const double value = strtod(as_text, &end);
+        if (end == as_text || !std::isfinite(value) || value < 0) {
+            return std::nullopt;
+        }
+        seconds = seconds * 60 + value;
+        if (*end == '\0') break;
+        if (*end != ':') return std::nullopt;
+        as_text = end + 1;
+    }
+    if (seconds * 1e9 >= (double)std::numeric_limits<int64_t>::max()) {
+        return std::nullopt;  // Would not fit in a Duration.
+    }
+    return Duration::Nanos(llround(seconds * 1e9));
+}
+
 // Print our version and various version numbers from our dependencies.
 static int PrintVersion(FILE *stream) {
     fprintf(stream, "timg " TIMG_VERSION
@@ -498,11 +711,15 @@ static int PrintVersion(FILE *stream) {
 #ifdef WITH_TIMG_VIDEO
     fprintf(stream, "Video decoding %s\n", timg::VideoSource::VersionInfo());
 #endif
-#ifdef WITH_TIMG_SIXEL
+#ifdef WITH_TIMG_LIBSIXEL
     fprintf(stream, "Libsixel version %s\n", LIBSIXEL_VERSION);
 #endif
     fprintf(stream,
+#ifdef WITH_TIMG_LIBSIXEL
             "Half, quarter, iterm2, and kitty graphics output: "
+#else
+            "Half, quarter, iterm2, kitty, and sixel graphics output: "
+#endif
             "timg builtin.\n");
     return 0;
 }
@@ -513,25 +730,39 @@ int main(int argc, char *argv[]) {
 #endif
 
     bool verbose                    = false;
-    const timg::TermSizeResult term = timg::DetermineTermSize();
+    bool benchmark                  = false;
+    const char *trace_file          = nullptr;
+    bool refresh_term_cache         = false;
+    if (timg::GetBoolenEnv("TIMG_TERM_CACHE")) {
+        timg::EnableTermQueryCache(timg::GetCacheDirectory(), false);
+    }
+    timg::TermSizeResult term = timg::DetermineTermSize();
 
     timg::DisplayOptions display_opts;
     timg::PresentationOptions present;
     present.terminal_use_upper_block =
         timg::GetBoolenEnv("TIMG_USE_UPPER_BLOCK");
+    present.block_encode_threads =
+        timg::GetIntEnv("TIMG_BLOCK_THREADS", kDefaultThreadCount);
 
     std::string bg_color         = "auto";
     const char *bg_pattern_color = nullptr;
     display_opts.allow_frame_skipping =
         timg::GetBoolenEnv("TIMG_ALLOW_FRAME_SKIP");
+    if (timg::GetBoolenEnv("TIMG_USE_CACHE")) {
+        display_opts.cache_dir = timg::GetCacheDirectory();
+    }
 
     int output_fd = STDOUT_FILENO;
-    std::vector<std::string> filelist;  // from -f<filelist> and command line
+    // from -f<filelist> and command line. Leaked, as reading might not
+    // be finished when we exit.
+    FilenameStream *const filelist = new FilenameStream();
     int frame_offset          = 0;
     int max_frames            = timg::kNotInitialized;
     bool do_img_loading       = true;
     bool do_vid_loading       = true;
     int thread_count          = kDefaultThreadCount;
+    int decode_processes      = 0;
     int geometry_width        = (term.cols - 2);
     int geometry_height       = (term.rows - 2);
     bool debug_no_frame_delay = false;
@@ -557,6 +788,7 @@ int main(int argc, char *argv[]) {
 
     enum LongOptionIds {
         OPT_CLEAR_SCREEN = 1000,
+        OPT_BENCHMARK,
         OPT_COLOR_256,
         OPT_COMPRESS_PIXEL,
         OPT_NO_FRAME_DELAY,
@@ -566,24 +798,30 @@ int main(int argc, char *argv[]) {
         OPT_PATTERN_SIZE,
         OPT_ROTATE,
         OPT_THREADS,
+        OPT_DECODE_PROCS,
         OPT_TITLE,
         OPT_VERBOSE,
         OPT_VERSION,
         OPT_MANPAGE_HELP,
         OPT_AUTO_CROP,
+        OPT_REFRESH_CACHE,
         OPT_SCROLL,
+        OPT_START_TIME,
+        OPT_TRACE,
     };
 
     // Flags with optional parameters need to be long-options, as on MacOS,
     // there is no way to have single-character options with
     static constexpr struct option long_options[] = {
         {"auto-crop",            optional_argument, NULL, OPT_AUTO_CROP     },
+        {"benchmark",            no_argument,       NULL, OPT_BENCHMARK     },
         {"center",               no_argument,       NULL, 'C'               },
         {"clear",                optional_argument, NULL, OPT_CLEAR_SCREEN  },
         {"color8",               no_argument,       NULL, OPT_COLOR_256     },
         {"compress",             optional_argument, NULL, OPT_COMPRESS_PIXEL},
         {"delta-move",           required_argument, NULL, 'd'               },
         {"debug-no-frame-delay", no_argument,       NULL, OPT_NO_FRAME_DELAY},
+        {"decode-processes",     required_argument, NULL, OPT_DECODE_PROCS  },
         {"frame-offset",         required_argument, NULL, OPT_FRAME_OFFSET  },
         {"fit-width",            no_argument,       NULL, 'W'               },
         {"frames",               required_argument, NULL, OPT_FRAME_COUNT   },
@@ -592,10 +830,13 @@ int main(int argc, char *argv[]) {
         {"loops",                optional_argument, NULL, 'c'               },
         {"pattern-size",         required_argument, NULL, OPT_PATTERN_SIZE  },
         {"pixelation",           required_argument, NULL, 'p'               },
+        {"refresh-term-cache",   no_argument,       NULL, OPT_REFRESH_CACHE },
         {"rotate",               required_argument, NULL, OPT_ROTATE        },
         {"scroll",               optional_argument, NULL, OPT_SCROLL        },
+        {"start-time",           required_argument, NULL, OPT_START_TIME    },
         {"threads",              required_argument, NULL, OPT_THREADS       },
         {"title",                optional_argument, NULL, OPT_TITLE         },
+        {"trace",                required_argument, NULL, OPT_TRACE         },
         {"upscale",              optional_argument, NULL, 'U'               },
         {"verbose",              no_argument,       NULL, OPT_VERBOSE       },
         {"version",              no_argument,       NULL, OPT_VERSION       },
@@ -660,6 +901,19 @@ int main(int argc, char *argv[]) {
             break;
         case OPT_FRAME_OFFSET: frame_offset = atoi(optarg); break;
         case OPT_FRAME_COUNT: max_frames = atoi(optarg); break;
+        case OPT_START_TIME:
+            if (auto start = ParseTimePosition(optarg)) {
+                display_opts.start_time = *start;
+            }
+            else {
+                fprintf(stderr,
+                        "--start-time: expected seconds or "
+                        "[[hh:]mm:]ss[.fraction], got '%s'\n",
+                        optarg);
+                return usage(argv[0], ExitCode::kParameterError,
+                             geometry_width, geometry_height);
+            }
+            break;
         case 'a': display_opts.antialias = false; break;
         case 'b': bg_color = std::string(optarg); break;
         case 'B': bg_pattern_color = strdup(optarg); break;
@@ -709,6 +963,7 @@ int main(int argc, char *argv[]) {
             }
             break;
         case OPT_THREADS: thread_count = atoi(optarg); break;
+        case OPT_DECODE_PROCS: decode_processes = atoi(optarg); break;
         case 'd':
             if (sscanf(optarg, "%d:%d", &display_opts.scroll_dx,
                        &display_opts.scroll_dy) < 1) {
@@ -740,7 +995,7 @@ int main(int argc, char *argv[]) {
             }
             break;
         case 'F':
-            if (!AppendToFileList(optarg, true, &filelist)) {
+            if (!filelist->AddFileList(optarg, true)) {
                 return usage(argv[0], ExitCode::kFilelistProblem,
                              geometry_width, geometry_height);
             }
@@ -761,7 +1016,7 @@ int main(int argc, char *argv[]) {
             }
             break;
         case 'f':
-            if (!AppendToFileList(optarg, false, &filelist)) {
+            if (!filelist->AddFileList(optarg, false)) {
                 return usage(argv[0], ExitCode::kFilelistProblem,
                              geometry_width, geometry_height);
             }
@@ -776,7 +1031,10 @@ int main(int argc, char *argv[]) {
             }
             break;
         case OPT_COMPRESS_PIXEL:
-            if (optarg) {
+            if (optarg && strcasecmp(optarg, "auto") == 0) {
+                display_opts.compress_pixel_level = timg::kAdaptiveCompression;
+            }
+            else if (optarg) {
                 int level = atoi(optarg);
                 level     = (level >= 0 && level <= 9) ? level : 1;
                 display_opts.compress_pixel_level = level;
@@ -787,7 +1045,13 @@ int main(int argc, char *argv[]) {
             break;
         case OPT_COLOR_256: present.use_256_color = true; break;
         case OPT_VERBOSE: verbose = true; break;
+        case OPT_BENCHMARK: benchmark = true; break;
+        case OPT_TRACE:
+            trace_file = optarg;
+            PipelineStats::EnableTrace();
+            break;
         case OPT_NO_FRAME_DELAY: debug_no_frame_delay = true; break;
+        case OPT_REFRESH_CACHE: refresh_term_cache = true; break;
         case OPT_MANPAGE_HELP:
             InvokeHelpPager();
             return 0;
@@ -803,6 +1067,12 @@ int main(int argc, char *argv[]) {
 
     // -- A sieve of sanity checks and configuration refinement.
 
+    // The cell size might've been taken from the cache before we knew.
+    if (refresh_term_cache) {
+        timg::EnableTermQueryCache(timg::GetCacheDirectory(), true);
+        term = timg::DetermineTermSize();
+    }
+
     if (geometry_width < 1 || geometry_height < 1) {
         if (term.cols < 0 || term.rows < 0) {
             fprintf(stderr,
@@ -850,6 +1120,12 @@ int main(int argc, char *argv[]) {
         if (term.font_width_px > 0 && term.font_height_px > 0) {
             auto graphics_info      = timg::QuerySupportedGraphicsProtocol();
             present.tmux_workaround = graphics_info.in_tmux;
+            present.kitty_animation_frames =
+                graphics_info.kitty_animation_frames;
+            present.kitty_placements = graphics_info.kitty_placements;
+            if (graphics_info.kitty_shared_memory) {
+                present.kitty_medium = KittyMedium::kSharedMemory;
+            }
             switch (graphics_info.preferred_graphics) {
             case timg::GraphicsProtocol::kIterm2:
                 present.pixelation = Pixelation::kiTerm2Graphics;
@@ -872,8 +1148,13 @@ int main(int argc, char *argv[]) {
     }
     else if (present.pixelation == Pixelation::kKittyGraphics) {
         // If the user manually chooses kitty, we still need to know if in tmux
-        auto graphics_info      = timg::QuerySupportedGraphicsProtocol();
-        present.tmux_workaround = graphics_info.in_tmux;
+        auto graphics_info = timg::QuerySupportedGraphicsProtocol();
+        present.tmux_workaround        = graphics_info.in_tmux;
+        present.kitty_animation_frames = graphics_info.kitty_animation_frames;
+        present.kitty_placements       = graphics_info.kitty_placements;
+        if (graphics_info.kitty_shared_memory) {
+            present.kitty_medium = KittyMedium::kSharedMemory;
+        }
     }
 #if defined(WITH_TIMG_SIXEL)
     // If the user manually choose sixel, we still can't avoid a terminal
@@ -885,6 +1166,19 @@ int main(int argc, char *argv[]) {
     }
 #endif
 
+    // Auto-detection of a local terminal is conservative, allow to override.
+    if (const char *medium = getenv("TIMG_KITTY_MEDIUM")) {
+        if (strcasecmp(medium, "direct") == 0) {
+            present.kitty_medium = KittyMedium::kDirect;
+        }
+        else if (strcasecmp(medium, "shm") == 0) {
+            present.kitty_medium = KittyMedium::kSharedMemory;
+        }
+        else if (strcasecmp(medium, "file") == 0) {
+            present.kitty_medium = KittyMedium::kTempFile;
+        }
+    }
+
     // The high-res image terminals provide alpha-blending, no need to
     // query the terminal color for 'auto'
     if (is_pixel_direct_with_alpha(present.pixelation) &&
@@ -934,10 +1228,10 @@ int main(int argc, char *argv[]) {
     display_opts.height = geometry_height * display_opts.cell_y_px;
 
     for (int imgarg = optind; imgarg < argc && !interrupt_received; ++imgarg) {
-        filelist.push_back(argv[imgarg]);
+        filelist->AddFile(argv[imgarg]);
     }
 
-    if (filelist.empty()) {
+    if (filelist->inputs() == 0) {
         fprintf(stderr,
                 "Expected image filename(s) on command line "
                 "or via -f\n");
@@ -973,8 +1267,9 @@ int main(int argc, char *argv[]) {
     }
 
     // If nothing is set to limit animations but we have multiple images,
-    // set some sensible limit.
-    if (filelist.size() > 1 && present.loops == timg::kNotInitialized &&
+    // set some sensible limit. File lists are assumed to have multiple.
+    if ((filelist->inputs() > 1 || filelist->has_file_lists()) &&
+        present.loops == timg::kNotInitialized &&
         present.duration_per_image == Duration::InfiniteFuture()) {
         present.loops = 1;  // Don't get stuck on the first endless-loop
     }
@@ -984,14 +1279,28 @@ int main(int argc, char *argv[]) {
         display_opts.height -= display_opts.cell_y_px * present.grid_rows;
     }
 
-    // Asynconrous image loading (filelist.size()) and terminal query (+1)
+    // The aync write queue (BufferedWriteSequencer) lines up the next
+    // buffers to be emitted.
+    static constexpr int kAsyncWriteQueueSize = 4;
+
+    // One pool for asynchronous image loading, the terminal query and
+    // encoding of the frames to be shown. It should be able to encode
+    // everything that is in the write queue in parallel.
     thread_count = (thread_count > 0 ? thread_count : kDefaultThreadCount);
 
+    // Worker processes are forked, which needs to happen before there
+    // are any threads.
+    if (decode_processes > 0) {
+        timg::DecoderProcessPool::Start(decode_processes);
+    }
+
     // Note: this thread pool will be leaked explicitly to not unnecessarily
     // have to wait on potentially blocking cleanup at program exit where it
     // does not matter.
-    timg::ThreadPool *const pool =
-        new timg::ThreadPool(std::min(thread_count, (int)filelist.size() + 1));
+    // One thread is kept for high priority work such as encoding, as the
+    // next frame waits on it, while loading images can take long.
+    timg::ThreadPool *const pool = new timg::ThreadPool(
+        std::max(thread_count, kAsyncWriteQueueSize + 1), 1);
 
     std::future<rgba_t> background_color_future;
     if (strcasecmp(bg_color.c_str(), "auto") == 0) {
@@ -1001,7 +1310,8 @@ int main(int argc, char *argv[]) {
         // Finding the background color might take a while, so we query
         // it asynchonously and only force a wait on it once an image display
         // actually queries it.
-        background_color_future     = pool->ExecAsync(query_terminal);
+        background_color_future = pool->ExecAsync(
+            query_terminal, timg::ThreadPool::Priority::kHigh);
         display_opts.bgcolor_getter = [&background_color_future]() {
             static const rgba_t value = background_color_future.get();  // once
             return value;
@@ -1011,6 +1321,7 @@ int main(int argc, char *argv[]) {
         const rgba_t bg             = rgba_t::ParseColor(bg_color.c_str());
         display_opts.bgcolor_getter = [bg]() { return bg; };
     }
+    display_opts.bg_color_name = bg_color;
 
     display_opts.bg_pattern_color = rgba_t::ParseColor(bg_pattern_color);
 
@@ -1023,44 +1334,79 @@ int main(int argc, char *argv[]) {
     std::mutex errors_lock;  // Collect any errors to display later.
     std::deque<std::string> errors;
 
-    // Async image loading, preparing them in a thread pool
-    LoadedImageSources loaded_sources;
-    for (const std::string &filename : filelist) {
-        if (interrupt_received) break;
-        const std::function<timg::ImageSource *()> f =
-            [filename, frame_offset, max_frames, do_img_loading, do_vid_loading,
-             &display_opts, &exit_code, &errors_lock,
-             &errors]() -> timg::ImageSource * {
-            if (interrupt_received) return nullptr;
-            // TODO: after switch to c++17, use variant in return ?
-            std::string err;
-            ImageSource *result = ImageSource::Create(
-                filename, display_opts, frame_offset, max_frames,
-                do_img_loading, do_vid_loading, &err);
-            if (!result) {
-                std::unique_lock<std::mutex> l(errors_lock);
-                exit_code = ExitCode::kImageReadError;
-                if (!err.empty()) errors.push_back(err);
-            }
-            return result;
-        };
-        loaded_sources.push_back(pool->ExecAsync(f));
-    }
-
-    // The aync write queue (BufferedWriteSequencer) lines up the next
-    // buffers to be emitted.
-    static constexpr int kAsyncWriteQueueSize = 4;
-
     // Since Unicode blocks emit differences, we can't skip frames in output.
+    // Same for kitty if it only sends changed regions of animation frames.
     // TODO: should probably better ask the canvas directly instead.
-    const bool buffer_allow_skipping = (display_opts.allow_frame_skipping &&
-                                        is_pixel_direct_p(present.pixelation));
+    const bool buffer_allow_skipping =
+        (display_opts.allow_frame_skipping &&
+         is_pixel_direct_p(present.pixelation) &&
+         !(present.pixelation == Pixelation::kKittyGraphics &&
+           present.kitty_animation_frames));
+    if (benchmark) {
+        PipelineStats::Enable();
+        debug_no_frame_delay = true;  // As fast as possible.
+    }
     timg::BufferedWriteSequencer sequencer(
         output_fd, buffer_allow_skipping, kAsyncWriteQueueSize,
         debug_no_frame_delay, interrupt_received);
+
+    // Allow sources to not even bother preparing frames that will be skipped.
+    display_opts.frame_is_late = [&sequencer](const Duration &end_of_frame) {
+        return sequencer.SkipLateFrame(end_of_frame);
+    };
+
+    // Async image loading, preparing them in a thread pool. Keep enough
+    // in flight to fill the pool and the next grid page.
+    const LoadedImageSources::LoadFunction load_source =
+        [frame_offset, max_frames, do_img_loading, do_vid_loading,
+         &display_opts, &exit_code, &errors_lock,
+         &errors](const std::string &filename) -> timg::ImageSource * {
+        if (interrupt_received) return nullptr;
+        // TODO: after switch to c++17, use variant in return ?
+        std::string err;
+        ImageSource *result = nullptr;
+#ifdef WITH_TIMG_VIDEO
+        // Load downloaded URLs from memory. If that fails, it might still
+        // be something the video decoder can read from the URL directly.
+        if (url_fetcher && timg::UrlFetcher::IsUrl(filename)) {
+            std::shared_ptr<timg::FetchedFile> fetched =
+                url_fetcher->Get(filename);
+            if (fetched) {
+                result = ImageSource::Create(fetched->path(), display_opts,
+                                             frame_offset, max_frames,
+                                             do_img_loading, do_vid_loading,
+                                             &err);
+                if (result) result->SetOrigin(filename, fetched);
+                err.clear();
+            }
+        }
+#endif
+        if (!result) {
+            result = ImageSource::Create(filename, display_opts, frame_offset,
+                                         max_frames, do_img_loading,
+                                         do_vid_loading, &err);
+        }
+        if (!result) {
+            std::unique_lock<std::mutex> l(errors_lock);
+            exit_code = ExitCode::kImageReadError;
+            if (!err.empty()) errors.push_back(err);
+        }
+        return result;
+    };
+    const size_t lookahead =
+        2 * thread_count + present.grid_cols * present.grid_rows;
+#ifdef WITH_TIMG_VIDEO
+    if (do_img_loading) {
+        url_fetcher =
+            new timg::UrlFetcher(kUrlFetchConnections, interrupt_received);
+    }
+#endif
+    filelist->Start();
+    LoadedImageSources loaded_sources(pool, filelist, lookahead, load_source);
+
     const Time start_show = Time::Now();
     const int successful_images =
-        PresentImages(&loaded_sources, display_opts, present, &sequencer,
+        PresentImages(&loaded_sources, display_opts, present, &sequencer, pool,
                       &cell_size_warning_needed);
     const Time end_show = Time::Now();
 
@@ -1151,13 +1497,15 @@ int main(int argc, char *argv[]) {
         fprintf(stderr,
                 "%d file%s (%d successful); %s written (%s/s) "
                 "%" PRId64 " frames",
-                (int)filelist.size(), filelist.size() == 1 ? "" : "s",
+                (int)loaded_sources.files_seen(),
+                loaded_sources.files_seen() == 1 ? "" : "s",
                 successful_images,
                 timg::HumanReadableByteValue(written_bytes).c_str(),
                 timg::HumanReadableByteValue(written_bytes / d).c_str(),
                 sequencer.frames_total());
         // Only show FPS if we have one video or animation
-        if (filelist.size() == 1 && sequencer.frames_total() > 50) {
+        if (loaded_sources.files_seen() == 1 &&
+            sequencer.frames_total() > 50) {
             fprintf(stderr, "; %.1ffps", sequencer.frames_total() / d);
         }
         if (display_opts.allow_frame_skipping && sequencer.frames_total() > 0) {
@@ -1167,6 +1515,29 @@ int main(int argc, char *argv[]) {
                 100.0 * sequencer.frames_skipped() / sequencer.frames_total());
         }
         fprintf(stderr, "\n");
+        const auto write_stats = sequencer.write_stats();
+        if (write_stats.writes > 0) {
+            fprintf(stderr,
+                    "Output: %" PRId64 " writes; latency avg %.1fms, "
+                    "max %.1fms",
+                    write_stats.writes,
+                    write_stats.write_ns / 1e6 / write_stats.writes,
+                    write_stats.max_write_ns / 1e6);
+            if (write_stats.stalls > 0) {
+                fprintf(stderr, "; %" PRId64 " stalls (%.1fs total)",
+                        write_stats.stalls, write_stats.stall_ns / 1e9);
+            }
+            if (write_stats.max_backlog > 0) {
+                fprintf(stderr, "; up to %s queued",
+                        timg::HumanReadableByteValue(write_stats.max_backlog)
+                            .c_str());
+            }
+            fprintf(stderr, "\n");
+        }
+        if (display_opts.compress_pixel_level == timg::kAdaptiveCompression) {
+            fprintf(stderr, "Adaptive compression level at end: %d\n",
+                    sequencer.adaptive_compression_level());
+        }
 
         auto print_env = [](const char *env) {
             const char *value = getenv(env);
@@ -1178,9 +1549,25 @@ int main(int argc, char *argv[]) {
         print_env("TIMG_DEFAULT_TITLE");
         print_env("TIMG_ALLOW_FRAME_SKIP");
         print_env("TIMG_USE_UPPER_BLOCK");
+        print_env("TIMG_USE_CACHE");
+        print_env("TIMG_BLOCK_THREADS");
+        print_env("TIMG_KITTY_MEDIUM");
+        print_env("TIMG_SIXEL_BUILTIN");
+        print_env("TIMG_VIDEO_HWACCEL");
         print_env("TIMG_FONT_WIDTH_CORRECT");
     }
 
+    if (benchmark) {
+        fprintf(stderr, "Benchmark: %.3fs total\n",
+                (end_show - start_show).nanoseconds() / 1e9);
+        PipelineStats::PrintReport(stderr);
+    }
+
+    if (trace_file && !PipelineStats::WriteTrace(trace_file)) {
+        fprintf(stderr, "Could not write trace to %s: %s\n", trace_file,
+                strerror(errno));
+    }
+
     if (cell_size_unknown_in_pixel_mode && cell_size_warning_needed) {
         fprintf(stderr,
                 "Terminal does not support pixel size query, "
@@ -15,21 +15,31 @@
 
 #include "unicode-block-canvas.h"
 
+#include <algorithm>
 #include <cmath>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <functional>
+#include <future>
+#include <string>
 #include <utility>
+#include <vector>
 
 #include "buffered-write-sequencer.h"
+#include "encoded-frame-cache.h"
 #include "framebuffer.h"
+#include "pipeline-stats.h"
 #include "terminal-canvas.h"
+#include "thread-pool.h"
 #include "timg-time.h"
 
 #define SCREEN_CURSOR_UP_FORMAT    "\033[%dA"  // Move cursor up given lines.
 #define SCREEN_CURSOR_DN_FORMAT    "\033[%dB"  // Move cursor down given lines.
 #define SCREEN_CURSOR_RIGHT_FORMAT "\033[%dC"  // Move cursor right given cols
+#define SCREEN_INSERT_LINES_FORMAT "\033[%dL"  // Insert lines at cursor.
+#define SCREEN_DELETE_LINES_FORMAT "\033[%dM"  // Delete lines at cursor.
 
 #define PIXEL_BLOCK_CHARACTER_LEN strlen("\u2584")  // blocks are 3 bytes UTF8
 
@@ -88,13 +98,18 @@ static constexpr const char *kBlockGlyphs[9] = {
 };
 
 UnicodeBlockCanvas::UnicodeBlockCanvas(BufferedWriteSequencer *ws,
-                                       bool use_quarter,
+                                       ThreadPool *thread_pool,
+                                       int encode_bands, bool use_quarter,
                                        bool use_upper_half_block,
-                                       bool use_256_color)
+                                       bool use_256_color,
+                                       bool allow_line_shift)
     : TerminalCanvas(ws),
+      executor_(thread_pool),
+      encode_bands_(thread_pool ? encode_bands : 1),
       use_quarter_blocks_(use_quarter),
       use_upper_half_block_(use_upper_half_block),
-      use_256_color_(use_256_color) {}
+      use_256_color_(use_256_color),
+      allow_line_shift_(allow_line_shift) {}
 
 UnicodeBlockCanvas::~UnicodeBlockCanvas() {
     free(backing_buffer_);
@@ -110,11 +125,11 @@ template <int colorbits>
 static inline const char *AnsiSetBG() {
     return colorbits == 8 ? PIXEL_SET_BG_COLOR8 : PIXEL_SET_BG_COLOR24;
 }
+// Colors in 8 bit mode are expected to be converted with PaletteColor().
 template <int colorbits>
 static char *AnsiWriteColor(char *buf, rgba_t color) {
     static_assert(colorbits == 8 || colorbits == 24, "unsupported color bits");
-    if (colorbits == 8)
-        return int_append_with_semicolon(buf, color.As256TermColor());
+    if (colorbits == 8) return int_append_with_semicolon(buf, color.r);
 
     buf = int_append_with_semicolon(buf, color.r);
     buf = int_append_with_semicolon(buf, color.g);
@@ -135,6 +150,26 @@ inline bool EqualToBacking(const rgba_t *top, const rgba_t *bottom,
            *bottom == backing[2] && *(bottom + 1) == backing[3];
 }
 
+// Compare a whole double-row of pixels with its backing store.
+template <int N>
+static bool DoubleRowEqualToBacking(int width, const rgba_t *top,
+                                    const rgba_t *bottom,
+                                    const rgba_t *backing) {
+    for (int x = 0; x < width;
+         x += N, top += N, bottom += N, backing += 2 * N) {
+        if (!EqualToBacking<N>(top, bottom, backing)) return false;
+    }
+    return true;
+}
+
+// If all pixels of the cell are fully transparent, there is nothing to draw.
+template <int N>
+inline bool CellFullyTransparent(const rgba_t *top, const rgba_t *bottom) {
+    if (N == 1) return top->a == 0 && bottom->a == 0;
+    return top[0].a == 0 && top[1].a == 0 && bottom[0].a == 0 &&
+           bottom[1].a == 0;
+}
+
 // Store pixels of top and bottom row into backing store.
 template <int N>
 inline void StoreBacking(rgba_t *backing, const rgba_t *top,
@@ -153,12 +188,49 @@ inline void StoreBacking(rgba_t *backing, const rgba_t *top,
 
 inline bool is_transparent(rgba_t c) { return c.a < 0x60; }
 
+// In 8 bit mode, many colors end up as the same palette entry. Represent
+// them by the palette index in "r", so that colors compare equal if they
+// are equal on screen and switching between them needs no escape sequence.
+static inline rgba_t PaletteColor(rgba_t color) {
+    return {color.As256TermColor(), 0, 0,
+            (uint8_t)(is_transparent(color) ? 0x00 : 0xff)};
+}
+
 struct UnicodeBlockCanvas::GlyphPick {
     rgba_t fg;
     rgba_t bg;
     BlockChoice block;
 };
 
+// Don't bother splitting up the work if there are less double-rows per band.
+static constexpr int kMinRowsPerBand = 8;
+
+// Number of quarter-block cells FindBestQuarterGlyphs() looks at at once.
+static constexpr int kBatchCells = 8;
+
+// Determine foreground and background color for the given quarter block
+// and return the sum of color distances of each sub-block to these.
+static inline float QuarterBlockColors(BlockChoice block, const LinearColor &tl,
+                                       const LinearColor &tr,
+                                       const LinearColor &bl,
+                                       const LinearColor &br, LinearColor *fg,
+                                       LinearColor *bg) {
+    // clang-format off
+    switch (block) {
+    case kBackground:      { float d = avd(bg, {tl, tr, bl, br}); *fg = *bg; return d; }
+    case kTopLeft:         { float d = avd(bg, {tr, bl, br});     *fg = tl;  return d; }
+    case kTopRight:        { float d = avd(bg, {tl, bl, br});     *fg = tr;  return d; }
+    case kBotLeft:         { float d = avd(bg, {tl, tr, br});     *fg = bl;  return d; }
+    case kBotRight:        { float d = avd(bg, {tl, tr, bl});     *fg = br;  return d; }
+    case kLeftBar:         return avd(bg, {tr, br}) + avd(fg, {tl, bl});
+    case kTopLeftBotRight: return avd(bg, {tr, bl}) + avd(fg, {tl, br});
+    case kLowerBlock:      return avd(bg, {tl, tr}) + avd(fg, {bl, br});
+    case kUpperBlock:      return avd(bg, {bl, br}) + avd(fg, {tl, tr});
+    }
+    // clang-format on
+    return 1e12;
+}
+
 template <int N>
 UnicodeBlockCanvas::GlyphPick UnicodeBlockCanvas::FindBestGlyph(
     const rgba_t *top, const rgba_t *bottom) const {
@@ -196,7 +268,6 @@ UnicodeBlockCanvas::GlyphPick UnicodeBlockCanvas::FindBestGlyph(
     } best;
     float best_distance = 1e12;
     for (int b = 0; b < 8; ++b) {
-        float d;  // Sum of color distance for each sub-block to average color
         LinearColor fg, bg;
         // We can't fix all the blocks that the user tries to work around
         // with TIMG_USE_UPPER_BLOCK. But fix the half-blocks at least.
@@ -204,19 +275,7 @@ UnicodeBlockCanvas::GlyphPick UnicodeBlockCanvas::FindBestGlyph(
             (BlockChoice)(b < 7 ? b
                                 : (use_upper_half_block_ ? kUpperBlock
                                                          : kLowerBlock));
-        // clang-format off
-        switch (block) {
-        case kBackground:      d = avd(&bg, {tl, tr, bl, br}); fg = bg;   break;
-        case kTopLeft:         d = avd(&bg, {tr, bl, br});     fg = tl;   break;
-        case kTopRight:        d = avd(&bg, {tl, bl, br});     fg = tr;   break;
-        case kBotLeft:         d = avd(&bg, {tl, tr, br});     fg = bl;   break;
-        case kBotRight:        d = avd(&bg, {tl, tr, bl});     fg = br;   break;
-        case kLeftBar:         d = avd(&bg, {tr, br})+avd(&fg, {tl, bl}); break;
-        case kTopLeftBotRight: d = avd(&bg, {tr, bl})+avd(&fg, {tl, br}); break;
-        case kLowerBlock:      d = avd(&bg, {tl, tr})+avd(&fg, {bl, br}); break;
-        case kUpperBlock:      d = avd(&bg, {bl, br})+avd(&fg, {tl, tr}); break;
-        }
-        // clang-format on
+        const float d = QuarterBlockColors(block, tl, tr, bl, br, &fg, &bg);
         if (d < best_distance) {
             best = {fg, bg, block};
             if (d < 1) break;  // Essentially zero.
@@ -226,12 +285,165 @@ UnicodeBlockCanvas::GlyphPick UnicodeBlockCanvas::FindBestGlyph(
     return {best.fg.repack(), best.bg.repack(), best.block};
 }
 
+// The batch glyph finder evaluates kBatchCells quarter-block cells in
+// parallel, one per vector lane. Using the compiler vector extensions, this
+// maps to SSE/AVX2 on x86 and NEON on ARM.
+// Results must be identical to the scalar version, so all the arithmetic
+// is done in exactly the same order as in avd() (this is also why this
+// file is compiled with -ffp-contract=off: no fused multiply-add).
+#if defined(__GNUC__)
+typedef float batch_float __attribute__((vector_size(kBatchCells * 4)));
+typedef int32_t batch_int __attribute__((vector_size(kBatchCells * 4)));
+
+namespace {
+struct BatchColor {
+    batch_float r, g, b;
+};
+}  // namespace
+
+// Same as avd(), just without alpha and for all lanes. Distance sum is
+// stored in "sum".
+template <int n>
+static inline void batch_avd(const BatchColor *const (&values)[n],
+                             batch_float *sum) {
+    *sum = batch_float{};
+    BatchColor res = *values[0];
+    for (int i = 1; i < n; ++i) {
+        res.r += values[i]->r;
+        res.g += values[i]->g;
+        res.b += values[i]->b;
+    }
+    res.r /= (float)n;
+    res.g /= (float)n;
+    res.b /= (float)n;
+    for (int i = 0; i < n; ++i) {
+        const batch_float dr = values[i]->r - res.r;
+        const batch_float dg = values[i]->g - res.g;
+        const batch_float db = values[i]->b - res.b;
+        *sum += dr * dr + dg * dg + db * db;
+    }
+}
+
+// Choose the best block for each of up to kBatchCells cells.
+#if defined(__x86_64__) && defined(__linux__) && defined(__has_attribute)
+#if __has_attribute(target_clones)
+__attribute__((target_clones("avx2", "default")))
+#endif
+#endif
+static void ChooseQuarterBlocks(const rgba_t *top, const rgba_t *bottom,
+                                int count, bool use_upper_half_block,
+                                BlockChoice *choice) {
+    BatchColor tl = {}, tr = {}, bl = {}, br = {};
+    for (int i = 0; i < count; ++i) {
+        const LinearColor ctl(top[2 * i]), ctr(top[2 * i + 1]);
+        const LinearColor cbl(bottom[2 * i]), cbr(bottom[2 * i + 1]);
+        tl.r[i] = ctl.r, tl.g[i] = ctl.g, tl.b[i] = ctl.b;
+        tr.r[i] = ctr.r, tr.g[i] = ctr.g, tr.b[i] = ctr.b;
+        bl.r[i] = cbl.r, bl.g[i] = cbl.g, bl.b[i] = cbl.b;
+        br.r[i] = cbr.r, br.g[i] = cbr.g, br.b[i] = cbr.b;
+    }
+
+    batch_float best_distance;
+    batch_int best_block, done;  // done: 0 or -1 (all bits set) per lane.
+    for (int i = 0; i < kBatchCells; ++i) {
+        best_distance[i] = 1e12;
+        best_block[i]    = kBackground;
+        done[i]          = 0;
+    }
+    for (int b = 0; b < 8; ++b) {
+        const BlockChoice block =
+            (BlockChoice)(b < 7 ? b
+                                : (use_upper_half_block ? kUpperBlock
+                                                        : kLowerBlock));
+        batch_float d, d2 = {};  // d2: second part of two-color blocks.
+        // clang-format off
+        switch (block) {
+        case kBackground:      batch_avd<4>({&tl, &tr, &bl, &br}, &d); break;
+        case kTopLeft:         batch_avd<3>({&tr, &bl, &br}, &d);      break;
+        case kTopRight:        batch_avd<3>({&tl, &bl, &br}, &d);      break;
+        case kBotLeft:         batch_avd<3>({&tl, &tr, &br}, &d);      break;
+        case kBotRight:        batch_avd<3>({&tl, &tr, &bl}, &d);      break;
+        case kLeftBar:         batch_avd<2>({&tr, &br}, &d);
+                               batch_avd<2>({&tl, &bl}, &d2);          break;
+        case kTopLeftBotRight: batch_avd<2>({&tr, &bl}, &d);
+                               batch_avd<2>({&tl, &br}, &d2);          break;
+        case kLowerBlock:      batch_avd<2>({&tl, &tr}, &d);
+                               batch_avd<2>({&bl, &br}, &d2);          break;
+        case kUpperBlock:      batch_avd<2>({&bl, &br}, &d);
+                               batch_avd<2>({&tl, &tr}, &d2);          break;
+        }
+        // clang-format on
+        if (block >= kLeftBar) d += d2;
+        // Same as the scalar loop: take if better, stop if essentially zero.
+        const batch_int update = ~done & (d < best_distance);
+        best_block    = (update & (int32_t)block) | (~update & best_block);
+        best_distance = (batch_float)(((batch_int)d & update) |
+                                      ((batch_int)best_distance & ~update));
+        done |= update & (d < 1);
+    }
+    for (int i = 0; i < count; ++i) {
+        choice[i] = (BlockChoice)best_block[i];
+    }
+}
+#else
+static void ChooseQuarterBlocks(const rgba_t *top, const rgba_t *bottom,
+                                int count, bool use_upper_half_block,
+                                BlockChoice *choice) {
+    for (int i = 0; i < count; ++i) {
+        const LinearColor tl(top[2 * i]), tr(top[2 * i + 1]);
+        const LinearColor bl(bottom[2 * i]), br(bottom[2 * i + 1]);
+        float best_distance = 1e12;
+        choice[i]           = kBackground;
+        for (int b = 0; b < 8; ++b) {
+            const BlockChoice block =
+                (BlockChoice)(b < 7 ? b
+                                    : (use_upper_half_block ? kUpperBlock
+                                                            : kLowerBlock));
+            LinearColor fg, bg;
+            const float d = QuarterBlockColors(block, tl, tr, bl, br, &fg, &bg);
+            if (d < best_distance) {
+                choice[i] = block;
+                if (d < 1) break;
+                best_distance = d;
+            }
+        }
+    }
+}
+#endif
+
+void UnicodeBlockCanvas::FindBestQuarterGlyphs(const rgba_t *top,
+                                               const rgba_t *bottom, int count,
+                                               GlyphPick *picks) const {
+    BlockChoice choice[kBatchCells];
+    ChooseQuarterBlocks(top, bottom, count, use_upper_half_block_, choice);
+    for (int i = 0; i < count; ++i, top += 2, bottom += 2) {
+        if ((is_transparent(top[0]) && is_transparent(top[1])) ||
+            (is_transparent(bottom[0]) && is_transparent(bottom[1]))) {
+            picks[i] = FindBestGlyph<2>(top, bottom);  // special cases.
+            continue;
+        }
+        LinearColor fg, bg;
+        QuarterBlockColors(choice[i], top[0], top[1], bottom[0], bottom[1],
+                           &fg, &bg);
+        picks[i] = {fg.repack(), bg.repack(), choice[i]};
+    }
+}
+
+// Emit cursor down or newlines, whatever is shorter
+static char *AppendCursorDown(char *pos, int rows) {
+    if (rows <= 4) {
+        memset(pos, '\n', rows);
+        return pos + rows;
+    }
+    return pos + sprintf(pos, SCREEN_CURSOR_DN_FORMAT, rows);
+}
+
 // Append two rows of pixels at once.
 template <int N, int colorbits>  // Advancing N x-pixels per char
 char *UnicodeBlockCanvas::AppendDoubleRow(char *pos, int indent, int width,
                                           const rgba_t *tline,
-                                          const rgba_t *bline, bool emit_diff,
-                                          int *y_skip) {
+                                          const rgba_t *bline, rgba_t *backing,
+                                          bool emit_diff, int *y_skip) {
     static constexpr char kStartEscape[] = "\033[";
     GlyphPick last                       = {};
     rgba_t last_foreground               = {};
@@ -239,21 +451,25 @@ char *UnicodeBlockCanvas::AppendDoubleRow(char *pos, int indent, int width,
     bool last_bg_unknown                 = true;
     int x_skip                           = indent;
     const char *start                    = pos;
+    GlyphPick batch[kBatchCells];  // Quarter blocks are evaluated in batches
+    int batch_start = -kBatchCells;
     for (int x = 0; x < width;
-         x += N, prev_content_it_ += 2 * N, tline += N, bline += N) {
-        if (emit_diff && EqualToBacking<N>(tline, bline, prev_content_it_)) {
+         x += N, backing += 2 * N, tline += N, bline += N) {
+        if (emit_diff && EqualToBacking<N>(tline, bline, backing)) {
+            ++x_skip;
+            continue;
+        }
+        if (!emit_diff && CellFullyTransparent<N>(tline, bline)) {
+            // Leave the screen as-is, e.g. between images of a grid row.
+            // Only moving right; the row itself is always finished with a
+            // newline below, so that the terminal scrolls as needed.
+            StoreBacking<N>(backing, tline, bline);
             ++x_skip;
             continue;
         }
 
-        if (*y_skip) {  // Emit cursor down or newlines, whatever is shorter
-            if (*y_skip <= 4) {
-                memset(pos, '\n', *y_skip);
-                pos += *y_skip;
-            }
-            else {
-                pos += sprintf(pos, SCREEN_CURSOR_DN_FORMAT, *y_skip);
-            }
+        if (*y_skip) {
+            pos     = AppendCursorDown(pos, *y_skip);
             *y_skip = 0;
         }
 
@@ -262,7 +478,23 @@ char *UnicodeBlockCanvas::AppendDoubleRow(char *pos, int indent, int width,
             x_skip = 0;
         }
 
-        const GlyphPick pick = FindBestGlyph<N>(tline, bline);
+        GlyphPick pick;
+        if (N == 2) {
+            const int cell = x / 2;
+            if (cell >= batch_start + kBatchCells) {
+                batch_start     = cell;
+                const int count = std::min(kBatchCells, (width - x + 1) / 2);
+                FindBestQuarterGlyphs(tline, bline, count, batch);
+            }
+            pick = batch[cell - batch_start];
+        }
+        else {
+            pick = FindBestGlyph<N>(tline, bline);
+        }
+        if (colorbits == 8) {
+            pick.fg = PaletteColor(pick.fg);
+            pick.bg = PaletteColor(pick.bg);
+        }
 
         bool color_emitted = false;
 
@@ -307,10 +539,10 @@ char *UnicodeBlockCanvas::AppendDoubleRow(char *pos, int indent, int width,
                              PIXEL_BLOCK_CHARACTER_LEN);
         }
         last = pick;
-        StoreBacking<N>(prev_content_it_, tline, bline);
+        StoreBacking<N>(backing, tline, bline);
     }
 
-    if (pos == start) {  // Nothing emitted for whole line
+    if (pos == start && emit_diff) {  // Nothing emitted for whole line
         (*y_skip)++;
     }
     else {
@@ -320,11 +552,159 @@ char *UnicodeBlockCanvas::AppendDoubleRow(char *pos, int indent, int width,
     return pos;
 }
 
+char *UnicodeBlockCanvas::AppendRows(char *pos, int x, const Framebuffer &fb,
+                                     int row_offset, int y_begin, int y_end,
+                                     bool emit_difference, int *y_skip) {
+    PipelineStats::Scope timing(Stage::kEncode);
+    const int width          = fb.width();
+    const int height         = fb.height();
+    const int N              = use_quarter_blocks_ ? 2 : 1;
+    const int backing_stride = 2 * N * ((width + N - 1) / N);
+    for (int y = y_begin; y < y_end; y += 2) {
+        const int row             = y + row_offset;
+        const rgba_t *top_row     = row < 0 ? empty_line_ : fb.row(row);
+        const rgba_t *bottom_row =
+            (row + 1) >= height ? empty_line_ : fb.row(row + 1);
+        rgba_t *const backing_row = backing_buffer_ + (y / 2) * backing_stride;
+
+        if (use_256_color_) {
+            if (use_quarter_blocks_) {
+                pos = AppendDoubleRow<2, 8>(pos, x, width, top_row, bottom_row,
+                                            backing_row, emit_difference,
+                                            y_skip);
+            }
+            else {
+                pos = AppendDoubleRow<1, 8>(pos, x, width, top_row, bottom_row,
+                                            backing_row, emit_difference,
+                                            y_skip);
+            }
+        }
+        else {
+            if (use_quarter_blocks_) {
+                pos = AppendDoubleRow<2, 24>(pos, x, width, top_row, bottom_row,
+                                             backing_row, emit_difference,
+                                             y_skip);
+            }
+            else {
+                pos = AppendDoubleRow<1, 24>(pos, x, width, top_row, bottom_row,
+                                             backing_row, emit_difference,
+                                             y_skip);
+            }
+        }
+    }
+    return pos;
+}
+
+void UnicodeBlockCanvas::StoreBackingRows(const Framebuffer &fb,
+                                          int row_offset) {
+    const int width          = fb.width();
+    const int height         = fb.height();
+    const int N              = use_quarter_blocks_ ? 2 : 1;
+    const int backing_stride = 2 * N * ((width + N - 1) / N);
+    for (int y = 0; y < height; y += 2) {
+        const int row       = y + row_offset;
+        const rgba_t *tline = row < 0 ? empty_line_ : fb.row(row);
+        const rgba_t *bline =
+            (row + 1) >= height ? empty_line_ : fb.row(row + 1);
+        rgba_t *backing = backing_buffer_ + (y / 2) * backing_stride;
+        for (int x = 0; x < width;
+             x += N, backing += 2 * N, tline += N, bline += N) {
+            if (use_quarter_blocks_) {
+                StoreBacking<2>(backing, tline, bline);
+            }
+            else {
+                StoreBacking<1>(backing, tline, bline);
+            }
+        }
+    }
+}
+
+int UnicodeBlockCanvas::FindLineShift(const Framebuffer &fb,
+                                      int row_offset) const {
+    const int width          = fb.width();
+    const int height         = fb.height();
+    const int N              = use_quarter_blocks_ ? 2 : 1;
+    const int backing_stride = 2 * N * ((width + N - 1) / N);
+    const int double_rows    = (height + 1) / 2;
+    if (double_rows < 2) return 0;
+
+    // Does double-row "r" of the framebuffer look like the backing row "b" ?
+    auto row_equal = [&](int r, int b) {
+        const int row         = 2 * r + row_offset;
+        const rgba_t *top     = row < 0 ? empty_line_ : fb.row(row);
+        const rgba_t *bottom  = (row + 1) >= height ? empty_line_
+                                                    : fb.row(row + 1);
+        const rgba_t *backing = backing_buffer_ + b * backing_stride;
+        return N == 2 ? DoubleRowEqualToBacking<2>(width, top, bottom, backing)
+                      : DoubleRowEqualToBacking<1>(width, top, bottom, backing);
+    };
+
+    // If the edges did not change, the regular difference is good enough.
+    if (row_equal(0, 0) && row_equal(double_rows - 1, double_rows - 1)) {
+        return 0;
+    }
+
+    // Candidates for the shift are where the first (or last) row of the
+    // new frame shows up in the last frame; verify the overlap.
+    auto overlap_equal = [&](int shift) {
+        for (int r = 0; r < double_rows - abs(shift); ++r) {
+            if (shift > 0 ? !row_equal(r, r + shift)
+                          : !row_equal(r - shift, r)) {
+                return false;
+            }
+        }
+        return true;
+    };
+    for (int k = 1; k < double_rows; ++k) {
+        if (row_equal(0, k) && overlap_equal(k)) return k;
+        if (row_equal(double_rows - 1, double_rows - 1 - k) &&
+            overlap_equal(-k)) {
+            return -k;
+        }
+    }
+    return 0;
+}
+
+char *UnicodeBlockCanvas::AppendLineShift(char *pos, const Framebuffer &fb,
+                                          int shift, int *first_row,
+                                          int *last_row) {
+    const int N              = use_quarter_blocks_ ? 2 : 1;
+    const int backing_stride = 2 * N * ((fb.width() + N - 1) / N);
+    const int double_rows    = (fb.height() + 1) / 2;
+    const int k              = abs(shift);
+    const size_t kept_bytes =
+        (size_t)(double_rows - k) * backing_stride * sizeof(rgba_t);
+
+    // Deleting lines pulls up everything below, inserting lines pushes it
+    // down again. Used in pairs, only the lines of the image move, while
+    // text below stays where it was.
+    if (shift > 0) {  // Content moved up, new rows at the bottom.
+        pos += sprintf(pos, SCREEN_DELETE_LINES_FORMAT, k);
+        pos = AppendCursorDown(pos, double_rows - k);
+        pos += sprintf(pos, SCREEN_INSERT_LINES_FORMAT, k);
+        memmove(backing_buffer_, backing_buffer_ + k * backing_stride,
+                kept_bytes);
+        *first_row = double_rows - k;
+        *last_row  = double_rows;
+    }
+    else {  // Content moved down, new rows at the top.
+        pos = AppendCursorDown(pos, double_rows - k);
+        pos += sprintf(pos, SCREEN_DELETE_LINES_FORMAT, k);
+        pos += sprintf(pos, SCREEN_CURSOR_UP_FORMAT, double_rows - k);
+        pos += sprintf(pos, SCREEN_INSERT_LINES_FORMAT, k);
+        memmove(backing_buffer_ + k * backing_stride, backing_buffer_,
+                kept_bytes);
+        *first_row = 0;
+        *last_row  = k;
+    }
+    return pos;
+}
+
 void UnicodeBlockCanvas::Send(int x, int dy, const Framebuffer &framebuffer,
                               SeqType seq_type, Duration end_of_frame) {
     const int width  = framebuffer.width();
     const int height = framebuffer.height();
-    OutBuffer out_buffer(RequestBuffers(width, height), 0);
+    OutBuffer out_buffer = RequestBuffers(width, height);
     char *pos = out_buffer.data;
 
     if (dy < 0) MoveCursorDY(cell_height_for_pixels(dy));
@@ -335,12 +715,8 @@ void UnicodeBlockCanvas::Send(int x, int dy, const Framebuffer &framebuffer,
 
     const char *before_image_emission = pos;
 
-    const rgba_t *const pixels = framebuffer.begin();
-    const rgba_t *top_row, *bottom_row;
-
     // If we just got requested to move back where we started the last image,
     // we just need to emit pixels that changed.
-    prev_content_it_           = backing_buffer_;
     const bool emit_difference = (x == last_x_indent_) &&
                                  (last_framebuffer_height_ > 0) &&
                                  abs(dy) == last_framebuffer_height_;
@@ -357,38 +733,122 @@ void UnicodeBlockCanvas::Send(int x, int dy, const Framebuffer &framebuffer,
     const bool top_optional_blank = !use_upper_half_block_;
     const int row_offset = (needs_empty_line && top_optional_blank) ? -1 : 0;
 
-    int y_skip = 0;
-    for (int y = 0; y < height; y += 2) {
-        const int row = y + row_offset;
-        top_row       = row < 0 ? empty_line_ : &pixels[width * row];
-        bottom_row =
-            (row + 1) >= height ? empty_line_ : &pixels[width * (row + 1)];
+    // Looping animations send the same frames again. The encoding depends
+    // on the content, the indentation and, if we only emit the difference,
+    // the previous frame shown.
+    uint64_t cache_key      = 0;
+    uint64_t frame_hash     = 0;
+    const bool is_animation = (seq_type == SeqType::StartOfAnimation ||
+                               seq_type == SeqType::AnimationFrame);
+    if (is_animation) {
+        if (seq_type == SeqType::StartOfAnimation) encoded_cache_->Clear();
+        frame_hash = EncodedFrameCache::HashFramebuffer(framebuffer);
+        if (!emit_difference || last_frame_hash_) {
+            cache_key = EncodedFrameCache::Combine(
+                EncodedFrameCache::Combine(
+                    frame_hash, emit_difference ? last_frame_hash_ : 0),
+                x);
+        }
+    }
+    last_frame_hash_ = frame_hash;
+
+    if (cache_key) {
+        if (EncodedFrameCache::Payload payload =
+                encoded_cache_->Lookup(cache_key)) {
+            StoreBackingRows(framebuffer, row_offset);
+            last_framebuffer_height_ = height;
+            last_x_indent_           = x;
+            if (!payload->empty()) {  // Otherwise, keep buffer size zero.
+                memcpy(pos, payload->data(), payload->size());
+                out_buffer.size = (pos - out_buffer.data) + payload->size();
+            }
+            write_sequencer_->WriteBuffer(std::move(out_buffer), seq_type,
+                                          end_of_frame);
+            return;
+        }
+    }
 
-        if (use_256_color_) {
-            if (use_quarter_blocks_) {
-                pos = AppendDoubleRow<2, 8>(pos, x, width, top_row, bottom_row,
-                                            emit_difference, &y_skip);
+    // Large images are split into horizontal bands of double-rows that are
+    // encoded in parallel, each into its own section of the output buffer
+    // that is large enough for the worst case. Afterwards, the sections are
+    // moved together.
+    const int double_rows = (height + 1) / 2;
+    int bands             = double_rows / kMinRowsPerBand;
+    if (bands > encode_bands_) bands = encode_bands_;
+    if (bands < 1) bands = 1;
+
+    // If the content just moved up or down by whole character rows, the
+    // terminal can move the lines it already shows; only the newly exposed
+    // rows need to be sent. The line moving sequences need less space than
+    // the one double-row that will at least not be emitted.
+    const int shift = (emit_difference && allow_line_shift_)
+                          ? FindLineShift(framebuffer, row_offset)
+                          : 0;
+
+    int y_skip = 0;
+    if (shift != 0) {
+        int first_row, last_row;
+        pos = AppendLineShift(pos, framebuffer, shift, &first_row, &last_row);
+        pos = AppendRows(pos, x, framebuffer, row_offset, 2 * first_row,
+                         std::min(2 * last_row, height), false, &y_skip);
+        y_skip = double_rows - last_row;
+    }
+    else if (bands == 1) {
+        pos = AppendRows(pos, x, framebuffer, row_offset, 0, height,
+                         emit_difference, &y_skip);
+    }
+    else {
+        const size_t max_row_size = MaxDoubleRowSize(width);
+        struct Band {
+            char *start;
+            std::future<char *> end;
+            int y_skip = 0;  // Pending skipped rows at end of band.
+        };
+        std::vector<Band> band(bands);
+        std::function<char *()> first_band;
+        // We wait for all bands below, so they can all refer to it.
+        const Framebuffer *const fb = &framebuffer;
+        for (int b = 0; b < bands; ++b) {
+            const int row_begin = b * double_rows / bands;
+            const int row_end   = (b + 1) * double_rows / bands;
+            Band *const job     = &band[b];
+            job->start          = pos + row_begin * max_row_size;
+            std::function<char *()> encode = [=]() {
+                return AppendRows(job->start, x, *fb, row_offset,
+                                  2 * row_begin, 2 * row_end, emit_difference,
+                                  &job->y_skip);
+            };
+            if (b == 0) {
+                first_band = encode;  // That one we do in our own thread.
             }
             else {
-                pos = AppendDoubleRow<1, 8>(pos, x, width, top_row, bottom_row,
-                                            emit_difference, &y_skip);
+                job->end =
+                    executor_->ExecAsync(encode, ThreadPool::Priority::kHigh);
             }
         }
-        else {
-            if (use_quarter_blocks_) {
-                pos = AppendDoubleRow<2, 24>(pos, x, width, top_row, bottom_row,
-                                             emit_difference, &y_skip);
-            }
-            else {
-                pos = AppendDoubleRow<1, 24>(pos, x, width, top_row, bottom_row,
-                                             emit_difference, &y_skip);
+        std::promise<char *> first_band_done;
+        band[0].end = first_band_done.get_future();
+        first_band_done.set_value(first_band());
+
+        for (Band &job : band) {
+            const char *const end = job.end.get();
+            if (end == job.start) {  // Nothing emitted, all rows skipped.
+                y_skip += job.y_skip;
+                continue;
             }
+            if (y_skip) pos = AppendCursorDown(pos, y_skip);
+            // Emitting a skip needs less space than the skipped rows would
+            // have used, so we never overrun the following band.
+            memmove(pos, job.start, end - job.start);
+            pos += end - job.start;
+            y_skip = job.y_skip;
         }
     }
     last_framebuffer_height_ = height;
     last_x_indent_           = x;
     if (before_image_emission == pos) {
         // Don't even emit cursor up/dn jump, keep buffer size zero.
+        if (cache_key) encoded_cache_->Insert(cache_key, "", false);
         write_sequencer_->WriteBuffer(std::move(out_buffer), seq_type,
                                       end_of_frame);
         return;
@@ -397,12 +857,18 @@ void UnicodeBlockCanvas::Send(int x, int dy, const Framebuffer &framebuffer,
     if (y_skip) {
         pos += sprintf(pos, SCREEN_CURSOR_DN_FORMAT, y_skip);
     }
+    if (cache_key) {
+        encoded_cache_->Insert(
+            cache_key,
+            std::string(before_image_emission, pos - before_image_emission),
+            false);
+    }
     out_buffer.size = (size_t)(pos - out_buffer.data);
     write_sequencer_->WriteBuffer(std::move(out_buffer), seq_type,
                                   end_of_frame);
 }
 
-char *UnicodeBlockCanvas::RequestBuffers(int width, int height) {
+size_t UnicodeBlockCanvas::MaxDoubleRowSize(int width) {
     // Pixels will be variable size depending on if we need to change colors
     // between two adjacent pixels. This is the maximum size they can be.
     static const int max_pixel_size =
@@ -413,15 +879,18 @@ char *UnicodeBlockCanvas::RequestBuffers(int width, int height) {
         + 1                                           /* m */
         + PIXEL_BLOCK_CHARACTER_LEN;
     // Few extra space for number printed in the format.
-    static const int opt_cursor_up    = strlen(SCREEN_CURSOR_UP_FORMAT) + 3;
     static const int opt_cursor_right = strlen(SCREEN_CURSOR_RIGHT_FORMAT) + 3;
-    const int vertical_characters = (height + 1) / 2;  // two pixels, one glyph
+    return opt_cursor_right            // Horizontal jump
+           + width * max_pixel_size    // pixels in one row
+           + SCREEN_END_OF_LINE_LEN;   // Finishing a line.
+}
+
+OutBuffer UnicodeBlockCanvas::RequestBuffers(int width, int height) {
+    static const int opt_cursor_up = strlen(SCREEN_CURSOR_UP_FORMAT) + 3;
+    const int vertical_characters  = (height + 1) / 2;  // two pixels, one glyph
     const size_t content_size =
         opt_cursor_up  // Jump up
-        +
-        vertical_characters * (opt_cursor_right            // Horizontal jump
-                               + width * max_pixel_size    // pixels in one row
-                               + SCREEN_END_OF_LINE_LEN);  // Finishing a line.
+        + vertical_characters * MaxDoubleRowSize(width);
 
     // Depending on even/odd situation, we might need one extra row.
     // For quarter, we have one extra possible pixel wider.
@@ -437,7 +906,7 @@ char *UnicodeBlockCanvas::RequestBuffers(int width, int height) {
         empty_line_size_ = new_empty;
         memset(empty_line_, 0x00, empty_line_size_);
     }
-    return new char[content_size];
+    return write_sequencer_->RequestBuffer(content_size);
 }
 
 // Converting the colors requires fast uint8 -> ASCII decimal digits with
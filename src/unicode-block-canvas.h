@@ -18,6 +18,7 @@
 
 #include <cassert>
 #include <cstddef>
+#include <cstdint>
 
 #include "buffered-write-sequencer.h"
 #include "framebuffer.h"
@@ -25,6 +26,7 @@
 #include "timg-time.h"
 
 namespace timg {
+class ThreadPool;
 
 // Canvas that can send a framebuffer to a terminal with either half
 // or quarter blocks.
@@ -35,8 +37,15 @@ public:
     // if "use_upper_half_block" is set, uses the upper instead of the
     // lower block (only for use_quarter == false).
     // "use_256_color" is for terminals that can't do 24 bit colors.
-    UnicodeBlockCanvas(BufferedWriteSequencer *ws, bool use_quarter,
-                       bool use_upper_half_block, bool use_256_color);
+    // If "allow_line_shift" is set, animations that move up or down are sent
+    // by letting the terminal move whole lines. Only possible if nothing else
+    // is shown next to the image.
+    // If "thread_pool" is given, large images are split into up to
+    // "encode_bands" horizontal bands that are encoded in parallel.
+    UnicodeBlockCanvas(BufferedWriteSequencer *ws, ThreadPool *thread_pool,
+                       int encode_bands, bool use_quarter,
+                       bool use_upper_half_block, bool use_256_color,
+                       bool allow_line_shift);
     ~UnicodeBlockCanvas() override;
 
     int cell_height_for_pixels(int pixels) const final {
@@ -48,32 +57,63 @@ public:
 
 private:
     struct GlyphPick;
+    ThreadPool *const executor_;
+    const int encode_bands_;
     const bool use_quarter_blocks_;
     const bool use_upper_half_block_;
     const bool use_256_color_;
+    const bool allow_line_shift_;
 
     // Ensure that all buffers needed for emitting the framebuffer have
     // enough space.
     // Return a buffer large enough to hold the whole ANSI-color encoded text
     // to be used with the write sequencer.
-    char *RequestBuffers(int width, int height);
+    OutBuffer RequestBuffers(int width, int height);
+
+    // Maximum space a double-row of pixels can take in encoded form.
+    static size_t MaxDoubleRowSize(int width);
+
+    // Append the pixel rows in range [y_begin, y_end) of framebuffer.
+    char *AppendRows(char *pos, int x, const Framebuffer &fb, int row_offset,
+                     int y_begin, int y_end, bool emit_difference,
+                     int *y_skip);
+
+    // Compared to the backing buffer, determine if the content of the
+    // framebuffer moved up (positive) or down (negative) by that many
+    // double-rows, but otherwise stayed the same. Returns 0 if not.
+    int FindLineShift(const Framebuffer &fb, int row_offset) const;
+
+    // Append the terminal sequences to move the lines by "shift" as returned
+    // by FindLineShift() and shift the backing buffer alike. Returns the range
+    // of double-rows [first_row, last_row) that are now blank.
+    char *AppendLineShift(char *pos, const Framebuffer &fb, int shift,
+                          int *first_row, int *last_row);
+
+    // Update the backing buffer as if the framebuffer was emitted.
+    void StoreBackingRows(const Framebuffer &fb, int row_offset);
 
     template <int N, int colorbits>
     char *AppendDoubleRow(char *pos, int indent, int width,
                           const rgba_t *top_line, const rgba_t *bottom_line,
-                          bool emit_difference, int *y_skip);
+                          rgba_t *backing, bool emit_difference, int *y_skip);
 
     // Find best glyph for two rows of color.
     template <int N>
     GlyphPick FindBestGlyph(const rgba_t *top, const rgba_t *bottom) const;
 
+    // Quarter-block version of FindBestGlyph<2>() that evaluates "count"
+    // adjacent cells at once. Writes the same choices FindBestGlyph<2>() would
+    // make to "picks".
+    void FindBestQuarterGlyphs(const rgba_t *top, const rgba_t *bottom,
+                               int count, GlyphPick *picks) const;
+
     // Backing buffer stores a flattened view of last frame, storing top and
     // bottom pixel linearly.
     rgba_t *backing_buffer_     = nullptr;  // Remembering last frame
     size_t backing_buffer_size_ = 0;
-    rgba_t *prev_content_it_;
     int last_framebuffer_height_ = 0;
     int last_x_indent_           = 0;
+    uint64_t last_frame_hash_    = 0;  // Hash of last animation frame or 0.
 
     rgba_t *empty_line_     = nullptr;
     size_t empty_line_size_ = 0;
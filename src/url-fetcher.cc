@@ -0,0 +1,199 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// (c) 2024 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#include "url-fetcher.h"
+
+#include <strings.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// libav: "U NO extern C in header ?"
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavformat/avio.h>
+#include <libavutil/mem.h>
+#include <libavutil/opt.h>
+}
+
+// Images larger than that are not worth keeping in memory; if they are
+// that large, they are probably a video anyway.
+static constexpr size_t kMaxFetchSize = 128 << 20;
+
+namespace timg {
+std::unique_ptr<FetchedFile> FetchedFile::Create() {
+    char path[64];
+#ifdef __linux__
+    // Anonymous memory that can still be opened by name.
+    const int fd = memfd_create("timg-fetched", MFD_CLOEXEC);
+    if (fd < 0) return nullptr;
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    return std::unique_ptr<FetchedFile>(new FetchedFile(fd, path, false));
+#else
+    // Elsewhere, /dev/fd/<n> would share the file offset between all
+    // readers, so go through a temporary file.
+    const char *tmpdir = getenv("TMPDIR");
+    snprintf(path, sizeof(path), "%s/timg-fetched-XXXXXX",
+             tmpdir ? tmpdir : "/tmp");
+    const int fd = mkstemp(path);
+    if (fd < 0) return nullptr;
+    return std::unique_ptr<FetchedFile>(new FetchedFile(fd, path, true));
+#endif
+}
+
+FetchedFile::~FetchedFile() {
+    if (unlink_path_) unlink(path_.c_str());
+    close(fd_);
+}
+
+bool FetchedFile::Append(const uint8_t *data, size_t len) {
+    while (len > 0) {
+        const ssize_t w = write(fd_, data, len);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return false;
+        data += w;
+        len -= w;
+    }
+    return true;
+}
+
+// Streams are better read on demand by the video decoder.
+static bool IsStreamingContent(AVIOContext *in) {
+    uint8_t *mime_type = nullptr;
+    if (av_opt_get(in, "mime_type", AV_OPT_SEARCH_CHILDREN, &mime_type) < 0 ||
+        !mime_type) {
+        return false;
+    }
+    bool is_stream = false;
+    for (const char *prefix : {"video/", "audio/", "multipart/"}) {
+        const size_t len = strlen(prefix);
+        if (strncasecmp((const char *)mime_type, prefix, len) == 0) {
+            is_stream = true;
+        }
+    }
+    av_free(mime_type);
+    return is_stream;
+}
+
+static std::shared_ptr<FetchedFile> Fetch(const std::string &url,
+                                          const AVIOInterruptCB *interrupt) {
+    AVIOContext *in = nullptr;
+    if (avio_open2(&in, url.c_str(), AVIO_FLAG_READ, interrupt, nullptr) < 0) {
+        return nullptr;
+    }
+    std::shared_ptr<FetchedFile> result;
+    const int64_t announced_size = avio_size(in);  // If known.
+    if (!IsStreamingContent(in) && announced_size <= (int64_t)kMaxFetchSize) {
+        result = FetchedFile::Create();
+    }
+    if (result) {
+        uint8_t buffer[65536];
+        size_t total = 0;
+        int r;
+        while ((r = avio_read(in, buffer, sizeof(buffer))) > 0) {
+            total += r;
+            if (total > kMaxFetchSize || !result->Append(buffer, r)) break;
+        }
+        if (r != AVERROR_EOF && r != 0) result.reset();  // Incomplete.
+    }
+    avio_closep(&in);
+    return result;
+}
+
+UrlFetcher::UrlFetcher(int connections,
+                       const volatile sig_atomic_t &interrupt_received)
+    : interrupt_received_(interrupt_received) {
+    avformat_network_init();
+    for (int i = 0; i < connections; ++i) {
+        std::thread(&UrlFetcher::Run, this).detach();
+    }
+}
+
+bool UrlFetcher::IsUrl(const std::string &name) {
+    return strncasecmp(name.c_str(), "http://", 7) == 0 ||
+           strncasecmp(name.c_str(), "https://", 8) == 0;
+}
+
+void UrlFetcher::Prefetch(const std::string &url,
+                          const std::function<void()> &done) {
+    {
+        std::unique_lock<std::mutex> l(lock_);
+        Download &download = downloads_[url];
+        if (download.done) {  // Same URL earlier, not picked up yet.
+            ++download.users;
+            l.unlock();
+            if (done) done();
+            return;
+        }
+        if (done) download.on_done.push_back(done);
+        if (download.users++ > 0) return;  // Already on its way.
+        queue_.push_back(url);
+    }
+    work_available_.notify_one();
+}
+
+std::shared_ptr<FetchedFile> UrlFetcher::Get(const std::string &url) {
+    std::unique_lock<std::mutex> l(lock_);
+    if (downloads_.find(url) == downloads_.end()) {
+        l.unlock();
+        Prefetch(url);
+        l.lock();
+    }
+    auto found = downloads_.find(url);
+    download_done_.wait(l, [&found]() { return found->second.done; });
+    std::shared_ptr<FetchedFile> result = found->second.result;
+    if (--found->second.users == 0) downloads_.erase(found);
+    return result;
+}
+
+int UrlFetcher::CheckInterrupt(void *fetcher) {
+    return ((UrlFetcher *)fetcher)->interrupt_received_;
+}
+
+void UrlFetcher::Run() {
+    const AVIOInterruptCB interrupt = {&UrlFetcher::CheckInterrupt, this};
+    for (;;) {
+        std::string url;
+        {
+            std::unique_lock<std::mutex> l(lock_);
+            work_available_.wait(l, [this]() { return !queue_.empty(); });
+            url = queue_.front();
+            queue_.pop_front();
+        }
+        std::shared_ptr<FetchedFile> result = Fetch(url, &interrupt);
+        std::vector<std::function<void()>> on_done;
+        {
+            std::unique_lock<std::mutex> l(lock_);
+            Download &download = downloads_[url];
+            download.result    = result;
+            download.done      = true;
+            on_done.swap(download.on_done);
+        }
+        download_done_.notify_all();
+        for (const std::function<void()> &done : on_done) done();
+    }
+}
+}  // namespace timg
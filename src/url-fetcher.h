@@ -0,0 +1,105 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// (c) 2024 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#ifndef TIMG_URL_FETCHER_H
+#define TIMG_URL_FETCHER_H
+
+#include <csignal>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace timg {
+// Downloaded content, held in memory. Decoders read it as a regular
+// file with the given path, so every decoder and option works with it.
+class FetchedFile {
+public:
+    // Create an empty in-memory file. Returns nullptr on failure.
+    static std::unique_ptr<FetchedFile> Create();
+    ~FetchedFile();
+
+    FetchedFile(const FetchedFile &)            = delete;
+    FetchedFile &operator=(const FetchedFile &) = delete;
+
+    bool Append(const uint8_t *data, size_t len);
+
+    // Path the content can be opened with while this object exists.
+    const std::string &path() const { return path_; }
+
+private:
+    FetchedFile(int fd, const std::string &path, bool unlink_path)
+        : fd_(fd), path_(path), unlink_path_(unlink_path) {}
+
+    const int fd_;
+    const std::string path_;
+    const bool unlink_path_;
+};
+
+// Downloads http(s) URLs in the background, with a limited number of
+// connections at a time, so that the content is ready by the time the
+// image is loaded. Download threads run detached, so the fetcher needs to
+// live until the end of the program.
+//
+// Content that announces itself as a stream (video, multipart) or is too
+// large to hold in memory is not fetched; it is best left to the video
+// decoder to read from the URL directly.
+class UrlFetcher {
+public:
+    // Start "connections" download threads. Downloads are stopped once
+    // "interrupt_received" is set.
+    UrlFetcher(int connections,
+               const volatile sig_atomic_t &interrupt_received);
+    UrlFetcher(const UrlFetcher &) = delete;
+
+    static bool IsUrl(const std::string &name);
+
+    // Start downloading "url" if not already. Once it is done, "done" is
+    // called in the download thread, so Get() will not have to wait.
+    void Prefetch(const std::string &url,
+                  const std::function<void()> &done = nullptr);
+
+    // Wait for the download of "url", starting it if it was not
+    // prefetched. Each Prefetch() needs to be followed by one Get().
+    // Returns nullptr if it can't be fetched.
+    std::shared_ptr<FetchedFile> Get(const std::string &url);
+
+private:
+    struct Download {
+        int users = 0;  // Expected Get() calls.
+        bool done = false;
+        std::shared_ptr<FetchedFile> result;
+        std::vector<std::function<void()>> on_done;
+    };
+
+    void Run();
+    static int CheckInterrupt(void *fetcher);
+
+    const volatile sig_atomic_t &interrupt_received_;
+    std::mutex lock_;
+    std::condition_variable work_available_;
+    std::condition_variable download_done_;
+    std::map<std::string, Download> downloads_;
+    std::deque<std::string> queue_;
+};
+}  // namespace timg
+
+#endif  // TIMG_URL_FETCHER_H
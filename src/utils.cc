@@ -16,6 +16,7 @@
 #include "utils.h"
 
 #include <strings.h>
+#include <sys/stat.h>
 
 #include <cstdint>
 #include <cstdio>
@@ -39,6 +40,14 @@ float GetFloatEnv(const char *env_var, float default_value) {
     return (*err == '\0' ? result : default_value);
 }
 
+int GetIntEnv(const char *env_var, int default_value) {
+    const char *value = getenv(env_var);
+    if (!value) return default_value;
+    char *err        = nullptr;
+    const int result = strtol(value, &err, 10);
+    return (*err == '\0' ? result : default_value);
+}
+
 std::string HumanReadableByteValue(int64_t byte_count) {
     float print_bytes = byte_count;
     const char *unit  = "Bytes";
@@ -59,4 +68,25 @@ std::string HumanReadableByteValue(int64_t byte_count) {
     return buf;
 }
 
+std::string GetCacheDirectory() {
+    std::string base;
+    const char *const xdg_cache = getenv("XDG_CACHE_HOME");
+    const char *const home      = getenv("HOME");
+    if (xdg_cache && *xdg_cache) {
+        base = xdg_cache;
+    }
+    else if (home && *home) {
+        base = std::string(home) + "/.cache";
+    }
+    else {
+        return "";
+    }
+    mkdir(base.c_str(), 0700);  // Ok to fail if it exists already.
+    const std::string dir = base + "/timg";
+    mkdir(dir.c_str(), 0700);
+    struct stat s;
+    if (stat(dir.c_str(), &s) != 0 || !S_ISDIR(s.st_mode)) return "";
+    return dir;
+}
+
 }  // namespace timg
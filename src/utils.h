@@ -26,9 +26,16 @@ bool GetBoolenEnv(const char *env_name, bool default_value = false);
 // Get float value from named environment variable.
 float GetFloatEnv(const char *env_var, float default_value);
 
+// Get integer value from named environment variable.
+int GetIntEnv(const char *env_var, int default_value);
+
 // Given number of bytes, return a human-readable version of that
 // (e.g. "13.2 MiB").
 std::string HumanReadableByteValue(int64_t byte_count);
+
+// Return the directory timg can keep cached data in, $XDG_CACHE_HOME/timg
+// or ~/.cache/timg, creating it if needed. Empty string if not available.
+std::string GetCacheDirectory();
 }  // namespace timg
 
 #endif  // TIMG_TERMUTILS_H
@@ -21,20 +21,29 @@
 #include <strings.h>
 
 #include <algorithm>
+#include <atomic>
 #include <csignal>
 #include <cstdarg>
 #include <cstddef>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <functional>
+#include <memory>
 #include <mutex>
 #include <string>
 #include <thread>
+#include <utility>
+#include <vector>
 
 #include "buffered-write-sequencer.h"
 #include "display-options.h"
 #include "framebuffer.h"
 #include "image-source.h"
+#include "pipeline-stats.h"
 #include "renderer.h"
+#include "spsc-queue.h"
+#include "timg-swscale.h"
 #include "timg-time.h"
 
 // libav: "U NO extern C in header ?"
@@ -44,34 +53,60 @@ extern "C" {
 #include <libavdevice/avdevice.h>
 #endif
 #include <libavformat/avformat.h>
+#include <libavutil/hwcontext.h>
 #include <libavutil/log.h>
+#include <libavutil/pixdesc.h>
 #include <libavutil/pixfmt.h>
 #include <libswscale/swscale.h>
 }
 
 static constexpr bool kDebug = false;
 
+// Number of frames at the start of a video looked at to find the content
+// to auto-crop to.
+static constexpr int kAutoCropProbeFrames = 10;
+
+// Compression artifacts make borders not exactly uniform.
+static constexpr int kAutoCropFuzz = 24;
+
+// Frames in flight between the stages of the playback pipeline, and the
+// framebuffers it needs: one each in the queue, the scaler and the sink.
+static constexpr int kPipelineDepth        = 2;
+static constexpr int kPipelineFramebuffers = kPipelineDepth + 2;
+
+// The scaler stage is the only scaler running during playback, but it
+// shares the cores with decoding and encoding.
+static const int kScalerThreads =
+    std::max(1, (int)std::thread::hardware_concurrency() / 2);
+
+// With live input, we only look at so much of the stream to determine its
+// format before starting to show it.
+static constexpr int64_t kLiveProbeBytes          = 256 << 10;
+static constexpr int64_t kLiveMaxAnalyzeDurationUs = 500000;
+
 namespace timg {
 // Convert deprecated color formats to new and manually set the color range.
 // YUV has funny ranges (16-235), while the YUVJ are 0-255. SWS prefers to
 // deal with the YUV range, but then requires to set the output range.
 // https://libav.org/documentation/doxygen/master/pixfmt_8h.html#a9a8e335cf3be472042bc9f0cf80cd4c5
-static SwsContext *CreateSWSContext(const AVCodecContext *codec_ctx,
-                                    int display_width, int display_height) {
+static SwsContext *CreateSWSContext(AVPixelFormat pix_fmt, int width,
+                                    int height, int display_width,
+                                    int display_height, int threads) {
     AVPixelFormat src_pix_fmt;
     bool src_range_extended_yuvj = true;
     // Remap deprecated to new pixel format.
-    switch (codec_ctx->pix_fmt) {
+    switch (pix_fmt) {
     case AV_PIX_FMT_YUVJ420P: src_pix_fmt = AV_PIX_FMT_YUV420P; break;
     case AV_PIX_FMT_YUVJ422P: src_pix_fmt = AV_PIX_FMT_YUV422P; break;
     case AV_PIX_FMT_YUVJ444P: src_pix_fmt = AV_PIX_FMT_YUV444P; break;
     case AV_PIX_FMT_YUVJ440P: src_pix_fmt = AV_PIX_FMT_YUV440P; break;
-    default: src_range_extended_yuvj = false; src_pix_fmt = codec_ctx->pix_fmt;
+    default: src_range_extended_yuvj = false; src_pix_fmt = pix_fmt;
     }
     SwsContext *swsCtx =
-        sws_getContext(codec_ctx->width, codec_ctx->height, src_pix_fmt,
-                       display_width, display_height, AV_PIX_FMT_RGBA,
-                       SWS_BILINEAR, nullptr, nullptr, nullptr);
+        CreateScaleContext(width, height, src_pix_fmt, display_width,
+                           display_height, AV_PIX_FMT_RGBA, SWS_BILINEAR,
+                           threads);
+    if (!swsCtx) return nullptr;
     if (src_range_extended_yuvj) {
         // Manually set the source range to be extended. Read modify write.
         int dontcare[4];
@@ -88,6 +123,32 @@ static SwsContext *CreateSWSContext(const AVCodecContext *codec_ctx,
     return swsCtx;
 }
 
+// Pick the hardware pixel format we prepared the device for, otherwise the
+// first software format as the decoder can't do this in hardware.
+static AVPixelFormat GetHardwareFormat(AVCodecContext *codec_ctx,
+                                       const AVPixelFormat *formats) {
+    const int hw_pix_fmt = *(const int *)codec_ctx->opaque;
+    for (const AVPixelFormat *f = formats; *f != AV_PIX_FMT_NONE; ++f) {
+        if (*f == hw_pix_fmt) return *f;
+    }
+    for (const AVPixelFormat *f = formats; *f != AV_PIX_FMT_NONE; ++f) {
+        if (!(av_pix_fmt_desc_get(*f)->flags & AV_PIX_FMT_FLAG_HWACCEL)) {
+            return *f;
+        }
+    }
+    return AV_PIX_FMT_NONE;
+}
+
+// Cameras and streaming protocols deliver frames as they happen; there is
+// nothing to buffer ahead and we rather want to see the latest frame.
+static bool IsLiveInput(const char *file) {
+    for (const char *prefix : {"/dev/video", "rtsp://", "rtsps://", "rtmp://",
+                               "rtp://", "udp://", "srt://"}) {
+        if (strncasecmp(file, prefix, strlen(prefix)) == 0) return true;
+    }
+    return false;
+}
+
 static void dummy_log(void *, int, const char *, va_list) {
     // Let's not disturb our terminal with messages from here.
     // Maybe add logging to separate stream later.
@@ -114,7 +175,6 @@ VideoSource::~VideoSource() {
     avcodec_close(codec_context_);
     avcodec_free_context(&codec_context_);
     avformat_close_input(&format_context_);
-    delete terminal_fb_;
 }
 
 const char *VideoSource::VersionInfo() {
@@ -126,15 +186,14 @@ const char *VideoSource::VersionInfo() {
 }
 
 std::string VideoSource::FormatTitle(const std::string &format_string) const {
-    return FormatFromParameters(format_string, filename_, orig_width_,
+    return FormatFromParameters(format_string, display_name(), orig_width_,
                                 orig_height_, "video");
 }
 
 bool VideoSource::LoadAndScale(const DisplayOptions &display_options,
                                int frame_offset, int frame_count) {
-    options_      = display_options;
-    frame_offset_ = frame_offset;
-    frame_count_  = frame_count;
+    options_     = display_options;
+    frame_count_ = frame_count;
 
     const char *file = (filename() == "-") ? "/dev/stdin" : filename().c_str();
     const size_t file_len = strlen(file);
@@ -151,6 +210,12 @@ bool VideoSource::LoadAndScale(const DisplayOptions &display_options,
     }
 
     format_context_ = avformat_alloc_context();
+    live_           = IsLiveInput(file);
+    if (live_) {
+        format_context_->probesize            = kLiveProbeBytes;
+        format_context_->max_analyze_duration = kLiveMaxAnalyzeDurationUs;
+        format_context_->flags |= AVFMT_FLAG_NOBUFFER;
+    }
     int ret;
     if ((ret = avformat_open_input(&format_context_, file, nullptr, nullptr)) !=
         0) {
@@ -173,6 +238,14 @@ bool VideoSource::LoadAndScale(const DisplayOptions &display_options,
         return false;
     }
 
+    // A HTTP URL can be a file or a stream; a stream can't seek and has
+    // no duration.
+    if (!live_ && strncasecmp(file, "http", 4) == 0 && format_context_->pb &&
+        !(format_context_->pb->seekable & AVIO_SEEKABLE_NORMAL) &&
+        format_context_->duration == AV_NOPTS_VALUE) {
+        live_ = true;
+    }
+
     // Find the first video stream
     const AVCodecParameters *codec_parameters = nullptr;
     const AVCodec *av_codec                   = nullptr;
@@ -191,13 +264,24 @@ bool VideoSource::LoadAndScale(const DisplayOptions &display_options,
     AVRational rate = av_guess_frame_rate(format_context_, stream, nullptr);
     frame_duration_ = Duration::Nanos(1e9 * rate.den / rate.num);
 
+    // Frame offset and start time are both converted to a time to seek to.
+    start_time_ = display_options.start_time;
+    start_time_.Add(
+        Duration::Nanos(frame_offset * frame_duration_.nanoseconds()));
+
     codec_context_ = avcodec_alloc_context3(av_codec);
-    if (av_codec->capabilities & AV_CODEC_CAP_FRAME_THREADS &&
+    const bool hw_decode = PrepareHardwareDecoder(av_codec);
+    // Frame threading delays the output by a frame per thread. For live
+    // input, only use slice threading, which does not add latency.
+    const int thread_capability =
+        live_ ? AV_CODEC_CAP_SLICE_THREADS : AV_CODEC_CAP_FRAME_THREADS;
+    if (!hw_decode && av_codec->capabilities & thread_capability &&
         std::thread::hardware_concurrency() > 1) {
-        codec_context_->thread_type = FF_THREAD_FRAME;
+        codec_context_->thread_type = live_ ? FF_THREAD_SLICE : FF_THREAD_FRAME;
         codec_context_->thread_count =
             std::min(4, (int)std::thread::hardware_concurrency());
     }
+    if (live_) codec_context_->flags |= AV_CODEC_FLAG_LOW_DELAY;
     if (avcodec_parameters_to_context(codec_context_, codec_parameters) < 0)
         return false;
     if (avcodec_open2(codec_context_, av_codec, nullptr) < 0 ||
@@ -206,6 +290,7 @@ bool VideoSource::LoadAndScale(const DisplayOptions &display_options,
 
     orig_width_  = codec_context_->width;
     orig_height_ = codec_context_->height;
+    DetermineCropRegion(display_options);
 
     /*
      * Prepare frame to hold the scaled target frame to be send to matrix.
@@ -215,76 +300,242 @@ bool VideoSource::LoadAndScale(const DisplayOptions &display_options,
 
     // Make display fit within canvas using the timg scaling utility.
     DisplayOptions opts(display_options);
-    // Make sure we don't confuse users. Some image URLs actually end up here,
-    // so make sure that it is clear certain options won't work.
-    // TODO: this is a crude work-around. And while we tell the user what to
-    // do, it would be better if we'd dealt with it already.
-    if (opts.crop_border != 0 || opts.auto_crop) {
-        const bool is_url = (strncmp(file, "http://", 7) == 0 ||
-                             strncmp(file, "https://", 8) == 0);
-        fprintf(stderr,
-                "%s%s is handled by video subsystem. "
-                "Unfortunately, no auto-crop feature is implemented there.\n",
-                is_url ? "URL " : "", file);
-        if (is_url) {
-            fprintf(stderr,
-                    "use:\n\twget -qO- %s | timg -T%d -\n... instead "
-                    "for this to work\n",
-                    file, opts.crop_border);
-        }
-    }
     opts.fill_height = false;  // This only makes sense for horizontal scroll.
-    CalcScaleToFitDisplay(codec_context_->width, codec_context_->height, opts,
-                          false, &target_width, &target_height);
+    CalcScaleToFitDisplay(crop_.width, crop_.height, opts, false,
+                          &target_width, &target_height);
 
     if (display_options.center_horizontally) {
         center_indentation_ = (display_options.width - target_width) / 2;
     }
-    // initialize SWS context for software scaling
-    sws_context_ =
-        CreateSWSContext(codec_context_, target_width, target_height);
-    if (!sws_context_) {
+    target_width_  = target_width;
+    target_height_ = target_height;
+
+    // initialize SWS context for software scaling. With hardware decoding,
+    // we only know the pixel format once the first frame is downloaded.
+    if (!hw_decode) {
+        sws_context_  = CreateSWSContext(codec_context_->pix_fmt, crop_.width,
+                                         crop_.height, target_width,
+                                         target_height, kScalerThreads);
+        scale_format_ = codec_context_->pix_fmt;
+    }
+    if (!hw_decode && !sws_context_) {
         if (kDebug)
             fprintf(stderr, "Trouble doing scaling to %dx%d :(\n", opts.width,
                     opts.height);
         return false;
     }
-
-    // Framebuffer to interface with the timg TerminalCanvas
-    terminal_fb_ = new timg::Framebuffer(target_width, target_height);
     return true;
 }
 
-void VideoSource::AlphaBlendFramebuffer() {
+bool VideoSource::PrepareHardwareDecoder(const AVCodec *codec) {
+    static constexpr const char *kHwAccelEnv = "TIMG_VIDEO_HWACCEL";
+    const char *const requested = getenv(kHwAccelEnv);
+    if (!requested || !*requested) return false;
+
+    const bool try_any = (strcasecmp(requested, "auto") == 0);
+    const AVHWDeviceType wanted =
+        try_any ? AV_HWDEVICE_TYPE_NONE
+                : av_hwdevice_find_type_by_name(requested);
+    if (!try_any && wanted == AV_HWDEVICE_TYPE_NONE) {
+        static std::once_flag warn_once;
+        std::call_once(warn_once, [requested]() {
+            fprintf(stderr, "%s=%s: unknown device type. Available:",
+                    kHwAccelEnv, requested);
+            AVHWDeviceType t = AV_HWDEVICE_TYPE_NONE;
+            while ((t = av_hwdevice_iterate_types(t)) !=
+                   AV_HWDEVICE_TYPE_NONE) {
+                fprintf(stderr, " %s", av_hwdevice_get_type_name(t));
+            }
+            fprintf(stderr, "\n");
+        });
+        return false;
+    }
+
+    for (int i = 0;; ++i) {
+        const AVCodecHWConfig *config = avcodec_get_hw_config(codec, i);
+        if (!config) break;
+        if (!(config->methods & AV_CODEC_HW_CONFIG_METHOD_HW_DEVICE_CTX)) {
+            continue;
+        }
+        if (!try_any && config->device_type != wanted) continue;
+        AVBufferRef *device = nullptr;
+        if (av_hwdevice_ctx_create(&device, config->device_type, nullptr,
+                                   nullptr, 0) < 0) {
+            continue;  // Not available on this machine; maybe the next one.
+        }
+        hw_pix_fmt_                   = config->pix_fmt;
+        codec_context_->hw_device_ctx = device;  // codec context owns it now.
+        codec_context_->opaque        = &hw_pix_fmt_;
+        codec_context_->get_format    = GetHardwareFormat;
+        return true;
+    }
+    return false;  // Silently fall back to software decoding.
+}
+
+void VideoSource::DetermineCropRegion(const DisplayOptions &opts) {
+    const int width  = codec_context_->width;
+    const int height = codec_context_->height;
+    const int border =
+        std::clamp(opts.crop_border, 0, std::min(width, height) / 2);
+    crop_ = {border, border, std::max(1, width - 2 * border),
+             std::max(1, height - 2 * border)};
+    if (!opts.auto_crop) return;
+
+    // Looking at frames consumes them, so we need to be able to rewind.
+    if (!format_context_->pb ||
+        !(format_context_->pb->seekable & AVIO_SEEKABLE_NORMAL)) {
+        fprintf(stderr, "%s: can't auto-crop video that is not seekable.\n",
+                filename().c_str());
+        return;
+    }
+
+    // The content is the union of what we find in the first frames; frames
+    // of one color, such as a fade-in from black, don't tell us anything.
+    const Rect region = crop_;
+    int left = width, top = height, right = -1, bottom = -1;
+    Framebuffer probe(width, height);
+    SwsContext *probe_sws = nullptr;
+    int probe_format      = -1;
+    AVPacket *packet      = av_packet_alloc();
+    AVFrame *frame        = av_frame_alloc();
+    AVFrame *sw_frame     = av_frame_alloc();
+    bool reading          = true;
+    int probed            = 0;
+    while (probed < kAutoCropProbeFrames) {
+        if (reading && av_read_frame(format_context_, packet) == 0) {
+            if (packet->stream_index == video_stream_index_) {
+                avcodec_send_packet(codec_context_, packet);
+            }
+            av_packet_unref(packet);
+        }
+        else if (reading) {
+            reading = false;
+            avcodec_send_packet(codec_context_, nullptr);  // Trigger drain.
+        }
+        int ret = 0;
+        while (probed < kAutoCropProbeFrames &&
+               (ret = avcodec_receive_frame(codec_context_, frame)) == 0) {
+            ++probed;
+            AVFrame *src = frame;
+            if (frame->format == hw_pix_fmt_) {
+                av_frame_unref(sw_frame);
+                if (av_hwframe_transfer_data(sw_frame, frame, 0) < 0) continue;
+                src = sw_frame;
+            }
+            if (src->format != probe_format) {
+                sws_freeContext(probe_sws);
+                probe_sws    = CreateSWSContext((AVPixelFormat)src->format,
+                                                width, height, width, height,
+                                                1);
+                probe_format = src->format;
+            }
+            if (!probe_sws || !ScaleFrame(probe_sws, src, &probe)) continue;
+            const Rect box = probe.FindContentBox(region, kAutoCropFuzz);
+            if (box.width == 0) continue;
+            left   = std::min(left, box.x);
+            top    = std::min(top, box.y);
+            right  = std::max(right, box.x + box.width - 1);
+            bottom = std::max(bottom, box.y + box.height - 1);
+        }
+        if (!reading && ret != AVERROR(EAGAIN)) break;  // Drained.
+    }
+    sws_freeContext(probe_sws);
+    av_frame_free(&sw_frame);
+    av_frame_free(&frame);
+    av_packet_free(&packet);
+
+    av_seek_frame(format_context_, video_stream_index_, 0, AVSEEK_FLAG_ANY);
+    avcodec_flush_buffers(codec_context_);
+
+    if (right < left) return;  // Nothing but uniform frames.
+    // Even coordinates keep subsampled chroma aligned.
+    left &= ~1;
+    top &= ~1;
+    crop_ = {left, top, std::min(width - left, (right - left + 2) & ~1),
+             std::min(height - top, (bottom - top + 2) & ~1)};
+}
+
+bool VideoSource::CropFrame(AVFrame *frame) const {
+    if (frame->width == crop_.width && frame->height == crop_.height) {
+        return true;
+    }
+    if (frame->width < crop_.x + crop_.width ||
+        frame->height < crop_.y + crop_.height) {
+        return false;  // Size changed mid-stream.
+    }
+    frame->crop_left   = crop_.x;
+    frame->crop_top    = crop_.y;
+    frame->crop_right  = frame->width - crop_.x - crop_.width;
+    frame->crop_bottom = frame->height - crop_.y - crop_.height;
+    return av_frame_apply_cropping(frame, AV_FRAME_CROP_UNALIGNED) >= 0;
+}
+
+int64_t VideoSource::SeekToStart() {
+    const AVStream *stream = format_context_->streams[video_stream_index_];
+    // Be lenient with rounding: show the frame that covers the start time.
+    const int64_t start_ns =
+        start_time_.nanoseconds() - frame_duration_.nanoseconds() / 2;
+    int64_t target = av_rescale_q(start_ns, AVRational{1, 1000000000},
+                                  stream->time_base);
+    if (stream->start_time != AV_NOPTS_VALUE) target += stream->start_time;
+
+    // Go to the keyframe before the target, then decode forward from there.
+    if (av_seek_frame(format_context_, video_stream_index_, target,
+                      AVSEEK_FLAG_BACKWARD) < 0) {
+        return AV_NOPTS_VALUE;
+    }
+    avcodec_flush_buffers(codec_context_);
+    return target;
+}
+
+AVFrame *VideoSource::TakeFrameForScaling(AVFrame *decoded) {
+    AVFrame *frame = av_frame_alloc();
+    if (decoded->format == hw_pix_fmt_) {
+        const bool transferred =
+            av_hwframe_transfer_data(frame, decoded, 0) >= 0;
+        av_frame_unref(decoded);
+        if (!transferred) {
+            av_frame_free(&frame);
+            return nullptr;
+        }
+    }
+    else {
+        av_frame_move_ref(frame, decoded);
+    }
+    if (!CropFrame(frame)) av_frame_free(&frame);
+    return frame;
+}
+
+bool VideoSource::PrepareScaleContext(const AVFrame *frame) {
+    // With hardware decoding, the format is only known now, and for a
+    // decoder that had to fall back to software, it is not what we
+    // downloaded before.
+    if (sws_context_ && frame->format == scale_format_) return true;
+    sws_freeContext(sws_context_);
+    sws_context_  = CreateSWSContext((AVPixelFormat)frame->format, crop_.width,
+                                     crop_.height, target_width_,
+                                     target_height_, kScalerThreads);
+    scale_format_ = frame->format;
+    return sws_context_ != nullptr;
+}
+
+void VideoSource::AlphaBlendFramebuffer(Framebuffer *fb) {
     if (!maybe_transparent_) return;
-    terminal_fb_->AlphaComposeBackground(
+    fb->AlphaComposeBackground(
         options_.bgcolor_getter, options_.bg_pattern_color,
         options_.pattern_size * options_.cell_x_px,
         options_.pattern_size * options_.cell_y_px / 2);
 }
 
-void VideoSource::SendFrames(const Duration &duration, int loops,
-                             const volatile sig_atomic_t &interrupt_received,
-                             const Renderer::WriteFramebufferFun &sink) {
+void VideoSource::DecodeFrames(
+    const Duration &duration, int loops, bool loop_forever,
+    const volatile sig_atomic_t &interrupt_received,
+    const std::function<void(AVFrame *, const Duration &)> &emit) {
     const bool frame_limit = (frame_count_ > 0);
 
-    if (frame_count_ == 1)  // If there is only one frame, nothing to repeat.
-        loops = 1;
-
-    // Unlike animated images, in which a not set value in loops means
-    // 'infinite' repeat, it feels more sensible to show videos exactly once
-    // then. A negative value otherwise is considered 'forever'
-    const bool animated_png =
-        filename().size() > 3 &&
-        (strcasecmp(filename().c_str() + filename().size() - 3, "png") == 0);
-    const bool loop_forever =
-        (loops < 0) && (loops != timg::kNotInitialized || animated_png);
-
-    if (loops == timg::kNotInitialized && !animated_png) loops = 1;
-
     AVPacket *packet = av_packet_alloc();
-    bool is_first    = true;
     timg::Duration time_from_first_frame;
+    const Time start = Time::Now();
 
     // We made guesses above if something is potentially an animation, but
     // we don't know until we observe how many frames there are - we don't
@@ -297,15 +548,23 @@ void VideoSource::SendFrames(const Duration &duration, int loops,
          ((loop_forever || k < loops) && observed_frame_count != 1) &&
          !interrupt_received && time_from_first_frame < duration;
          ++k) {
-        if (k > 0) {
+        observed_frame_count   = 0;
+        int remaining_frames   = frame_count_;
+        int skip_offset        = 0;  // Frames to skip if we can't seek.
+        int64_t skip_until_pts = AV_NOPTS_VALUE;
+        if (start_time_ > Duration()) {
+            skip_until_pts = SeekToStart();
+            if (skip_until_pts == AV_NOPTS_VALUE) {
+                skip_offset = start_time_.nanoseconds() /
+                              frame_duration_.nanoseconds();
+            }
+        }
+        else if (k > 0) {
             // Rewind unless we're just starting.
             av_seek_frame(format_context_, video_stream_index_, 0,
                           AVSEEK_FLAG_ANY);
             avcodec_flush_buffers(codec_context_);
         }
-        observed_frame_count = 0;
-        int remaining_frames = frame_count_;
-        int skip_offset      = frame_offset_;
         int decode_in_flight = 0;
 
         bool state_reading = true;
@@ -337,26 +596,29 @@ void VideoSource::SendFrames(const Duration &duration, int loops,
             while (decode_in_flight &&
                    avcodec_receive_frame(codec_context_, decode_frame) == 0) {
                 --decode_in_flight;
+                if (skip_until_pts != AV_NOPTS_VALUE) {
+                    // Decoding forward from the keyframe we seeked to.
+                    const int64_t pts = decode_frame->best_effort_timestamp;
+                    if (pts != AV_NOPTS_VALUE && pts < skip_until_pts) {
+                        continue;
+                    }
+                    skip_until_pts = AV_NOPTS_VALUE;  // Arrived.
+                }
                 if (skip_offset > 0) {
-                    // TODO: there is probably a faster/better way to skip
-                    // ahead to the last keyframe first.
                     --skip_offset;
                     continue;
                 }
 
-                time_from_first_frame.Add(frame_duration_);
-                // TODO: when frame skipping enabled, avoid this step if we're
-                // falling behind.
-                sws_scale(sws_context_, decode_frame->data,
-                          decode_frame->linesize, 0, codec_context_->height,
-                          terminal_fb_->row_data(), terminal_fb_->stride());
-                AlphaBlendFramebuffer();
-                const int dy = is_first ? 0 : -terminal_fb_->height();
-                sink(center_indentation_, dy, *terminal_fb_,
-                     is_first ? SeqType::StartOfAnimation
-                              : SeqType::AnimationFrame,
-                     time_from_first_frame);
-                is_first = false;
+                if (live_) {
+                    // The frame rate is only nominal; cameras might provide
+                    // fewer frames. Show them as they come.
+                    time_from_first_frame = Time::Now() - start;
+                }
+                else {
+                    time_from_first_frame.Add(frame_duration_);
+                }
+                AVFrame *scale_frame = TakeFrameForScaling(decode_frame);
+                if (scale_frame) emit(scale_frame, time_from_first_frame);
                 if (frame_limit) --remaining_frames;
                 ++observed_frame_count;
             }
@@ -367,4 +629,122 @@ void VideoSource::SendFrames(const Duration &duration, int loops,
     av_packet_free(&packet);
 }
 
+namespace {
+// Frame on its way from the decoder to the scaler. A nullptr frame marks
+// the end of the stream.
+struct DecodedFrame {
+    AVFrame *frame = nullptr;
+    Duration end_of_frame;
+};
+
+// Scaled frame ready to be sent. A nullptr framebuffer marks the end.
+struct ScaledFrame {
+    Framebuffer *framebuffer = nullptr;
+    Duration end_of_frame;
+};
+}  // namespace
+
+void VideoSource::SendFrames(const Duration &duration, int loops,
+                             const volatile sig_atomic_t &interrupt_received,
+                             const Renderer::WriteFramebufferFun &sink) {
+    if (frame_count_ == 1)  // If there is only one frame, nothing to repeat.
+        loops = 1;
+
+    // Unlike animated images, in which a not set value in loops means
+    // 'infinite' repeat, it feels more sensible to show videos exactly once
+    // then. A negative value otherwise is considered 'forever'
+    const bool animated_png =
+        filename().size() > 3 &&
+        (strcasecmp(filename().c_str() + filename().size() - 3, "png") == 0);
+    const bool loop_forever =
+        (loops < 0) && (loops != timg::kNotInitialized || animated_png);
+
+    if (loops == timg::kNotInitialized && !animated_png) loops = 1;
+
+    // Decoding, scaling and sending to the canvas (which encodes) each run
+    // in their own thread, so that they overlap. They are connected by
+    // short queues; the scaled frames go back to the scaler once sent.
+    SpscQueue<DecodedFrame> decoded(kPipelineDepth);
+    SpscQueue<ScaledFrame> scaled(kPipelineDepth);
+    SpscQueue<Framebuffer *> available(kPipelineFramebuffers);
+    std::vector<std::unique_ptr<Framebuffer>> framebuffers;
+    for (int i = 0; i < kPipelineFramebuffers; ++i) {
+        framebuffers.emplace_back(new Framebuffer(
+            target_width_, target_height_, Framebuffer::Layout::kAlignedRows));
+        available.Push(framebuffers.back().get());
+    }
+
+    std::thread decoder([&]() {
+        DecodeFrames(duration, loops, loop_forever, interrupt_received,
+                     [&](AVFrame *frame, const Duration &end_of_frame) {
+                         decoded.Push({frame, end_of_frame});
+                     });
+        decoded.Push({});
+    });
+
+    // Set once the sink got the first frame; from then on, the scaler can
+    // ask if frames are late.
+    std::atomic<bool> first_frame_sent{false};
+
+    std::thread scaler([&]() {
+        for (;;) {
+            DecodedFrame in = *decoded.WaitFront();
+            decoded.Pop();
+            // With live input, skip to the newest frame.
+            while (live_ && in.frame && decoded.Front() &&
+                   decoded.Front()->frame) {
+                PipelineStats::TraceInstant("skip-stale-frame");
+                av_frame_free(&in.frame);
+                in = *decoded.Front();
+                decoded.Pop();
+            }
+            if (!in.frame) break;
+            // Don't scale and blend frames that would not be shown anyway.
+            const bool too_late = first_frame_sent.load() &&
+                                  options_.frame_is_late &&
+                                  options_.frame_is_late(in.end_of_frame);
+            // After an interrupt, only drain what is still coming.
+            if (!interrupt_received && !too_late &&
+                PrepareScaleContext(in.frame)) {
+                Framebuffer *const fb = *available.WaitFront();
+                available.Pop();
+                ScaleFrame(sws_context_, in.frame, fb);
+                AlphaBlendFramebuffer(fb);
+                scaled.Push({fb, in.end_of_frame});
+            }
+            av_frame_free(&in.frame);
+        }
+        scaled.Push({});
+    });
+
+    bool is_first = true;
+    for (;;) {
+        ScaledFrame out = *scaled.WaitFront();
+        scaled.Pop();
+        while (live_ && out.framebuffer && scaled.Front() &&
+               scaled.Front()->framebuffer) {
+            PipelineStats::TraceInstant("skip-stale-frame");
+            available.Push(std::move(out.framebuffer));
+            out = *scaled.Front();
+            scaled.Pop();
+        }
+        if (!out.framebuffer) break;
+        // If we're falling behind, don't bother encoding a frame that would
+        // not be shown. Frames can also become late after being scaled.
+        const bool too_late = !is_first && options_.frame_is_late &&
+                              options_.frame_is_late(out.end_of_frame);
+        if (!interrupt_received && !too_late) {
+            const int dy = is_first ? 0 : -out.framebuffer->height();
+            sink(center_indentation_, dy, *out.framebuffer,
+                 is_first ? SeqType::StartOfAnimation : SeqType::AnimationFrame,
+                 out.end_of_frame);
+            if (is_first) first_frame_sent.store(true);
+            is_first = false;
+        }
+        available.Push(std::move(out.framebuffer));
+    }
+    scaler.join();
+    decoder.join();
+}
+
 }  // namespace timg
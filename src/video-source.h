@@ -17,6 +17,8 @@
 #define VIDEO_SOURCE_H_
 
 #include <csignal>
+#include <cstdint>
+#include <functional>
 #include <string>
 
 #include "display-options.h"
@@ -25,6 +27,7 @@
 #include "renderer.h"
 #include "timg-time.h"
 
+struct AVCodec;
 struct AVCodecContext;
 struct AVFormatContext;
 struct AVFrame;
@@ -60,21 +63,59 @@ public:
     bool IsAnimationBeforeFrameLimit() const override { return true; }
 
 private:
-    void AlphaBlendFramebuffer();
+    void AlphaBlendFramebuffer(Framebuffer *fb);
+
+    // Read and decode frames with all the looping, seeking and frame
+    // skipping. Frames to be shown are handed to "emit", which takes
+    // ownership.
+    void DecodeFrames(
+        const Duration &duration, int loops, bool loop_forever,
+        const volatile sig_atomic_t &interrupt_received,
+        const std::function<void(AVFrame *, const Duration &)> &emit);
+
+    // Seek to the keyframe before start_time_. Returns the timestamp in
+    // the stream time-base from which on frames should be shown or
+    // AV_NOPTS_VALUE if the stream can't seek.
+    int64_t SeekToStart();
+
+    // If requested in the environment, set up the codec context to decode
+    // on the GPU. Returns true if a hardware device could be opened.
+    bool PrepareHardwareDecoder(const AVCodec *codec);
+
+    // Set crop_ from the crop options. With auto-crop, this looks at the
+    // first frames of the video to find the content, then rewinds.
+    void DetermineCropRegion(const DisplayOptions &opts);
+
+    // Reduce "frame" to crop_. No pixels are copied; only the plane
+    // pointers and the size of the frame are adjusted.
+    bool CropFrame(AVFrame *frame) const;
+
+    // Move the content of "decoded" into a new frame to be scaled; with
+    // hardware decoding, transfer it to main memory. Then apply the crop.
+    // Returns the frame or nullptr on failure.
+    AVFrame *TakeFrameForScaling(AVFrame *decoded);
+
+    // Make sure sws_context_ is set up for the format of "frame".
+    bool PrepareScaleContext(const AVFrame *frame);
 
     DisplayOptions options_;
     bool maybe_transparent_ = false;
-    int frame_offset_       = 0;
+    bool live_              = false;  // Camera or stream: show newest frame.
+    Duration start_time_;  // From frame offset and start time option.
     int frame_count_        = -1;
     int orig_width_, orig_height_;
+    Rect crop_;  // Part of the decoded frames to show.
 
     int video_stream_index_          = -1;
     AVFormatContext *format_context_ = nullptr;
     AVCodecContext *codec_context_   = nullptr;
     SwsContext *sws_context_         = nullptr;
+    int hw_pix_fmt_                  = -1;  // AVPixelFormat of GPU frames.
+    int scale_format_                = -1;  // Input format of sws_context_
     timg::Duration frame_duration_;  // 1/fps
-    timg::Framebuffer *terminal_fb_ = nullptr;
-    int center_indentation_         = 0;
+    int target_width_       = 0;     // Size of framebuffers sent.
+    int target_height_      = 0;
+    int center_indentation_ = 0;
 };
 
 }  // namespace timg